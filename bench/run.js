@@ -0,0 +1,392 @@
+/*
+ * bench/run.js: throughput and latency benchmarks for consume() and aggwalk().
+ * These run against the stub libdtrace (see src/stub/dtrace_stub.c), which
+ * synthesizes the same data on every run, so results are comparable across
+ * runs and hosts.  See README.md for how to build it.
+ *
+ * Usage: node bench/run.js [-d ms] [-f filter] [-j] [-b baseline [-t tol]]
+ *
+ *     -d ms		run each benchmark for this long (default 2000)
+ *     -f filter	only run benchmarks whose names contain "filter"
+ *     -j		print results as JSON (suitable as a baseline)
+ *     -b baseline	compare throughput against the JSON results in the file
+ *     			"baseline", and exit with status 1 if any benchmark
+ *     			is slower by more than the tolerance
+ *     -t tol		the tolerance, as a fraction (default 0.1)
+ */
+
+var mod_assert = require('assert');
+var mod_fs = require('fs');
+
+var lda = require('../lib/dtrace-async');
+
+/*
+ * Each benchmark sets the given stub options (see dtrace_stub.c), then calls
+ * consume() or aggwalk() (with options "walkopts", if any) back to back.  The
+ * D programs are only descriptive: the stub ignores them.
+ */
+var benchmarks = [ {
+    'name': 'consume',
+    'kind': 'consume',
+    'prog': 'stub:::entry { trace(seq); trace(str); }',
+    'opts': { 'stub_records': 10000 }
+}, {
+    'name': 'consume-printf',
+    'kind': 'consume',
+    'prog': 'stub:::entry { printf("%s seq %d\\n", str, seq); }',
+    'opts': { 'stub_records': 10000, 'stub_printf': 1 }
+}, {
+    'name': 'consume-wide',
+    'kind': 'consume',
+    'prog': 'stub:::entry { trace(seq); trace(str); }',
+    'opts': {
+	'stub_records': 10000,
+	'stub_probes': 1000,
+	'stub_strings': 100000
+    }
+}, {
+    'name': 'aggwalk-count',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = count(); }',
+    'opts': {
+	'stub_agg': 'count',
+	'stub_keys': 1000,
+	'stub_aggrecords': 100000
+    }
+}, {
+    'name': 'aggwalk-quantize',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = quantize(value); }',
+    'opts': {
+	'stub_agg': 'quantize',
+	'stub_keys': 1000,
+	'stub_aggrecords': 100000
+    }
+}, {
+    'name': 'aggwalk-lquantize',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = lquantize(value, 0, 1000, 10); }',
+    'opts': {
+	'stub_agg': 'lquantize',
+	'stub_keys': 1000,
+	'stub_aggrecords': 100000
+    }
+}, {
+    'name': 'aggwalk-llquantize',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = llquantize(value, 10, 0, 6, 20); }',
+    'opts': {
+	'stub_agg': 'llquantize',
+	'stub_keys': 1000,
+	'stub_aggrecords': 100000
+    }
+}, {
+    'name': 'aggwalk-count-slots',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = count(); }',
+    'walkopts': { 'slots': true },
+    'opts': {
+	'stub_agg': 'count',
+	'stub_keys': 1000,
+	'stub_aggrecords': 100000
+    }
+}, {
+    'name': 'aggwalk-quantize-wide',
+    'kind': 'aggwalk',
+    'prog': 'stub:::entry { @agg[key] = quantize(value); }',
+    'opts': {
+	'stub_agg': 'quantize',
+	'stub_keys': 20000,
+	'stub_aggrecords': 200000
+    }
+} ];
+
+/* Interval at which event loop lag is sampled, in milliseconds */
+var LAG_INTERVAL = 10;
+
+function main()
+{
+	var args = parseArgs(process.argv.slice(2));
+	var todo, results = [];
+
+	todo = benchmarks.filter(function (b) {
+		return (args.filter === null ||
+		    b.name.indexOf(args.filter) != -1);
+	});
+
+	if (todo.length === 0)
+		fatal('no benchmarks match "' + args.filter + '"');
+
+	if (!args.json)
+		printRow('BENCHMARK', 'RATE', 'UNIT', 'CALL(ms)', 'LAGMAX(ms)',
+		    'RSS(MB)', 'RSSGROW(MB)');
+
+	function next() {
+		var b = todo.shift();
+
+		if (b === undefined) {
+			done(args, results);
+			return;
+		}
+
+		run(b, args.duration, function (err, result) {
+			if (err)
+				fatal(b.name + ': ' + err.message);
+
+			results.push(result);
+			if (!args.json)
+				printResult(result);
+			next();
+		});
+	}
+
+	next();
+}
+
+function parseArgs(argv)
+{
+	var args = {
+	    'duration': 2000,
+	    'filter': null,
+	    'json': false,
+	    'baseline': null,
+	    'tolerance': 0.1
+	};
+	var i;
+
+	function optarg() {
+		if (i + 1 >= argv.length)
+			usage();
+		return (argv[++i]);
+	}
+
+	for (i = 0; i < argv.length; i++) {
+		switch (argv[i]) {
+		case '-d':
+			args.duration = parseInt(optarg(), 10);
+			break;
+		case '-f':
+			args.filter = optarg();
+			break;
+		case '-j':
+			args.json = true;
+			break;
+		case '-b':
+			args.baseline = optarg();
+			break;
+		case '-t':
+			args.tolerance = parseFloat(optarg());
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (isNaN(args.duration) || args.duration <= 0 ||
+	    isNaN(args.tolerance) || args.tolerance < 0)
+		usage();
+
+	return (args);
+}
+
+function usage()
+{
+	console.error('usage: node bench/run.js [-d ms] [-f filter] [-j] ' +
+	    '[-b baseline [-t tolerance]]');
+	process.exit(2);
+}
+
+function fatal(message)
+{
+	console.error('bench: ' + message);
+	process.exit(1);
+}
+
+function printRow()
+{
+	var widths = [ 24, 12, 10, 10, 12, 10, 12 ];
+	var cols = Array.prototype.slice.call(arguments);
+
+	console.log(cols.map(function (col, i) {
+		col = String(col);
+		while (col.length < widths[i])
+			col = i === 0 ? col + ' ' : ' ' + col;
+		return (col);
+	}).join(''));
+}
+
+function printResult(result)
+{
+	printRow(result.name, result.rate.toFixed(0), result.unit + '/s',
+	    result.callMs.toFixed(3), result.lagMaxMs.toFixed(1),
+	    (result.rssPeak / 1048576).toFixed(1),
+	    (result.rssGrowth / 1048576).toFixed(1));
+}
+
+function hrtimeMs(start)
+{
+	var delta = process.hrtime(start);
+
+	return (delta[0] * 1e3 + delta[1] / 1e6);
+}
+
+/*
+ * Run one benchmark for "duration" milliseconds on a new consumer, and invoke
+ * callback(err, result).
+ */
+function run(b, duration, callback)
+{
+	var dtp = lda.createConsumer();
+
+	dtp.on('ready', function () {
+		if (!/\(stub\)/.test(dtp.version())) {
+			callback(new Error('the binding wasn\'t built ' +
+			    'against the stub libdtrace (see README.md)'));
+			return;
+		}
+
+		try {
+			Object.keys(b.opts).forEach(function (opt) {
+				dtp.setopt(opt, String(b.opts[opt]));
+			});
+		} catch (ex) {
+			callback(ex);
+			return;
+		}
+
+		dtp.strcompile(b.prog, function (err) {
+			if (err) {
+				callback(err);
+				return;
+			}
+
+			dtp.go(function (err2) {
+				if (err2) {
+					callback(err2);
+					return;
+				}
+
+				measure(dtp, b, duration, function (result) {
+					dtp.stop(function (err3) {
+						dtp.close();
+						callback(err3, result);
+					});
+				});
+			});
+		});
+	});
+}
+
+/*
+ * Call consume() or aggwalk() back to back, yielding to the event loop between
+ * calls, while a timer samples the event loop's lag and the process's RSS.
+ */
+function measure(dtp, b, duration, callback)
+{
+	var units = 0, calls = 0, busy = 0;
+	var lagmax = 0, lagsum = 0, nlags = 0;
+	var rssStart = process.memoryUsage().rss, rssPeak = rssStart;
+	var start = process.hrtime();
+	var expected = Date.now() + LAG_INTERVAL;
+	var timer;
+
+	function count() {
+		units++;
+	}
+
+	timer = setInterval(function () {
+		var now = Date.now();
+		var lag = Math.max(0, now - expected);
+
+		lagmax = Math.max(lagmax, lag);
+		lagsum += lag;
+		nlags++;
+		expected = now + LAG_INTERVAL;
+		rssPeak = Math.max(rssPeak, process.memoryUsage().rss);
+	}, LAG_INTERVAL);
+
+	function iter() {
+		var t0, elapsed;
+
+		t0 = process.hrtime();
+		if (b.kind == 'consume')
+			dtp.consume(count);
+		else
+			dtp.aggwalk(b.walkopts || {}, count);
+		busy += hrtimeMs(t0);
+		calls++;
+
+		if ((elapsed = hrtimeMs(start)) < duration) {
+			setImmediate(iter);
+			return;
+		}
+
+		clearInterval(timer);
+		rssPeak = Math.max(rssPeak, process.memoryUsage().rss);
+		callback({
+		    'name': b.name,
+		    'unit': b.kind == 'consume' ? 'records' : 'keys',
+		    'units': units,
+		    'calls': calls,
+		    'rate': units / (elapsed / 1e3),
+		    'callMs': busy / calls,
+		    'lagMaxMs': lagmax,
+		    'lagMeanMs': nlags === 0 ? 0 : lagsum / nlags,
+		    'rssPeak': rssPeak,
+		    'rssGrowth': process.memoryUsage().rss - rssStart
+		});
+	}
+
+	setImmediate(iter);
+}
+
+/*
+ * Print the results as JSON, if requested, and compare them to the baseline,
+ * if any.
+ */
+function done(args, results)
+{
+	var baseline, byname = {}, regressions = 0;
+
+	if (args.json)
+		console.log(JSON.stringify(results, null, 4));
+
+	if (args.baseline === null)
+		return;
+
+	try {
+		baseline = JSON.parse(
+		    mod_fs.readFileSync(args.baseline, 'utf8'));
+	} catch (ex) {
+		fatal('reading baseline: ' + ex.message);
+	}
+
+	mod_assert.ok(Array.isArray(baseline), 'baseline must be an array');
+	baseline.forEach(function (result) {
+		byname[result.name] = result;
+	});
+
+	results.forEach(function (result) {
+		var base = byname[result.name];
+		var ratio;
+
+		if (base === undefined || base.rate === 0)
+			return;
+
+		ratio = result.rate / base.rate;
+		if (ratio >= 1 - args.tolerance)
+			return;
+
+		regressions++;
+		console.error('bench: ' + result.name + ': ' +
+		    result.rate.toFixed(0) + ' ' + result.unit + '/s is ' +
+		    ((1 - ratio) * 100).toFixed(1) + '% below the baseline (' +
+		    base.rate.toFixed(0) + ')');
+	});
+
+	if (regressions > 0)
+		process.exit(1);
+}
+
+main();
@@ -1,24 +1,75 @@
 {
   'variables': {
     'node_addon': '<!(node -p -e "require(\'path\').dirname(require.resolve(\'addon-layer\'))")',
+    # Set to 1 (node-gyp configure -- -Ddtrace_stub=1) to build against the
+    # stub libdtrace in src/stub rather than the system's.  See bench/.
+    'dtrace_stub%': 0,
+    # Whether the system provides libdtrace.  Where it doesn't, only the
+    # replay binding is built (unless the stub is requested), so that
+    # captures can be replayed on such hosts.
+    'conditions': [
+      [ 'OS=="solaris" or OS=="mac" or OS=="freebsd"', {
+        'has_libdtrace%': 1,
+      }, {
+        'has_libdtrace%': 0,
+      } ],
+    ],
   },
   'targets': [
     {
-      'target_name': 'dtrace_async',
+      'target_name': 'dtrace_replay',
       'cflags': [ '-Wall -Werror' ],
-      'cflags_cc': ['-fexceptions'],
-      'ldflags': ['-ldtrace'],
-      'libraries': ['-ldtrace'],
       'dependencies': [ '<(node_addon)/binding.gyp:addon-layer', ],
       'include_dirs': [ '<(node_addon)/include', ],
-      'sources': [ 'src/dtrace_async.c' ],
+      'sources': [
+          'src/dtrace_replay.c',
+          'src/dta_aggtab.c',
+          'src/dta_buf.c',
+          'src/dta_caplog.c',
+          'src/dta_wire.c',
+      ],
       'xcode_settings': {
           'OTHER_CPLUSPLUSFLAGS': [
-              '-fexceptions',
               '-Wall',
               '-Werror',
           ],
       }
     },
   ],
+  'conditions': [
+    [ 'has_libdtrace == 1 or dtrace_stub == 1', {
+      'targets': [
+        {
+          'target_name': 'dtrace_async',
+          'cflags': [ '-Wall -Werror' ],
+          'cflags_cc': ['-fexceptions'],
+          'dependencies': [ '<(node_addon)/binding.gyp:addon-layer', ],
+          'include_dirs': [ '<(node_addon)/include', ],
+          'sources': [
+              'src/dtrace_async.c',
+              'src/dta_aggtab.c',
+              'src/dta_buf.c',
+              'src/dta_caplog.c',
+              'src/dta_wire.c',
+          ],
+          'conditions': [
+            [ 'dtrace_stub == 1', {
+              'include_dirs': [ 'src/stub', ],
+              'sources': [ 'src/stub/dtrace_stub.c', ],
+            }, {
+              'ldflags': ['-ldtrace'],
+              'libraries': ['-ldtrace'],
+            } ],
+          ],
+          'xcode_settings': {
+              'OTHER_CPLUSPLUSFLAGS': [
+                  '-fexceptions',
+                  '-Wall',
+                  '-Werror',
+              ],
+          }
+        }
+      ],
+    } ],
+  ],
 }
@@ -0,0 +1,234 @@
+/*
+ * lib/aggsnapshot.js: reader for the binary aggregation snapshots produced by
+ * consumer.aggsnapshot().  This module doesn't depend on the native binding, so
+ * it can be loaded in worker threads that have been handed a snapshot's
+ * SharedArrayBuffer.  Records are decoded lazily, directly out of the shared
+ * memory.  See dta_snaphdr_t in src/dtrace_async.c for the layout.
+ */
+
+var mod_assert = require('assert');
+
+var mod_buckets = require('./buckets');
+
+/* Public interface */
+exports.AggSnapshot = AggSnapshot;
+
+var SNAP_MAGIC = 0x53415444;
+var SNAP_VERSION = 1;
+var SNAP_VARSIZE = 32;
+var SNAP_ROWSIZE = 24;
+
+/* Names of aggregating actions, indexed by dta_aggkind_t */
+var snap_actions = [ null, 'count()', 'min()', 'max()', 'sum()', 'avg()',
+    'quantize()', 'lquantize()', 'llquantize()' ];
+
+/*
+ * Wrap a snapshot, which may be an ArrayBuffer, a SharedArrayBuffer, or any
+ * view onto one (including a Node Buffer).  Nothing is copied.
+ */
+function AggSnapshot(data)
+{
+	var view, le;
+
+	if (ArrayBuffer.isView(data)) {
+		view = new DataView(data.buffer, data.byteOffset,
+		    data.byteLength);
+	} else {
+		view = new DataView(data);
+	}
+
+	if (view.getUint32(0, true) == SNAP_MAGIC)
+		le = true;
+	else if (view.getUint32(0, false) == SNAP_MAGIC)
+		le = false;
+	else
+		throw (new Error('aggsnapshot: bad magic number'));
+
+	if (view.getUint16(4, le) != SNAP_VERSION)
+		throw (new Error('aggsnapshot: unsupported version ' +
+		    view.getUint16(4, le)));
+
+	this.as_view = view;
+	this.as_le = le;
+	this.as_size = view.getUint32(8, le);
+	this.as_nvars = view.getUint32(12, le);
+	this.as_nrows = view.getUint32(16, le);
+	this.as_nstrings = view.getUint32(20, le);
+	this.as_maxkeys = view.getUint32(24, le);
+	this.as_varoff = view.getUint32(32, le);
+	this.as_stroff = view.getUint32(36, le);
+	this.as_strdataoff = view.getUint32(40, le);
+	this.as_keyoff = view.getUint32(44, le);
+	this.as_rowoff = view.getUint32(48, le);
+	this.as_bucketoff = view.getUint32(52, le);
+	this.as_conf = {
+	    'DTRACE_QUANTIZE_NBUCKETS': view.getUint16(56, le),
+	    'DTRACE_QUANTIZE_ZEROBUCKET': view.getUint16(58, le),
+	    'INT64_MIN': -Math.pow(2, 63),
+	    'INT64_MAX': Math.pow(2, 63)
+	};
+
+	mod_assert.ok(this.as_size <= view.byteLength,
+	    'aggsnapshot: truncated snapshot');
+
+	this.as_strings = new Array(this.as_nstrings);
+	this.as_vars = new Array(this.as_nvars);
+	this.as_ranges = {};
+}
+
+AggSnapshot.prototype.nvariables = function ()
+{
+	return (this.as_nvars);
+};
+
+AggSnapshot.prototype.nrecords = function ()
+{
+	return (this.as_nrows);
+};
+
+/*
+ * Returns a description of variable table entry "vi".
+ */
+AggSnapshot.prototype.variable = function (vi)
+{
+	var view = this.as_view;
+	var le = this.as_le;
+	var off;
+
+	mod_assert.ok(vi >= 0 && vi < this.as_nvars);
+	if (this.as_vars[vi] !== undefined)
+		return (this.as_vars[vi]);
+
+	off = this.as_varoff + vi * SNAP_VARSIZE;
+	this.as_vars[vi] = {
+	    'varid': view.getInt32(off, le),
+	    'action': snap_actions[view.getUint16(off + 4, le)],
+	    'nkeys': view.getUint16(off + 6, le),
+	    'strkeys': view.getUint32(off + 8, le),
+	    'nbuckets': view.getUint32(off + 12, le),
+	    'paramhi': view.getUint32(off + 16 + (le ? 4 : 0), le),
+	    'paramlo': view.getUint32(off + 16 + (le ? 0 : 4), le),
+	    'name': this.string(view.getUint32(off + 24, le))
+	};
+
+	return (this.as_vars[vi]);
+};
+
+AggSnapshot.prototype.string = function (si)
+{
+	var off, len, start;
+
+	mod_assert.ok(si >= 0 && si < this.as_nstrings);
+	if (this.as_strings[si] === undefined) {
+		off = this.as_stroff + si * 8;
+		start = this.as_strdataoff +
+		    this.as_view.getUint32(off, this.as_le);
+		len = this.as_view.getUint32(off + 4, this.as_le);
+		this.as_strings[si] = Buffer.from(this.as_view.buffer,
+		    this.as_view.byteOffset + start, len).toString('utf8');
+	}
+
+	return (this.as_strings[si]);
+};
+
+/*
+ * Returns record "ri" as an object with "varid", "key" and "value" properties,
+ * in the same form that consumer.aggwalk() provides them.
+ */
+AggSnapshot.prototype.record = function (ri)
+{
+	var view = this.as_view;
+	var le = this.as_le;
+	var off, keyoff, var_, key, value, i, nb, bucket;
+
+	mod_assert.ok(ri >= 0 && ri < this.as_nrows);
+	off = this.as_rowoff + ri * SNAP_ROWSIZE;
+	var_ = this.variable(view.getUint32(off, le));
+
+	keyoff = this.as_keyoff + ri * this.as_maxkeys * 8;
+	key = new Array(var_.nkeys);
+	for (i = 0; i < var_.nkeys; i++) {
+		if ((var_.strkeys & (1 << i)) !== 0)
+			key[i] = this.string(this.int64(keyoff + i * 8));
+		else
+			key[i] = this.int64(keyoff + i * 8);
+	}
+
+	if (var_.nbuckets === 0) {
+		value = this.int64(off + 8);
+		if (var_.action == 'avg()')
+			value /= this.int64(off + 16);
+	} else {
+		bucket = this.as_bucketoff + view.getUint32(off + 4, le) * 8;
+		value = [];
+		for (i = 0; i < var_.nbuckets; i++) {
+			if ((nb = this.int64(bucket + i * 8)) === 0)
+				continue;
+			value.push([ this.ranges(var_)[i], nb ]);
+		}
+	}
+
+	return ({ 'varid': var_.varid, 'key': key, 'value': value });
+};
+
+/*
+ * Invoke func(varid, key, value) for each record, just like
+ * consumer.aggwalk().
+ */
+AggSnapshot.prototype.forEach = function (func)
+{
+	var i, rec;
+
+	for (i = 0; i < this.as_nrows; i++) {
+		rec = this.record(i);
+		func(rec.varid, rec.key, rec.value);
+	}
+};
+
+/*
+ * Returns the bucket ranges for the given variable's quantizing action.
+ */
+AggSnapshot.prototype.ranges = function (var_)
+{
+	var conf = this.as_conf;
+	var hi = var_.paramhi;
+	var lo = var_.paramlo;
+	var key = var_.action + ':' + hi + ':' + lo;
+
+	if (this.as_ranges[key] !== undefined)
+		return (this.as_ranges[key]);
+
+	if (var_.action == 'quantize()') {
+		this.as_ranges[key] = mod_buckets.makeQuantizeBuckets(conf);
+	} else if (var_.action == 'lquantize()') {
+		this.as_ranges[key] = mod_buckets.makeLquantizeBuckets(conf,
+		    lo | 0, hi >>> 16, hi & 0xffff);
+	} else {
+		mod_assert.equal(var_.action, 'llquantize()');
+		this.as_ranges[key] = mod_buckets.makeLlquantizeBuckets(conf,
+		    hi >>> 16, hi & 0xffff, lo >>> 16, lo & 0xffff,
+		    var_.nbuckets);
+	}
+
+	return (this.as_ranges[key]);
+};
+
+/*
+ * Read the 64-bit signed integer at byte offset "off".  Values beyond 2^53 lose
+ * precision, just as they do in consumer.aggwalk().
+ */
+AggSnapshot.prototype.int64 = function (off)
+{
+	var view = this.as_view;
+	var hi, lo;
+
+	if (this.as_le) {
+		lo = view.getUint32(off, true);
+		hi = view.getInt32(off + 4, true);
+	} else {
+		hi = view.getInt32(off, false);
+		lo = view.getUint32(off + 4, false);
+	}
+
+	return (hi * 4294967296 + lo);
+};
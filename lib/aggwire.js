@@ -0,0 +1,514 @@
+/*
+ * lib/aggwire.js: decoder for the wire frames produced by consumer.aggencode().
+ * Like lib/aggsnapshot.js, this doesn't depend on the native binding, so it can
+ * be used on hosts without DTrace to receive aggregation data shipped from
+ * hosts with it.  See src/dta_wire.h for the format.  NativeAggWireDecoder
+ * does the same thing with the native decoder, which is part of the
+ * libdtrace-free dtrace_replay binding; that's only loaded when one is created.
+ */
+
+var mod_assert = require('assert');
+
+var mod_buckets = require('./buckets');
+
+/* Public interface */
+exports.AggWireDecoder = AggWireDecoder;
+exports.NativeAggWireDecoder = NativeAggWireDecoder;
+
+var WIRE_MAGIC = 'DTAW';
+var WIRE_VERSION = 1;
+var WIRE_HDRSIZE = 6;
+var WIRE_F_DELTA = 0x1;
+
+/* Names of aggregating actions, indexed by dta_aggkind_t */
+var wire_actions = [ null, 'count()', 'min()', 'max()', 'sum()', 'avg()',
+    'quantize()', 'lquantize()', 'llquantize()' ];
+
+/*
+ * A decoder holds a copy of the sender's aggregation records, which it updates
+ * as each frame is decoded.  Frames must be decoded in the order they were
+ * produced, starting with a full frame; a delta frame that doesn't follow the
+ * frame it was encoded against is rejected, after which the decoder needs a
+ * full frame to recover.
+ */
+function AggWireDecoder()
+{
+	this.aw_seq = 0;
+	this.aw_vars = {};
+	this.aw_records = {};
+	this.aw_nrecords = 0;
+	this.aw_ranges = {};
+}
+
+/*
+ * Returns the sequence number of the last frame decoded, or zero if none has
+ * been.
+ */
+AggWireDecoder.prototype.seq = function ()
+{
+	return (this.aw_seq);
+};
+
+AggWireDecoder.prototype.nrecords = function ()
+{
+	return (this.aw_nrecords);
+};
+
+/*
+ * Apply the frame in "buf" (a Buffer).  The frame is validated before any
+ * records are changed, so if this throws, the decoder's state is unchanged.
+ */
+AggWireDecoder.prototype.decode = function (buf)
+{
+	var rd, flags, seq, baseseq, n, i, strings, vars, var_, updates,
+	    removed, key;
+
+	mod_assert.ok(Buffer.isBuffer(buf), 'aggwire: expected a Buffer');
+
+	if (buf.length < WIRE_HDRSIZE ||
+	    buf.toString('latin1', 0, 4) != WIRE_MAGIC)
+		throw (new Error('aggwire: bad magic number'));
+	if (buf[4] != WIRE_VERSION)
+		throw (new Error('aggwire: unsupported version ' + buf[4]));
+
+	flags = buf[5];
+	rd = new WireReader(buf, WIRE_HDRSIZE);
+	seq = rd.uvarint();
+	if ((flags & WIRE_F_DELTA) !== 0) {
+		baseseq = rd.uvarint();
+		if (baseseq !== this.aw_seq)
+			throw (new Error('aggwire: frame ' + seq + ' is ' +
+			    'relative to frame ' + baseseq + ', but last ' +
+			    'frame decoded was ' + this.aw_seq));
+	}
+
+	n = rd.count();
+	strings = new Array(n);
+	for (i = 0; i < n; i++)
+		strings[i] = rd.string();
+
+	n = rd.count();
+	vars = new Array(n);
+	for (i = 0; i < n; i++) {
+		var_ = {
+		    'varid': rd.zvarint(),
+		    'action': wire_actions[rd.uvarint()],
+		    'nkeys': rd.uvarint(),
+		    'nvals': rd.uvarint(),
+		    'param': rd.uvarint64(),
+		    'name': strings[rd.index(strings.length)]
+		};
+
+		if (var_.action === undefined || var_.action === null ||
+		    var_.nkeys > 64)
+			throw (new Error('aggwire: malformed variable'));
+
+		if ((flags & WIRE_F_DELTA) !== 0 &&
+		    this.aw_vars.hasOwnProperty(var_.varid) &&
+		    (this.aw_vars[var_.varid].action != var_.action ||
+		    this.aw_vars[var_.varid].nkeys != var_.nkeys ||
+		    this.aw_vars[var_.varid].nvals != var_.nvals))
+			throw (new Error('aggwire: variable ' + var_.varid +
+			    ' changed shape'));
+
+		vars[i] = var_;
+	}
+
+	n = rd.count();
+	updates = new Array(n);
+	for (i = 0; i < n; i++) {
+		var_ = vars[rd.index(vars.length)];
+		key = rd.keys(var_, strings);
+		updates[i] = [ var_, key, rd.values(var_) ];
+	}
+
+	n = rd.count();
+	if (n !== 0 && (flags & WIRE_F_DELTA) === 0)
+		throw (new Error('aggwire: removals in a full frame'));
+
+	removed = new Array(n);
+	for (i = 0; i < n; i++) {
+		var_ = vars[rd.index(vars.length)];
+		removed[i] = JSON.stringify(
+		    [ var_.varid ].concat(rd.keys(var_, strings)));
+	}
+
+	if (!rd.done())
+		throw (new Error('aggwire: trailing bytes in frame'));
+
+	/*
+	 * The frame is valid.  Apply it.
+	 */
+	if ((flags & WIRE_F_DELTA) === 0) {
+		this.aw_vars = {};
+		this.aw_records = {};
+		this.aw_nrecords = 0;
+	}
+
+	this.applyUpdates(vars, updates, removed);
+	this.aw_seq = seq;
+	return (seq);
+};
+
+AggWireDecoder.prototype.applyUpdates = function (vars, updates, removed)
+{
+	var records = this.aw_records;
+	var self = this;
+
+	vars.forEach(function (var_) {
+		self.aw_vars[var_.varid] = var_;
+	});
+
+	updates.forEach(function (update) {
+		var var_ = update[0];
+		var id = JSON.stringify([ var_.varid ].concat(update[1]));
+		var rec, i;
+
+		if (!records.hasOwnProperty(id)) {
+			records[id] = {
+			    'varid': var_.varid,
+			    'key': update[1],
+			    'vals': new Array(var_.nvals)
+			};
+
+			for (i = 0; i < var_.nvals; i++)
+				records[id].vals[i] = 0;
+			self.aw_nrecords++;
+		}
+
+		rec = records[id];
+		for (i = 0; i < var_.nvals; i++)
+			rec.vals[i] += update[2][i];
+	});
+
+	removed.forEach(function (id) {
+		if (records.hasOwnProperty(id)) {
+			delete (records[id]);
+			self.aw_nrecords--;
+		}
+	});
+};
+
+/*
+ * Invoke func(varid, key, value) for each record, just like
+ * consumer.aggwalk().
+ */
+AggWireDecoder.prototype.forEach = function (func)
+{
+	var records = this.aw_records;
+	var self = this;
+
+	Object.keys(records).forEach(function (id) {
+		var rec = records[id];
+
+		func(rec.varid, rec.key,
+		    self.value(self.aw_vars[rec.varid], rec.vals));
+	});
+};
+
+/*
+ * Returns the value of a record of the given variable, as consumer.aggwalk()
+ * would report it, from the record's raw values.
+ */
+AggWireDecoder.prototype.value = function (var_, vals)
+{
+	var value, ranges, i;
+
+	switch (var_.action) {
+	case 'avg()':
+		value = vals[0] === 0 ? 0 : vals[1] / vals[0];
+		break;
+
+	case 'quantize()':
+	case 'lquantize()':
+	case 'llquantize()':
+		ranges = this.ranges(var_);
+		value = [];
+		for (i = 0; i < var_.nvals; i++) {
+			if (vals[i] !== 0)
+				value.push([ ranges[i], vals[i] ]);
+		}
+		break;
+
+	default:
+		value = vals[0];
+		break;
+	}
+
+	return (value);
+};
+
+/*
+ * Returns the bucket ranges for the given variable's quantizing action.
+ */
+AggWireDecoder.prototype.ranges = function (var_)
+{
+	var hi = var_.param[0];
+	var lo = var_.param[1];
+	var key = var_.action + ':' + hi + ':' + lo + ':' + var_.nvals;
+	var conf = {
+	    'DTRACE_QUANTIZE_NBUCKETS': var_.nvals,
+	    'DTRACE_QUANTIZE_ZEROBUCKET': (var_.nvals - 1) / 2,
+	    'INT64_MIN': -Math.pow(2, 63),
+	    'INT64_MAX': Math.pow(2, 63)
+	};
+
+	if (this.aw_ranges[key] !== undefined)
+		return (this.aw_ranges[key]);
+
+	if (var_.action == 'quantize()') {
+		this.aw_ranges[key] = mod_buckets.makeQuantizeBuckets(conf);
+	} else if (var_.action == 'lquantize()') {
+		this.aw_ranges[key] = mod_buckets.makeLquantizeBuckets(conf,
+		    lo | 0, hi >>> 16, hi & 0xffff);
+	} else {
+		mod_assert.equal(var_.action, 'llquantize()');
+		this.aw_ranges[key] = mod_buckets.makeLlquantizeBuckets(conf,
+		    hi >>> 16, hi & 0xffff, lo >>> 16, lo & 0xffff,
+		    var_.nvals);
+	}
+
+	return (this.aw_ranges[key]);
+};
+
+
+var aw_binding = null;			/* dtrace_replay binding */
+var aw_finalizer = null;		/* closes collected native decoders */
+
+/*
+ * A NativeAggWireDecoder has the same interface as an AggWireDecoder, but
+ * decodes frames with dta_wire_decode(), so its state is kept in native memory
+ * rather than on the JavaScript heap.  Decoders should be closed with close()
+ * when they're no longer needed; ones that are garbage collected first are
+ * closed then, but that may happen much later, or never.
+ */
+function NativeAggWireDecoder()
+{
+	if (aw_binding === null) {
+		aw_binding = require('bindings')('dtrace_replay.node');
+		if (typeof (FinalizationRegistry) == 'function')
+			aw_finalizer = new FinalizationRegistry(
+			    function (handle) {
+				aw_binding.wireclose(handle);
+			    });
+	}
+
+	this.aw_ranges = {};
+	this.aw_handle = aw_binding.wireopen();
+
+	if (aw_finalizer !== null)
+		aw_finalizer.register(this, this.aw_handle, this);
+}
+
+NativeAggWireDecoder.prototype.value = AggWireDecoder.prototype.value;
+NativeAggWireDecoder.prototype.ranges = AggWireDecoder.prototype.ranges;
+
+NativeAggWireDecoder.prototype.checkOpen = function ()
+{
+	if (this.aw_handle === null)
+		throw (new Error('aggwire: decoder is closed'));
+};
+
+/*
+ * Returns the sequence number of the last frame decoded, or zero if none has
+ * been.  This is also zero if the decoder ran out of memory applying a frame,
+ * in which case it needs a full frame to recover.
+ */
+NativeAggWireDecoder.prototype.seq = function ()
+{
+	this.checkOpen();
+	return (aw_binding.wireseq(this.aw_handle));
+};
+
+NativeAggWireDecoder.prototype.nrecords = function ()
+{
+	this.checkOpen();
+	return (aw_binding.wirecount(this.aw_handle));
+};
+
+/*
+ * Apply the frame in "buf" (a Buffer).  As with AggWireDecoder, the frame is
+ * validated before any records are changed.
+ */
+NativeAggWireDecoder.prototype.decode = function (buf)
+{
+	mod_assert.ok(Buffer.isBuffer(buf), 'aggwire: expected a Buffer');
+	this.checkOpen();
+	return (aw_binding.wiredecode(this.aw_handle, buf));
+};
+
+/*
+ * Invoke func(varid, key, value) for each record, just like
+ * AggWireDecoder.forEach().
+ */
+NativeAggWireDecoder.prototype.forEach = function (func)
+{
+	var self = this;
+
+	this.checkOpen();
+	aw_binding.wirewalk(this.aw_handle,
+	    function (varid, kind, paramhi, paramlo, nkeys) {
+		var args = Array.prototype.slice.call(arguments, 5);
+		var var_ = {
+		    'action': wire_actions[kind],
+		    'param': [ paramhi, paramlo ],
+		    'nvals': args.length - nkeys
+		};
+
+		func(varid, args.slice(0, nkeys),
+		    self.value(var_, args.slice(nkeys)));
+	    });
+};
+
+NativeAggWireDecoder.prototype.close = function ()
+{
+	if (this.aw_handle === null)
+		return;
+
+	aw_binding.wireclose(this.aw_handle);
+	if (aw_finalizer !== null)
+		aw_finalizer.unregister(this);
+	this.aw_handle = null;
+};
+
+
+/*
+ * Sequential reader for the body of a frame.  Every method throws if the frame
+ * is malformed.  As with the other readers, 64-bit values beyond 2^53 lose
+ * precision.
+ */
+function WireReader(buf, off)
+{
+	this.wr_buf = buf;
+	this.wr_off = off;
+}
+
+WireReader.prototype.done = function ()
+{
+	return (this.wr_off == this.wr_buf.length);
+};
+
+/*
+ * Read a varint as a pair of 32-bit halves, [ hi, lo ].
+ */
+WireReader.prototype.uvarint64 = function ()
+{
+	var buf = this.wr_buf;
+	var hi = 0, lo = 0;
+	var shift, b;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (this.wr_off >= buf.length)
+			throw (new Error('aggwire: truncated frame'));
+
+		b = buf[this.wr_off++] & 0x7f;
+		if (shift < 28) {
+			lo |= b << shift;
+		} else if (shift == 28) {
+			lo |= b << 28;
+			hi |= b >>> 4;
+		} else {
+			hi |= b << (shift - 32);
+		}
+
+		if ((buf[this.wr_off - 1] & 0x80) === 0)
+			return ([ hi >>> 0, lo >>> 0 ]);
+	}
+
+	throw (new Error('aggwire: malformed varint'));
+};
+
+WireReader.prototype.uvarint = function ()
+{
+	var v = this.uvarint64();
+	return (v[0] * 4294967296 + v[1]);
+};
+
+WireReader.prototype.zvarint = function ()
+{
+	var v = this.uvarint64();
+	var half = v[0] * 2147483648 + Math.floor(v[1] / 2);
+
+	return ((v[1] & 1) !== 0 ? -half - 1 : half);
+};
+
+/*
+ * Read a count of items that each take at least one byte.
+ */
+WireReader.prototype.count = function ()
+{
+	var n = this.uvarint();
+
+	if (n > this.wr_buf.length - this.wr_off)
+		throw (new Error('aggwire: malformed count'));
+	return (n);
+};
+
+/*
+ * Read an index into a table of "n" entries.
+ */
+WireReader.prototype.index = function (n)
+{
+	var i = this.uvarint();
+
+	if (i >= n)
+		throw (new Error('aggwire: index out of range'));
+	return (i);
+};
+
+WireReader.prototype.string = function ()
+{
+	var len = this.count();
+	var str = this.wr_buf.toString('utf8', this.wr_off,
+	    this.wr_off + len);
+
+	this.wr_off += len;
+	return (str);
+};
+
+WireReader.prototype.keys = function (var_, strings)
+{
+	var strkeys = this.uvarint64();
+	var key = new Array(var_.nkeys);
+	var i, isstr;
+
+	for (i = 0; i < var_.nkeys; i++) {
+		isstr = i < 32 ? (strkeys[1] & (1 << i)) !== 0 :
+		    (strkeys[0] & (1 << (i - 32))) !== 0;
+		key[i] = isstr ? strings[this.index(strings.length)] :
+		    this.zvarint();
+	}
+
+	return (key);
+};
+
+WireReader.prototype.values = function (var_)
+{
+	var vals = new Array(var_.nvals);
+	var n, i, bi;
+
+	for (i = 0; i < var_.nvals; i++)
+		vals[i] = 0;
+
+	switch (var_.action) {
+	case 'quantize()':
+	case 'lquantize()':
+	case 'llquantize()':
+		n = this.count();
+		for (i = 0, bi = 0; i < n; i++) {
+			bi += this.zvarint();
+			if (bi < 0 || bi >= var_.nvals)
+				throw (new Error('aggwire: bucket out of ' +
+				    'range'));
+			vals[bi] = this.zvarint();
+		}
+		break;
+
+	default:
+		for (i = 0; i < var_.nvals; i++)
+			vals[i] = this.zvarint();
+		break;
+	}
+
+	return (vals);
+};
@@ -0,0 +1,125 @@
+/*
+ * lib/buckets.js: bucket range tables for the quantize(), lquantize(), and
+ * llquantize() aggregating actions.  These are shared by the consumer and by
+ * the readers of the binary formats the binding produces, which may run where
+ * the native binding isn't loaded (e.g., in a worker thread).  As a result,
+ * everything here takes the handful of C constants it needs as a "conf"
+ * object rather than asking the binding for them.
+ */
+
+var mod_assert = require('assert');
+
+/* Public interface */
+exports.makeQuantizeBuckets = makeQuantizeBuckets;
+exports.makeLquantizeBuckets = makeLquantizeBuckets;
+exports.makeLlquantizeBuckets = makeLlquantizeBuckets;
+
+/*
+ * Initialize the mapping between bucket index and the corresponding range of
+ * values for a quantize() bucket.  Each range is an array denoting [min, max].
+ * Values are always integers, and both endpoints are included.  As a result,
+ * you get buckets like:
+ *
+ * RANGE     CONTAINED VALUES
+ * [-7, -4]  -7, -6, -5, and -4
+ * [-3, -2]  -2 and -3
+ * [-1, -1]  -1
+ * [ 0,  0]   0
+ * [ 1,  1]   1
+ * [ 2,  3]   2 and 3
+ * [ 4,  7]   4, 5, 6, and 7
+ */
+function makeQuantizeBuckets(conf)
+{
+	var rv = new Array(conf.DTRACE_QUANTIZE_NBUCKETS);
+	var i, min, max;
+
+	for (i = 0; i < rv.length; i++) {
+		if (i < conf.DTRACE_QUANTIZE_ZEROBUCKET) {
+			min = i > 0 ? quantizeBucketval(conf, i - 1) + 1 :
+			    conf.INT64_MIN;
+			max = quantizeBucketval(conf, i);
+		} else if (i == conf.DTRACE_QUANTIZE_ZEROBUCKET) {
+			min = max = 0;
+		} else {
+			min = quantizeBucketval(conf, i);
+			max = i < conf.DTRACE_QUANTIZE_NBUCKETS - 1 ?
+			    quantizeBucketval(conf, i + 1) - 1 : conf.INT64_MAX;
+		}
+
+		rv[i] = [ min, max ];
+	}
+
+	return (rv);
+}
+
+/*
+ * JS implementation of DTRACE_QUANTIZE_BUCKETVAL() macro.
+ */
+function quantizeBucketval(conf, bi)
+{
+	/*
+	 * There aren't enough bits in JavaScript numbers for shifting to do the
+	 * right thing.  Math.pow() is pretty slow, but we're only doing this
+	 * once in the entire program lifetime.
+	 */
+	if (bi < conf.DTRACE_QUANTIZE_ZEROBUCKET)
+		return (-Math.pow(2,
+		    (conf.DTRACE_QUANTIZE_ZEROBUCKET - 1 - bi)));
+	if (bi == conf.DTRACE_QUANTIZE_ZEROBUCKET)
+		return (0);
+	return (Math.pow(2, (bi - conf.DTRACE_QUANTIZE_ZEROBUCKET - 1)));
+}
+
+/*
+ * Initialize the mapping between bucket ids and [ min, max ] ranges for an
+ * lquantize() with parameters "base", "step", and "nlevels".
+ */
+function makeLquantizeBuckets(conf, base, step, nlevels)
+{
+	var rv = new Array(nlevels + 2);
+	var i, min, max;
+
+	for (i = 0; i < rv.length; i++) {
+		min = i === 0 ? conf.INT64_MIN : base + ((i - 1) * step);
+		max = i > nlevels ? conf.INT64_MAX : base + (i * step) - 1;
+		rv[i] = [ min, max ];
+	}
+
+	return (rv);
+}
+
+/*
+ * Initialize the mapping between bucket ids and [ min, max ] ranges for an
+ * llquantize() with parameters "factor", "low", "high", "nsteps", and
+ * "nbuckets" buckets.
+ */
+function makeLlquantizeBuckets(conf, factor, low, high, nsteps, nbuckets)
+{
+	var rv = new Array(nbuckets);
+	var value = 1;
+	var order, bucket, step, next;
+
+	for (order = 0; order < low; order++)
+		value *= factor;
+
+	bucket = 0;
+	rv[bucket++] = [ 0, value - 1 ];
+	next = value * factor;
+	step = next > nsteps ? Math.floor(next / nsteps) : 1;
+
+	while (order <= high) {
+		rv[bucket++] = [ value, value + step - 1 ];
+
+		if ((value += step) != next)
+			continue;
+
+		next = value * factor;
+		step = next > nsteps ? Math.floor(next / nsteps) : 1;
+		order++;
+	}
+
+	rv[bucket] = [ value, conf.INT64_MAX ];
+	mod_assert.equal(bucket + 1, nbuckets);
+	return (rv);
+}
@@ -10,14 +10,37 @@ var mod_events = require('events');
 var mod_util = require('util');
 
 var makeBindingWrapper = require('./binding_wrap');
+var mod_aggsnapshot = require('./aggsnapshot');
+var mod_aggwire = require('./aggwire');
+var mod_buckets = require('./buckets');
 
 /* Public interface */
 exports.createConsumer = createConsumer;
+exports.memoryUsage = memoryUsage;
+exports.AggSnapshot = mod_aggsnapshot.AggSnapshot;
+exports.AggWireDecoder = mod_aggwire.AggWireDecoder;
+exports.NativeAggWireDecoder = mod_aggwire.NativeAggWireDecoder;
 
 /* Static configuration */
 var dtc_conf;				/* miscellaneous C constants */
 var dtc_isready = function () { this.checkReady(); };
 
+/*
+ * Consumers that are garbage collected without having been closed are closed
+ * here, so that their native state (including the libdtrace handle) isn't
+ * leaked.  This is only a backstop: collection may happen much later, or
+ * never, and until then the consumer's buffers remain allocated, so consumers
+ * should be closed explicitly.
+ */
+var dtc_finalizer = typeof (FinalizationRegistry) == 'function' ?
+    new FinalizationRegistry(function (handle) {
+	try {
+		binding.close(handle);
+	} catch (ex) {
+		/* The handle was busy, which should be impossible here. */
+	}
+    }) : null;
+
 var dtc_buckets_quantize = null;	/* quantize() action bucket ranges */
 var dtc_buckets_lquantize = {};		/* lquantize() action bucket ranges */
 					/* (indexed by params) */
@@ -33,6 +56,21 @@ function createConsumer()
 	return (new DTraceConsumer());
 }
 
+/*
+ * Public interface: returns the number of consumers that haven't been closed
+ * and the native memory they use, in bytes.
+ */
+function memoryUsage()
+{
+	var rv;
+
+	binding.memtotal(function (nconsumers, bytes) {
+		rv = { 'consumers': nconsumers, 'bytes': bytes };
+	});
+
+	return (rv);
+}
+
 
 /*
  * Each DTraceConsumer encapsulates a single DTrace enabling -- what normally
@@ -47,6 +85,10 @@ function DTraceConsumer()
 	mod_events.EventEmitter.call(this);
 
 	this.dt_status = 'uninit';
+	this.dt_capturing = false;
+	this.dt_dispatching = false;	/* see dispatchImpl() */
+	this.dt_dispatch = { 'walkopts': null };	/* see Subscription() */
+	this.dt_unsubscribed = [];
 	this.dt = binding.init(function (err) {
 		if (err) {
 			dt.dt_status = 'error';
@@ -58,6 +100,9 @@ function DTraceConsumer()
 		}
 	});
 
+	if (dtc_finalizer !== null)
+		dtc_finalizer.register(this, this.dt, this);
+
 	if (dtc_conf === undefined) {
 		dtc_conf = {};
 		binding.conf(function (name, value) {
@@ -83,6 +128,50 @@ DTraceConsumer.prototype.checkReady = function ()
 	}
 };
 
+/*
+ * Release the libdtrace handle, which disables tracing if it's enabled, and
+ * all native state associated with this consumer.  The consumer can't be used
+ * afterwards.  Closing a consumer that's already closed does nothing.
+ */
+DTraceConsumer.prototype.close = function ()
+{
+	if (this.dt_status == 'destroyed')
+		return;
+
+	if (this.dt_status == 'uninit')
+		throw (new Error('DTraceConsumer not yet ready'));
+
+	binding.close(this.dt);
+	if (dtc_finalizer !== null)
+		dtc_finalizer.unregister(this);
+
+	this.dt = null;
+	this.dt_status = 'destroyed';
+	this.dt_capturing = false;
+};
+
+DTraceConsumer.prototype.destroy = DTraceConsumer.prototype.close;
+
+/*
+ * Returns the native memory used by this consumer, in bytes, by category and
+ * in total.  See README.md for the categories.
+ */
+DTraceConsumer.prototype.memoryUsage = function ()
+{
+	var rv = {}, total = 0;
+
+	if (this.dt_status == 'destroyed')
+		throw (new Error('DTraceConsumer already destroyed'));
+
+	binding.memusage(this.dt, function (name, bytes) {
+		rv[name] = bytes;
+		total += bytes;
+	});
+
+	rv.total = total;
+	return (rv);
+};
+
 DTraceConsumer.prototype.setopt = function (option, value)
 {
 	this.checkReady();
@@ -93,52 +182,980 @@ DTraceConsumer.prototype.setopt = function (option, value)
 	binding.setopt(this.dt, option, value);
 };
 
-DTraceConsumer.prototype.consume = function (callback)
+/*
+ * Consume the principal buffer.  If "options.exact" is true, integer records
+ * are passed as BigInts, so that 64-bit values are exact.
+ */
+DTraceConsumer.prototype.consume = function (options, callback)
 {
+	var exact;
+
 	this.checkReady();
+
+	if (callback === undefined && typeof (options) != 'object') {
+		callback = options;
+		options = {};
+	}
+
+	mod_assert.equal(typeof (options), 'object',
+	    'consume: expected object argument');
+	exact = checkExact('consume', options);
+
+	/*
+	 * While capturing, records go to the capture log, so the callback is
+	 * only needed if they're also being passed through.
+	 */
+	if (callback === undefined && this.dt_capturing)
+		callback = function () {};
 	mod_assert.equal(typeof (callback), 'function',
 	    'consume: expected function argument');
-	binding.consume(this.dt, function (provider, module, func, name, data) {
-		var probe = {
-		    'provider': provider,
-		    'module': module,
-		    'func': func,
-		    'name': name
+	binding.consume(this.dt, function () {
+		consumeRecord(callback, arguments);
+	}, exact ? 1 : 0);
+};
+
+/*
+ * Translate the arguments of the binding's consume() callback, which are the
+ * probe's provider, module, function, and name, followed by the record's data
+ * (if any, and as two 32-bit halves for exact integers), and invoke
+ * "callback".
+ */
+function consumeRecord(callback, args)
+{
+	var probe = {
+	    'provider': args[0],
+	    'module': args[1],
+	    'func': args[2],
+	    'name': args[3]
+	};
+
+	if (args.length == 4)
+		callback(probe);
+	else if (args.length == 6)
+		callback(probe, { 'data': int64(args[4], args[5]) });
+	else
+		callback(probe, { 'data': args[4] });
+}
+
+DTraceConsumer.prototype.aggwalk = function (options, callback)
+{
+	if (arguments.length == 1)
+		aggwalkImpl(this, 'aggwalk', [], {}, options);
+	else
+		aggwalkImpl(this, 'aggwalk', [], options, callback);
+};
+
+/*
+ * Like aggwalk(), but records are left in place rather than removed.
+ */
+DTraceConsumer.prototype.aggpeek = function (options, callback)
+{
+	if (arguments.length == 1)
+		aggwalkImpl(this, 'aggpeek', [], {}, options);
+	else
+		aggwalkImpl(this, 'aggpeek', [], options, callback);
+};
+
+/*
+ * Common implementation of aggwalk(), aggpeek(), and rollupQuery().  "extra"
+ * contains any method-specific arguments that the binding expects between the
+ * callback and the aggwalk() options.
+ */
+function aggwalkImpl(consumer, method, extra, options, callback)
+{
+	var args;
+
+	consumer.checkReady();
+	mod_assert.equal(typeof (options), 'object',
+	    method + ': expected object argument');
+	mod_assert.equal(typeof (callback), 'function',
+	    method + ': expected function argument');
+
+	args = extra.concat(aggwalkArgs(method, options));
+	args.unshift(consumer.dt, function () {
+		aggwalkRecord(options, callback, arguments);
+	});
+
+	binding[method].apply(null, args);
+}
+
+/*
+ * Translate the arguments of the binding's aggwalk() callback (see
+ * dta_dt_aggwalk() in src/dtrace_async.c) for a walk with the given options,
+ * and invoke "callback".
+ */
+function aggwalkRecord(options, callback, args)
+{
+	var vid = args[0];
+	var action = args[1];
+	var nkeys = args[2];
+	var key, value, i;
+
+	if (options.exact) {
+		aggwalkExact(options, callback, args);
+		return;
+	}
+
+	if (options.slots) {
+		/* The keys are replaced by their slot (see slotInfo()). */
+		key = args[2];
+		i = 0;
+	} else {
+		key = new Array(nkeys);
+		for (i = 0; i < nkeys; i++)
+			key[i] = args[i + 3];
+	}
+
+	if (options.percentiles !== undefined &&
+	    (action == 'quantize()' || action == 'lquantize()' ||
+	    action == 'llquantize()')) {
+		value = xlateStats(options.percentiles,
+		    Array.prototype.slice.call(args, i + 3));
+	} else if (action == 'quantize()') {
+		value = xlateQuantize(Array.prototype.slice.call(args, i + 3));
+	} else if (action == 'lquantize()') {
+		value = xlateLquantize(Array.prototype.slice.call(args, i + 3));
+	} else if (action == 'llquantize()') {
+		value = xlateLlquantize(
+		    Array.prototype.slice.call(args, i + 3));
+	} else {
+		value = args[i + 3];
+	}
+
+	callback(vid, key, value);
+}
+
+/*
+ * Translate the arguments of an exact aggregation walk's callback (see "Exact
+ * aggregation walks" in src/dtrace_async.c): the last argument is a buffer of
+ * 64-bit integers holding each integer key (passed as null), then the
+ * parameter word and the values.  Bucket counts are passed in bulk, as a
+ * BigInt64Array over the buffer, without creating a BigInt for each one.
+ */
+function aggwalkExact(options, callback, args)
+{
+	var vid = args[0];
+	var action = args[1];
+	var nkeys = options.slots ? 0 : args[2];
+	var ints = int64Array(args[args.length - 1]);
+	var key = options.slots ? args[2] : new Array(nkeys);
+	var ni = 0;
+	var value, param, hi, lo, vals, i;
+
+	for (i = 0; i < nkeys; i++)
+		key[i] = args[i + 3] === null ? ints[ni++] : args[i + 3];
+
+	if (options.percentiles !== undefined &&
+	    (action == 'quantize()' || action == 'lquantize()' ||
+	    action == 'llquantize()')) {
+		callback(vid, key, xlateStats(options.percentiles,
+		    Array.prototype.slice.call(args, nkeys + 3,
+		    args.length - 1)));
+		return;
+	}
+
+	param = ints[ni];
+	vals = ints.subarray(ni + 1);
+	hi = Number((param >> BigInt(32)) & BigInt(0xffffffff));
+	lo = Number(param & BigInt(0xffffffff));
+
+	switch (action) {
+	case 'avg()':
+		value = Number(vals[1]) / Number(vals[0]);
+		break;
+
+	case 'quantize()':
+		value = { 'ranges': quantizeRanges(), 'counts': vals };
+		break;
+
+	case 'lquantize()':
+		value = {
+		    'ranges': lquantizeRanges(lo | 0, hi >>> 16, hi & 0xffff),
+		    'counts': vals
 		};
+		break;
+
+	case 'llquantize()':
+		value = {
+		    'ranges': llquantizeRanges(hi >>> 16, hi & 0xffff,
+			lo >>> 16, lo & 0xffff, vals.length),
+		    'counts': vals
+		};
+		break;
+
+	default:
+		value = vals[0];
+		break;
+	}
+
+	callback(vid, key, value);
+}
+
+/*
+ * Validate the "exact" option, which requires BigInt support.
+ */
+function checkExact(method, options)
+{
+	if (!options.exact)
+		return (false);
+
+	mod_assert.equal(typeof (BigInt), 'function',
+	    method + ': "exact" requires BigInt support');
+	return (true);
+}
+
+/*
+ * Returns the BigInt whose high and low 32 bits are "hi" (signed) and "lo".
+ */
+function int64(hi, lo)
+{
+	return ((BigInt(hi) << BigInt(32)) + BigInt(lo));
+}
+
+/*
+ * Returns a BigInt64Array over the 64-bit integers in "buf", copying them only
+ * if they're not suitably aligned.
+ */
+function int64Array(buf)
+{
+	if (buf.byteOffset % 8 !== 0)
+		return (new BigInt64Array(new Uint8Array(buf).buffer));
+	return (new BigInt64Array(buf.buffer, buf.byteOffset,
+	    buf.length / 8));
+}
+
+/*
+ * Subscribe to some of this consumer's records, so that independent parts of a
+ * program can share one consumer (and so one set of enablings and buffers).
+ * "opts.consume" is invoked like a consume() callback for the records of
+ * probes matching "opts.probe" (an object with any of "provider", "module",
+ * "func", and "name"), and "opts.aggwalk" like an aggwalk() callback for the
+ * records of the aggregation variables in "opts.varids" (or all variables).
+ * Records are delivered by dispatch() and aggdispatch().
+ */
+DTraceConsumer.prototype.subscribe = function (opts)
+{
+	this.checkReady();
+	return (new Subscription(this, opts));
+};
+
+function Subscription(consumer, opts)
+{
+	var state = { 'active': true };
+	var dispatch = consumer.dt_dispatch;
+	var probe, varids, args;
+
+	mod_assert.equal(typeof (opts), 'object',
+	    'subscribe: expected object argument');
+	mod_assert.ok(opts.consume === undefined ||
+	    typeof (opts.consume) == 'function',
+	    'subscribe: expected "consume" to be a function');
+	mod_assert.ok(opts.aggwalk === undefined ||
+	    typeof (opts.aggwalk) == 'function',
+	    'subscribe: expected "aggwalk" to be a function');
+	mod_assert.ok(opts.consume !== undefined || opts.aggwalk !== undefined,
+	    'subscribe: expected "consume" or "aggwalk"');
+
+	probe = opts.probe || {};
+	mod_assert.equal(typeof (probe), 'object',
+	    'subscribe: expected "probe" to be an object');
+	varids = opts.varids || [];
+	mod_assert.ok(Array.isArray(varids),
+	    'subscribe: expected "varids" to be an array');
+
+	/*
+	 * The binding holds on to these callbacks until the subscriber is
+	 * removed, so they must not refer to the consumer (or to this
+	 * subscription, which does); otherwise, a consumer with subscribers
+	 * could never be garbage collected.
+	 */
+	args = [ consumer.dt ];
+	args.push(opts.consume === undefined ? null : function () {
+		if (state.active)
+			consumeRecord(opts.consume, arguments);
+	});
+	args.push(opts.aggwalk === undefined ? null : function () {
+		if (state.active)
+			aggwalkRecord(dispatch.walkopts, opts.aggwalk,
+			    arguments);
+	});
+
+	[ 'provider', 'module', 'func', 'name' ].forEach(function (field) {
+		mod_assert.ok(probe[field] === undefined ||
+		    typeof (probe[field]) == 'string',
+		    'subscribe: expected "probe.' + field + '" to be a string');
+		args.push(probe[field] === undefined ? null : probe[field]);
+	});
+
+	args.push(varids.length);
+	varids.forEach(function (varid) {
+		mod_assert.equal(typeof (varid), 'number',
+		    'subscribe: expected "varids" to contain numbers');
+		args.push(varid);
+	});
+
+	this.ds_consumer = consumer;
+	this.ds_id = binding.subscribe.apply(null, args);
+	this.ds_state = state;
+}
+
+/*
+ * Stop delivering records to this subscriber.  This may be called from within
+ * the subscriber's own callbacks, and does nothing once the consumer has been
+ * closed (which removes all subscribers).
+ */
+Subscription.prototype.unsubscribe = function ()
+{
+	var consumer = this.ds_consumer;
+
+	if (!this.ds_state.active)
+		return;
+
+	this.ds_state.active = false;
+	if (consumer.dt_status == 'destroyed')
+		return;
+
+	if (consumer.dt_dispatching)
+		consumer.dt_unsubscribed.push(this.ds_id);
+	else
+		binding.unsubscribe(consumer.dt, this.ds_id);
+};
+
+/*
+ * Consume the principal buffer (just like consume()), passing each record to
+ * the subscribers that want it.  "options.exact" is as for consume().
+ */
+DTraceConsumer.prototype.dispatch = function (options)
+{
+	var consumer = this;
+	var exact;
+
+	this.checkReady();
+	if (options === undefined)
+		options = {};
+	mod_assert.equal(typeof (options), 'object',
+	    'dispatch: expected object argument');
+	exact = checkExact('dispatch', options);
+
+	dispatchImpl(this, options, function () {
+		binding.consume(consumer.dt, null, exact ? 1 : 0);
+	});
+};
+
+/*
+ * Consume the aggregation buffer (just like aggwalk()), passing each record to
+ * the subscribers that want it.  Records that no subscriber wants are
+ * discarded.  "options" are as for aggwalk(), and if "options.peek" is true,
+ * records are left in place, as with aggpeek().
+ */
+DTraceConsumer.prototype.aggdispatch = function (options)
+{
+	var consumer = this;
+	var args;
+
+	this.checkReady();
+	if (options === undefined)
+		options = {};
+	mod_assert.equal(typeof (options), 'object',
+	    'aggdispatch: expected object argument');
+
+	args = aggwalkArgs('aggdispatch', options);
+	args.unshift(this.dt, null);
+	dispatchImpl(this, options, function () {
+		binding[options.peek ? 'aggpeek' : 'aggwalk'].apply(null, args);
+	});
+};
+
+/*
+ * Common implementation of dispatch() and aggdispatch().  Subscribers can't
+ * be removed from the binding while it's dispatching records, so those that
+ * unsubscribe during "func" are removed once it's done.
+ */
+function dispatchImpl(consumer, options, func)
+{
+	if (consumer.dt_dispatching)
+		throw (new Error('consumer is busy'));
+
+	consumer.dt_dispatching = true;
+	consumer.dt_dispatch.walkopts = options;
+
+	try {
+		func();
+	} finally {
+		consumer.dt_dispatching = false;
+		consumer.dt_dispatch.walkopts = null;
+		consumer.dt_unsubscribed.splice(0).forEach(function (id) {
+			binding.unsubscribe(consumer.dt, id);
+		});
+	}
+}
+
+/*
+ * Zero the values of all records of aggregation variable "varid" (or of all
+ * variables, if "varid" is not specified), keeping their keys.  Returns the
+ * number of records cleared.
+ */
+DTraceConsumer.prototype.aggclear = function (varid)
+{
+	this.checkReady();
+	if (varid === undefined)
+		varid = -1;
+	mod_assert.equal(typeof (varid), 'number',
+	    'aggclear: expected number argument');
+	return (binding.aggclear(this.dt, varid));
+};
+
+/*
+ * Remove all but the "n" records of aggregation variable "varid" (or of each
+ * variable, if "varid" is negative) with the largest values (or the smallest,
+ * if "n" is negative).  Returns the number of records removed.
+ */
+DTraceConsumer.prototype.aggtrunc = function (varid, n)
+{
+	this.checkReady();
+	if (n === undefined)
+		n = 0;
+	mod_assert.equal(typeof (varid), 'number',
+	    'aggtrunc: expected number argument');
+	mod_assert.equal(typeof (n), 'number',
+	    'aggtrunc: expected number argument');
+	return (binding.aggtrunc(this.dt, varid, n));
+};
+
+/*
+ * Enable rollups with a ring of "nwindows" windows, discarding any existing
+ * windows.  If "nwindows" is zero, rollups are disabled.
+ */
+DTraceConsumer.prototype.rollup = function (nwindows)
+{
+	this.checkReady();
+	mod_assert.ok(typeof (nwindows) == 'number' && nwindows >= 0 &&
+	    Math.floor(nwindows) == nwindows,
+	    'rollup: expected non-negative integer argument');
+	binding.rollup(this.dt, nwindows);
+};
+
+/*
+ * Consume the aggregation buffer (just like aggwalk()) into the next rollup
+ * window, replacing the oldest one if the ring is full.  Returns the number of
+ * records in the new window.
+ */
+DTraceConsumer.prototype.rollupTick = function ()
+{
+	this.checkReady();
+	return (binding.rolluptick(this.dt));
+};
+
+/*
+ * Merge the newest "nwindows" rollup windows and invoke "callback" for each
+ * record, just like aggwalk() (and with the same options).
+ */
+DTraceConsumer.prototype.rollupQuery = function (nwindows, options, callback)
+{
+	mod_assert.ok(typeof (nwindows) == 'number' && nwindows >= 0,
+	    'rollupQuery: expected non-negative number argument');
+	if (arguments.length == 2)
+		aggwalkImpl(this, 'rollupquery', [ nwindows ], {}, options);
+	else
+		aggwalkImpl(this, 'rollupquery', [ nwindows ], options,
+		    callback);
+};
+
+/*
+ * Flags for binding.aggmerge() (see DTA_MERGE_F_* in src/dtrace_async.c).
+ */
+var MERGE_F_PEEK = 0x1;
+
+/*
+ * Consume the aggregation buffers of this consumer and of each consumer in
+ * "others" (just like aggwalk()), merge records with the same aggregation name
+ * and keys natively, and invoke "callback" once for each merged record, just
+ * like aggwalk() (and with the same options).  If "options.peek" is true,
+ * records are left in place, as with aggpeek().
+ */
+DTraceConsumer.prototype.aggmerge = function (others, options, callback)
+{
+	var extra;
+
+	mod_assert.ok(Array.isArray(others),
+	    'aggmerge: expected array argument');
+	if (arguments.length == 2) {
+		callback = options;
+		options = {};
+	}
+	mod_assert.equal(typeof (options), 'object',
+	    'aggmerge: expected object argument');
+
+	extra = [ options.peek ? MERGE_F_PEEK : 0, others.length ];
+	others.forEach(function (other) {
+		mod_assert.ok(other instanceof DTraceConsumer,
+		    'aggmerge: expected an array of consumers');
+		other.checkReady();
+		extra.push(other.dt);
+	});
+
+	aggwalkImpl(this, 'aggmerge', extra, options, callback);
+};
+
+/*
+ * Translate aggwalk() options into the flattened arguments that the binding
+ * expects:
+ *
+ *     nvarids, varid1, ..., nprefix, key1, ..., npercentiles, percentile1, ...,
+ *     exact, slots
+ *
+ * "npercentiles" is -1 if no statistics were requested.
+ */
+function aggwalkArgs(method, options)
+{
+	var args = [];
+	var varids = options.varids || [];
+	var prefix = options.keyPrefix || [];
+	var percentiles = options.percentiles || [];
+	var exact = checkExact(method, options);
+
+	if (options.varids === undefined && options.keyPrefix === undefined &&
+	    options.percentiles === undefined && !exact && !options.slots)
+		return (args);
+
+	mod_assert.ok(Array.isArray(varids),
+	    method + ': expected "varids" to be an array');
+	mod_assert.ok(Array.isArray(prefix),
+	    method + ': expected "keyPrefix" to be an array');
+
+	args.push(varids.length);
+	varids.forEach(function (varid) {
+		mod_assert.equal(typeof (varid), 'number',
+		    method + ': expected "varids" to contain numbers');
+		args.push(varid);
+	});
+
+	args.push(prefix.length);
+	prefix.forEach(function (key) {
+		mod_assert.ok(typeof (key) == 'number' ||
+		    typeof (key) == 'string',
+		    method + ': expected "keyPrefix" to contain numbers ' +
+		    'or strings');
+		args.push(key);
+	});
 
-		if (arguments.length == 4)
-			callback(probe);
-		else
-			callback(probe, { 'data': data });
+	mod_assert.ok(Array.isArray(percentiles),
+	    method + ': expected "percentiles" to be an array');
+	args.push(options.percentiles === undefined ? -1 : percentiles.length);
+	percentiles.forEach(function (pct) {
+		mod_assert.ok(typeof (pct) == 'number' && pct >= 0 &&
+		    pct <= 100, method + ': expected "percentiles" to ' +
+		    'contain numbers between 0 and 100');
+		args.push(pct);
 	});
+
+	args.push(exact ? 1 : 0);
+	args.push(options.slots ? 1 : 0);
+	return (args);
+}
+
+/*
+ * Consume the aggregation buffer (just like aggwalk()) into a single binary
+ * snapshot, which can be read with AggSnapshot.  If "target" is given, it may
+ * be a Buffer, an ArrayBuffer, a SharedArrayBuffer, or a view onto one of
+ * these; the snapshot is written directly into it and the snapshot's size is
+ * returned.  If "target" is too small, an Error is thrown with a "needed"
+ * property, but the snapshot is kept, so no data is lost by retrying with a
+ * bigger buffer.  If "target" is not given, a new Buffer is returned.
+ */
+DTraceConsumer.prototype.aggsnapshot = function (target)
+{
+	var buf, size, err;
+
+	this.checkReady();
+	if (target === undefined)
+		return (binding.aggsnapshot(this.dt));
+
+	if (Buffer.isBuffer(target))
+		buf = target;
+	else if (ArrayBuffer.isView(target))
+		buf = Buffer.from(target.buffer, target.byteOffset,
+		    target.byteLength);
+	else
+		buf = Buffer.from(target);
+
+	size = binding.aggsnapshot(this.dt, buf);
+	if (size > buf.length) {
+		err = new Error(mod_util.format('aggsnapshot: snapshot ' +
+		    'requires %d bytes (target has %d)', size, buf.length));
+		err.needed = size;
+		throw (err);
+	}
+
+	return (size);
 };
 
-DTraceConsumer.prototype.aggwalk = function (callback)
+/*
+ * Flags for binding.exposition() (see DTA_EXPO_F_* in src/dtrace_async.c).
+ */
+var EXPO_F_CONSUME = 0x1;
+var EXPO_F_OPENMETRICS = 0x2;
+
+var expo_metric_re = /^[a-zA-Z_:][a-zA-Z0-9_:]*$/;
+var expo_label_re = /^[a-zA-Z_][a-zA-Z0-9_]*$/;
+
+/*
+ * Render the aggregations described by "opts.metrics" as Prometheus (or, with
+ * "opts.format" set to "openmetrics", OpenMetrics) text, returned in a single
+ * Buffer.  "opts.metrics" maps aggregation variable IDs to either a metric
+ * name or an object with "name" and optional "help", "type", and "labels"
+ * properties.  Records are left in place unless "opts.consume" is true.
+ */
+DTraceConsumer.prototype.exposition = function (opts)
 {
+	var args = [];
+	var names = {};
+	var flags = 0;
+	var metrics;
+
+	this.checkReady();
+	mod_assert.equal(typeof (opts), 'object',
+	    'exposition: expected object argument');
+	mod_assert.ok(opts.metrics !== null &&
+	    typeof (opts.metrics) == 'object',
+	    'exposition: expected "metrics" to be an object');
+
+	if (opts.consume)
+		flags |= EXPO_F_CONSUME;
+	if (opts.format !== undefined && opts.format != 'prometheus') {
+		mod_assert.equal(opts.format, 'openmetrics',
+		    'exposition: unsupported format');
+		flags |= EXPO_F_OPENMETRICS;
+	}
+
+	metrics = Object.keys(opts.metrics);
+	args.push(this.dt, flags, metrics.length);
+	metrics.forEach(function (varid) {
+		var metric = opts.metrics[varid];
+		var labels;
+
+		if (typeof (metric) == 'string')
+			metric = { 'name': metric };
+
+		mod_assert.ok(/^[0-9]+$/.test(varid),
+		    'exposition: expected variable IDs as keys');
+		mod_assert.ok(typeof (metric.name) == 'string' &&
+		    expo_metric_re.test(metric.name),
+		    'exposition: invalid metric name for varid ' + varid);
+		mod_assert.ok(!names.hasOwnProperty(metric.name),
+		    'exposition: duplicate metric name "' + metric.name + '"');
+		mod_assert.ok(metric.help === undefined ||
+		    typeof (metric.help) == 'string',
+		    'exposition: expected "help" to be a string');
+		mod_assert.ok(metric.type === undefined ||
+		    metric.type == 'counter' || metric.type == 'gauge',
+		    'exposition: expected "type" to be "counter" or "gauge"');
+		names[metric.name] = true;
+
+		labels = metric.labels || [];
+		mod_assert.ok(Array.isArray(labels),
+		    'exposition: expected "labels" to be an array');
+		labels.forEach(function (label) {
+			mod_assert.ok(typeof (label) == 'string' &&
+			    expo_label_re.test(label) && label != 'le',
+			    'exposition: invalid label name "' + label + '"');
+		});
+
+		args.push(parseInt(varid, 10), metric.name, metric.help,
+		    metric.type, labels.length);
+		args.push.apply(args, labels);
+	});
+
+	return (binding.exposition.apply(null, args));
+};
+
+/*
+ * Flags for binding.capture() (see DTA_CAP_F_* in src/dtrace_async.c).
+ */
+var CAP_F_SYNC = 0x1;
+var CAP_F_PASSTHROUGH = 0x2;
+
+/*
+ * Start capturing the records that consume() processes to the capture log at
+ * "path" (see src/dta_caplog.h), appending to it if it exists.  Options:
+ *
+ *     segmentSize	target size of each segment, in bytes (default 1MB)
+ *     maxSegmentAge	write a segment once its records are this many
+ *     			milliseconds old, even if it's not full (default 5000;
+ *     			zero to wait until it's full)
+ *     sync		sync each segment to disk
+ *     passthrough	also pass records to the consume() callback
+ */
+DTraceConsumer.prototype.capture = function (path, opts)
+{
+	var segsize = 1024 * 1024;
+	var maxage = 5000;
+	var flags = 0;
+
 	this.checkReady();
+	mod_assert.equal(typeof (path), 'string',
+	    'capture: expected string argument');
+	if (opts === undefined)
+		opts = {};
+	mod_assert.equal(typeof (opts), 'object',
+	    'capture: expected object argument');
+
+	if (opts.segmentSize !== undefined) {
+		mod_assert.ok(typeof (opts.segmentSize) == 'number' &&
+		    opts.segmentSize >= 4096 && opts.segmentSize <= 0x40000000,
+		    'capture: expected "segmentSize" between 4KB and 1GB');
+		segsize = Math.floor(opts.segmentSize);
+	}
+
+	if (opts.maxSegmentAge !== undefined) {
+		mod_assert.ok(typeof (opts.maxSegmentAge) == 'number' &&
+		    opts.maxSegmentAge >= 0,
+		    'capture: expected non-negative "maxSegmentAge"');
+		maxage = opts.maxSegmentAge;
+	}
+
+	if (opts.sync)
+		flags |= CAP_F_SYNC;
+	if (opts.passthrough)
+		flags |= CAP_F_PASSTHROUGH;
+
+	binding.capture(this.dt, path, segsize, flags, maxage);
+	this.dt_capturing = true;
+};
+
+/*
+ * Write out the records captured so far.
+ */
+DTraceConsumer.prototype.captureFlush = function ()
+{
+	this.checkReady();
+	binding.captureflush(this.dt);
+};
+
+function captureStats(records, segments, bytes, dropped, nsecs)
+{
+	return ({
+	    'records': records,
+	    'segments': segments,
+	    'bytes': bytes,
+	    'dropped': dropped,
+	    'nsecs': nsecs,
+	    'recordsPerSecond': nsecs === 0 ? 0 : records / (nsecs / 1e9),
+	    'bytesPerSecond': nsecs === 0 ? 0 : bytes / (nsecs / 1e9)
+	});
+}
+
+/*
+ * Returns statistics about the capture in progress.
+ */
+DTraceConsumer.prototype.captureStats = function ()
+{
+	var rv;
+
+	this.checkReady();
+	binding.capturestats(this.dt, function () {
+		rv = captureStats.apply(null, arguments);
+	});
+	return (rv);
+};
+
+/*
+ * Write out any remaining records, stop capturing, and return the final
+ * statistics.
+ */
+DTraceConsumer.prototype.captureStop = function ()
+{
+	var rv;
+
+	this.checkReady();
+	/*
+	 * The binding reports statistics whenever the capture was stopped,
+	 * even if it then throws because the last records couldn't be written.
+	 */
+	try {
+		binding.capturestop(this.dt, function () {
+			rv = captureStats.apply(null, arguments);
+		});
+	} finally {
+		if (rv !== undefined)
+			this.dt_capturing = false;
+	}
+
+	return (rv);
+};
+
+/*
+ * Flags for binding.snapshot() (see DTA_RING_F_* in src/dtrace_async.c).
+ */
+var RING_F_STOP = 0x1;
+
+/*
+ * Drain the principal buffers once, as for a flight recorder using
+ * bufpolicy=ring, and invoke callback(err, batch).  The buffers are read on a
+ * worker thread; "batch.records" holds what consume() would have delivered, as
+ * { probe, rec } pairs.  Tracing is stopped first, since ring buffers generally
+ * can't be read while it's active, so a snapshot ends the enabling.  Options:
+ *
+ *     stop		if false, read the buffers without stopping tracing
+ *     		(only where the system allows that)
+ */
+DTraceConsumer.prototype.snapshot = function (opts, callback)
+{
+	var dt = this.dt;
+	var start, flags;
+
+	this.checkReady();
+
+	if (callback === undefined) {
+		callback = opts;
+		opts = {};
+	}
+
+	mod_assert.equal(typeof (opts), 'object',
+	    'snapshot: expected object argument');
 	mod_assert.equal(typeof (callback), 'function',
-	    'aggwalk: expected function argument');
-	binding.aggwalk(this.dt, function (vid, action, nkeys) {
-		var key, value, i;
-		key = new Array(nkeys);
-		for (i = 0; i < nkeys; i++)
-			key[i] = arguments[i + 3];
-
-		if (action == 'quantize()') {
-			value = xlateQuantize(
-			    Array.prototype.slice.call(arguments, i + 3));
-		} else if (action == 'lquantize()') {
-			value = xlateLquantize(
-			    Array.prototype.slice.call(arguments, i + 3));
-		} else if (action == 'llquantize()') {
-			value = xlateLlquantize(
-			    Array.prototype.slice.call(arguments, i + 3));
-		} else {
-			value = arguments[i + 3];
+	    'snapshot: expected function argument');
+
+	flags = opts.stop === false ? 0 : RING_F_STOP;
+	start = process.hrtime();
+	binding.snapshot(dt, flags, function (err) {
+		var batch = { 'records': [] };
+		var elapsed;
+
+		if (err) {
+			callback(err);
+			return;
 		}
 
-		callback(vid, key, value);
+		binding.snapshotread(dt, function () {
+			consumeRecord(function (probe, rec) {
+				batch.records.push({
+				    'probe': probe,
+				    'rec': rec
+				});
+			}, arguments);
+		}, function (nrecords, bytes, nsecs) {
+			batch.nrecords = nrecords;
+			batch.bytes = bytes;
+			batch.drainTime = nsecs;
+		});
+
+		elapsed = process.hrtime(start);
+		batch.latency = elapsed[0] * 1e9 + elapsed[1];
+		callback(null, batch);
+	});
+};
+
+/*
+ * Returns what's known about key slot "slot" (see the "slots" option of
+ * aggwalk()): the aggregation variable ID, the keys, and the stable 64-bit hash
+ * and canonical binary encoding of the keys that identify the slot.  This may
+ * be called from within aggwalk() callbacks.
+ */
+DTraceConsumer.prototype.slotInfo = function (slot)
+{
+	var rv;
+
+	this.checkReady();
+	mod_assert.ok(typeof (slot) == 'number' && slot >= 0 &&
+	    Math.floor(slot) == slot,
+	    'slotInfo: expected non-negative integer argument');
+	binding.slotinfo(this.dt, slot, function (varid, hash, encoding) {
+		rv = {
+		    'varid': varid,
+		    'key': Array.prototype.slice.call(arguments, 3),
+		    'hash': hash,
+		    'encoding': encoding
+		};
+	});
+	return (rv);
+};
+
+/*
+ * Returns the number of key slots assigned so far.
+ */
+DTraceConsumer.prototype.slotCount = function ()
+{
+	this.checkReady();
+	return (binding.slotcount(this.dt));
+};
+
+/*
+ * Forget all key slots, so that they're assigned from zero again.
+ */
+DTraceConsumer.prototype.slotReset = function ()
+{
+	this.checkReady();
+	binding.slotreset(this.dt);
+};
+
+/*
+ * Configure the table of strings shared across consume() and aggwalk()
+ * callbacks: keep up to "capacity" strings (rounded up to a power of 2), or
+ * none, if "capacity" is zero.  The table is emptied either way.
+ */
+DTraceConsumer.prototype.internConfig = function (capacity)
+{
+	this.checkReady();
+	mod_assert.ok(typeof (capacity) == 'number' && capacity >= 0 &&
+	    capacity <= 1048576 && Math.floor(capacity) == capacity,
+	    'internConfig: expected integer between 0 and 1048576');
+	binding.internconf(this.dt, capacity);
+};
+
+/*
+ * Returns statistics about the string intern table.
+ */
+DTraceConsumer.prototype.internStats = function ()
+{
+	var rv;
+
+	this.checkReady();
+	binding.internstats(this.dt,
+	    function (count, capacity, hits, misses, evictions, uncached) {
+		var total = hits + misses + uncached;
+
+		rv = {
+		    'count': count,
+		    'capacity': capacity,
+		    'hits': hits,
+		    'misses': misses,
+		    'evictions': evictions,
+		    'uncached': uncached,
+		    'hitRate': total === 0 ? 0 : hits / total
+		};
 	});
+	return (rv);
+};
+
+/*
+ * Flags for binding.aggencode() (see DTA_WIRE_ENC_F_* in src/dtrace_async.c).
+ */
+var WIRE_ENC_F_DELTA = 0x1;
+var WIRE_ENC_F_PEEK = 0x2;
+
+/*
+ * Encode the aggregation buffer as a compact binary frame (see
+ * src/dta_wire.h), returned in a Buffer.  If "opts.delta" is true, the frame
+ * is encoded relative to the previous one.  Records are consumed, as with
+ * aggwalk(), unless "opts.peek" is true.
+ */
+DTraceConsumer.prototype.aggencode = function (opts)
+{
+	var flags = 0;
+
+	this.checkReady();
+	if (opts === undefined)
+		opts = {};
+	mod_assert.equal(typeof (opts), 'object',
+	    'aggencode: expected object argument');
+
+	if (opts.delta)
+		flags |= WIRE_ENC_F_DELTA;
+	if (opts.peek)
+		flags |= WIRE_ENC_F_PEEK;
+
+	return (binding.aggencode(this.dt, flags));
 };
 
 DTraceConsumer.prototype.strcompile = makeBindingWrapper(
@@ -155,11 +1172,17 @@ DTraceConsumer.prototype.version = makeBindingWrapper(
  * the format we provide to consumers.
  */
 function xlateQuantize(args)
+{
+	return (xlateBuckets(quantizeRanges(), args));
+}
+
+function quantizeRanges()
 {
 	if (dtc_buckets_quantize === null)
-		dtc_buckets_quantize = makeQuantizeBuckets();
+		dtc_buckets_quantize =
+		    mod_buckets.makeQuantizeBuckets(dtc_conf);
 
-	return (xlateBuckets(dtc_buckets_quantize, args));
+	return (dtc_buckets_quantize);
 }
 
 /*
@@ -168,21 +1191,22 @@ function xlateQuantize(args)
  */
 function xlateLquantize(args)
 {
-	var base = args[0];
-	var step = args[1];
-	var nlevels = args[2];
-	var ranges;
+	return (xlateBuckets(lquantizeRanges(args[0], args[1], args[2]),
+	    args.slice(3)));
+}
 
+function lquantizeRanges(base, step, nlevels)
+{
 	if (dtc_buckets_lquantize[nlevels] === undefined)
 		dtc_buckets_lquantize[nlevels] = {};
 	if (dtc_buckets_lquantize[nlevels][base] === undefined)
 		dtc_buckets_lquantize[nlevels][base] = {};
 	if (dtc_buckets_lquantize[nlevels][base][step] === undefined)
 		dtc_buckets_lquantize[nlevels][base][step] =
-		    makeLquantizeBuckets(base, step, nlevels);
+		    mod_buckets.makeLquantizeBuckets(dtc_conf,
+		    base, step, nlevels);
 
-	ranges = dtc_buckets_lquantize[nlevels][base][step];
-	return (xlateBuckets(ranges, args.slice(3)));
+	return (dtc_buckets_lquantize[nlevels][base][step]);
 }
 
 /*
@@ -191,12 +1215,12 @@ function xlateLquantize(args)
  */
 function xlateLlquantize(args)
 {
-	var factor = args[0];
-	var low = args[1];
-	var high = args[2];
-	var nsteps = args[3];
-	var nbuckets = args[4];
+	return (xlateBuckets(llquantizeRanges(args[0], args[1], args[2],
+	    args[3], args[4]), args.slice(5)));
+}
 
+function llquantizeRanges(factor, low, high, nsteps, nbuckets)
+{
 	var key = 'factor=' + factor +
 	    ';low=' + low +
 	    ';high=' + high +
@@ -204,129 +1228,39 @@ function xlateLlquantize(args)
 	    ';nbuckets=' + nbuckets;
 
 	if (dtc_buckets_llquantize[key] === undefined)
-		dtc_buckets_llquantize[key] = makeLlquantizeBuckets(
+		dtc_buckets_llquantize[key] =
+		    mod_buckets.makeLlquantizeBuckets(dtc_conf,
 		    factor, low, high, nsteps, nbuckets);
 
-	return (xlateBuckets(dtc_buckets_llquantize[key], args.slice(5)));
-}
-
-function xlateBuckets(ranges, args)
-{
-	var nbuckets = args.length >> 1;
-	var rv = new Array(nbuckets);
-	var i;
-
-	for (i = 0; i < nbuckets; i++)
-		rv[i] = [ ranges[args[i << 1]], args[(i << 1) + 1]];
-	return (rv);
-}
-
-/*
- * Initialize the mapping between bucket index and the corresponding range of
- * values for a quantize() bucket.  Each range is an array denoting [min, max].
- * Values are always integers, and both endpoints are included.  As a result,
- * you get buckets like:
- *
- * RANGE     CONTAINED VALUES
- * [-7, -4]  -7, -6, -5, and -4
- * [-3, -2]  -2 and -3
- * [-1, -1]  -1
- * [ 0,  0]   0
- * [ 1,  1]   1
- * [ 2,  3]   2 and 3
- * [ 4,  7]   4, 5, 6, and 7
- */
-function makeQuantizeBuckets()
-{
-	var rv = new Array(dtc_conf.DTRACE_QUANTIZE_NBUCKETS);
-	var i, min, max;
-
-	for (i = 0; i < rv.length; i++) {
-		if (i < dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET) {
-			min = i > 0 ? quantizeBucketval(i - 1) + 1 :
-			    dtc_conf.INT64_MIN;
-			max = quantizeBucketval(i);
-		} else if (i == dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET) {
-			min = max = 0;
-		} else {
-			min = quantizeBucketval(i);
-			max = i < dtc_conf.DTRACE_QUANTIZE_NBUCKETS - 1 ?
-			    quantizeBucketval(i + 1) - 1 : dtc_conf.INT64_MAX;
-		}
-
-		rv[i] = [ min, max ];
-	}
-
-	return (rv);
-}
-
-/*
- * JS implementation of DTRACE_QUANTIZE_BUCKETVAL() macro.
- */
-function quantizeBucketval(bi)
-{
-	/*
-	 * There aren't enough bits in JavaScript numbers for shifting to do the
-	 * right thing.  Math.pow() is pretty slow, but we're only doing this
-	 * once in the entire program lifetime.
-	 */
-	if (bi < dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET)
-		return (-Math.pow(2,
-		    (dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET - 1 - bi)));
-	if (bi == dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET)
-		return (0);
-	return (Math.pow(2, (bi - dtc_conf.DTRACE_QUANTIZE_ZEROBUCKET - 1)));
+	return (dtc_buckets_llquantize[key]);
 }
 
 /*
- * Initialize the mapping between bucket ids and [ min, max ] ranges for an
- * lquantize() with parameters "base", "step", and "nlevels".
+ * Translate from the internal format of the statistics computed for a
+ * quantizing action (count, mean, and then each requested percentile) into the
+ * format we provide to consumers.
  */
-function makeLquantizeBuckets(base, step, nlevels)
+function xlateStats(percentiles, args)
 {
-	var rv = new Array(nlevels + 2);
-	var i, min, max;
-
-	for (i = 0; i < rv.length; i++) {
-		min = i === 0 ? dtc_conf.INT64_MIN : base + ((i - 1) * step);
-		max = i > nlevels ? dtc_conf.INT64_MAX : base + (i * step) - 1;
-		rv[i] = [ min, max ];
-	}
+	var rv = {
+	    'count': args[0],
+	    'mean': args[1],
+	    'percentiles': {}
+	};
+	var i;
 
+	for (i = 0; i < percentiles.length; i++)
+		rv.percentiles[percentiles[i]] = args[i + 2];
 	return (rv);
 }
 
-/*
- * Initialize the mapping between bucket ids and [ min, max ] ranges for an
- * llquantize() with parameters "factor", "low", "high", "nsteps", and
- * "nbuckets" buckets.
- */
-function makeLlquantizeBuckets(factor, low, high, nsteps, nbuckets)
+function xlateBuckets(ranges, args)
 {
+	var nbuckets = args.length >> 1;
 	var rv = new Array(nbuckets);
-	var value = 1;
-	var order, bucket, step, next;
-
-	for (order = 0; order < low; order++)
-		value *= factor;
-
-	bucket = 0;
-	rv[bucket++] = [ 0, value - 1 ];
-	next = value * factor;
-	step = next > nsteps ? Math.floor(next / nsteps) : 1;
-
-	while (order <= high) {
-		rv[bucket++] = [ value, value + step - 1 ];
-
-		if ((value += step) != next)
-			continue;
-
-		next = value * factor;
-		step = next > nsteps ? Math.floor(next / nsteps) : 1;
-		order++;
-	}
+	var i;
 
-	rv[bucket] = [ value, dtc_conf.INT64_MAX ];
-	mod_assert.equal(bucket + 1, nbuckets);
+	for (i = 0; i < nbuckets; i++)
+		rv[i] = [ ranges[args[i << 1]], args[(i << 1) + 1]];
 	return (rv);
 }
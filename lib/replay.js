@@ -0,0 +1,236 @@
+/*
+ * lib/replay.js: replays the capture logs written by consumer.capture().  The
+ * native part of this is a separate binding that doesn't depend on libdtrace,
+ * so captures can be replayed on hosts without DTrace.  See src/dta_caplog.h
+ * for the format.
+ */
+var binding = require('bindings')('dtrace_replay.node');
+
+var mod_assert = require('assert');
+
+/* Public interface */
+exports.createReplayConsumer = createReplayConsumer;
+exports.ReplayConsumer = ReplayConsumer;
+
+/* Flags for binding.open() (see DTA_CAPREAD_F_* in src/dta_caplog.h) */
+var CAPREAD_F_VERIFY = 0x1;
+
+/*
+ * As with DTraceConsumers, ReplayConsumers that are garbage collected without
+ * having been closed are closed here, so that the log isn't left mapped.  This
+ * is only a backstop, since collection may happen much later, or never.
+ */
+var rc_finalizer = typeof (FinalizationRegistry) == 'function' ?
+    new FinalizationRegistry(function (handle) {
+	binding.close(handle);
+    }) : null;
+
+/*
+ * Public interface: open the capture log at "path" for replay.  See README.md
+ * for details.
+ */
+function createReplayConsumer(path, opts)
+{
+	return (new ReplayConsumer(path, opts));
+}
+
+/*
+ * A ReplayConsumer delivers the records of a capture log through consume(),
+ * just as the DTraceConsumer that captured them would have.  Each call to
+ * consume() delivers the records that one consume() call captured.
+ */
+function ReplayConsumer(path, opts)
+{
+	var probe;
+
+	mod_assert.equal(typeof (path), 'string',
+	    'replay: expected string argument');
+	if (opts === undefined)
+		opts = {};
+	mod_assert.equal(typeof (opts), 'object',
+	    'replay: expected object argument');
+
+	this.rc_timer = null;
+	this.rc = binding.open(path,
+	    opts.verify === false ? 0 : CAPREAD_F_VERIFY);
+	if (rc_finalizer !== null)
+		rc_finalizer.register(this, this.rc, this);
+
+	if (opts.probe !== undefined) {
+		probe = opts.probe;
+		mod_assert.equal(typeof (probe), 'object',
+		    'replay: expected "probe" to be an object');
+		binding.filter(this.rc, probe.provider, probe.module,
+		    probe.func, probe.name);
+	}
+}
+
+/*
+ * Deliver the records of the next captured consume() call, invoking
+ * func(probe, rec) exactly as DTraceConsumer.consume() does.  Returns the time
+ * at which the records were captured, as a Date, or null if there are no more
+ * records.
+ */
+ReplayConsumer.prototype.consume = function (func)
+{
+	var time;
+
+	mod_assert.equal(typeof (func), 'function',
+	    'consume: expected function argument');
+	this.checkOpen();
+	time = binding.read(this.rc,
+	    function (provider, module, funcname, name, data) {
+		var probe = {
+		    'provider': provider,
+		    'module': module,
+		    'func': funcname,
+		    'name': name
+		};
+
+		if (arguments.length == 4)
+			func(probe);
+		else
+			func(probe, { 'data': data });
+	});
+
+	return (time < 0 ? null : new Date(time));
+};
+
+/*
+ * Deliver all remaining records.
+ */
+ReplayConsumer.prototype.consumeAll = function (func)
+{
+	while (this.consume(func) !== null)
+		continue;
+};
+
+/*
+ * Deliver the remaining records at the pace at which they were captured (or
+ * "opts.speed" times that pace), then invoke "callback".  Playback stops if
+ * the consumer is closed.
+ */
+ReplayConsumer.prototype.play = function (func, opts, callback)
+{
+	var rc = this;
+	var speed;
+
+	if (arguments.length == 2) {
+		callback = opts;
+		opts = {};
+	}
+
+	mod_assert.equal(typeof (func), 'function',
+	    'play: expected function argument');
+	mod_assert.equal(typeof (opts), 'object',
+	    'play: expected object argument');
+	mod_assert.equal(typeof (callback), 'function',
+	    'play: expected function argument');
+	mod_assert.ok(this.rc_timer === null, 'play: already playing');
+	this.checkOpen();
+
+	speed = opts.speed === undefined ? 1 : opts.speed;
+	mod_assert.ok(typeof (speed) == 'number' && speed > 0,
+	    'play: "speed" must be a positive number');
+
+	function tick() {
+		var time;
+
+		rc.rc_timer = null;
+		if ((time = rc.consume(func)) === null) {
+			callback();
+			return;
+		}
+
+		/* "func" may have closed the consumer. */
+		if (rc.rc === null)
+			return;
+
+		rc.rc_timer = setTimeout(tick, Math.max(0,
+		    (binding.time(rc.rc) - time.getTime()) / speed));
+	}
+
+	this.rc_timer = setTimeout(tick, 0);
+};
+
+/*
+ * Continue from the first records captured at or after "when" (a Date or
+ * milliseconds since the epoch).  Seeking to 0 rewinds to the beginning.
+ */
+ReplayConsumer.prototype.seek = function (when)
+{
+	if (when instanceof Date)
+		when = when.getTime();
+	mod_assert.equal(typeof (when), 'number',
+	    'seek: expected Date or number argument');
+	this.checkOpen();
+	binding.seek(this.rc, when);
+};
+
+/*
+ * Returns the index of the log's segments.
+ */
+ReplayConsumer.prototype.segments = function ()
+{
+	var rv = [];
+
+	this.checkOpen();
+	binding.segments(this.rc, function (start, end, nevents, nprobes) {
+		rv.push({
+		    'start': new Date(start),
+		    'end': new Date(end),
+		    'nevents': nevents,
+		    'nprobes': nprobes
+		});
+	});
+
+	return (rv);
+};
+
+/*
+ * Returns an object describing the log: "segments" (the number of complete
+ * segments), "corrupt" (the number of those skipped so far because their
+ * checksums didn't match), and "tornBytes" (the size of the incomplete
+ * segment at the end of the log, if any).
+ */
+ReplayConsumer.prototype.stats = function ()
+{
+	var rv;
+
+	this.checkOpen();
+	binding.stats(this.rc, function (nsegs, nbad, valid, size) {
+		rv = {
+		    'segments': nsegs,
+		    'corrupt': nbad,
+		    'tornBytes': size - valid
+		};
+	});
+
+	return (rv);
+};
+
+ReplayConsumer.prototype.checkOpen = function ()
+{
+	if (this.rc === null)
+		throw (new Error('replay: capture log is closed'));
+};
+
+/*
+ * Stop playback, unmap the log, and free the native state.  The consumer can't
+ * be used afterwards; closing it again does nothing.
+ */
+ReplayConsumer.prototype.close = function ()
+{
+	if (this.rc === null)
+		return;
+
+	if (this.rc_timer !== null) {
+		clearTimeout(this.rc_timer);
+		this.rc_timer = null;
+	}
+
+	binding.close(this.rc);
+	if (rc_finalizer !== null)
+		rc_finalizer.unregister(this);
+	this.rc = null;
+};
@@ -0,0 +1,533 @@
+/*
+ * dta_aggtab.c: native tables of aggregation records.  See dta_aggtab.h.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dta_aggtab.h"
+
+static int dta_aggtab_grow(dta_aggtab_t *);
+static int dta_keyidx_grow(dta_keyidx_t *);
+
+
+/*
+ * Returns the hash of a record: the variable ID (as 8 little-endian bytes)
+ * followed by its canonical key encoding.  Like the encoding itself, this is
+ * the same on every host.
+ */
+uint64_t
+dta_aggkey_hash(int64_t varid, const uint8_t *key, size_t keylen)
+{
+	uint8_t buf[DTA_AGGKEY_INTSIZE];
+
+	(void) dta_aggkey_int(buf, varid);
+	return (dta_hash(dta_hash(DTA_HASH_INIT, buf + 1, sizeof (int64_t)),
+	    key, keylen));
+}
+
+
+/*
+ * Canonical key encoding
+ */
+
+/*
+ * Encode an integer key into "buf", which must have room for
+ * DTA_AGGKEY_INTSIZE bytes, and return the number of bytes used.
+ */
+size_t
+dta_aggkey_int(uint8_t *buf, int64_t val)
+{
+	uint64_t uval = (uint64_t)val;
+	int i;
+
+	buf[0] = DTA_KEY_INT;
+	for (i = 0; i < 8; i++)
+		buf[i + 1] = (uval >> (8 * i)) & 0xff;
+	return (DTA_AGGKEY_INTSIZE);
+}
+
+/*
+ * Encode a string key of length "len" into "buf", which must have room for
+ * DTA_AGGKEY_STRSIZE(len) bytes, and return the number of bytes used.
+ */
+size_t
+dta_aggkey_string(uint8_t *buf, const char *str, size_t len)
+{
+	int i;
+
+	buf[0] = DTA_KEY_STRING;
+	for (i = 0; i < 4; i++)
+		buf[i + 1] = (len >> (8 * i)) & 0xff;
+	bcopy(str, buf + 5, len);
+	buf[5 + len] = '\0';
+	return (DTA_AGGKEY_STRSIZE(len));
+}
+
+/*
+ * Decode the next key from "*bufp", which ends at "end".  On success, returns
+ * the key's tag, stores the key into either "*valp" or "*strp" and "*lenp",
+ * and advances "*bufp" past it.  Returns -1 if the encoding is invalid.
+ */
+int
+dta_aggkey_next(const uint8_t **bufp, const uint8_t *end, int64_t *valp,
+    const char **strp, uint32_t *lenp)
+{
+	const uint8_t *p = *bufp;
+	uint64_t uval = 0;
+	uint32_t len = 0;
+	int i;
+
+	if (p >= end)
+		return (-1);
+
+	switch (p[0]) {
+	case DTA_KEY_INT:
+		if (end - p < DTA_AGGKEY_INTSIZE)
+			return (-1);
+
+		for (i = 0; i < 8; i++)
+			uval |= (uint64_t)p[i + 1] << (8 * i);
+
+		*valp = (int64_t)uval;
+		*bufp = p + DTA_AGGKEY_INTSIZE;
+		return (DTA_KEY_INT);
+
+	case DTA_KEY_STRING:
+		if (end - p < DTA_AGGKEY_STRSIZE(0))
+			return (-1);
+
+		for (i = 0; i < 4; i++)
+			len |= (uint32_t)p[i + 1] << (8 * i);
+
+		if (end - p < DTA_AGGKEY_STRSIZE((uint64_t)len) ||
+		    p[5 + len] != '\0')
+			return (-1);
+
+		*strp = (const char *)(p + 5);
+		*lenp = len;
+		*bufp = p + DTA_AGGKEY_STRSIZE(len);
+		return (DTA_KEY_STRING);
+
+	default:
+		return (-1);
+	}
+}
+
+
+/*
+ * Tables
+ */
+
+void
+dta_aggtab_init(dta_aggtab_t *tab)
+{
+	bzero(tab, sizeof (*tab));
+}
+
+void
+dta_aggtab_fini(dta_aggtab_t *tab)
+{
+	dta_aggvar_t *var, *next;
+
+	dta_aggtab_clear(tab);
+	free(tab->dat_hash);
+
+	for (var = tab->dat_vars; var != NULL; var = next) {
+		next = var->dav_next;
+		free(var->dav_name);
+		free(var);
+	}
+
+	bzero(tab, sizeof (*tab));
+}
+
+/*
+ * Remove all records, but keep the variables and the hash table.
+ */
+void
+dta_aggtab_clear(dta_aggtab_t *tab)
+{
+	dta_aggent_t *ent, *next;
+
+	for (ent = tab->dat_first; ent != NULL; ent = next) {
+		next = ent->dae_lnext;
+		free(ent);
+	}
+
+	if (tab->dat_hash != NULL)
+		bzero(tab->dat_hash,
+		    tab->dat_hashsz * sizeof (tab->dat_hash[0]));
+
+	tab->dat_first = tab->dat_last = NULL;
+	tab->dat_nents = 0;
+	tab->dat_memsize = 0;
+}
+
+/*
+ * Returns the table's variable with the given ID, creating it if necessary.
+ * Returns NULL with errno set to EINVAL if the variable exists but has
+ * different properties, as happens when merging tables from unrelated
+ * programs.
+ */
+dta_aggvar_t *
+dta_aggtab_var(dta_aggtab_t *tab, int64_t varid, dta_aggkind_t kind,
+    uint64_t param, int nkeys, int nvals, const char *name)
+{
+	dta_aggvar_t *var, **prevp;
+
+	for (prevp = &tab->dat_vars; (var = *prevp) != NULL;
+	    prevp = &var->dav_next) {
+		if (var->dav_varid != varid)
+			continue;
+
+		if (var->dav_kind != kind || var->dav_param != param ||
+		    var->dav_nkeys != nkeys || var->dav_nvals != nvals) {
+			errno = EINVAL;
+			return (NULL);
+		}
+
+		return (var);
+	}
+
+	if ((var = calloc(1, sizeof (*var))) == NULL)
+		return (NULL);
+
+	if ((var->dav_name = strdup(name)) == NULL) {
+		free(var);
+		return (NULL);
+	}
+
+	var->dav_varid = varid;
+	var->dav_kind = kind;
+	var->dav_param = param;
+	var->dav_nkeys = nkeys;
+	var->dav_nvals = nvals;
+	*prevp = var;
+	return (var);
+}
+
+/*
+ * Returns the table's variable with the given ID, or NULL if there is none.
+ */
+dta_aggvar_t *
+dta_aggtab_findvar(const dta_aggtab_t *tab, int64_t varid)
+{
+	dta_aggvar_t *var;
+
+	for (var = tab->dat_vars; var != NULL; var = var->dav_next) {
+		if (var->dav_varid == varid)
+			return (var);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Find the record for the given variable and key.  If there is none and
+ * "create" is set, create one with all values zero.  Returns NULL if the record
+ * doesn't exist and couldn't be created.
+ */
+dta_aggent_t *
+dta_aggtab_lookup(dta_aggtab_t *tab, const dta_aggvar_t *var,
+    const uint8_t *key, size_t keylen, int create)
+{
+	dta_aggent_t *ent;
+	uint64_t hash;
+	size_t size;
+	uint32_t bucket;
+
+	hash = dta_aggkey_hash(var->dav_varid, key, keylen);
+
+	if (tab->dat_hashsz != 0) {
+		bucket = hash & (tab->dat_hashsz - 1);
+		for (ent = tab->dat_hash[bucket]; ent != NULL;
+		    ent = ent->dae_next) {
+			if (ent->dae_hash == hash && ent->dae_var == var &&
+			    ent->dae_keylen == keylen &&
+			    bcmp(ent->dae_key, key, keylen) == 0)
+				return (ent);
+		}
+	}
+
+	if (!create)
+		return (NULL);
+
+	if (tab->dat_nents >= tab->dat_hashsz && dta_aggtab_grow(tab) != 0)
+		return (NULL);
+
+	size = sizeof (*ent) + var->dav_nvals * sizeof (int64_t) + keylen;
+	if ((ent = calloc(1, size)) == NULL)
+		return (NULL);
+
+	ent->dae_var = var;
+	ent->dae_hash = hash;
+	ent->dae_keylen = keylen;
+	ent->dae_vals = (int64_t *)(ent + 1);
+	ent->dae_key = (uint8_t *)(ent->dae_vals + var->dav_nvals);
+	bcopy(key, (uint8_t *)ent->dae_key, keylen);
+
+	bucket = hash & (tab->dat_hashsz - 1);
+	ent->dae_next = tab->dat_hash[bucket];
+	tab->dat_hash[bucket] = ent;
+
+	ent->dae_lprev = tab->dat_last;
+	if (tab->dat_last == NULL)
+		tab->dat_first = ent;
+	else
+		tab->dat_last->dae_lnext = ent;
+	tab->dat_last = ent;
+	tab->dat_nents++;
+	tab->dat_memsize += size;
+	return (ent);
+}
+
+static int
+dta_aggtab_grow(dta_aggtab_t *tab)
+{
+	dta_aggent_t **newhash, *ent;
+	uint32_t newsz, bucket;
+
+	newsz = tab->dat_hashsz == 0 ? 64 : tab->dat_hashsz * 2;
+	if ((newhash = calloc(newsz, sizeof (newhash[0]))) == NULL)
+		return (-1);
+
+	for (ent = tab->dat_first; ent != NULL; ent = ent->dae_lnext) {
+		bucket = ent->dae_hash & (newsz - 1);
+		ent->dae_next = newhash[bucket];
+		newhash[bucket] = ent;
+	}
+
+	free(tab->dat_hash);
+	tab->dat_hash = newhash;
+	tab->dat_hashsz = newsz;
+	return (0);
+}
+
+/*
+ * Remove a record from the table and free it.
+ */
+void
+dta_aggtab_remove(dta_aggtab_t *tab, dta_aggent_t *ent)
+{
+	dta_aggent_t **entp;
+
+	for (entp = &tab->dat_hash[ent->dae_hash & (tab->dat_hashsz - 1)];
+	    *entp != ent; entp = &(*entp)->dae_next)
+		assert(*entp != NULL);
+	*entp = ent->dae_next;
+
+	if (ent->dae_lprev == NULL)
+		tab->dat_first = ent->dae_lnext;
+	else
+		ent->dae_lprev->dae_lnext = ent->dae_lnext;
+
+	if (ent->dae_lnext == NULL)
+		tab->dat_last = ent->dae_lprev;
+	else
+		ent->dae_lnext->dae_lprev = ent->dae_lprev;
+
+	tab->dat_nents--;
+	tab->dat_memsize -= sizeof (*ent) +
+	    ent->dae_var->dav_nvals * sizeof (int64_t) + ent->dae_keylen;
+	free(ent);
+}
+
+/*
+ * Merge the values "vals" into the record for the given variable and key.
+ */
+int
+dta_aggtab_update(dta_aggtab_t *tab, const dta_aggvar_t *var,
+    const uint8_t *key, size_t keylen, const int64_t *vals)
+{
+	dta_aggent_t *ent;
+	int created;
+
+	created = tab->dat_nents;
+	if ((ent = dta_aggtab_lookup(tab, var, key, keylen, 1)) == NULL)
+		return (-1);
+
+	if (tab->dat_nents != created) {
+		/* A new record takes the values as they are. */
+		bcopy(vals, ent->dae_vals, var->dav_nvals * sizeof (int64_t));
+		return (0);
+	}
+
+	dta_aggvals_merge(var->dav_kind, ent->dae_vals, vals, var->dav_nvals);
+	return (0);
+}
+
+/*
+ * Merge every record of "src" into "dst".
+ */
+int
+dta_aggtab_merge(dta_aggtab_t *dst, const dta_aggtab_t *src)
+{
+	const dta_aggent_t *ent;
+	const dta_aggvar_t *svar, *lastsvar = NULL;
+	dta_aggvar_t *dvar = NULL;
+
+	for (ent = src->dat_first; ent != NULL; ent = ent->dae_lnext) {
+		svar = ent->dae_var;
+		if (svar != lastsvar) {
+			if ((dvar = dta_aggtab_var(dst, svar->dav_varid,
+			    svar->dav_kind, svar->dav_param, svar->dav_nkeys,
+			    svar->dav_nvals, svar->dav_name)) == NULL)
+				return (-1);
+			lastsvar = svar;
+		}
+
+		if (dta_aggtab_update(dst, dvar, ent->dae_key, ent->dae_keylen,
+		    ent->dae_vals) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Merge the values of one record into another, according to the aggregating
+ * action.  The loops are kept trivial so that the compiler can vectorize them.
+ */
+void
+dta_aggvals_merge(dta_aggkind_t kind, int64_t *restrict dst,
+    const int64_t *restrict src, int nvals)
+{
+	int i;
+
+	switch (kind) {
+	case DTA_AGG_MIN:
+		if (src[0] < dst[0])
+			dst[0] = src[0];
+		break;
+
+	case DTA_AGG_MAX:
+		if (src[0] > dst[0])
+			dst[0] = src[0];
+		break;
+
+	default:
+		/*
+		 * count(), sum(), avg() (count and sum), and the quantizing
+		 * actions' buckets are all merged by addition.
+		 */
+		for (i = 0; i < nvals; i++)
+			dst[i] += src[i];
+		break;
+	}
+}
+
+
+/*
+ * Key indexes
+ */
+
+void
+dta_keyidx_init(dta_keyidx_t *idx)
+{
+	bzero(idx, sizeof (*idx));
+}
+
+void
+dta_keyidx_fini(dta_keyidx_t *idx)
+{
+	dta_buf_fini(&idx->dki_slots);
+	dta_buf_fini(&idx->dki_keys);
+	free(idx->dki_hash);
+	bzero(idx, sizeof (*idx));
+}
+
+/*
+ * Returns the slot for variable "varid" and the "keylen"-byte key encoding
+ * "key", whose hash (as computed by dta_aggkey_hash()) is "hash", assigning
+ * the next slot if the pair hasn't been seen before.  Returns -1 on failure,
+ * with errno set to ENOSPC if the index is full.
+ */
+int64_t
+dta_keyidx_slot(dta_keyidx_t *idx, int64_t varid, uint64_t hash,
+    const uint8_t *key, size_t keylen)
+{
+	const dta_keyslot_t *slots;
+	dta_keyslot_t *dks;
+	uint8_t *p;
+	uint32_t i, j;
+
+	if (2 * (idx->dki_nslots + 1) > idx->dki_hashsz &&
+	    dta_keyidx_grow(idx) != 0)
+		return (-1);
+
+	slots = (const dta_keyslot_t *)idx->dki_slots.db_buf;
+	for (j = hash & (idx->dki_hashsz - 1); idx->dki_hash[j] != 0;
+	    j = (j + 1) & (idx->dki_hashsz - 1)) {
+		i = idx->dki_hash[j] - 1;
+		if (slots[i].dks_hash == hash && slots[i].dks_varid == varid &&
+		    slots[i].dks_keylen == keylen &&
+		    bcmp(idx->dki_keys.db_buf + slots[i].dks_keyoff, key,
+		    keylen) == 0)
+			return (i);
+	}
+
+	if (idx->dki_nslots >= DTA_KEYIDX_MAXSLOTS) {
+		errno = ENOSPC;
+		return (-1);
+	}
+
+	if ((dks = dta_buf_reserve(&idx->dki_slots, sizeof (*dks))) == NULL)
+		return (-1);
+
+	if ((p = dta_buf_reserve(&idx->dki_keys, keylen)) == NULL) {
+		idx->dki_slots.db_len -= sizeof (*dks);
+		return (-1);
+	}
+
+	bcopy(key, p, keylen);
+	dks->dks_varid = varid;
+	dks->dks_hash = hash;
+	dks->dks_keyoff = idx->dki_keys.db_len - keylen;
+	dks->dks_keylen = keylen;
+	idx->dki_hash[j] = ++idx->dki_nslots;
+	return (idx->dki_nslots - 1);
+}
+
+/*
+ * Returns slot "i", which must exist, storing a pointer to its key encoding
+ * into "*keyp".
+ */
+const dta_keyslot_t *
+dta_keyidx_get(const dta_keyidx_t *idx, uint32_t i, const uint8_t **keyp)
+{
+	const dta_keyslot_t *dks;
+
+	assert(i < idx->dki_nslots);
+	dks = &((const dta_keyslot_t *)idx->dki_slots.db_buf)[i];
+	*keyp = (const uint8_t *)idx->dki_keys.db_buf + dks->dks_keyoff;
+	return (dks);
+}
+
+static int
+dta_keyidx_grow(dta_keyidx_t *idx)
+{
+	const dta_keyslot_t *slots;
+	uint32_t *newhash;
+	uint32_t i, j, newsz;
+
+	newsz = idx->dki_hashsz == 0 ? 64 : idx->dki_hashsz * 2;
+	if ((newhash = calloc(newsz, sizeof (newhash[0]))) == NULL)
+		return (-1);
+
+	slots = (const dta_keyslot_t *)idx->dki_slots.db_buf;
+	for (i = 0; i < idx->dki_nslots; i++) {
+		for (j = slots[i].dks_hash & (newsz - 1); newhash[j] != 0;
+		    j = (j + 1) & (newsz - 1))
+			continue;
+		newhash[j] = i + 1;
+	}
+
+	free(idx->dki_hash);
+	idx->dki_hash = newhash;
+	idx->dki_hashsz = newsz;
+	return (0);
+}
@@ -0,0 +1,142 @@
+/*
+ * dta_aggtab.h: native tables of aggregation records.  A table maps an
+ * aggregation variable and a canonical binary encoding of a record's keys to a
+ * fixed-size vector of 64-bit values, and knows how to merge records the way
+ * DTrace itself does for each aggregating action.  This is used to accumulate
+ * aggregation data outside of libdtrace (e.g., for rollups), so it depends on
+ * neither libdtrace nor the shim.
+ */
+
+#ifndef _DTA_AGGTAB_H
+#define	_DTA_AGGTAB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dta_buf.h"
+
+/*
+ * Stable codes for the aggregating actions we support.  These appear in the
+ * binary formats we produce, so existing values must never change.
+ */
+typedef enum {
+	DTA_AGG_COUNT = 1,
+	DTA_AGG_MIN,
+	DTA_AGG_MAX,
+	DTA_AGG_SUM,
+	DTA_AGG_AVG,
+	DTA_AGG_QUANTIZE,
+	DTA_AGG_LQUANTIZE,
+	DTA_AGG_LLQUANTIZE,
+} dta_aggkind_t;
+
+/*
+ * Canonical key encoding: a record's keys are encoded one after another, each
+ * as a one-byte tag followed by its value.  Integers (DTA_KEY_INT) are encoded
+ * as 8 bytes, little-endian.  Strings (DTA_KEY_STRING) are encoded as a 4-byte
+ * little-endian length, the bytes of the string, and a terminating NUL that's
+ * not included in the length.  The encoding of a given tuple is unique, so keys
+ * can be compared (and prefixes of keys matched) bytewise, and the encoding is
+ * the same on every host.
+ */
+#define	DTA_KEY_INT		1
+#define	DTA_KEY_STRING		2
+
+extern size_t dta_aggkey_int(uint8_t *, int64_t);
+extern size_t dta_aggkey_string(uint8_t *, const char *, size_t);
+extern int dta_aggkey_next(const uint8_t **, const uint8_t *, int64_t *,
+    const char **, uint32_t *);
+
+#define	DTA_AGGKEY_INTSIZE		(1 + sizeof (int64_t))
+#define	DTA_AGGKEY_STRSIZE(len)		(1 + sizeof (uint32_t) + (len) + 1)
+
+/*
+ * Each table has its own list of the aggregation variables it has seen.  The
+ * number of values per record is fixed for a variable: one for count(), min(),
+ * max() and sum(); two for avg() (count and sum); and one per bucket for the
+ * quantizing actions, whose parameter word is "param".
+ */
+typedef struct dta_aggvar {
+	struct dta_aggvar *dav_next;
+	int64_t		dav_varid;
+	dta_aggkind_t	dav_kind;
+	uint64_t	dav_param;
+	int		dav_nkeys;
+	int		dav_nvals;
+	char		*dav_name;
+} dta_aggvar_t;
+
+/*
+ * Records are allocated with their values and key immediately following them,
+ * so each one has a fixed footprint for its variable.
+ */
+typedef struct dta_aggent {
+	struct dta_aggent *dae_next;	/* hash chain */
+	struct dta_aggent *dae_lnext;	/* all records, in insertion order */
+	struct dta_aggent *dae_lprev;
+	const dta_aggvar_t *dae_var;
+	uint64_t	dae_hash;	/* see dta_aggkey_hash() */
+	uint32_t	dae_keylen;
+	const uint8_t	*dae_key;
+	int64_t		*dae_vals;
+} dta_aggent_t;
+
+typedef struct dta_aggtab {
+	dta_aggvar_t	*dat_vars;
+	dta_aggent_t	**dat_hash;
+	uint32_t	dat_hashsz;	/* power of 2 */
+	uint32_t	dat_nents;
+	dta_aggent_t	*dat_first;
+	dta_aggent_t	*dat_last;
+	size_t		dat_memsize;	/* bytes allocated for records */
+} dta_aggtab_t;
+
+extern uint64_t dta_aggkey_hash(int64_t, const uint8_t *, size_t);
+
+extern void dta_aggtab_init(dta_aggtab_t *);
+extern void dta_aggtab_fini(dta_aggtab_t *);
+extern void dta_aggtab_clear(dta_aggtab_t *);
+extern dta_aggvar_t *dta_aggtab_var(dta_aggtab_t *, int64_t, dta_aggkind_t,
+    uint64_t, int, int, const char *);
+extern dta_aggvar_t *dta_aggtab_findvar(const dta_aggtab_t *, int64_t);
+extern dta_aggent_t *dta_aggtab_lookup(dta_aggtab_t *, const dta_aggvar_t *,
+    const uint8_t *, size_t, int);
+extern void dta_aggtab_remove(dta_aggtab_t *, dta_aggent_t *);
+extern int dta_aggtab_update(dta_aggtab_t *, const dta_aggvar_t *,
+    const uint8_t *, size_t, const int64_t *);
+extern int dta_aggtab_merge(dta_aggtab_t *, const dta_aggtab_t *);
+extern void dta_aggvals_merge(dta_aggkind_t, int64_t *, const int64_t *, int);
+
+/*
+ * Key index: assigns each distinct pair of an aggregation variable and a
+ * canonical key encoding a small integer (a "slot"), in the order in which the
+ * pairs are first seen.  Slots are dense and aren't reused until the index is
+ * cleared, so callers can keep per-key state in arrays indexed by slot rather
+ * than in tables keyed by strings.  "dki_slots" holds a dta_keyslot_t for each
+ * slot, and "dki_keys" holds the encodings, one after another.
+ */
+typedef struct dta_keyslot {
+	int64_t		dks_varid;
+	uint64_t	dks_hash;	/* see dta_aggkey_hash() */
+	size_t		dks_keyoff;	/* offset of encoding in dki_keys */
+	uint32_t	dks_keylen;
+} dta_keyslot_t;
+
+typedef struct dta_keyidx {
+	dta_buf_t	dki_slots;	/* dta_keyslot_t */
+	dta_buf_t	dki_keys;
+	uint32_t	dki_nslots;
+	uint32_t	*dki_hash;	/* slot + 1, or 0 */
+	uint32_t	dki_hashsz;	/* power of 2 */
+} dta_keyidx_t;
+
+#define	DTA_KEYIDX_MAXSLOTS	(1U << 30)
+
+extern void dta_keyidx_init(dta_keyidx_t *);
+extern void dta_keyidx_fini(dta_keyidx_t *);
+extern int64_t dta_keyidx_slot(dta_keyidx_t *, int64_t, uint64_t,
+    const uint8_t *, size_t);
+extern const dta_keyslot_t *dta_keyidx_get(const dta_keyidx_t *, uint32_t,
+    const uint8_t **);
+
+#endif	/* _DTA_AGGTAB_H */
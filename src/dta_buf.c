@@ -0,0 +1,258 @@
+/*
+ * dta_buf.c: growable buffers, string tables, and hashing.  See dta_buf.h.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dta_buf.h"
+
+
+/*
+ * Buffers
+ */
+
+/*
+ * Append "len" zeroed bytes to the buffer and return a pointer to them.  The
+ * pointer is only valid until the next operation on the buffer.
+ */
+void *
+dta_buf_reserve(dta_buf_t *dbp, size_t len)
+{
+	size_t newsize;
+	char *newbuf, *rv;
+
+	if (dbp->db_len + len > dbp->db_size) {
+		newsize = dbp->db_size == 0 ? 4096 : dbp->db_size;
+		while (newsize < dbp->db_len + len)
+			newsize *= 2;
+
+		if ((newbuf = realloc(dbp->db_buf, newsize)) == NULL)
+			return (NULL);
+
+		dbp->db_buf = newbuf;
+		dbp->db_size = newsize;
+	}
+
+	rv = dbp->db_buf + dbp->db_len;
+	bzero(rv, len);
+	dbp->db_len += len;
+	return (rv);
+}
+
+int
+dta_buf_append(dta_buf_t *dbp, const void *data, size_t len)
+{
+	void *dst;
+
+	if (len == 0)
+		return (0);
+
+	if ((dst = dta_buf_reserve(dbp, len)) == NULL)
+		return (-1);
+
+	bcopy(data, dst, len);
+	return (0);
+}
+
+/*
+ * Append formatted text to the buffer (without a terminating NUL).
+ */
+int
+dta_buf_printf(dta_buf_t *dbp, const char *fmt, ...)
+{
+	va_list ap;
+	char *dst;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+
+	if (len < 0 || (dst = dta_buf_reserve(dbp, len + 1)) == NULL)
+		return (-1);
+
+	va_start(ap, fmt);
+	(void) vsnprintf(dst, len + 1, fmt, ap);
+	va_end(ap);
+
+	dbp->db_len--;
+	return (0);
+}
+
+/*
+ * Append "val" as a LEB128 varint: 7 bits per byte, least significant group
+ * first, with the high bit set on every byte but the last.
+ */
+int
+dta_buf_putu(dta_buf_t *dbp, uint64_t val)
+{
+	uint8_t *p;
+	int n = 0;
+
+	if ((p = dta_buf_reserve(dbp, 10)) == NULL)
+		return (-1);
+
+	do {
+		p[n] = val & 0x7f;
+		if ((val >>= 7) != 0)
+			p[n] |= 0x80;
+		n++;
+	} while (val != 0);
+
+	dbp->db_len -= 10 - n;
+	return (0);
+}
+
+/*
+ * Append "val" as a zig-zag encoded varint, so that values near zero are short
+ * regardless of sign.
+ */
+int
+dta_buf_putz(dta_buf_t *dbp, int64_t val)
+{
+	return (dta_buf_putu(dbp,
+	    ((uint64_t)val << 1) ^ (uint64_t)(val >> 63)));
+}
+
+void
+dta_buf_fini(dta_buf_t *dbp)
+{
+	free(dbp->db_buf);
+	bzero(dbp, sizeof (*dbp));
+}
+
+
+/*
+ * String tables
+ */
+
+/*
+ * Return the index of the "len"-byte string "str" in the table, adding it if
+ * necessary, or -1 on failure.
+ */
+int
+dta_strtab_intern(dta_strtab_t *tab, const char *str, size_t len)
+{
+	uint32_t *index, *hash, *newhash;
+	uint32_t i, j, newsz;
+	char *data;
+
+	if (2 * (tab->dst_nstrings + 1) > tab->dst_hashsz) {
+		newsz = tab->dst_hashsz == 0 ? 64 : tab->dst_hashsz * 2;
+		if ((newhash = calloc(newsz, sizeof (uint32_t))) == NULL)
+			return (-1);
+
+		index = (uint32_t *)tab->dst_index.db_buf;
+		for (i = 0; i < tab->dst_nstrings; i++) {
+			j = dta_hash(DTA_HASH_INIT,
+			    tab->dst_data.db_buf + index[2 * i],
+			    index[2 * i + 1]) & (newsz - 1);
+			while (newhash[j] != 0)
+				j = (j + 1) & (newsz - 1);
+			newhash[j] = i + 1;
+		}
+
+		free(tab->dst_hash);
+		tab->dst_hash = newhash;
+		tab->dst_hashsz = newsz;
+	}
+
+	hash = tab->dst_hash;
+	index = (uint32_t *)tab->dst_index.db_buf;
+	for (j = dta_hash(DTA_HASH_INIT, str, len) & (tab->dst_hashsz - 1);
+	    hash[j] != 0; j = (j + 1) & (tab->dst_hashsz - 1)) {
+		i = hash[j] - 1;
+		if (index[2 * i + 1] == len &&
+		    bcmp(tab->dst_data.db_buf + index[2 * i], str, len) == 0)
+			return (i);
+	}
+
+	if ((index = dta_buf_reserve(&tab->dst_index,
+	    2 * sizeof (uint32_t))) == NULL)
+		return (-1);
+
+	index[0] = tab->dst_data.db_len;
+	index[1] = len;
+	if ((data = dta_buf_reserve(&tab->dst_data, len + 1)) == NULL) {
+		tab->dst_index.db_len -= 2 * sizeof (uint32_t);
+		return (-1);
+	}
+
+	bcopy(str, data, len);
+	hash[j] = ++tab->dst_nstrings;
+	return (tab->dst_nstrings - 1);
+}
+
+/*
+ * Returns string "i" of the table, storing its length into "*lenp".
+ */
+const char *
+dta_strtab_get(const dta_strtab_t *tab, uint32_t i, uint32_t *lenp)
+{
+	const uint32_t *index = (uint32_t *)tab->dst_index.db_buf;
+
+	*lenp = index[2 * i + 1];
+	return (tab->dst_data.db_buf + index[2 * i]);
+}
+
+void
+dta_strtab_fini(dta_strtab_t *tab)
+{
+	dta_buf_fini(&tab->dst_index);
+	dta_buf_fini(&tab->dst_data);
+	free(tab->dst_hash);
+	bzero(tab, sizeof (*tab));
+}
+
+
+/*
+ * Hashing
+ */
+
+/*
+ * 64-bit FNV-1a, continuing from hash value "h" (DTA_HASH_INIT to start).
+ */
+uint64_t
+dta_hash(uint64_t h, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return (h);
+}
+
+/*
+ * CRC-32 (as used by zlib and Ethernet), continuing from "crc" (zero to start).
+ * This uses a 16-entry table, trading some speed for not having to generate or
+ * carry a larger one.
+ */
+uint32_t
+dta_crc32(uint32_t crc, const void *data, size_t len)
+{
+	static const uint32_t tab[16] = {
+		0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+		0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+		0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+		0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+	};
+	const uint8_t *p = data;
+	size_t i;
+
+	crc = ~crc;
+	for (i = 0; i < len; i++) {
+		crc ^= p[i];
+		crc = (crc >> 4) ^ tab[crc & 0xf];
+		crc = (crc >> 4) ^ tab[crc & 0xf];
+	}
+
+	return (~crc);
+}
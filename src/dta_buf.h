@@ -0,0 +1,49 @@
+/*
+ * dta_buf.h: growable buffers, string tables, and hashing, used to assemble the
+ * binary formats that the binding produces and consumes.  Like dta_aggtab.h,
+ * this depends on neither libdtrace nor the shim.
+ */
+
+#ifndef _DTA_BUF_H
+#define	_DTA_BUF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct dta_buf {
+	char		*db_buf;
+	size_t		db_len;		/* bytes used */
+	size_t		db_size;	/* bytes allocated */
+} dta_buf_t;
+
+extern void *dta_buf_reserve(dta_buf_t *, size_t);
+extern int dta_buf_append(dta_buf_t *, const void *, size_t);
+extern int dta_buf_printf(dta_buf_t *, const char *, ...);
+extern int dta_buf_putu(dta_buf_t *, uint64_t);
+extern int dta_buf_putz(dta_buf_t *, int64_t);
+extern void dta_buf_fini(dta_buf_t *);
+
+/*
+ * String table: a set of distinct strings, each identified by the order in
+ * which it was added.  "dst_index" holds an (offset, length) pair of uint32_t
+ * for each string, with offsets relative to "dst_data", which holds the bytes
+ * of each string followed by a NUL.
+ */
+typedef struct dta_strtab {
+	dta_buf_t	dst_index;
+	dta_buf_t	dst_data;
+	uint32_t	dst_nstrings;
+	uint32_t	*dst_hash;	/* string index + 1, or 0 */
+	uint32_t	dst_hashsz;	/* power of 2 */
+} dta_strtab_t;
+
+extern int dta_strtab_intern(dta_strtab_t *, const char *, size_t);
+extern const char *dta_strtab_get(const dta_strtab_t *, uint32_t, uint32_t *);
+extern void dta_strtab_fini(dta_strtab_t *);
+
+extern uint64_t dta_hash(uint64_t, const void *, size_t);
+extern uint32_t dta_crc32(uint32_t, const void *, size_t);
+
+#define	DTA_HASH_INIT		0xcbf29ce484222325ULL
+
+#endif	/* _DTA_BUF_H */
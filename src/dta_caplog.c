@@ -0,0 +1,844 @@
+/*
+ * dta_caplog.c: capture log writer and reader.  See dta_caplog.h.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dta_caplog.h"
+
+static int dta_caplog_recover(dta_caplog_t *, off_t);
+static int dta_caplog_writev(int, struct iovec *, int);
+static void dta_caplog_reset(dta_caplog_t *);
+static int dta_capread_load(dta_capreader_t *);
+static int dta_capread_getu(dta_capreader_t *, uint64_t *);
+static int dta_capread_name(dta_capreader_t *, dta_buf_t *);
+static void dta_le32(uint8_t *, uint32_t);
+static void dta_le64(uint8_t *, uint64_t);
+static uint32_t dta_get_le32(const uint8_t *);
+static uint64_t dta_get_le64(const uint8_t *);
+
+/*
+ * Open the capture log at "path" for appending, creating it if necessary.
+ * Segment bodies are written once they reach "segsize" bytes (or when
+ * dta_caplog_flush() is called).  If the log exists but ends with a segment
+ * that was only partly written (e.g., because the system crashed), that
+ * segment is discarded.  Fails with EINVAL if the file exists but isn't a
+ * capture log.
+ */
+int
+dta_caplog_open(dta_caplog_t *log, const char *path, size_t segsize,
+    int flags)
+{
+	uint8_t hdr[DTA_CAPLOG_HDRSIZE];
+	struct timespec ts;
+	struct stat st;
+	int err;
+
+	bzero(log, sizeof (*log));
+	log->dcl_segsize = segsize;
+	log->dcl_flags = flags;
+	log->dcl_gen = 1;
+
+	if ((log->dcl_fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644)) == -1)
+		return (-1);
+
+	if (fstat(log->dcl_fd, &st) != 0)
+		goto err;
+
+	if (st.st_size != 0) {
+		if (dta_caplog_recover(log, st.st_size) != 0)
+			goto err;
+		return (0);
+	}
+
+	(void) clock_gettime(CLOCK_REALTIME, &ts);
+	bzero(hdr, sizeof (hdr));
+	bcopy(DTA_CAPLOG_MAGIC, hdr, 4);
+	hdr[4] = DTA_CAPLOG_VERSION & 0xff;
+	hdr[5] = DTA_CAPLOG_VERSION >> 8;
+	dta_le64(hdr + 8, (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+
+	if (write(log->dcl_fd, hdr, sizeof (hdr)) != sizeof (hdr)) {
+		if (errno == 0)
+			errno = EIO;
+		goto err;
+	}
+
+	return (0);
+
+err:
+	err = errno;
+	(void) close(log->dcl_fd);
+	log->dcl_fd = -1;
+	errno = err;
+	return (-1);
+}
+
+/*
+ * Check the header of an existing log and find the end of its last complete
+ * segment, truncating anything after it.
+ */
+static int
+dta_caplog_recover(dta_caplog_t *log, off_t size)
+{
+	uint8_t hdr[DTA_CAPLOG_SEGHDRSIZE];
+	uint32_t hdrsize, bodysize, crc;
+	off_t off, last = -1;
+	uint8_t *body;
+
+	if (size < DTA_CAPLOG_HDRSIZE ||
+	    pread(log->dcl_fd, hdr, DTA_CAPLOG_HDRSIZE, 0) !=
+	    DTA_CAPLOG_HDRSIZE || bcmp(hdr, DTA_CAPLOG_MAGIC, 4) != 0 ||
+	    (hdr[4] | (hdr[5] << 8)) != DTA_CAPLOG_VERSION) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (off = DTA_CAPLOG_HDRSIZE; off < size; off += hdrsize + bodysize) {
+		if (size - off < DTA_CAPLOG_SEGHDRSIZE ||
+		    pread(log->dcl_fd, hdr, sizeof (hdr), off) != sizeof (hdr))
+			break;
+
+		hdrsize = dta_get_le32(hdr + 4);
+		bodysize = dta_get_le32(hdr + 8);
+		if (bcmp(hdr, DTA_CAPLOG_SEGMAGIC, 4) != 0 ||
+		    hdrsize != DTA_CAPLOG_SEGHDRSIZE ||
+		    dta_get_le32(hdr + 44) != dta_crc32(0, hdr, 44) ||
+		    size - off - hdrsize < bodysize)
+			break;
+
+		last = off;
+	}
+
+	/*
+	 * The headers of the segments we found are intact, but the body of
+	 * the last one may not be if the system crashed while it was being
+	 * written.  It's the only one we need to check.
+	 */
+	if (last != -1 && off == size) {
+		bodysize = dta_get_le32(hdr + 8);
+		if ((body = malloc(bodysize + 1)) == NULL)
+			return (-1);
+
+		crc = pread(log->dcl_fd, body, bodysize,
+		    last + DTA_CAPLOG_SEGHDRSIZE) == (ssize_t)bodysize ?
+		    dta_crc32(0, body, bodysize) : ~dta_get_le32(hdr + 12);
+		free(body);
+
+		if (crc != dta_get_le32(hdr + 12))
+			off = last;
+	}
+
+	if (off != size && ftruncate(log->dcl_fd, off) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Note the time (in nanoseconds since the epoch) at which the events that
+ * follow were collected.  If no events have been added since the last time
+ * was noted, that time is replaced, so that an idle consumer doesn't grow the
+ * segment.
+ */
+int
+dta_caplog_time(dta_caplog_t *log, uint64_t time)
+{
+	uint8_t tag = DTA_CAPEV_TIME;
+
+	if (log->dcl_timelast) {
+		log->dcl_events.db_len = log->dcl_timeoff;
+		log->dcl_nevents--;
+		log->dcl_timelast = 0;
+	}
+
+	if (log->dcl_nevents == 0)
+		log->dcl_start = time;
+	else if (time < log->dcl_start)
+		time = log->dcl_start;
+
+	log->dcl_timeoff = log->dcl_events.db_len;
+	if (dta_buf_append(&log->dcl_events, &tag, 1) != 0 ||
+	    dta_buf_putu(&log->dcl_events, time - log->dcl_start) != 0) {
+		log->dcl_events.db_len = log->dcl_timeoff;
+		return (-1);
+	}
+
+	log->dcl_nevents++;
+	log->dcl_time = time;
+	log->dcl_timelast = 1;
+	return (0);
+}
+
+/*
+ * Returns the index of the given probe in the current segment's probe table,
+ * adding it if necessary.  The index remains valid until "dcl_gen" changes.
+ */
+int
+dta_caplog_probe(dta_caplog_t *log, const char *prov, const char *mod,
+    const char *func, const char *name)
+{
+	const char *names[4] = { prov, mod, func, name };
+	dta_buf_t *dbp = &log->dcl_scratch;
+	int i;
+
+	dbp->db_len = 0;
+	for (i = 0; i < 4; i++) {
+		if (dta_buf_append(dbp, names[i], strlen(names[i]) + 1) != 0)
+			return (-1);
+	}
+
+	return (dta_strtab_intern(&log->dcl_probes, dbp->db_buf,
+	    dbp->db_len - 1));
+}
+
+/*
+ * Append an event for probe "probe" (see dta_caplog_probe()): "ival" for
+ * DTA_CAPEV_INT, the "len"-byte string "str" for DTA_CAPEV_STRING, and nothing
+ * for DTA_CAPEV_PROBE.  The segment is written out if it's full, in which case
+ * a failure may mean that it was lost (see dcl_stat_dropped).
+ */
+int
+dta_caplog_event(dta_caplog_t *log, dta_capev_t kind, int probe,
+    int64_t ival, const char *str, size_t len)
+{
+	uint8_t tag = kind;
+	size_t off;
+	int si;
+
+	assert(kind != DTA_CAPEV_TIME);
+
+	/*
+	 * Each segment begins with the time, so that it can be read alone.
+	 */
+	if (log->dcl_nevents == 0 && log->dcl_time != 0 &&
+	    dta_caplog_time(log, log->dcl_time) != 0)
+		return (-1);
+
+	/*
+	 * On failure, remove whatever was appended of the event, since the
+	 * segment would otherwise be written out with a malformed event.
+	 */
+	off = log->dcl_events.db_len;
+	if (dta_buf_append(&log->dcl_events, &tag, 1) != 0 ||
+	    dta_buf_putu(&log->dcl_events, probe) != 0 ||
+	    (kind == DTA_CAPEV_INT &&
+	    dta_buf_putz(&log->dcl_events, ival) != 0) ||
+	    (kind == DTA_CAPEV_STRING &&
+	    ((si = dta_strtab_intern(&log->dcl_strings, str, len)) == -1 ||
+	    dta_buf_putu(&log->dcl_events, si) != 0))) {
+		log->dcl_events.db_len = off;
+		return (-1);
+	}
+
+	log->dcl_nevents++;
+	log->dcl_nrecords++;
+	log->dcl_stat_events++;
+	log->dcl_timelast = 0;
+
+	if (log->dcl_events.db_len >= log->dcl_segsize)
+		return (dta_caplog_flush(log));
+
+	return (0);
+}
+
+/*
+ * Write out the current segment, if there's anything in it.  On failure, the
+ * segment is discarded and anything written of it is truncated, so the log
+ * remains readable.
+ */
+int
+dta_caplog_flush(dta_caplog_t *log)
+{
+	dta_buf_t *dbp = &log->dcl_scratch;
+	struct iovec iov[2];
+	const char *str;
+	uint8_t *hdr;
+	uint32_t i, len, plen, crc;
+	struct stat st;
+	off_t size = -1;
+	int err, j;
+
+	if (log->dcl_nevents == 0)
+		return (0);
+
+	dbp->db_len = 0;
+	if (dta_buf_reserve(dbp, DTA_CAPLOG_SEGHDRSIZE) == NULL)
+		goto err;
+
+	for (i = 0; i < log->dcl_probes.dst_nstrings; i++) {
+		str = dta_strtab_get(&log->dcl_probes, i, &len);
+		for (j = 0; j < 4; j++) {
+			plen = strlen(str);
+			if (dta_buf_putu(dbp, plen) != 0 ||
+			    dta_buf_append(dbp, str, plen) != 0)
+				goto err;
+			str += plen + 1;
+		}
+	}
+
+	for (i = 0; i < log->dcl_strings.dst_nstrings; i++) {
+		str = dta_strtab_get(&log->dcl_strings, i, &len);
+		if (dta_buf_putu(dbp, len) != 0 ||
+		    dta_buf_append(dbp, str, len) != 0)
+			goto err;
+	}
+
+	crc = dta_crc32(0, dbp->db_buf + DTA_CAPLOG_SEGHDRSIZE,
+	    dbp->db_len - DTA_CAPLOG_SEGHDRSIZE);
+	crc = dta_crc32(crc, log->dcl_events.db_buf, log->dcl_events.db_len);
+
+	hdr = (uint8_t *)dbp->db_buf;
+	bcopy(DTA_CAPLOG_SEGMAGIC, hdr, 4);
+	dta_le32(hdr + 4, DTA_CAPLOG_SEGHDRSIZE);
+	dta_le32(hdr + 8, dbp->db_len - DTA_CAPLOG_SEGHDRSIZE +
+	    log->dcl_events.db_len);
+	dta_le32(hdr + 12, crc);
+	dta_le64(hdr + 16, log->dcl_start);
+	dta_le64(hdr + 24, log->dcl_time);
+	dta_le32(hdr + 32, log->dcl_nevents);
+	dta_le32(hdr + 36, log->dcl_probes.dst_nstrings);
+	dta_le32(hdr + 40, log->dcl_strings.dst_nstrings);
+	dta_le32(hdr + 44, dta_crc32(0, hdr, 44));
+
+	iov[0].iov_base = dbp->db_buf;
+	iov[0].iov_len = dbp->db_len;
+	iov[1].iov_base = log->dcl_events.db_buf;
+	iov[1].iov_len = log->dcl_events.db_len;
+
+	if (fstat(log->dcl_fd, &st) != 0)
+		goto err;
+
+	size = st.st_size;
+	if (dta_caplog_writev(log->dcl_fd, iov, 2) != 0 ||
+	    ((log->dcl_flags & DTA_CAPLOG_F_SYNC) != 0 &&
+	    fsync(log->dcl_fd) != 0))
+		goto err;
+
+	log->dcl_stat_segments++;
+	log->dcl_stat_bytes += dbp->db_len + log->dcl_events.db_len;
+	dta_caplog_reset(log);
+	return (0);
+
+err:
+	err = errno;
+	if (size != -1)
+		(void) ftruncate(log->dcl_fd, size);
+
+	log->dcl_stat_events -= log->dcl_nrecords;
+	log->dcl_stat_dropped += log->dcl_nrecords;
+	dta_caplog_reset(log);
+	errno = err;
+	return (-1);
+}
+
+/*
+ * Write out any partial segment and close the log.
+ */
+int
+dta_caplog_close(dta_caplog_t *log)
+{
+	int rv, err;
+
+	rv = dta_caplog_flush(log);
+	err = errno;
+
+	(void) close(log->dcl_fd);
+	dta_buf_fini(&log->dcl_events);
+	dta_buf_fini(&log->dcl_scratch);
+	dta_strtab_fini(&log->dcl_probes);
+	dta_strtab_fini(&log->dcl_strings);
+
+	errno = err;
+	return (rv);
+}
+
+/*
+ * Start a new segment.
+ */
+static void
+dta_caplog_reset(dta_caplog_t *log)
+{
+	log->dcl_events.db_len = 0;
+	log->dcl_nevents = 0;
+	log->dcl_nrecords = 0;
+	log->dcl_start = 0;
+	log->dcl_timelast = 0;
+	log->dcl_gen++;
+	dta_strtab_fini(&log->dcl_probes);
+	dta_strtab_fini(&log->dcl_strings);
+}
+
+
+/*
+ * Reading
+ */
+
+/*
+ * Map the capture log at "path" and index its segments.  Anything after the
+ * last segment whose header is intact is ignored.  Fails with EINVAL if the
+ * file isn't a capture log.
+ */
+int
+dta_capread_open(dta_capreader_t *rd, const char *path, int flags)
+{
+	const uint8_t *hdr;
+	dta_capseg_t *seg;
+	struct stat st;
+	size_t off, size;
+	void *base;
+	int fd, err;
+
+	bzero(rd, sizeof (*rd));
+	rd->dcr_flags = flags;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return (-1);
+
+	if (fstat(fd, &st) != 0) {
+		err = errno;
+		(void) close(fd);
+		errno = err;
+		return (-1);
+	}
+
+	if (st.st_size < DTA_CAPLOG_HDRSIZE) {
+		(void) close(fd);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	err = errno;
+	(void) close(fd);
+	if (base == MAP_FAILED) {
+		errno = err;
+		return (-1);
+	}
+
+	rd->dcr_base = base;
+	rd->dcr_size = st.st_size;
+	(void) madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+	if (bcmp(rd->dcr_base, DTA_CAPLOG_MAGIC, 4) != 0 ||
+	    (rd->dcr_base[4] | (rd->dcr_base[5] << 8)) != DTA_CAPLOG_VERSION) {
+		dta_capread_close(rd);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	/*
+	 * Segments are at least DTA_CAPLOG_SEGHDRSIZE bytes, which bounds the
+	 * size of the index.
+	 */
+	if ((rd->dcr_segs = malloc(sizeof (dta_capseg_t) *
+	    (rd->dcr_size / DTA_CAPLOG_SEGHDRSIZE + 1))) == NULL) {
+		dta_capread_close(rd);
+		return (-1);
+	}
+
+	for (off = DTA_CAPLOG_HDRSIZE; rd->dcr_size - off >=
+	    DTA_CAPLOG_SEGHDRSIZE; off += DTA_CAPLOG_SEGHDRSIZE + size) {
+		hdr = rd->dcr_base + off;
+		size = dta_get_le32(hdr + 8);
+		if (bcmp(hdr, DTA_CAPLOG_SEGMAGIC, 4) != 0 ||
+		    dta_get_le32(hdr + 4) != DTA_CAPLOG_SEGHDRSIZE ||
+		    dta_get_le32(hdr + 44) != dta_crc32(0, hdr, 44) ||
+		    rd->dcr_size - off - DTA_CAPLOG_SEGHDRSIZE < size)
+			break;
+
+		seg = &rd->dcr_segs[rd->dcr_nsegs++];
+		seg->dcs_off = off + DTA_CAPLOG_SEGHDRSIZE;
+		seg->dcs_size = size;
+		seg->dcs_crc = dta_get_le32(hdr + 12);
+		seg->dcs_start = dta_get_le64(hdr + 16);
+		seg->dcs_end = dta_get_le64(hdr + 24);
+		seg->dcs_nevents = dta_get_le32(hdr + 32);
+		seg->dcs_nprobes = dta_get_le32(hdr + 36);
+		seg->dcs_nstrings = dta_get_le32(hdr + 40);
+	}
+
+	rd->dcr_valid = off;
+	return (0);
+}
+
+/*
+ * Only return events for probes matching the given provider, module, function
+ * and name, any of which may be NULL or empty to match anything.  Segments that
+ * contain no matching probes are skipped without being decoded.  This takes
+ * effect with the next segment loaded, so it should be set before reading
+ * (or seeking).
+ */
+int
+dta_capread_filter(dta_capreader_t *rd, const char *prov, const char *mod,
+    const char *func, const char *name)
+{
+	const char *names[4] = { prov, mod, func, name };
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		free(rd->dcr_filter[i]);
+		rd->dcr_filter[i] = NULL;
+		if (names[i] != NULL && names[i][0] != '\0' &&
+		    (rd->dcr_filter[i] = strdup(names[i])) == NULL)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Position the cursor at the first event at or after "time".
+ */
+int
+dta_capread_seek(dta_capreader_t *rd, uint64_t time)
+{
+	dta_capevent_t ev;
+	const uint8_t *p;
+	uint32_t i, seg, left;
+	uint64_t evtime;
+	int rv;
+
+	for (i = 0; i < rd->dcr_nsegs; i++) {
+		if (rd->dcr_segs[i].dcs_end >= time)
+			break;
+	}
+
+	rd->dcr_seg = i;
+	rd->dcr_left = 0;
+	rd->dcr_time = 0;
+
+	/*
+	 * Skip events until we reach the right time.  We remember where each
+	 * event started so that we can back up to the first one we want.  If
+	 * that's the first one we read from its segment, we just arrange for
+	 * the segment to be loaded again.
+	 */
+	for (;;) {
+		seg = rd->dcr_seg;
+		p = rd->dcr_p;
+		left = rd->dcr_left;
+		evtime = rd->dcr_time;
+
+		if ((rv = dta_capread_next(rd, &ev)) != 1)
+			return (rv);
+
+		if (ev.dce_time < time)
+			continue;
+
+		if (rd->dcr_seg == seg && left != 0) {
+			rd->dcr_p = p;
+			rd->dcr_left = left;
+			rd->dcr_time = evtime;
+		} else {
+			rd->dcr_seg--;
+			rd->dcr_left = 0;
+		}
+
+		return (0);
+	}
+}
+
+/*
+ * Read the next event into "evp".  Returns 1 if there was one, 0 at the end of
+ * the log, and -1 on failure.  Segments that are corrupt are skipped (and
+ * counted in "dcr_nbad"), as are events for probes that don't match the
+ * filter.
+ */
+int
+dta_capread_next(dta_capreader_t *rd, dta_capevent_t *evp)
+{
+	const uint32_t *probes, *strings;
+	const uint8_t *match;
+	uint64_t kind, probe, val;
+	int i;
+
+	for (;;) {
+		while (rd->dcr_left == 0) {
+			if (rd->dcr_seg >= rd->dcr_nsegs)
+				return (0);
+
+			if (dta_capread_load(rd) != 0) {
+				if (errno != EINVAL)
+					return (-1);
+				rd->dcr_nbad++;
+			}
+		}
+
+		rd->dcr_left--;
+		if (rd->dcr_p >= rd->dcr_end)
+			goto bad;
+
+		kind = *rd->dcr_p++;
+		if (dta_capread_getu(rd, &val) != 0)
+			goto bad;
+
+		if (kind == DTA_CAPEV_TIME) {
+			rd->dcr_time = rd->dcr_segs[rd->dcr_seg - 1].dcs_start +
+			    val;
+			evp->dce_kind = DTA_CAPEV_TIME;
+			evp->dce_time = rd->dcr_time;
+			return (1);
+		}
+
+		probe = val;
+		probes = (uint32_t *)rd->dcr_probes.db_buf;
+		strings = (uint32_t *)rd->dcr_strings.db_buf;
+		match = (uint8_t *)rd->dcr_match.db_buf;
+		if (probe >= rd->dcr_segs[rd->dcr_seg - 1].dcs_nprobes)
+			goto bad;
+
+		switch (kind) {
+		case DTA_CAPEV_PROBE:
+			break;
+
+		case DTA_CAPEV_INT:
+			if (dta_capread_getu(rd, &val) != 0)
+				goto bad;
+			evp->dce_int = (int64_t)((val >> 1) ^ -(val & 1));
+			break;
+
+		case DTA_CAPEV_STRING:
+			if (dta_capread_getu(rd, &val) != 0 ||
+			    val >= rd->dcr_segs[rd->dcr_seg - 1].dcs_nstrings)
+				goto bad;
+			evp->dce_str = rd->dcr_tables.db_buf + strings[val];
+			break;
+
+		default:
+			goto bad;
+		}
+
+		if (!match[probe])
+			continue;
+
+		evp->dce_kind = kind;
+		evp->dce_time = rd->dcr_time;
+		for (i = 0; i < 4; i++) {
+			evp->dce_probe[i] = rd->dcr_tables.db_buf +
+			    probes[4 * probe + i];
+		}
+
+		return (1);
+
+bad:
+		/*
+		 * The segment's checksum was fine (or wasn't checked), but its
+		 * events are malformed.  Skip the rest of it.
+		 */
+		rd->dcr_nbad++;
+		rd->dcr_left = 0;
+	}
+}
+
+/*
+ * Load segment "dcr_seg" and advance "dcr_seg" past it.  Fails with EINVAL if
+ * the segment is corrupt.  If no probe in the segment matches the filter, the
+ * segment is left with no events to read.
+ */
+static int
+dta_capread_load(dta_capreader_t *rd)
+{
+	const dta_capseg_t *seg = &rd->dcr_segs[rd->dcr_seg++];
+	uint32_t i, j, off, nmatch = 0;
+	uint8_t *match;
+
+	rd->dcr_p = rd->dcr_base + seg->dcs_off;
+	rd->dcr_end = rd->dcr_p + seg->dcs_size;
+	rd->dcr_left = 0;
+	rd->dcr_time = seg->dcs_start;
+	rd->dcr_tables.db_len = 0;
+	rd->dcr_probes.db_len = 0;
+	rd->dcr_strings.db_len = 0;
+	rd->dcr_match.db_len = 0;
+
+	if ((rd->dcr_flags & DTA_CAPREAD_F_VERIFY) != 0 &&
+	    dta_crc32(0, rd->dcr_p, seg->dcs_size) != seg->dcs_crc) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (seg->dcs_nprobes > seg->dcs_size ||
+	    seg->dcs_nstrings > seg->dcs_size ||
+	    (match = dta_buf_reserve(&rd->dcr_match,
+	    seg->dcs_nprobes)) == NULL)
+		goto err;
+
+	for (i = 0; i < seg->dcs_nprobes; i++) {
+		match[i] = 1;
+		for (j = 0; j < 4; j++) {
+			off = rd->dcr_tables.db_len;
+			if (dta_capread_name(rd, &rd->dcr_probes) != 0)
+				goto err;
+
+			if (rd->dcr_filter[j] != NULL &&
+			    strcmp(rd->dcr_tables.db_buf + off,
+			    rd->dcr_filter[j]) != 0)
+				match[i] = 0;
+		}
+
+		nmatch += match[i];
+	}
+
+	if (nmatch == 0) {
+		/* Nothing to see here: skip the rest of the segment. */
+		return (0);
+	}
+
+	for (i = 0; i < seg->dcs_nstrings; i++) {
+		if (dta_capread_name(rd, &rd->dcr_strings) != 0)
+			goto err;
+	}
+
+	rd->dcr_left = seg->dcs_nevents;
+	return (0);
+
+err:
+	if (errno != ENOMEM)
+		errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Copy a length-prefixed name from the segment into "dcr_tables" and record
+ * its offset in "index".
+ */
+static int
+dta_capread_name(dta_capreader_t *rd, dta_buf_t *index)
+{
+	uint32_t off = rd->dcr_tables.db_len;
+	uint64_t len;
+	char *dst;
+
+	if (dta_capread_getu(rd, &len) != 0 ||
+	    len > (uint64_t)(rd->dcr_end - rd->dcr_p) ||
+	    memchr(rd->dcr_p, '\0', len) != NULL) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((dst = dta_buf_reserve(&rd->dcr_tables, len + 1)) == NULL ||
+	    dta_buf_append(index, &off, sizeof (off)) != 0) {
+		errno = ENOMEM;
+		return (-1);
+	}
+
+	bcopy(rd->dcr_p, dst, len);
+	rd->dcr_p += len;
+	return (0);
+}
+
+static int
+dta_capread_getu(dta_capreader_t *rd, uint64_t *valp)
+{
+	uint64_t val = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (rd->dcr_p >= rd->dcr_end)
+			return (-1);
+
+		val |= (uint64_t)(*rd->dcr_p & 0x7f) << shift;
+		if ((*rd->dcr_p++ & 0x80) == 0) {
+			*valp = val;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+void
+dta_capread_close(dta_capreader_t *rd)
+{
+	int i;
+
+	if (rd->dcr_base != NULL)
+		(void) munmap((void *)rd->dcr_base, rd->dcr_size);
+
+	for (i = 0; i < 4; i++)
+		free(rd->dcr_filter[i]);
+
+	free(rd->dcr_segs);
+	dta_buf_fini(&rd->dcr_tables);
+	dta_buf_fini(&rd->dcr_probes);
+	dta_buf_fini(&rd->dcr_strings);
+	dta_buf_fini(&rd->dcr_match);
+	bzero(rd, sizeof (*rd));
+}
+
+
+/*
+ * Helpers
+ */
+
+static int
+dta_caplog_writev(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t rv;
+
+	while (iovcnt > 0) {
+		if ((rv = writev(fd, iov, iovcnt)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+
+		while (iovcnt > 0 && (size_t)rv >= iov->iov_len) {
+			rv -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + rv;
+			iov->iov_len -= rv;
+		}
+	}
+
+	return (0);
+}
+
+static void
+dta_le32(uint8_t *p, uint32_t val)
+{
+	int i;
+
+	for (i = 0; i < 4; i++)
+		p[i] = (val >> (8 * i)) & 0xff;
+}
+
+static void
+dta_le64(uint8_t *p, uint64_t val)
+{
+	int i;
+
+	for (i = 0; i < 8; i++)
+		p[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint32_t
+dta_get_le32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+}
+
+static uint64_t
+dta_get_le64(const uint8_t *p)
+{
+	return ((uint64_t)dta_get_le32(p) |
+	    ((uint64_t)dta_get_le32(p + 4) << 32));
+}
@@ -0,0 +1,179 @@
+/*
+ * dta_caplog.h: capture logs, which hold the trace records produced by a
+ * consumer so that they can be replayed later.  Like dta_aggtab.h, this
+ * depends on neither libdtrace nor the shim.
+ *
+ * A capture log is a file header followed by any number of segments.  Records
+ * are accumulated in memory and written out a whole segment at a time, so each
+ * segment costs a single write.  Each segment stands alone: it carries its own
+ * probe and string tables, so a reader can start at any segment, and a
+ * checksum, so a reader can tell where a log that was being written when the
+ * system crashed ends.  The file is only ever appended to.  Readers map the
+ * file and index it by segment, so they can seek by time and skip segments
+ * that don't contain the probes they're interested in.
+ *
+ * All fixed-size integers are little-endian.  The file header is:
+ *
+ *     magic		4 bytes, "DTAC"
+ *     version		2 bytes, DTA_CAPLOG_VERSION
+ *     reserved		2 bytes, zero
+ *     created		8 bytes, creation time (nanoseconds since the epoch)
+ *
+ * Each segment has a fixed-size header:
+ *
+ *     magic		4 bytes, "DTCS"
+ *     hdrsize		4 bytes, DTA_CAPLOG_SEGHDRSIZE
+ *     size		4 bytes, size of the segment body
+ *     crc		4 bytes, CRC-32 of the segment body
+ *     start		8 bytes, time of the first record (ns since the epoch)
+ *     end		8 bytes, time of the last record
+ *     nevents		4 bytes, number of events in the body
+ *     nprobes		4 bytes, number of probes in the probe table
+ *     nstrings		4 bytes, number of strings in the string table
+ *     hdrcrc		4 bytes, CRC-32 of the preceding header bytes
+ *
+ * The body uses the varints of dta_wire.h ("varint", and "zvarint" for signed
+ * values):
+ *
+ *     probes		for each probe: provider, module, function, and name,
+ *     			each a varint length followed by that many bytes
+ *     strings		for each string: varint length followed by the bytes
+ *     events		nevents events, each a one-byte DTA_CAPEV_* tag
+ *     			followed by its fields
+ *
+ * The events mirror the arguments of the consume() callback:
+ *
+ *     DTA_CAPEV_TIME	varint time, relative to "start"; applies to the
+ *     			events that follow
+ *     DTA_CAPEV_PROBE	varint probe index: the probe fired (no data)
+ *     DTA_CAPEV_INT	varint probe index, zvarint value
+ *     DTA_CAPEV_STRING	varint probe index, varint string index
+ */
+
+#ifndef _DTA_CAPLOG_H
+#define	_DTA_CAPLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dta_buf.h"
+
+#define	DTA_CAPLOG_MAGIC	"DTAC"
+#define	DTA_CAPLOG_SEGMAGIC	"DTCS"
+#define	DTA_CAPLOG_VERSION	1
+#define	DTA_CAPLOG_HDRSIZE	16
+#define	DTA_CAPLOG_SEGHDRSIZE	48
+
+typedef enum {
+	DTA_CAPEV_TIME = 1,
+	DTA_CAPEV_PROBE,
+	DTA_CAPEV_INT,
+	DTA_CAPEV_STRING,
+} dta_capev_t;
+
+#define	DTA_CAPLOG_F_SYNC	0x1	/* sync each segment to disk */
+
+/*
+ * Capture log writer.  "dcl_events" holds the events of the segment being
+ * accumulated, and "dcl_probes" and "dcl_strings" its tables.  Probes are
+ * interned as their four names separated by NULs.
+ */
+typedef struct dta_caplog {
+	int		dcl_fd;
+	int		dcl_flags;
+	size_t		dcl_segsize;	/* target size of segment bodies */
+	dta_buf_t	dcl_events;
+	dta_strtab_t	dcl_probes;
+	dta_strtab_t	dcl_strings;
+	dta_buf_t	dcl_scratch;
+	uint32_t	dcl_nevents;
+	uint32_t	dcl_nrecords;	/* events other than DTA_CAPEV_TIME */
+	uint64_t	dcl_start;	/* time of the first event, or zero */
+	uint64_t	dcl_time;	/* time of the last DTA_CAPEV_TIME */
+	size_t		dcl_timeoff;	/* offset of the last DTA_CAPEV_TIME */
+	int		dcl_timelast;	/* no events since DTA_CAPEV_TIME */
+	uint64_t	dcl_gen;	/* incremented with each new segment */
+
+	/* statistics */
+	uint64_t	dcl_stat_events;	/* records captured */
+	uint64_t	dcl_stat_segments;	/* segments written */
+	uint64_t	dcl_stat_bytes;		/* bytes written */
+	uint64_t	dcl_stat_dropped;	/* records lost to errors */
+} dta_caplog_t;
+
+extern int dta_caplog_open(dta_caplog_t *, const char *, size_t, int);
+extern int dta_caplog_time(dta_caplog_t *, uint64_t);
+extern int dta_caplog_probe(dta_caplog_t *, const char *, const char *,
+    const char *, const char *);
+extern int dta_caplog_event(dta_caplog_t *, dta_capev_t, int, int64_t,
+    const char *, size_t);
+extern int dta_caplog_flush(dta_caplog_t *);
+extern int dta_caplog_close(dta_caplog_t *);
+
+/*
+ * Capture log reader.  The log is mapped into memory, and "dcr_segs" indexes
+ * its segments by time range.  Events are read sequentially through the
+ * cursor ("dcr_seg", "dcr_p", "dcr_left"), which decodes one segment at a
+ * time.  The current segment's probe and string tables are copied into
+ * "dcr_tables" so that each name is NUL-terminated; "dcr_probes" holds four
+ * offsets per probe and "dcr_strings" one per string.
+ */
+typedef struct dta_capseg {
+	uint64_t	dcs_off;	/* offset of body in file */
+	uint32_t	dcs_size;
+	uint32_t	dcs_crc;
+	uint64_t	dcs_start;
+	uint64_t	dcs_end;
+	uint32_t	dcs_nevents;
+	uint32_t	dcs_nprobes;
+	uint32_t	dcs_nstrings;
+} dta_capseg_t;
+
+#define	DTA_CAPREAD_F_VERIFY	0x1	/* check each segment's CRC */
+
+typedef struct dta_capreader {
+	const uint8_t	*dcr_base;
+	size_t		dcr_size;
+	int		dcr_flags;
+	uint32_t	dcr_nsegs;
+	dta_capseg_t	*dcr_segs;
+	size_t		dcr_valid;	/* bytes of complete segments */
+
+	/* probe filter (see dta_capread_filter()) */
+	char		*dcr_filter[4];
+
+	/* cursor */
+	uint32_t	dcr_seg;	/* next segment to load */
+	const uint8_t	*dcr_p;
+	const uint8_t	*dcr_end;
+	uint32_t	dcr_left;	/* events left in current segment */
+	uint64_t	dcr_time;
+	dta_buf_t	dcr_tables;
+	dta_buf_t	dcr_probes;	/* uint32_t offsets into dcr_tables */
+	dta_buf_t	dcr_strings;	/* uint32_t offsets into dcr_tables */
+	dta_buf_t	dcr_match;	/* uint8_t per probe: matches filter */
+
+	/* statistics */
+	uint32_t	dcr_nbad;	/* segments skipped as corrupt */
+} dta_capreader_t;
+
+/*
+ * A decoded event.  For all but DTA_CAPEV_TIME, "dce_probe" points to the
+ * probe's provider, module, function, and name.
+ */
+typedef struct dta_capevent {
+	dta_capev_t	dce_kind;
+	uint64_t	dce_time;	/* time of the event (ns since epoch) */
+	const char	*dce_probe[4];
+	int64_t		dce_int;
+	const char	*dce_str;
+} dta_capevent_t;
+
+extern int dta_capread_open(dta_capreader_t *, const char *, int);
+extern int dta_capread_filter(dta_capreader_t *, const char *, const char *,
+    const char *, const char *);
+extern int dta_capread_seek(dta_capreader_t *, uint64_t);
+extern int dta_capread_next(dta_capreader_t *, dta_capevent_t *);
+extern void dta_capread_close(dta_capreader_t *);
+
+#endif	/* _DTA_CAPLOG_H */
@@ -0,0 +1,735 @@
+/*
+ * dta_wire.c: compact binary frames of aggregation data.  See dta_wire.h.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dta_wire.h"
+
+/*
+ * Upper bound on the number of values per record that we'll accept from a
+ * frame.  The largest llquantize() is far smaller than this; the limit just
+ * keeps a corrupt frame from making us allocate arbitrary amounts of memory.
+ */
+#define	DTA_WIRE_MAXVALS	(1 << 20)
+
+/*
+ * Encoder state.  Records and removals are encoded into separate buffers,
+ * since the string and variable tables that precede them in the frame aren't
+ * known until they've all been encoded.
+ */
+typedef struct dta_wenc {
+	dta_strtab_t	dwe_strings;
+	dta_buf_t	dwe_vars;	/* encoded variable table */
+	dta_buf_t	dwe_varids;	/* int64_t varid for each variable */
+	uint32_t	dwe_nvars;
+	dta_buf_t	dwe_recs;
+	uint32_t	dwe_nrecs;
+	dta_buf_t	dwe_removed;
+	uint32_t	dwe_nremoved;
+	int64_t		*dwe_diff;	/* scratch space for values */
+	int		dwe_ndiff;
+} dta_wenc_t;
+
+/*
+ * A variable as described by a frame being decoded.
+ */
+typedef struct dta_wvar {
+	int64_t		dwv_varid;
+	dta_aggkind_t	dwv_kind;
+	uint64_t	dwv_nkeys;
+	uint64_t	dwv_nvals;
+	uint64_t	dwv_param;
+	char		*dwv_name;
+} dta_wvar_t;
+
+/*
+ * Decoder state.
+ */
+typedef struct dta_wdec {
+	const uint8_t	*dwd_p;
+	const uint8_t	*dwd_end;
+	dta_aggtab_t	*dwd_target;	/* table the frame will be applied to */
+	dta_aggtab_t	*dwd_state;	/* NULL when only validating */
+	int		dwd_flags;
+	uint64_t	dwd_nstrings;
+	const uint8_t	**dwd_strs;
+	uint64_t	*dwd_strlens;
+	uint64_t	dwd_nvars;
+	dta_wvar_t	*dwd_vars;
+	dta_buf_t	dwd_key;	/* canonical encoding of current key */
+	int64_t		*dwd_vals;	/* values of current record */
+	uint64_t	dwd_nvals;	/* allocated size of dwd_vals */
+} dta_wdec_t;
+
+static int dta_wire_getu(dta_wdec_t *, uint64_t *);
+static int dta_wire_getz(dta_wdec_t *, int64_t *);
+
+static int dta_wenc_var(dta_wenc_t *, const dta_aggvar_t *);
+static int dta_wenc_keys(dta_wenc_t *, dta_buf_t *, const dta_aggent_t *);
+static int dta_wenc_record(dta_wenc_t *, const dta_aggent_t *,
+    const dta_aggent_t *);
+static void dta_wenc_fini(dta_wenc_t *);
+
+static int dta_wdec_run(dta_wdec_t *, const uint8_t *, size_t);
+static int dta_wdec_tables(dta_wdec_t *);
+static int dta_wdec_keys(dta_wdec_t *, const dta_wvar_t *);
+static int dta_wdec_values(dta_wdec_t *, const dta_wvar_t *);
+static void dta_wdec_fini(dta_wdec_t *);
+
+
+/*
+ * Varints
+ */
+
+static int
+dta_wire_getu(dta_wdec_t *dwd, uint64_t *valp)
+{
+	uint64_t val = 0;
+	int shift;
+
+	for (shift = 0; shift < 64; shift += 7) {
+		if (dwd->dwd_p >= dwd->dwd_end)
+			return (-1);
+
+		val |= (uint64_t)(*dwd->dwd_p & 0x7f) << shift;
+		if ((*dwd->dwd_p++ & 0x80) == 0) {
+			*valp = val;
+			return (0);
+		}
+	}
+
+	return (-1);
+}
+
+static int
+dta_wire_getz(dta_wdec_t *dwd, int64_t *valp)
+{
+	uint64_t val;
+
+	if (dta_wire_getu(dwd, &val) != 0)
+		return (-1);
+
+	*valp = (int64_t)((val >> 1) ^ -(val & 1));
+	return (0);
+}
+
+
+/*
+ * Encoding
+ */
+
+/*
+ * Encode the records of "cur" into a frame with sequence number "seq",
+ * appending it to "out".  If "base" is not NULL, the frame is a delta frame
+ * relative to "base", which was encoded as frame "baseseq".  Fails with
+ * EINVAL if a variable's shape differs between "cur" and "base", and with
+ * EOVERFLOW if a variable has more than 64 keys.
+ */
+int
+dta_wire_encode(const dta_aggtab_t *cur, const dta_aggtab_t *base,
+    uint64_t seq, uint64_t baseseq, dta_buf_t *out)
+{
+	dta_wenc_t enc;
+	const dta_aggent_t *ent, *bent;
+	const dta_aggvar_t *bvar, *var;
+	const char *str;
+	uint32_t i, len;
+	uint8_t flags = base != NULL ? DTA_WIRE_F_DELTA : 0;
+	int rv = -1;
+
+	assert(seq != 0);
+	bzero(&enc, sizeof (enc));
+
+	for (ent = cur->dat_first; ent != NULL; ent = ent->dae_lnext) {
+		var = ent->dae_var;
+		bent = NULL;
+		if (base != NULL &&
+		    (bvar = dta_aggtab_findvar(base, var->dav_varid)) != NULL) {
+			/*
+			 * A variable's shape can't change from one frame to the
+			 * next, since receivers couldn't apply the delta.
+			 */
+			if (bvar->dav_kind != var->dav_kind ||
+			    bvar->dav_param != var->dav_param ||
+			    bvar->dav_nkeys != var->dav_nkeys ||
+			    bvar->dav_nvals != var->dav_nvals) {
+				errno = EINVAL;
+				goto out;
+			}
+
+			bent = dta_aggtab_lookup((dta_aggtab_t *)base, bvar,
+			    ent->dae_key, ent->dae_keylen, 0);
+		}
+
+		if (dta_wenc_record(&enc, ent, bent) != 0)
+			goto out;
+	}
+
+	if (base != NULL) {
+		for (bent = base->dat_first; bent != NULL;
+		    bent = bent->dae_lnext) {
+			if ((var = dta_aggtab_findvar(cur,
+			    bent->dae_var->dav_varid)) != NULL &&
+			    dta_aggtab_lookup((dta_aggtab_t *)cur, var,
+			    bent->dae_key, bent->dae_keylen, 0) != NULL)
+				continue;
+
+			if (dta_wenc_keys(&enc, &enc.dwe_removed, bent) != 0)
+				goto out;
+			enc.dwe_nremoved++;
+		}
+	}
+
+	if (dta_buf_append(out, DTA_WIRE_MAGIC, 4) != 0 ||
+	    dta_buf_append(out, "\001", 1) != 0 ||
+	    dta_buf_append(out, &flags, 1) != 0 ||
+	    dta_buf_putu(out, seq) != 0 ||
+	    (base != NULL && dta_buf_putu(out, baseseq) != 0) ||
+	    dta_buf_putu(out, enc.dwe_strings.dst_nstrings) != 0)
+		goto out;
+
+	for (i = 0; i < enc.dwe_strings.dst_nstrings; i++) {
+		str = dta_strtab_get(&enc.dwe_strings, i, &len);
+		if (dta_buf_putu(out, len) != 0 ||
+		    dta_buf_append(out, str, len) != 0)
+			goto out;
+	}
+
+	if (dta_buf_putu(out, enc.dwe_nvars) != 0 ||
+	    dta_buf_append(out, enc.dwe_vars.db_buf,
+	    enc.dwe_vars.db_len) != 0 ||
+	    dta_buf_putu(out, enc.dwe_nrecs) != 0 ||
+	    dta_buf_append(out, enc.dwe_recs.db_buf,
+	    enc.dwe_recs.db_len) != 0 ||
+	    dta_buf_putu(out, enc.dwe_nremoved) != 0 ||
+	    dta_buf_append(out, enc.dwe_removed.db_buf,
+	    enc.dwe_removed.db_len) != 0)
+		goto out;
+
+	rv = 0;
+
+out:
+	dta_wenc_fini(&enc);
+	return (rv);
+}
+
+/*
+ * Encode record "ent" relative to "bent" (which may be NULL) into the records
+ * section, unless this is a delta frame and nothing has changed.
+ */
+static int
+dta_wenc_record(dta_wenc_t *enc, const dta_aggent_t *ent,
+    const dta_aggent_t *bent)
+{
+	const dta_aggvar_t *var = ent->dae_var;
+	dta_buf_t *dbp = &enc->dwe_recs;
+	int64_t *diff;
+	int changed = 0;
+	int i, n, last;
+
+	if (var->dav_nvals > enc->dwe_ndiff) {
+		free(enc->dwe_diff);
+		enc->dwe_ndiff = 0;
+		if ((enc->dwe_diff = malloc(var->dav_nvals *
+		    sizeof (int64_t))) == NULL)
+			return (-1);
+		enc->dwe_ndiff = var->dav_nvals;
+	}
+
+	/*
+	 * Differences are computed with unsigned arithmetic so that they wrap
+	 * rather than overflow; the decoder's additions wrap back.
+	 */
+	diff = enc->dwe_diff;
+	for (i = 0; i < var->dav_nvals; i++) {
+		diff[i] = bent == NULL ? ent->dae_vals[i] :
+		    (int64_t)((uint64_t)ent->dae_vals[i] -
+		    (uint64_t)bent->dae_vals[i]);
+		if (diff[i] != 0)
+			changed = 1;
+	}
+
+	if (bent != NULL && !changed)
+		return (0);
+
+	if (dta_wenc_keys(enc, dbp, ent) != 0)
+		return (-1);
+
+	switch (var->dav_kind) {
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		for (i = 0, n = 0; i < var->dav_nvals; i++) {
+			if (diff[i] != 0)
+				n++;
+		}
+
+		if (dta_buf_putu(dbp, n) != 0)
+			return (-1);
+
+		for (i = 0, last = 0; i < var->dav_nvals; i++) {
+			if (diff[i] == 0)
+				continue;
+
+			if (dta_buf_putz(dbp, i - last) != 0 ||
+			    dta_buf_putz(dbp, diff[i]) != 0)
+				return (-1);
+			last = i;
+		}
+		break;
+
+	default:
+		for (i = 0; i < var->dav_nvals; i++) {
+			if (dta_buf_putz(dbp, diff[i]) != 0)
+				return (-1);
+		}
+		break;
+	}
+
+	enc->dwe_nrecs++;
+	return (0);
+}
+
+/*
+ * Encode the variable index and keys of "ent" into "dbp".
+ */
+static int
+dta_wenc_keys(dta_wenc_t *enc, dta_buf_t *dbp, const dta_aggent_t *ent)
+{
+	const dta_aggvar_t *var = ent->dae_var;
+	const uint8_t *key, *end = ent->dae_key + ent->dae_keylen;
+	uint64_t strkeys = 0;
+	const char *str;
+	uint32_t len;
+	int64_t ival;
+	int vi, si, i;
+
+	if (var->dav_nkeys > 64) {
+		errno = EOVERFLOW;
+		return (-1);
+	}
+
+	if ((vi = dta_wenc_var(enc, var)) == -1 ||
+	    dta_buf_putu(dbp, vi) != 0)
+		return (-1);
+
+	key = ent->dae_key;
+	for (i = 0; i < var->dav_nkeys; i++) {
+		if (dta_aggkey_next(&key, end, &ival, &str, &len) ==
+		    DTA_KEY_STRING)
+			strkeys |= 1ULL << i;
+	}
+
+	if (dta_buf_putu(dbp, strkeys) != 0)
+		return (-1);
+
+	key = ent->dae_key;
+	for (i = 0; i < var->dav_nkeys; i++) {
+		if (dta_aggkey_next(&key, end, &ival, &str, &len) ==
+		    DTA_KEY_INT) {
+			if (dta_buf_putz(dbp, ival) != 0)
+				return (-1);
+			continue;
+		}
+
+		if ((si = dta_strtab_intern(&enc->dwe_strings, str,
+		    len)) == -1 || dta_buf_putu(dbp, si) != 0)
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Return the frame's index for variable "var", adding it to the variable table
+ * if necessary.
+ */
+static int
+dta_wenc_var(dta_wenc_t *enc, const dta_aggvar_t *var)
+{
+	const int64_t *varids = (int64_t *)enc->dwe_varids.db_buf;
+	dta_buf_t *dbp = &enc->dwe_vars;
+	uint32_t vi;
+	int name;
+
+	for (vi = 0; vi < enc->dwe_nvars; vi++) {
+		if (varids[vi] == var->dav_varid)
+			return (vi);
+	}
+
+	if ((name = dta_strtab_intern(&enc->dwe_strings, var->dav_name,
+	    strlen(var->dav_name))) == -1 ||
+	    dta_buf_append(&enc->dwe_varids, &var->dav_varid,
+	    sizeof (int64_t)) != 0 ||
+	    dta_buf_putz(dbp, var->dav_varid) != 0 ||
+	    dta_buf_putu(dbp, var->dav_kind) != 0 ||
+	    dta_buf_putu(dbp, var->dav_nkeys) != 0 ||
+	    dta_buf_putu(dbp, var->dav_nvals) != 0 ||
+	    dta_buf_putu(dbp, var->dav_param) != 0 ||
+	    dta_buf_putu(dbp, name) != 0)
+		return (-1);
+
+	return (enc->dwe_nvars++);
+}
+
+static void
+dta_wenc_fini(dta_wenc_t *enc)
+{
+	dta_strtab_fini(&enc->dwe_strings);
+	dta_buf_fini(&enc->dwe_vars);
+	dta_buf_fini(&enc->dwe_varids);
+	dta_buf_fini(&enc->dwe_recs);
+	dta_buf_fini(&enc->dwe_removed);
+	free(enc->dwe_diff);
+}
+
+
+/*
+ * Decoding
+ */
+
+/*
+ * Apply the "len"-byte frame at "buf" to "state".  "*seqp" is the sequence
+ * number of the last frame applied to "state" (zero if there was none), and
+ * is updated on success.  Fails with EINVAL if the frame is malformed and with
+ * ESTALE if it's a delta frame relative to a frame other than "*seqp".  The
+ * whole frame is validated before "state" is modified, so on failure "state"
+ * is unchanged unless we run out of memory.
+ */
+int
+dta_wire_decode(const uint8_t *buf, size_t len, dta_aggtab_t *state,
+    uint64_t *seqp)
+{
+	dta_wdec_t dwd;
+	const uint8_t *body;
+	uint64_t seq, baseseq = 0;
+	int rv;
+
+	bzero(&dwd, sizeof (dwd));
+	dwd.dwd_p = buf + DTA_WIRE_HDRSIZE;
+	dwd.dwd_end = buf + len;
+
+	if (len < DTA_WIRE_HDRSIZE || bcmp(buf, DTA_WIRE_MAGIC, 4) != 0 ||
+	    buf[4] != DTA_WIRE_VERSION || dta_wire_getu(&dwd, &seq) != 0 ||
+	    seq == 0 || ((buf[5] & DTA_WIRE_F_DELTA) != 0 &&
+	    dta_wire_getu(&dwd, &baseseq) != 0)) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if ((buf[5] & DTA_WIRE_F_DELTA) != 0 && baseseq != *seqp) {
+		errno = ESTALE;
+		return (-1);
+	}
+
+	/*
+	 * Make one pass to validate the frame and another to apply it.
+	 */
+	body = dwd.dwd_p;
+	dwd.dwd_flags = buf[5];
+	dwd.dwd_target = state;
+	if ((rv = dta_wdec_run(&dwd, body, dwd.dwd_end - body)) == 0) {
+		dwd.dwd_state = state;
+		if ((dwd.dwd_flags & DTA_WIRE_F_DELTA) == 0) {
+			dta_aggtab_fini(state);
+			dta_aggtab_init(state);
+		}
+
+		rv = dta_wdec_run(&dwd, body, dwd.dwd_end - body);
+	}
+
+	if (rv == 0)
+		*seqp = seq;
+
+	dta_wdec_fini(&dwd);
+	return (rv);
+}
+
+/*
+ * Decode the body of the frame (everything after the sequence numbers),
+ * applying it to dwd_state if that's set.
+ */
+static int
+dta_wdec_run(dta_wdec_t *dwd, const uint8_t *body, size_t len)
+{
+	dta_aggtab_t *state = dwd->dwd_state;
+	const dta_wvar_t *wvar;
+	dta_aggvar_t *var;
+	dta_aggent_t *ent;
+	uint64_t n, i, vi, j;
+
+	dwd->dwd_p = body;
+	dwd->dwd_end = body + len;
+
+	if (dta_wdec_tables(dwd) != 0 || dta_wire_getu(dwd, &n) != 0)
+		goto bad;
+
+	for (i = 0; i < n; i++) {
+		if (dta_wire_getu(dwd, &vi) != 0 || vi >= dwd->dwd_nvars)
+			goto bad;
+
+		wvar = &dwd->dwd_vars[vi];
+		if (dta_wdec_keys(dwd, wvar) != 0 ||
+		    dta_wdec_values(dwd, wvar) != 0)
+			goto bad;
+
+		if (state == NULL)
+			continue;
+
+		if ((var = dta_aggtab_var(state, wvar->dwv_varid,
+		    wvar->dwv_kind, wvar->dwv_param, wvar->dwv_nkeys,
+		    wvar->dwv_nvals, wvar->dwv_name)) == NULL ||
+		    (ent = dta_aggtab_lookup(state, var,
+		    (uint8_t *)dwd->dwd_key.db_buf, dwd->dwd_key.db_len,
+		    1)) == NULL)
+			return (-1);
+
+		for (j = 0; j < wvar->dwv_nvals; j++) {
+			ent->dae_vals[j] = (int64_t)
+			    ((uint64_t)ent->dae_vals[j] +
+			    (uint64_t)dwd->dwd_vals[j]);
+		}
+	}
+
+	if (dta_wire_getu(dwd, &n) != 0 ||
+	    (n != 0 && (dwd->dwd_flags & DTA_WIRE_F_DELTA) == 0))
+		goto bad;
+
+	for (i = 0; i < n; i++) {
+		if (dta_wire_getu(dwd, &vi) != 0 || vi >= dwd->dwd_nvars ||
+		    dta_wdec_keys(dwd, &dwd->dwd_vars[vi]) != 0)
+			goto bad;
+
+		if (state != NULL &&
+		    (var = dta_aggtab_findvar(state,
+		    dwd->dwd_vars[vi].dwv_varid)) != NULL &&
+		    (ent = dta_aggtab_lookup(state, var,
+		    (uint8_t *)dwd->dwd_key.db_buf, dwd->dwd_key.db_len,
+		    0)) != NULL)
+			dta_aggtab_remove(state, ent);
+	}
+
+	if (dwd->dwd_p != dwd->dwd_end)
+		goto bad;
+
+	return (0);
+
+bad:
+	errno = EINVAL;
+	return (-1);
+}
+
+/*
+ * Decode the string and variable tables.  These are only decoded once; on the
+ * second pass, we just skip over them.
+ */
+static int
+dta_wdec_tables(dta_wdec_t *dwd)
+{
+	dta_wvar_t *wvar;
+	dta_aggvar_t *var;
+	uint64_t n, i, j, kind, name;
+
+	if (dta_wire_getu(dwd, &n) != 0 ||
+	    n > (uint64_t)(dwd->dwd_end - dwd->dwd_p))
+		return (-1);
+
+	if (dwd->dwd_strs == NULL && n > 0 &&
+	    ((dwd->dwd_strs = calloc(n, sizeof (uint8_t *))) == NULL ||
+	    (dwd->dwd_strlens = calloc(n, sizeof (uint64_t))) == NULL))
+		return (-1);
+
+	dwd->dwd_nstrings = n;
+	for (i = 0; i < n; i++) {
+		if (dta_wire_getu(dwd, &dwd->dwd_strlens[i]) != 0 ||
+		    dwd->dwd_strlens[i] >
+		    (uint64_t)(dwd->dwd_end - dwd->dwd_p) ||
+		    dwd->dwd_strlens[i] > UINT32_MAX ||
+		    memchr(dwd->dwd_p, '\0', dwd->dwd_strlens[i]) != NULL)
+			return (-1);
+
+		dwd->dwd_strs[i] = dwd->dwd_p;
+		dwd->dwd_p += dwd->dwd_strlens[i];
+	}
+
+	if (dta_wire_getu(dwd, &n) != 0 ||
+	    n > (uint64_t)(dwd->dwd_end - dwd->dwd_p))
+		return (-1);
+
+	if (dwd->dwd_vars != NULL) {
+		/* Second pass: skip the table, which we've already seen. */
+		for (i = 0; i < 6 * n; i++) {
+			if (dta_wire_getu(dwd, &name) != 0)
+				return (-1);
+		}
+		return (0);
+	}
+
+	if (n > 0 && (dwd->dwd_vars = calloc(n, sizeof (dta_wvar_t))) == NULL)
+		return (-1);
+
+	dwd->dwd_nvars = n;
+	for (i = 0; i < n; i++) {
+		wvar = &dwd->dwd_vars[i];
+		if (dta_wire_getz(dwd, &wvar->dwv_varid) != 0 ||
+		    dta_wire_getu(dwd, &kind) != 0 ||
+		    dta_wire_getu(dwd, &wvar->dwv_nkeys) != 0 ||
+		    dta_wire_getu(dwd, &wvar->dwv_nvals) != 0 ||
+		    dta_wire_getu(dwd, &wvar->dwv_param) != 0 ||
+		    dta_wire_getu(dwd, &name) != 0 ||
+		    name >= dwd->dwd_nstrings || wvar->dwv_nkeys > 64 ||
+		    kind < DTA_AGG_COUNT || kind > DTA_AGG_LLQUANTIZE)
+			return (-1);
+
+		wvar->dwv_kind = kind;
+		switch (wvar->dwv_kind) {
+		case DTA_AGG_AVG:
+			if (wvar->dwv_nvals != 2)
+				return (-1);
+			break;
+
+		case DTA_AGG_QUANTIZE:
+		case DTA_AGG_LQUANTIZE:
+		case DTA_AGG_LLQUANTIZE:
+			if (wvar->dwv_nvals == 0 ||
+			    wvar->dwv_nvals > DTA_WIRE_MAXVALS)
+				return (-1);
+			break;
+
+		default:
+			if (wvar->dwv_nvals != 1)
+				return (-1);
+			break;
+		}
+
+		if ((wvar->dwv_name = malloc(dwd->dwd_strlens[name] + 1)) ==
+		    NULL)
+			return (-1);
+		bcopy(dwd->dwd_strs[name], wvar->dwv_name,
+		    dwd->dwd_strlens[name]);
+		wvar->dwv_name[dwd->dwd_strlens[name]] = '\0';
+
+		if (wvar->dwv_nvals > dwd->dwd_nvals) {
+			free(dwd->dwd_vals);
+			dwd->dwd_nvals = 0;
+			if ((dwd->dwd_vals = malloc(wvar->dwv_nvals *
+			    sizeof (int64_t))) == NULL)
+				return (-1);
+			dwd->dwd_nvals = wvar->dwv_nvals;
+		}
+
+		for (j = 0; j < i; j++) {
+			if (dwd->dwd_vars[j].dwv_varid == wvar->dwv_varid)
+				return (-1);
+		}
+
+		/*
+		 * A delta frame can only be applied if its variables match the
+		 * ones we already have.
+		 */
+		if ((dwd->dwd_flags & DTA_WIRE_F_DELTA) != 0 &&
+		    (var = dta_aggtab_findvar(dwd->dwd_target,
+		    wvar->dwv_varid)) != NULL &&
+		    (var->dav_kind != wvar->dwv_kind ||
+		    var->dav_param != wvar->dwv_param ||
+		    var->dav_nkeys != wvar->dwv_nkeys ||
+		    var->dav_nvals != wvar->dwv_nvals))
+			return (-1);
+	}
+
+	return (0);
+}
+
+/*
+ * Decode a record's keys into the canonical key encoding in dwd_key.
+ */
+static int
+dta_wdec_keys(dta_wdec_t *dwd, const dta_wvar_t *wvar)
+{
+	dta_buf_t *dbp = &dwd->dwd_key;
+	uint64_t strkeys, si, i;
+	int64_t ival;
+	uint8_t *p;
+
+	if (dta_wire_getu(dwd, &strkeys) != 0)
+		return (-1);
+
+	dbp->db_len = 0;
+	for (i = 0; i < wvar->dwv_nkeys; i++) {
+		if ((strkeys & (1ULL << i)) == 0) {
+			if (dta_wire_getz(dwd, &ival) != 0 ||
+			    (p = dta_buf_reserve(dbp,
+			    DTA_AGGKEY_INTSIZE)) == NULL)
+				return (-1);
+			(void) dta_aggkey_int(p, ival);
+			continue;
+		}
+
+		if (dta_wire_getu(dwd, &si) != 0 || si >= dwd->dwd_nstrings ||
+		    (p = dta_buf_reserve(dbp,
+		    DTA_AGGKEY_STRSIZE(dwd->dwd_strlens[si]))) == NULL)
+			return (-1);
+		(void) dta_aggkey_string(p, (const char *)dwd->dwd_strs[si],
+		    dwd->dwd_strlens[si]);
+	}
+
+	return (0);
+}
+
+/*
+ * Decode a record's values into dwd_vals.
+ */
+static int
+dta_wdec_values(dta_wdec_t *dwd, const dta_wvar_t *wvar)
+{
+	int64_t *vals = dwd->dwd_vals;
+	int64_t delta, bi;
+	uint64_t n, i;
+
+	switch (wvar->dwv_kind) {
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		bzero(vals, wvar->dwv_nvals * sizeof (int64_t));
+		if (dta_wire_getu(dwd, &n) != 0 || n > wvar->dwv_nvals)
+			return (-1);
+
+		for (i = 0, bi = 0; i < n; i++) {
+			if (dta_wire_getz(dwd, &delta) != 0 ||
+			    delta < 0 || (uint64_t)delta >= wvar->dwv_nvals ||
+			    (uint64_t)(bi += delta) >= wvar->dwv_nvals ||
+			    dta_wire_getz(dwd, &vals[bi]) != 0)
+				return (-1);
+		}
+		break;
+
+	default:
+		for (i = 0; i < wvar->dwv_nvals; i++) {
+			if (dta_wire_getz(dwd, &vals[i]) != 0)
+				return (-1);
+		}
+		break;
+	}
+
+	return (0);
+}
+
+static void
+dta_wdec_fini(dta_wdec_t *dwd)
+{
+	uint64_t i;
+
+	for (i = 0; i < dwd->dwd_nvars; i++)
+		free(dwd->dwd_vars[i].dwv_name);
+
+	free(dwd->dwd_vars);
+	free(dwd->dwd_strs);
+	free(dwd->dwd_strlens);
+	free(dwd->dwd_vals);
+	dta_buf_fini(&dwd->dwd_key);
+}
@@ -0,0 +1,71 @@
+/*
+ * dta_wire.h: compact binary frames of aggregation data, for shipping
+ * aggregations off-host.  A frame encodes the contents of a table of
+ * aggregation records (see dta_aggtab.h), either in full or as the difference
+ * from a previous frame.  Decoding a frame applies it to a table, so a
+ * receiver that decodes every frame in order has a copy of the sender's table.
+ * This depends on neither libdtrace nor the shim, so receivers need only this
+ * file, dta_aggtab.c, and dta_buf.c.  In JavaScript, frames can be decoded
+ * either by lib/aggwire.js or, through the dtrace_replay binding, by
+ * dta_wire_decode().
+ *
+ * Except for the fixed header, all integers are LEB128 varints ("varint"):
+ * 7 bits per byte, least significant group first, with the high bit set on
+ * every byte but the last.  Signed integers are zig-zag encoded ("zvarint")
+ * first, so that values near zero are short regardless of sign.
+ *
+ *     magic		4 bytes, "DTAW"
+ *     version		1 byte, DTA_WIRE_VERSION
+ *     flags		1 byte, DTA_WIRE_F_*
+ *     seq		varint: this frame's sequence number (never zero)
+ *     baseseq		varint: for delta frames only, the sequence number of
+ *     			the frame that this one is relative to
+ *     strings		varint count, then for each string: varint length
+ *     			followed by that many bytes
+ *     variables	varint count, then for each variable: zvarint varid,
+ *     			varint kind (dta_aggkind_t), varint nkeys, varint
+ *     			nvals, varint param, and varint name (string index)
+ *     records		varint count, then for each record: varint variable
+ *     			index, keys, and values
+ *     removed		varint count, then for each record: varint variable
+ *     			index and keys
+ *
+ * Keys are a varint bitmask with bit "i" set if key "i" is a string, then each
+ * key: a varint string index for strings and a zvarint for integers.
+ *
+ * Values depend on the variable's kind: one zvarint for count(), min(), max()
+ * and sum(); two (the count and the sum) for avg(); and for the quantizing
+ * actions, the number of non-zero buckets as a varint followed by a pair of
+ * zvarints for each one: the bucket index, as the difference from the previous
+ * non-zero bucket's index (or from zero, for the first), and the bucket count.
+ * Bucket ranges are not sent, since they follow from the kind, the parameter
+ * word, and the number of buckets.
+ *
+ * In a full frame, values are absolute and the "removed" section is empty.  In
+ * a delta frame (DTA_WIRE_F_DELTA), each value is the difference from the same
+ * record in the base frame (or from zero, for new records), records whose
+ * values haven't changed are omitted, and records that were in the base frame
+ * but no longer exist are listed under "removed".
+ */
+
+#ifndef _DTA_WIRE_H
+#define	_DTA_WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dta_aggtab.h"
+#include "dta_buf.h"
+
+#define	DTA_WIRE_MAGIC		"DTAW"
+#define	DTA_WIRE_VERSION	1
+#define	DTA_WIRE_HDRSIZE	6
+
+#define	DTA_WIRE_F_DELTA	0x1
+
+extern int dta_wire_encode(const dta_aggtab_t *, const dta_aggtab_t *,
+    uint64_t, uint64_t, dta_buf_t *);
+extern int dta_wire_decode(const uint8_t *, size_t, dta_aggtab_t *,
+    uint64_t *);
+
+#endif	/* _DTA_WIRE_H */
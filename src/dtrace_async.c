@@ -14,9 +14,13 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <time.h>
 
 /*
  * Sadly, libelf refuses to compile if _FILE_OFFSET_BITS has been manually
@@ -30,6 +34,11 @@
 
 #include <dtrace.h>
 
+#include "dta_aggtab.h"
+#include "dta_buf.h"
+#include "dta_caplog.h"
+#include "dta_wire.h"
+
 /*
  * This is a tad unsightly:  if we didn't find the definition of the
  * llquantize() aggregating action, we're going to redefine it here (along
@@ -74,8 +83,30 @@
 typedef enum {
 	DTA_F_BUSY = 0x1,		/* async operation pending */
 	DTA_F_CONSUMING = 0x2,		/* consume operation ongoing */
+	DTA_F_PEEKING = 0x4,		/* aggregation walk won't remove */
+	DTA_F_EXACT = 0x8,		/* consume 64-bit values exactly */
+	DTA_F_TRACING = 0x10,		/* between go() and stop() */
+	DTA_F_SLOTS = 0x20,		/* aggregation walk passes key slots */
 } dta_flags_t;
 
+/*
+ * Categories of native memory that a handle accounts for (see
+ * dta_mem_compute()).
+ */
+typedef enum {
+	DTA_MEM_HANDLE,			/* the handle itself */
+	DTA_MEM_BUFFERS,		/* libdtrace's buffers (estimated) */
+	DTA_MEM_PLANS,			/* decoding plans */
+	DTA_MEM_INTERN,			/* string intern table */
+	DTA_MEM_SUBSCRIBERS,		/* subscriber table */
+	DTA_MEM_ROLLUP,			/* rollup windows */
+	DTA_MEM_WIRE,			/* wire encoding state */
+	DTA_MEM_CAPTURE,		/* record capture */
+	DTA_MEM_SNAPSHOTS,		/* undelivered snapshots */
+	DTA_MEM_SLOTS,			/* aggregation key slots */
+	DTA_MEM_NCATS
+} dta_memcat_t;
+
 /*
  * Handle: there's one of these per JavaScript DTraceConsumer.  It may have at
  * most one asynchronous operation, consume operation, or aggwalk operation
@@ -85,6 +116,11 @@ typedef struct dta_hdl {
 	dtrace_hdl_t	*dta_dtrace;	/* libdtrace handle */
 	int		dta_flags;
 
+	/* lifecycle (see dta_close()) */
+	shim_val_t	*dta_self;	/* persistent reference to wrapper */
+	struct dta_hdl	*dta_next;	/* next open handle (see dta_hdls) */
+	size_t		dta_mem[DTA_MEM_NCATS];	/* last accounted footprint */
+
 	/* current consume operation state */
 	shim_val_t	*dta_consume_callback;
 	shim_ctx_t	*dta_consume_ctx;
@@ -96,8 +132,317 @@ typedef struct dta_hdl {
 	void		(*dta_func)(struct dta_hdl *);	/* internal func */
 	int		dta_rval;			/* internal rval */
 	char		dta_errmsg[1024];		/* error message */
+
+	/* filter for the current aggregation walk (see dta_aggfilter_t) */
+	struct dta_aggfilter *dta_aggfilter;
+
+	/* statistics for the current aggregation walk (see dta_aggstats_t) */
+	struct dta_aggstats *dta_aggstats;
+
+	/* integers for the current exact aggregation walk (see dta_exact_*) */
+	dta_buf_t	*dta_exact;
+
+	/* aggregation snapshot not yet delivered (see dta_aggsnapshot()) */
+	char		*dta_snapbuf;
+	size_t		dta_snaplen;
+
+	/* rollup windows, if enabled (see dta_rollup_t) */
+	struct dta_rollup *dta_rollup;
+
+	/* wire encoding state, once used (see dta_wstate_t) */
+	struct dta_wstate *dta_wire;
+
+	/* record capture, if enabled (see dta_capture_t) */
+	struct dta_capture *dta_capture;
+
+	/* string intern table, if enabled (see dta_intern_t) */
+	struct dta_intern *dta_intern;
+
+	/* decoding plans by EPID and by aggregation ID (see dta_plan_t) */
+	struct dta_plan	**dta_eplans;
+	uint32_t	dta_neplans;
+	struct dta_plan	**dta_aplans;
+	uint32_t	dta_naplans;
+
+	/* subscribers, once there have been any (see dta_subtab_t) */
+	struct dta_subtab *dta_subs;
+
+	/* ring-buffer snapshot, once one has been taken (see dta_ring_t) */
+	struct dta_ring	*dta_ring;
+
+	/* aggregation key slots, once used (see dta_slots_t) */
+	struct dta_slots *dta_slots;
 } dta_hdl_t;
 
+/*
+ * Decoded view of an aggregation record's value.  For avg(), the two values
+ * are the count and the sum (in that order).  For the quantizing actions, the
+ * values are the bucket counts, and "param" is the parameter word that
+ * libdtrace stores ahead of the buckets (zero for quantize()).
+ */
+typedef struct dta_aggval {
+	dta_aggkind_t	dtv_kind;
+	uint64_t	dtv_param;
+	const int64_t	*dtv_data;
+	int		dtv_nvals;
+} dta_aggval_t;
+
+/*
+ * Kinds of values that a single record can decode to.
+ */
+typedef enum {
+	DTA_V_INT,			/* integer */
+	DTA_V_STRING,			/* NUL-terminated string */
+} dta_vkind_t;
+
+/*
+ * Decoding plans: the layout of the records for an enabled probe (EPID) or an
+ * aggregation never changes once tracing has started, so the first time we
+ * see one, we classify each of its records into a field, and subsequent
+ * records are decoded using just the fields.  For an EPID, there's one field
+ * per record.  For an aggregation, there's one field per key, and the value
+ * is described by "dpl_aggkind" (zero if the aggregating action isn't
+ * supported), "dpl_valoff", "dpl_nvals", and "dpl_hasparam" (see
+ * dta_aggval_t).  Plans also cache the set of subscribers interested in their
+ * records (see dta_subtab_t).
+ */
+typedef enum {
+	DTA_FLD_UNSUPPORTED = 0,	/* action we can't decode */
+	DTA_FLD_PRINTF,			/* printf() (see dta_dt_bufhandler()) */
+	DTA_FLD_UINT8,
+	DTA_FLD_UINT16,
+	DTA_FLD_UINT32,
+	DTA_FLD_INT64,
+	DTA_FLD_STRING,
+	DTA_FLD_SYMBOL,			/* address to format as a symbol */
+} dta_fldkind_t;
+
+typedef struct dta_field {
+	dta_fldkind_t	dfl_kind;
+	uint32_t	dfl_offset;
+	const dtrace_recdesc_t *dfl_rec;
+} dta_field_t;
+
+typedef struct dta_plan {
+	int		dpl_nfields;
+	dta_field_t	*dpl_fields;
+
+	/* aggregations only */
+	dta_aggkind_t	dpl_aggkind;
+	const char	*dpl_action;	/* name of aggregating action */
+	uint32_t	dpl_valoff;
+	int		dpl_nvals;
+	int		dpl_hasparam;
+
+	/* matching subscribers, valid while "dpl_subgen" is current */
+	uint64_t	dpl_subs;
+	uint64_t	dpl_subgen;
+} dta_plan_t;
+
+/*
+ * Subscribers: several independent parts of a program can share one consumer
+ * (and so one set of enablings and buffers) by each subscribing to the records
+ * they're interested in.  A subscriber's consume() callback gets the records of
+ * probes matching "dsb_probe" (where NULL components match anything), and its
+ * aggwalk() callback gets the records of the aggregation variables in
+ * "dsb_varids" (or all of them, if there are none).  When consume() or
+ * aggwalk() is invoked without a callback, each record is decoded once and
+ * passed only to the matching subscribers, and records that no subscriber
+ * wants are skipped without creating any JavaScript values.
+ *
+ * Sets of subscribers are bitmasks of indexes into "dst_subs".  Which
+ * subscribers match an enabled probe or an aggregation only changes when a
+ * subscriber comes or goes, so the set is computed once per plan and cached
+ * there until "dst_gen" changes.
+ */
+#define	DTA_SUB_MAX	64
+
+typedef struct dta_sub {
+	int		dsb_active;
+	char		*dsb_probe[4];	/* provider, module, function, name */
+	int		dsb_nvarids;
+	int64_t		*dsb_varids;
+	shim_val_t	*dsb_consume;	/* persistent callback, or NULL */
+	shim_val_t	*dsb_aggwalk;	/* persistent callback, or NULL */
+} dta_sub_t;
+
+typedef struct dta_subtab {
+	uint64_t	dst_gen;
+	dta_sub_t	dst_subs[DTA_SUB_MAX];
+} dta_subtab_t;
+
+/*
+ * Aggregation walk filter: an aggregation record matches if its variable ID is
+ * one of "varids" (or "nvarids" is zero) and its first "nprefix" keys are equal
+ * to "prefix".  Records that don't match are skipped before any JavaScript
+ * values are created for them, and they're left in the aggregation buffer.
+ */
+typedef struct dta_filtkey {
+	dta_vkind_t	dfk_kind;
+	int64_t		dfk_int;
+	char		*dfk_str;
+} dta_filtkey_t;
+
+typedef struct dta_aggfilter {
+	int		daf_nvarids;
+	int64_t		*daf_varids;
+	int		daf_nprefix;
+	dta_filtkey_t	*daf_prefix;
+} dta_aggfilter_t;
+
+/*
+ * Aggregation walk statistics: when requested ("das_enabled"), the values of
+ * quantize(), lquantize() and llquantize() records are summarized as a count,
+ * an approximate mean, and the requested percentiles (each between 0 and 100,
+ * and possibly none at all), rather than passed bucket by bucket.  The
+ * remaining fields are scratch space for computing the summaries.
+ */
+typedef struct dta_aggstats {
+	int		das_enabled;
+	int		das_npct;
+	double		*das_pct;
+	double		*das_result;	/* computed percentiles */
+	int64_t		*das_lo;	/* bucket lower bounds */
+	int64_t		*das_hi;	/* bucket upper bounds */
+	int		das_nbuckets;	/* allocated size of das_lo, das_hi */
+} dta_aggstats_t;
+
+/*
+ * Aggregation rollups: an optional ring of "dru_nwindows" tables, each holding
+ * the aggregation records consumed during one interval (see dta_rolluptick()).
+ * "dru_cur" is the newest window, and "dru_nfilled" is the number of windows
+ * that have been filled so far.  Queries merge the newest windows into
+ * "dru_merged", which is kept around so that its hash table can be reused.
+ * Each tick fills "dru_next", which only replaces the oldest window once it's
+ * complete; the oldest window's table, emptied, becomes the next "dru_next".
+ */
+typedef struct dta_rollup {
+	int		dru_nwindows;
+	int		dru_cur;
+	int		dru_nfilled;
+	dta_aggtab_t	*dru_windows;
+	dta_aggtab_t	dru_merged;
+	dta_aggtab_t	dru_next;	/* window being filled */
+	dta_buf_t	dru_key;	/* scratch space for encoding keys */
+} dta_rollup_t;
+
+/*
+ * Wire encoding state: "dtw_prev" holds the records of the last frame that
+ * consumer.aggencode() produced (whose sequence number is "dtw_seq"), so that
+ * the next frame can be encoded relative to it.  "dtw_cur" collects the
+ * records for the next frame.
+ */
+typedef struct dta_wstate {
+	dta_aggtab_t	dtw_prev;
+	dta_aggtab_t	dtw_cur;
+	uint64_t	dtw_seq;
+	dta_buf_t	dtw_key;	/* scratch space for encoding keys */
+} dta_wstate_t;
+
+#define	DTA_WIRE_ENC_F_DELTA	0x1	/* encode relative to last frame */
+#define	DTA_WIRE_ENC_F_PEEK	0x2	/* leave the records in place */
+
+/*
+ * Aggregation key slots: when requested, aggregation walks pass each record's
+ * keys as a single integer, its slot in the handle's key index (see
+ * dta_keyidx_t), rather than as one argument per key.  The index is keyed by
+ * the canonical encoding of the keys (see dta_aggtab.h) and its hash, both
+ * computed from the raw key records, so a key that's been seen before costs
+ * no allocations at all.  Slots persist across walks until they're reset.
+ */
+typedef struct dta_slots {
+	dta_keyidx_t	dsl_idx;
+	dta_buf_t	dsl_key;	/* scratch space for encoding keys */
+} dta_slots_t;
+
+/*
+ * Record capture: while enabled, consume() writes each record to a capture log
+ * (see dta_caplog.h) rather than passing it to JavaScript, unless
+ * DTA_CAP_F_PASSTHROUGH is set, in which case it does both.  A segment is
+ * written once it's full or once it holds records older than "dcp_maxage"
+ * nanoseconds (if that's not zero).  "dcp_lastpd" caches the probe table index
+ * of the last probe captured, which is valid as long as the log's generation
+ * number hasn't changed.
+ */
+#define	DTA_CAP_F_SYNC		0x1	/* see DTA_CAPLOG_F_SYNC */
+#define	DTA_CAP_F_PASSTHROUGH	0x2	/* also pass records to JavaScript */
+
+typedef struct dta_capture {
+	dta_caplog_t	dcp_log;
+	int		dcp_flags;
+	uint64_t	dcp_maxage;
+	uint64_t	dcp_nsecs;	/* time spent in consume() */
+	const dtrace_probedesc_t *dcp_lastpd;
+	int		dcp_lastprobe;
+	uint64_t	dcp_lastgen;
+} dta_capture_t;
+
+/*
+ * Ring-buffer snapshots: with bufpolicy=ring, the principal buffers hold the
+ * most recent records and nothing needs to consume them until something
+ * interesting happens, at which point consumer.snapshot() drains them once on
+ * a worker thread.  JavaScript values can't be created there, so the records
+ * are collected natively into "drg_recs" (using the same event kinds as record
+ * capture), with strings copied into "drg_strings", and are then delivered on
+ * the main thread by dta_snapshotread().  Probe descriptions belong to
+ * libdtrace, which keeps them for the life of the handle.
+ */
+#define	DTA_RING_F_STOP		0x1	/* stop tracing before draining */
+
+typedef struct dta_ringrec {
+	const dtrace_probedesc_t *drr_pd;
+	dta_capev_t	drr_kind;	/* DTA_CAPEV_{PROBE,INT,STRING} */
+	int64_t		drr_val;	/* integer, or offset of string */
+} dta_ringrec_t;
+
+typedef struct dta_ring {
+	int		drg_flags;	/* DTA_RING_F_* */
+	dta_buf_t	drg_recs;	/* dta_ringrec_t */
+	dta_buf_t	drg_strings;	/* NUL-terminated strings */
+	uint64_t	drg_nsecs;	/* time spent draining */
+} dta_ring_t;
+
+/*
+ * String interning: the strings passed to consume() and aggwalk() callbacks
+ * tend to repeat (probe names, execnames, paths), so rather than create a new
+ * JavaScript string for each one, we keep up to "din_capacity" of them as
+ * persistent strings, indexed by a hash of their bytes.  When the table is
+ * full, an entry is evicted using the CLOCK algorithm: "din_hand" sweeps over
+ * the entries, clearing each one's reference bit, and evicts the first one
+ * whose bit was already clear.  Entries handed out for the callback currently
+ * being assembled (those whose "die_gen" is "din_gen") are never evicted,
+ * since the callback's arguments refer to them.  Strings longer than
+ * DTA_INTERN_MAXLEN, and strings for which no entry can be evicted, are
+ * created as usual.
+ */
+#define	DTA_INTERN_DEFCAPACITY	1024
+#define	DTA_INTERN_MAXLEN	256
+
+typedef struct dta_internent {
+	shim_val_t	*die_val;	/* persistent string */
+	char		*die_str;
+	size_t		die_len;
+	uint64_t	die_hash;
+	uint64_t	die_gen;	/* last callback this was used in */
+	uint32_t	die_next;	/* next entry in bucket + 1, or 0 */
+	int		die_ref;	/* reference bit */
+} dta_internent_t;
+
+typedef struct dta_intern {
+	uint32_t	din_capacity;	/* power of 2 */
+	uint32_t	din_count;
+	uint32_t	din_hand;
+	uint64_t	din_gen;
+	dta_internent_t	*din_ents;
+	uint32_t	*din_buckets;	/* entry index + 1, or 0 */
+
+	/* statistics */
+	uint64_t	din_hits;
+	uint64_t	din_misses;	/* strings added to the table */
+	uint64_t	din_evictions;
+	uint64_t	din_uncached;	/* strings not eligible for the table */
+} dta_intern_t;
+
 
 /* Shim configuration */
 static int initialize(shim_ctx_t *, shim_val_t *, shim_val_t *);
@@ -113,6 +458,32 @@ static int dta_stop(shim_ctx_t *, shim_args_t *);
 static int dta_setopt(shim_ctx_t *, shim_args_t *);
 static int dta_consume(shim_ctx_t *, shim_args_t *);
 static int dta_aggwalk(shim_ctx_t *, shim_args_t *);
+static int dta_aggpeek(shim_ctx_t *, shim_args_t *);
+static int dta_aggclear(shim_ctx_t *, shim_args_t *);
+static int dta_aggtrunc(shim_ctx_t *, shim_args_t *);
+static int dta_aggsnapshot(shim_ctx_t *, shim_args_t *);
+static int dta_rollup(shim_ctx_t *, shim_args_t *);
+static int dta_rolluptick(shim_ctx_t *, shim_args_t *);
+static int dta_rollupquery(shim_ctx_t *, shim_args_t *);
+static int dta_aggmerge(shim_ctx_t *, shim_args_t *);
+static int dta_exposition(shim_ctx_t *, shim_args_t *);
+static int dta_aggencode(shim_ctx_t *, shim_args_t *);
+static int dta_capture(shim_ctx_t *, shim_args_t *);
+static int dta_captureflush(shim_ctx_t *, shim_args_t *);
+static int dta_capturestats(shim_ctx_t *, shim_args_t *);
+static int dta_capturestop(shim_ctx_t *, shim_args_t *);
+static int dta_internconf(shim_ctx_t *, shim_args_t *);
+static int dta_internstats(shim_ctx_t *, shim_args_t *);
+static int dta_subscribe(shim_ctx_t *, shim_args_t *);
+static int dta_snapshot(shim_ctx_t *, shim_args_t *);
+static int dta_close(shim_ctx_t *, shim_args_t *);
+static int dta_memusage(shim_ctx_t *, shim_args_t *);
+static int dta_memtotal(shim_ctx_t *, shim_args_t *);
+static int dta_slotinfo(shim_ctx_t *, shim_args_t *);
+static int dta_slotcount(shim_ctx_t *, shim_args_t *);
+static int dta_slotreset(shim_ctx_t *, shim_args_t *);
+static int dta_snapshotread(shim_ctx_t *, shim_args_t *);
+static int dta_unsubscribe(shim_ctx_t *, shim_args_t *);
 
 /* Helper functions */
 static void dta_error_clear(dta_hdl_t *);
@@ -122,16 +493,99 @@ static shim_val_t *dta_error_obj(dta_hdl_t *, shim_ctx_t *);
 
 static int dta_dt_valid(const dtrace_recdesc_t *);
 static const char *dta_dt_action(dtrace_actkind_t);
-static shim_val_t *dta_dt_record(dta_hdl_t *, const dtrace_recdesc_t *,
-    caddr_t);
+static shim_val_t *dta_dt_record(dta_hdl_t *, const dta_field_t *, caddr_t,
+    int *);
+static dta_plan_t *dta_plan_epid(dta_hdl_t *, const dtrace_eprobedesc_t *);
+static dta_plan_t *dta_plan_agg(dta_hdl_t *, const dtrace_aggdesc_t *);
+static dta_plan_t *dta_plan_build(dta_hdl_t *, dta_plan_t ***, uint32_t *,
+    uint32_t, const dtrace_recdesc_t *, int);
+static dta_vkind_t dta_field_read(dta_hdl_t *, const dta_field_t *, caddr_t,
+    int64_t *, const char **, char *, size_t);
+static dta_vkind_t dta_dt_rawval(dta_hdl_t *, const dtrace_recdesc_t *,
+    caddr_t, int64_t *, const char **, char *, size_t);
 static int dta_aggwalk_argv_populate(dta_hdl_t *, shim_val_t **, int,
-    const dtrace_aggdata_t *, int *);
+    const dta_aggval_t *, int *);
+static int dta_aggwalk_common(shim_ctx_t *, shim_args_t *, int);
+static int dta_aggop_common(shim_ctx_t *, shim_args_t *, int);
+static int dta_agg_snapwalk(dta_hdl_t *,
+    int (*)(dtrace_hdl_t *, dtrace_aggregate_f *, void *),
+    dtrace_aggregate_f *, void *);
+static int dta_agg_remove(dta_hdl_t *);
+static int dta_aggfilter_parse(shim_ctx_t *, shim_args_t *, int *,
+    dta_aggfilter_t *);
+static int dta_aggfilter_match(dta_hdl_t *, const dta_aggfilter_t *,
+    const dtrace_aggdata_t *);
+static int dta_aggfilter_match_ent(const dta_aggfilter_t *,
+    const dta_aggent_t *);
+static int dta_aggfilter_varid(const dta_aggfilter_t *, int64_t);
+static void dta_aggfilter_fini(dta_aggfilter_t *);
+static int dta_aggstats_parse(shim_ctx_t *, shim_args_t *, int *,
+    dta_aggstats_t *);
+static int dta_aggstats_reserve(dta_aggstats_t *, int);
+static void dta_aggstats_compute(dta_aggstats_t *, const dta_aggval_t *,
+    double *, double *);
+static void dta_aggstats_fini(dta_aggstats_t *);
+static int dta_flag_parse(shim_ctx_t *, shim_args_t *, int *);
+static int dta_exact_begin(dta_hdl_t *, int);
+static void dta_exact_put(dta_hdl_t *, int64_t);
+static shim_val_t *dta_exact_take(dta_hdl_t *);
+static void dta_bucket_ranges(const dta_aggval_t *, int64_t *, int64_t *);
+static int dta_aggval(dta_hdl_t *, const dtrace_aggdata_t *, dta_aggval_t *);
+static const char *dta_aggkind_name(dta_aggkind_t);
+static int dta_aggkey_encode(dta_hdl_t *, const dtrace_aggdata_t *,
+    dta_buf_t *);
+static int dta_rollup_emit(dta_hdl_t *, const dta_aggent_t *);
+static dta_slots_t *dta_slots_init(dta_hdl_t *);
+static int64_t dta_slots_agg(dta_hdl_t *, const dtrace_aggdata_t *);
+static int64_t dta_slots_ent(dta_hdl_t *, const dta_aggent_t *);
+static int64_t dta_slots_get(dta_hdl_t *, int64_t, uint64_t, const uint8_t *,
+    size_t);
+static void dta_slots_free(dta_slots_t *);
+static void dta_rollup_fini(dta_rollup_t *);
+static dta_aggvar_t *dta_merge_var(dta_aggtab_t *, const dtrace_aggdesc_t *,
+    const dta_aggval_t *);
+static int dta_dt_mergeremove(const dtrace_aggdata_t *, void *);
+static void dta_merge_error(dta_hdl_t *, dta_hdl_t *, int);
+static int dta_capture_record(dta_hdl_t *, const dtrace_probedesc_t *,
+    dta_capev_t, int64_t, const char *);
+static void dta_capture_stats(dta_hdl_t *, shim_ctx_t *, shim_val_t *);
+static int dta_ring_record(dta_hdl_t *, const dtrace_probedesc_t *,
+    dta_capev_t, int64_t, const char *);
+static uint64_t dta_clock(clockid_t);
+static dta_intern_t *dta_intern_new(uint32_t);
+static shim_val_t *dta_intern_get(dta_hdl_t *, const char *, int *);
+static void dta_intern_release(dta_hdl_t *, shim_val_t **, const int *, int);
+static void dta_intern_fini(dta_intern_t *);
+static shim_val_t *dta_callback_arg(shim_args_t *, int);
+static uint64_t dta_sub_epid(dta_hdl_t *, dta_plan_t *,
+    const dtrace_probedesc_t *);
+static uint64_t dta_sub_agg(dta_hdl_t *, dta_plan_t *, int64_t);
+static void dta_sub_call(dta_hdl_t *, uint64_t, int, int, shim_val_t **);
+static void dta_sub_fini(dta_sub_t *);
+static void dta_hdl_free(dta_hdl_t *);
+static size_t dta_mem_compute(dta_hdl_t *);
+static size_t dta_plan_memsize(const dta_plan_t *);
+static void dta_plan_free(dta_plan_t *);
+static size_t dta_aggtab_memsize(const dta_aggtab_t *);
+static size_t dta_strtab_memsize(const dta_strtab_t *);
+
+static int dta_buf_escape(dta_buf_t *, const char *, int);
+static void dta_buf_free(char *, void *);
 
 /* libdtrace callbacks */
 static int dta_dt_bufhandler(const dtrace_bufdata_t *, void *);
 static int dta_dt_consumehandler(const dtrace_probedata_t *,
     const dtrace_recdesc_t *, void *);
+static int dta_dt_ringhandler(const dtrace_probedata_t *,
+    const dtrace_recdesc_t *, void *);
 static int dta_dt_aggwalk(const dtrace_aggdata_t *, void *);
+static int dta_dt_aggsnap(const dtrace_aggdata_t *, void *);
+static int dta_dt_aggremove(const dtrace_aggdata_t *, void *);
+static int dta_dt_aggop(const dtrace_aggdata_t *, void *);
+static int dta_dt_rollup(const dtrace_aggdata_t *, void *);
+static int dta_dt_merge(const dtrace_aggdata_t *, void *);
+static int dta_dt_expo(const dtrace_aggdata_t *, void *);
+static int dta_dt_wire(const dtrace_aggdata_t *, void *);
 
 /* Asynchronous work helper functions */
 static int dta_async_begin(shim_ctx_t *, dta_hdl_t *,
@@ -144,6 +598,7 @@ static void dta_async_open(dta_hdl_t *);
 static void dta_async_strcompile(dta_hdl_t *);
 static void dta_async_go(dta_hdl_t *);
 static void dta_async_stop(dta_hdl_t *);
+static void dta_async_snapshot(dta_hdl_t *);
 
 
 /*
@@ -155,6 +610,145 @@ static void dta_async_stop(dta_hdl_t *);
  */
 #define	UNPACK_SELF(arg) ((dta_hdl_t *)((arg) << 1))
 
+/*
+ * All open handles, for process-wide memory accounting.  Handles are only
+ * created and freed on the main thread.
+ */
+static dta_hdl_t *dta_hdls;
+
+
+/*
+ * Aggregation snapshot layout.  consumer.aggsnapshot() writes the entire
+ * contents of the aggregation buffer into a single, self-describing region of
+ * memory (typically a SharedArrayBuffer) so that other threads can read it in
+ * place.  All integers are in native byte order (readers use the magic number
+ * to tell which that is), and every section starts on an 8-byte boundary:
+ *
+ *     header		dta_snaphdr_t
+ *     variable table	dsh_nvars x dta_snapvar_t
+ *     string table	dsh_nstrings x (uint32_t offset, uint32_t length),
+ *     			with offsets relative to the string data
+ *     string data	NUL-terminated bytes for each string
+ *     key column	dsh_nrows x dsh_maxkeys x int64_t.  Key "i" of a row is
+ *     			a string index if bit "i" of the variable's
+ *     			dsv_strkeys is set and an integer otherwise.
+ *     row column	dsh_nrows x dta_snaprow_t
+ *     bucket column	dsh_nbuckets x int64_t
+ *
+ * lib/aggsnapshot.js reads this format, so the two must be changed together.
+ */
+#define	DTA_SNAP_MAGIC		0x53415444	/* "DTAS" */
+#define	DTA_SNAP_VERSION	1
+#define	DTA_SNAP_MAXKEYS	32
+
+typedef struct dta_snaphdr {
+	uint32_t	dsh_magic;
+	uint16_t	dsh_version;
+	uint16_t	dsh_hdrsize;		/* sizeof (dta_snaphdr_t) */
+	uint32_t	dsh_size;		/* total size, in bytes */
+	uint32_t	dsh_nvars;
+	uint32_t	dsh_nrows;
+	uint32_t	dsh_nstrings;
+	uint32_t	dsh_maxkeys;
+	uint32_t	dsh_nbuckets;
+	uint32_t	dsh_varoff;		/* section offsets */
+	uint32_t	dsh_stroff;
+	uint32_t	dsh_strdataoff;
+	uint32_t	dsh_keyoff;
+	uint32_t	dsh_rowoff;
+	uint32_t	dsh_bucketoff;
+	uint16_t	dsh_qnbuckets;		/* DTRACE_QUANTIZE_NBUCKETS */
+	uint16_t	dsh_qzerobucket;	/* DTRACE_QUANTIZE_ZEROBUCKET */
+	uint32_t	dsh_pad;
+} dta_snaphdr_t;
+
+typedef struct dta_snapvar {
+	int32_t		dsv_varid;
+	uint16_t	dsv_kind;		/* dta_aggkind_t */
+	uint16_t	dsv_nkeys;
+	uint32_t	dsv_strkeys;		/* bitmask of string keys */
+	uint32_t	dsv_nbuckets;		/* buckets per row */
+	uint64_t	dsv_param;		/* quantizing parameters */
+	uint32_t	dsv_name;		/* string index of name */
+	uint32_t	dsv_pad;
+} dta_snapvar_t;
+
+/*
+ * For count(), min(), max() and sum(), dsr_value is the value.  For avg(), it's
+ * the sum and dsr_value2 is the count.  For the quantizing actions, dsr_value
+ * is the total count and the buckets start at index dsr_bucket of the bucket
+ * column.
+ */
+typedef struct dta_snaprow {
+	uint32_t	dsr_var;		/* index into variable table */
+	uint32_t	dsr_bucket;
+	int64_t		dsr_value;
+	int64_t		dsr_value2;
+} dta_snaprow_t;
+
+/*
+ * State used while building a snapshot.  Keys are accumulated unpadded (that
+ * is, with only as many cells as each row's variable has keys) and laid out
+ * with a fixed stride once we know the maximum number of keys.
+ */
+typedef struct dta_snap {
+	dta_hdl_t	*dts_hdl;
+	dta_buf_t	dts_vars;
+	dta_strtab_t	dts_strings;
+	dta_buf_t	dts_keys;
+	dta_buf_t	dts_rows;
+	dta_buf_t	dts_buckets;
+	uint32_t	dts_maxkeys;
+	uint32_t	*dts_varmap;		/* varid -> var index + 1 */
+	uint32_t	dts_varmapsz;
+} dta_snap_t;
+
+static int dta_snap_var(dta_snap_t *, const dtrace_aggdata_t *,
+    const dta_aggval_t *, uint32_t);
+static int dta_snap_finish(dta_snap_t *, char **, size_t *);
+static void dta_snap_fini(dta_snap_t *);
+
+
+/*
+ * Metrics exposition.  consumer.exposition() renders the aggregation buffer as
+ * Prometheus (or OpenMetrics) text, using a caller-supplied description of the
+ * metric for each aggregation variable.  Records of other variables are
+ * skipped and left in place.
+ */
+#define	DTA_EXPO_F_CONSUME	0x1	/* remove the records rendered */
+#define	DTA_EXPO_F_OPENMETRICS	0x2	/* OpenMetrics rather than Prometheus */
+
+typedef struct dta_expmetric {
+	int64_t		dem_varid;
+	char		*dem_name;
+	char		*dem_help;	/* may be NULL */
+	char		*dem_type;	/* NULL to derive from the action */
+	int		dem_nlabels;
+	char		**dem_labels;	/* label names for the keys */
+} dta_expmetric_t;
+
+typedef struct dta_expo {
+	dta_hdl_t	*dte_hdl;
+	int		dte_flags;
+	int		dte_nmetrics;
+	dta_expmetric_t	*dte_metrics;
+	const dta_expmetric_t *dte_cur;	/* metric whose header was written */
+	dta_buf_t	dte_buf;	/* output */
+	dta_buf_t	dte_labels;	/* rendered labels of current record */
+	dta_aggstats_t	dte_stats;	/* scratch space for bucket ranges */
+} dta_expo_t;
+
+static int dta_expo_parse(shim_ctx_t *, shim_args_t *, dta_expo_t *);
+static int dta_expo_header(dta_expo_t *, const dta_expmetric_t *,
+    const char *);
+static int dta_expo_labels(dta_expo_t *, const dta_expmetric_t *,
+    const dtrace_aggdata_t *);
+static int dta_expo_sample(dta_expo_t *, const char *, const char *,
+    const char *, const char *, ...);
+static int dta_expo_histogram(dta_expo_t *, const char *,
+    const dta_aggval_t *);
+static void dta_expo_fini(dta_expo_t *);
+
 
 /*
  * Configuration variables: these are exported to JavaScript so it can interpret
@@ -162,7 +756,7 @@ static void dta_async_stop(dta_hdl_t *);
  */
 typedef struct {
 	const char 	*dtc_name;
-	uint64_t	dtc_value;
+	int64_t		dtc_value;
 } dta_conf_t;
 
 #define DEF_CONF(name) { # name , name }
@@ -186,12 +780,38 @@ initialize(shim_ctx_t *ctx, shim_val_t *exports, shim_val_t *module)
 		SHIM_FS_FULL("version", dta_version, 0, NULL, 0),
 
 		SHIM_FS_FULL("init", dta_init, 0, NULL, 0),
+		SHIM_FS_FULL("close", dta_close, 0, NULL, 0),
+		SHIM_FS_FULL("memusage", dta_memusage, 0, NULL, 0),
+		SHIM_FS_FULL("memtotal", dta_memtotal, 0, NULL, 0),
+		SHIM_FS_FULL("slotinfo", dta_slotinfo, 0, NULL, 0),
+		SHIM_FS_FULL("slotcount", dta_slotcount, 0, NULL, 0),
+		SHIM_FS_FULL("slotreset", dta_slotreset, 0, NULL, 0),
 		SHIM_FS_FULL("strcompile", dta_strcompile, 0, NULL, 0),
 		SHIM_FS_FULL("go", dta_go, 0, NULL, 0),
 		SHIM_FS_FULL("stop", dta_stop, 0, NULL, 0),
 		SHIM_FS_FULL("setopt", dta_setopt, 0, NULL, 0),
 		SHIM_FS_FULL("consume", dta_consume, 0, NULL, 0),
 		SHIM_FS_FULL("aggwalk", dta_aggwalk, 0, NULL, 0),
+		SHIM_FS_FULL("aggpeek", dta_aggpeek, 0, NULL, 0),
+		SHIM_FS_FULL("aggclear", dta_aggclear, 0, NULL, 0),
+		SHIM_FS_FULL("aggtrunc", dta_aggtrunc, 0, NULL, 0),
+		SHIM_FS_FULL("aggsnapshot", dta_aggsnapshot, 0, NULL, 0),
+		SHIM_FS_FULL("rollup", dta_rollup, 0, NULL, 0),
+		SHIM_FS_FULL("rolluptick", dta_rolluptick, 0, NULL, 0),
+		SHIM_FS_FULL("rollupquery", dta_rollupquery, 0, NULL, 0),
+		SHIM_FS_FULL("aggmerge", dta_aggmerge, 0, NULL, 0),
+		SHIM_FS_FULL("exposition", dta_exposition, 0, NULL, 0),
+		SHIM_FS_FULL("aggencode", dta_aggencode, 0, NULL, 0),
+		SHIM_FS_FULL("capture", dta_capture, 0, NULL, 0),
+		SHIM_FS_FULL("captureflush", dta_captureflush, 0, NULL, 0),
+		SHIM_FS_FULL("capturestats", dta_capturestats, 0, NULL, 0),
+		SHIM_FS_FULL("capturestop", dta_capturestop, 0, NULL, 0),
+		SHIM_FS_FULL("internconf", dta_internconf, 0, NULL, 0),
+		SHIM_FS_FULL("internstats", dta_internstats, 0, NULL, 0),
+		SHIM_FS_FULL("snapshot", dta_snapshot, 0, NULL, 0),
+		SHIM_FS_FULL("snapshotread", dta_snapshotread, 0, NULL, 0),
+		SHIM_FS_FULL("subscribe", dta_subscribe, 0, NULL, 0),
+		SHIM_FS_FULL("unsubscribe", dta_unsubscribe, 0, NULL, 0),
 		SHIM_FS_END,
 	};
 	
@@ -219,7 +839,8 @@ dta_conf(shim_ctx_t *ctx, shim_args_t *args)
 	nvars = sizeof (dta_conf_vars) / sizeof (dta_conf_vars[0]);
 	for (i = 0; i < nvars; i++) {
 		argv[0] = shim_string_new_copy(ctx, dta_conf_vars[i].dtc_name);
-		argv[1] = shim_number_new(ctx, dta_conf_vars[i].dtc_value);
+		argv[1] = shim_number_new(ctx,
+		    (double)dta_conf_vars[i].dtc_value);
 		(void) shim_func_call_val(ctx, NULL, callback, 2, argv, NULL);
 		shim_value_release(argv[0]);
 		shim_value_release(argv[1]);
@@ -252,13 +873,26 @@ dta_init(shim_ctx_t *ctx, shim_args_t *args)
 
 	bzero(dtap, sizeof (*dtap));
 
+	/*
+	 * Interning is only an optimization, so if the table can't be
+	 * allocated, we just do without.
+	 */
+	dtap->dta_intern = dta_intern_new(DTA_INTERN_DEFCAPACITY);
+
 	/* By design, argument checking happens in the caller. */
 	callback = shim_args_get(args, 0);
 
-	// XXX consider making weak?
+	/*
+	 * The persistent reference is released when the handle is closed.
+	 * Closing is explicit: the JavaScript consumer closes the handle when
+	 * asked to, or when it's garbage collected (see lib/dtrace-async.js).
+	 */
 	external_wrapper = shim_external_new(ctx, dtap);
 	persistent_wrapper = shim_persistent_new(ctx, external_wrapper);
 	shim_value_release(external_wrapper);
+	dtap->dta_self = persistent_wrapper;
+	dtap->dta_next = dta_hdls;
+	dta_hdls = dtap;
 
 	shim_args_set_rval(ctx, args, persistent_wrapper);
 	return (dta_async_begin(ctx, dtap, dta_async_open, callback));
@@ -396,6 +1030,7 @@ dta_async_go(dta_hdl_t *dtap)
 		    "couldn't enable tracing: %s\n",
 		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
 	} else {
+		dtap->dta_flags |= DTA_F_TRACING;
 		dtap->dta_rval = 0;
 	}
 }
@@ -441,10 +1076,322 @@ dta_async_stop(dta_hdl_t *dtap)
 		    "couldn't disable tracing: %s\n",
 		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
 	} else {
+		dtap->dta_flags &= ~DTA_F_TRACING;
 		dtap->dta_rval = 0;
 	}
 }
 
+/*
+ * Entry point for consumer.close(): release the libdtrace handle (which
+ * disables tracing and frees the kernel's buffers) and everything else the
+ * handle owns, including the handle itself.  The JavaScript wrapper must not
+ * be passed to the binding again.
+ */
+static int
+dta_close(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	dta_hdl_free(dtap);
+	return (TRUE);
+}
+
+static void
+dta_hdl_free(dta_hdl_t *dtap)
+{
+	dta_hdl_t **hdlp;
+	dta_wstate_t *dtw;
+	dta_ring_t *drg;
+	uint32_t i;
+
+	for (hdlp = &dta_hdls; *hdlp != dtap; hdlp = &(*hdlp)->dta_next)
+		assert(*hdlp != NULL);
+	*hdlp = dtap->dta_next;
+
+	if (dtap->dta_dtrace != NULL)
+		dtrace_close(dtap->dta_dtrace);
+
+	dta_rollup_fini(dtap->dta_rollup);
+
+	if ((dtw = dtap->dta_wire) != NULL) {
+		dta_aggtab_fini(&dtw->dtw_prev);
+		dta_aggtab_fini(&dtw->dtw_cur);
+		dta_buf_fini(&dtw->dtw_key);
+		free(dtw);
+	}
+
+	/* Write out whatever was captured, as captureStop() would. */
+	if (dtap->dta_capture != NULL) {
+		(void) dta_caplog_close(&dtap->dta_capture->dcp_log);
+		free(dtap->dta_capture);
+	}
+
+	if (dtap->dta_intern != NULL)
+		dta_intern_fini(dtap->dta_intern);
+
+	for (i = 0; i < dtap->dta_neplans; i++)
+		dta_plan_free(dtap->dta_eplans[i]);
+	for (i = 0; i < dtap->dta_naplans; i++)
+		dta_plan_free(dtap->dta_aplans[i]);
+	free(dtap->dta_eplans);
+	free(dtap->dta_aplans);
+
+	if (dtap->dta_subs != NULL) {
+		for (i = 0; i < DTA_SUB_MAX; i++) {
+			if (dtap->dta_subs->dst_subs[i].dsb_active)
+				dta_sub_fini(&dtap->dta_subs->dst_subs[i]);
+		}
+
+		free(dtap->dta_subs);
+	}
+
+	if ((drg = dtap->dta_ring) != NULL) {
+		dta_buf_fini(&drg->drg_recs);
+		dta_buf_fini(&drg->drg_strings);
+		free(drg);
+	}
+
+	dta_slots_free(dtap->dta_slots);
+	free(dtap->dta_snapbuf);
+	shim_persistent_dispose(dtap->dta_self);
+	free(dtap);
+}
+
+/*
+ * Entry point for consumer.memoryUsage(): invoke the callback with the name
+ * and size (in bytes) of each category of native memory the handle uses.
+ */
+static int
+dta_memusage(shim_ctx_t *ctx, shim_args_t *args)
+{
+	static const char *names[DTA_MEM_NCATS] = {
+		"handle", "buffers", "plans", "intern", "subscribers",
+		"rollup", "wire", "capture", "snapshots", "slots"
+	};
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	shim_val_t *argv[2];
+	int i;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+	(void) dta_mem_compute(dtap);
+
+	for (i = 0; i < DTA_MEM_NCATS; i++) {
+		argv[0] = shim_string_new_copy(ctx, names[i]);
+		argv[1] = shim_number_new(ctx, (double)dtap->dta_mem[i]);
+		(void) shim_func_call_val(ctx, NULL, callback, 2, argv, NULL);
+		shim_value_release(argv[0]);
+		shim_value_release(argv[1]);
+	}
+
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Entry point for the module's memoryUsage(): invoke the callback with the
+ * number of open handles and the native memory they use in total.
+ */
+static int
+dta_memtotal(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dta_hdl_t *dtap;
+	shim_val_t *argv[2];
+	uint32_t nhdls = 0;
+	size_t total = 0;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	for (dtap = dta_hdls; dtap != NULL; dtap = dtap->dta_next) {
+		total += dta_mem_compute(dtap);
+		nhdls++;
+	}
+
+	argv[0] = shim_number_new(ctx, nhdls);
+	argv[1] = shim_number_new(ctx, (double)total);
+	(void) shim_func_call_val(ctx, NULL, callback, 2, argv, NULL);
+	shim_value_release(argv[0]);
+	shim_value_release(argv[1]);
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Update the handle's memory accounting ("dta_mem") and return the total.
+ * This covers what the handle has allocated itself, plus an estimate of the
+ * buffers libdtrace allocates in this process while tracing (one principal
+ * buffer and one aggregation buffer).  While an asynchronous operation is
+ * pending, the handle may be changing under us, so we report the footprint as
+ * of the last update instead.
+ */
+static size_t
+dta_mem_compute(dta_hdl_t *dtap)
+{
+	size_t *mem = dtap->dta_mem;
+	dtrace_optval_t bufsize, aggsize;
+	const dta_intern_t *din;
+	const dta_caplog_t *log;
+	const dta_sub_t *dsb;
+	const dta_slots_t *dsl;
+	size_t total;
+	uint32_t i;
+	int j;
+
+	if ((dtap->dta_flags & DTA_F_BUSY) == 0) {
+		bzero(mem, sizeof (dtap->dta_mem));
+		mem[DTA_MEM_HANDLE] = sizeof (*dtap);
+
+		if ((dtap->dta_flags & DTA_F_TRACING) != 0) {
+			if (dtrace_getopt(dtap->dta_dtrace, "bufsize",
+			    &bufsize) == 0 && bufsize > 0)
+				mem[DTA_MEM_BUFFERS] += bufsize;
+			if (dtrace_getopt(dtap->dta_dtrace, "aggsize",
+			    &aggsize) == 0 && aggsize > 0)
+				mem[DTA_MEM_BUFFERS] += aggsize;
+		}
+
+		mem[DTA_MEM_PLANS] = (dtap->dta_neplans + dtap->dta_naplans) *
+		    sizeof (dta_plan_t *);
+		for (i = 0; i < dtap->dta_neplans; i++)
+			mem[DTA_MEM_PLANS] += dta_plan_memsize(
+			    dtap->dta_eplans[i]);
+		for (i = 0; i < dtap->dta_naplans; i++)
+			mem[DTA_MEM_PLANS] += dta_plan_memsize(
+			    dtap->dta_aplans[i]);
+
+		if ((din = dtap->dta_intern) != NULL) {
+			mem[DTA_MEM_INTERN] = sizeof (*din) +
+			    din->din_capacity * (sizeof (din->din_ents[0]) +
+			    sizeof (din->din_buckets[0]));
+			for (i = 0; i < din->din_count; i++)
+				mem[DTA_MEM_INTERN] +=
+				    din->din_ents[i].die_len + 1;
+		}
+
+		if (dtap->dta_subs != NULL) {
+			mem[DTA_MEM_SUBSCRIBERS] = sizeof (*dtap->dta_subs);
+			for (i = 0; i < DTA_SUB_MAX; i++) {
+				dsb = &dtap->dta_subs->dst_subs[i];
+				if (!dsb->dsb_active)
+					continue;
+
+				mem[DTA_MEM_SUBSCRIBERS] += dsb->dsb_nvarids *
+				    sizeof (dsb->dsb_varids[0]);
+				for (j = 0; j < 4; j++) {
+					if (dsb->dsb_probe[j] != NULL)
+						mem[DTA_MEM_SUBSCRIBERS] +=
+						    strlen(dsb->dsb_probe[j]) +
+						    1;
+				}
+			}
+		}
+
+		if (dtap->dta_rollup != NULL) {
+			mem[DTA_MEM_ROLLUP] = sizeof (*dtap->dta_rollup) +
+			    dta_aggtab_memsize(&dtap->dta_rollup->dru_merged) +
+			    dta_aggtab_memsize(&dtap->dta_rollup->dru_next) +
+			    dtap->dta_rollup->dru_key.db_size;
+			for (j = 0; j < dtap->dta_rollup->dru_nwindows; j++)
+				mem[DTA_MEM_ROLLUP] += sizeof (dta_aggtab_t) +
+				    dta_aggtab_memsize(
+				    &dtap->dta_rollup->dru_windows[j]);
+		}
+
+		if (dtap->dta_wire != NULL)
+			mem[DTA_MEM_WIRE] = sizeof (*dtap->dta_wire) +
+			    dta_aggtab_memsize(&dtap->dta_wire->dtw_prev) +
+			    dta_aggtab_memsize(&dtap->dta_wire->dtw_cur) +
+			    dtap->dta_wire->dtw_key.db_size;
+
+		if (dtap->dta_capture != NULL) {
+			log = &dtap->dta_capture->dcp_log;
+			mem[DTA_MEM_CAPTURE] = sizeof (*dtap->dta_capture) +
+			    log->dcl_events.db_size + log->dcl_scratch.db_size +
+			    dta_strtab_memsize(&log->dcl_probes) +
+			    dta_strtab_memsize(&log->dcl_strings);
+		}
+
+		mem[DTA_MEM_SNAPSHOTS] = dtap->dta_snapbuf == NULL ? 0 :
+		    dtap->dta_snaplen;
+		if (dtap->dta_ring != NULL)
+			mem[DTA_MEM_SNAPSHOTS] += sizeof (*dtap->dta_ring) +
+			    dtap->dta_ring->drg_recs.db_size +
+			    dtap->dta_ring->drg_strings.db_size;
+
+		if ((dsl = dtap->dta_slots) != NULL)
+			mem[DTA_MEM_SLOTS] = sizeof (*dsl) +
+			    dsl->dsl_idx.dki_slots.db_size +
+			    dsl->dsl_idx.dki_keys.db_size +
+			    dsl->dsl_idx.dki_hashsz *
+			    sizeof (dsl->dsl_idx.dki_hash[0]) +
+			    dsl->dsl_key.db_size;
+	}
+
+	for (i = 0, total = 0; i < DTA_MEM_NCATS; i++)
+		total += mem[i];
+
+	return (total);
+}
+
+static size_t
+dta_plan_memsize(const dta_plan_t *plan)
+{
+	if (plan == NULL)
+		return (0);
+
+	return (sizeof (*plan) + plan->dpl_nfields * sizeof (dta_field_t));
+}
+
+static void
+dta_plan_free(dta_plan_t *plan)
+{
+	if (plan == NULL)
+		return;
+
+	free(plan->dpl_fields);
+	free(plan);
+}
+
+static size_t
+dta_aggtab_memsize(const dta_aggtab_t *tab)
+{
+	return (tab->dat_memsize + tab->dat_hashsz * sizeof (tab->dat_hash[0]));
+}
+
+static size_t
+dta_strtab_memsize(const dta_strtab_t *tab)
+{
+	return (tab->dst_index.db_size + tab->dst_data.db_size +
+	    tab->dst_hashsz * sizeof (tab->dst_hash[0]));
+}
+
 static int
 dta_setopt(shim_ctx_t *ctx, shim_args_t *args)
 {
@@ -490,11 +1437,14 @@ dta_consume(shim_ctx_t *ctx, shim_args_t *args)
 	dta_hdl_t *dtap;
 	dtrace_workstatus_t status;
 	dtrace_hdl_t *dtp;
-	shim_val_t *callback = shim_value_alloc();
+	dta_capture_t *dcp;
+	dtrace_optval_t policy;
+	uint64_t start = 0;
+	int argi;
+	shim_val_t *callback;
 
 	if (!shim_unpack(ctx, args,
 	    SHIM_TYPE_UINT32, &selfptr,
-	    SHIM_TYPE_FUNCTION, &callback,
 	    SHIM_TYPE_UNKNOWN)) {
 		return (FALSE);
 	}
@@ -507,20 +1457,71 @@ dta_consume(shim_ctx_t *ctx, shim_args_t *args)
 		return (TRUE);
 	}
 
+	/*
+	 * Ring buffers are meant to be drained once, on demand, so consuming
+	 * them periodically would defeat the purpose (see dta_ring_t).
+	 */
+	if (dtrace_getopt(dtp, "bufpolicy", &policy) == 0 &&
+	    policy == DTRACEOPT_BUFPOLICY_RING) {
+		shim_throw_error(ctx, "consume() is not supported with "
+		    "bufpolicy=ring (use snapshot())");
+		return (TRUE);
+	}
+
+	/* Without a callback, records go to subscribers (see dta_subtab_t). */
+	callback = dta_callback_arg(args, 1);
+
+	argi = 2;
 	dtap->dta_flags |= DTA_F_CONSUMING;
+	if (dta_flag_parse(ctx, args, &argi))
+		dtap->dta_flags |= DTA_F_EXACT;
 	dtap->dta_consume_callback = callback;
 	dtap->dta_consume_ctx = ctx;
 	dta_error_clear(dtap);
 	dtap->dta_rval = 0;
+
+	if ((dcp = dtap->dta_capture) != NULL) {
+		start = dta_clock(CLOCK_MONOTONIC);
+		if (dta_caplog_time(&dcp->dcp_log,
+		    dta_clock(CLOCK_REALTIME)) != 0) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg), "capture: %s\n",
+			    strerror(errno));
+			dtap->dta_rval = -1;
+		}
+	}
+
 	status = dtrace_work(dtp, NULL, NULL, dta_dt_consumehandler, dtap);
 	dtap->dta_consume_callback = NULL;
 	dtap->dta_consume_ctx = NULL;
-	dtap->dta_flags &= ~DTA_F_CONSUMING;
+	dtap->dta_flags &= ~(DTA_F_CONSUMING | DTA_F_EXACT);
 
-	if (status != 0)
-		dtap->dta_rval = 0;
+	/*
+	 * If we aborted the consume ourselves (e.g., because a record couldn't
+	 * be captured), we've already recorded why.
+	 */
+	if (status == DTRACE_WORKSTATUS_ERROR && dtap->dta_rval == 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "dtrace_work: %s\n", dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		dtap->dta_rval = -1;
+	}
 
-	shim_value_release(callback);
+	if (dcp != NULL) {
+		if (dcp->dcp_maxage != 0 && dcp->dcp_log.dcl_nrecords != 0 &&
+		    dta_clock(CLOCK_REALTIME) - dcp->dcp_log.dcl_start >=
+		    dcp->dcp_maxage && dta_caplog_flush(&dcp->dcp_log) != 0 &&
+		    dtap->dta_rval == 0) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg), "capture: %s\n",
+			    strerror(errno));
+			dtap->dta_rval = -1;
+		}
+
+		dcp->dcp_nsecs += dta_clock(CLOCK_MONOTONIC) - start;
+	}
+
+	if (callback != NULL)
+		shim_value_release(callback);
 	dta_error_throw(dtap, ctx);
 	return (TRUE);
 }
@@ -534,22 +1535,55 @@ dta_dt_bufhandler(const dtrace_bufdata_t *bufdata, void *arg)
 	dtrace_probedesc_t *pd = data->dtpda_pdesc;
 	shim_ctx_t *ctx = dtap->dta_consume_ctx;
 	shim_val_t *argv[5];
-	int i, argc;
+	int lent[5];
+	int argc;
+	dta_plan_t *plan;
+	uint64_t subs = 0;
 
 	if (rec == NULL || rec->dtrd_action != DTRACEACT_PRINTF)
 		return (DTRACE_HANDLE_OK);
 
-	argv[0] = shim_string_new_copy(ctx, pd->dtpd_provider);
-	argv[1] = shim_string_new_copy(ctx, pd->dtpd_mod);
-	argv[2] = shim_string_new_copy(ctx, pd->dtpd_func);
-	argv[3] = shim_string_new_copy(ctx, pd->dtpd_name);
+	/*
+	 * The only time libdtrace calls us while the handle is busy is when a
+	 * snapshot is being taken on a worker thread (see dta_ring_t).
+	 */
+	if ((dtap->dta_flags & DTA_F_BUSY) != 0)
+		return (dta_ring_record(dtap, pd, DTA_CAPEV_STRING, 0,
+		    bufdata->dtbda_buffered) == 0 ? DTRACE_HANDLE_OK :
+		    DTRACE_HANDLE_ABORT);
+
+	if (dtap->dta_capture != NULL) {
+		if (dta_capture_record(dtap, pd, DTA_CAPEV_STRING, 0,
+		    bufdata->dtbda_buffered) != 0)
+			return (DTRACE_HANDLE_ABORT);
+
+		if ((dtap->dta_capture->dcp_flags &
+		    DTA_CAP_F_PASSTHROUGH) == 0)
+			return (DTRACE_HANDLE_OK);
+	}
+
+	if (dtap->dta_consume_callback == NULL) {
+		if ((plan = dta_plan_epid(dtap, data->dtpda_edesc)) == NULL)
+			return (DTRACE_HANDLE_ABORT);
+
+		if ((subs = dta_sub_epid(dtap, plan, pd)) == 0)
+			return (DTRACE_HANDLE_OK);
+	}
+
+	argv[0] = dta_intern_get(dtap, pd->dtpd_provider, &lent[0]);
+	argv[1] = dta_intern_get(dtap, pd->dtpd_mod, &lent[1]);
+	argv[2] = dta_intern_get(dtap, pd->dtpd_func, &lent[2]);
+	argv[3] = dta_intern_get(dtap, pd->dtpd_name, &lent[3]);
 	argv[4] = shim_string_new_copy(ctx, bufdata->dtbda_buffered);
+	lent[4] = 0;
 	argc = 5;
 
-	(void) shim_func_call_val(ctx, NULL,
-	    dtap->dta_consume_callback, argc, argv, NULL);
-	for (i = 0; i < argc; i++)
-		shim_value_release(argv[i]);
+	if (dtap->dta_consume_callback != NULL)
+		(void) shim_func_call_val(ctx, NULL,
+		    dtap->dta_consume_callback, argc, argv, NULL);
+	else
+		dta_sub_call(dtap, subs, B_FALSE, argc, argv);
+	dta_intern_release(dtap, argv, lent, argc);
 	return (DTRACE_HANDLE_OK);
 }
 
@@ -560,26 +1594,35 @@ dta_dt_consumehandler(const dtrace_probedata_t *data,
 	dta_hdl_t *dtap = arg;
 	dtrace_probedesc_t *pd = data->dtpda_pdesc;
 	shim_val_t *callback = dtap->dta_consume_callback;
-	shim_val_t *argv[5];
+	shim_val_t *argv[6];
+	int lent[6];
 	shim_ctx_t *ctx = dtap->dta_consume_ctx;
+	const dtrace_eprobedesc_t *edesc = data->dtpda_edesc;
+	const dta_field_t *fld = NULL;
+	dta_plan_t *plan;
+	uint64_t subs = 0;
+	char buf[2048];
+	const char *str;
+	int64_t val;
 	int i, argc;
 
-	argv[0] = shim_string_new_copy(ctx, pd->dtpd_provider);
-	argv[1] = shim_string_new_copy(ctx, pd->dtpd_mod);
-	argv[2] = shim_string_new_copy(ctx, pd->dtpd_func);
-	argv[3] = shim_string_new_copy(ctx, pd->dtpd_name);
-	argc = 4;
+	if ((plan = dta_plan_epid(dtap, edesc)) == NULL)
+		return (DTRACE_CONSUME_ABORT);
 
-	if (rec == NULL)
-		goto out;
+	if (rec != NULL) {
+		assert(rec >= edesc->dtepd_rec &&
+		    rec < edesc->dtepd_rec + edesc->dtepd_nrecs);
+		fld = &plan->dpl_fields[rec - edesc->dtepd_rec];
+	}
 
-	if (!dta_dt_valid(rec)) {
+	if (fld != NULL && fld->dfl_kind == DTA_FLD_PRINTF) {
 		/*
-		 * If this is a printf(), we'll defer to the bufhandler.
+		 * We'll defer printf() to the bufhandler.
 		 */
-		if (rec->dtrd_action == DTRACEACT_PRINTF)
-			return (DTRACE_CONSUME_THIS);
+		return (DTRACE_CONSUME_THIS);
+	}
 
+	if (fld != NULL && fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
 		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
 		    "unsupported action %s in record for %s:%s:%s:%s\n",
 		    dta_dt_action(rec->dtrd_action), pd->dtpd_provider,
@@ -588,71 +1631,146 @@ dta_dt_consumehandler(const dtrace_probedata_t *data,
 		return (DTRACE_CONSUME_ABORT);
 	}
 
-	argv[argc++] = dta_dt_record(dtap, rec, data->dtpda_data);
+	if (dtap->dta_capture != NULL) {
+		if (fld == NULL) {
+			i = dta_capture_record(dtap, pd, DTA_CAPEV_PROBE, 0,
+			    NULL);
+		} else if (dta_field_read(dtap, fld, data->dtpda_data, &val,
+		    &str, buf, sizeof (buf)) == DTA_V_STRING) {
+			i = dta_capture_record(dtap, pd, DTA_CAPEV_STRING, 0,
+			    str);
+		} else {
+			i = dta_capture_record(dtap, pd, DTA_CAPEV_INT, val,
+			    NULL);
+		}
 
-out:
-	(void) shim_func_call_val(ctx, NULL, callback, argc, argv, NULL);
-	for (i = 0; i < argc; i++)
-		shim_value_release(argv[i]);
+		if (i != 0)
+			return (DTRACE_CONSUME_ABORT);
+
+		if ((dtap->dta_capture->dcp_flags &
+		    DTA_CAP_F_PASSTHROUGH) == 0)
+			return (DTRACE_CONSUME_THIS);
+	}
+
+	if (callback == NULL && (subs = dta_sub_epid(dtap, plan, pd)) == 0)
+		return (DTRACE_CONSUME_THIS);
+
+	argv[0] = dta_intern_get(dtap, pd->dtpd_provider, &lent[0]);
+	argv[1] = dta_intern_get(dtap, pd->dtpd_mod, &lent[1]);
+	argv[2] = dta_intern_get(dtap, pd->dtpd_func, &lent[2]);
+	argv[3] = dta_intern_get(dtap, pd->dtpd_name, &lent[3]);
+	argc = 4;
+
+	if (fld != NULL && (dtap->dta_flags & DTA_F_EXACT) != 0 &&
+	    dta_field_read(dtap, fld, data->dtpda_data, &val, &str,
+	    buf, sizeof (buf)) == DTA_V_INT) {
+		/*
+		 * Pass exact integers as their high and low 32 bits.
+		 */
+		argv[argc] = shim_number_new(ctx, (int32_t)(val >> 32));
+		lent[argc++] = 0;
+		argv[argc] = shim_number_new(ctx, (uint32_t)val);
+		lent[argc++] = 0;
+	} else if (fld != NULL) {
+		argv[argc] = dta_dt_record(dtap, fld, data->dtpda_data,
+		    &lent[argc]);
+		argc++;
+	}
+
+	if (callback != NULL)
+		(void) shim_func_call_val(ctx, NULL, callback, argc, argv,
+		    NULL);
+	else
+		dta_sub_call(dtap, subs, B_FALSE, argc, argv);
+	dta_intern_release(dtap, argv, lent, argc);
 	return (DTRACE_CONSUME_THIS);
 }
 
 static int
 dta_aggwalk(shim_ctx_t *ctx, shim_args_t *args)
+{
+	return (dta_aggwalk_common(ctx, args, B_FALSE));
+}
+
+static int
+dta_aggpeek(shim_ctx_t *ctx, shim_args_t *args)
+{
+	return (dta_aggwalk_common(ctx, args, B_TRUE));
+}
+
+/*
+ * Common implementation of aggwalk() and aggpeek(), which differ only in
+ * whether the records visited are removed from the aggregation buffer.
+ */
+static int
+dta_aggwalk_common(shim_ctx_t *ctx, shim_args_t *args, int peek)
 {
 	uintptr_t selfptr;
 	dta_hdl_t *dtap;
-	dtrace_hdl_t *dtp;
-	int rval;
-	shim_val_t *callback = shim_value_alloc();
+	dta_aggfilter_t filter;
+	dta_aggstats_t stats;
+	dta_buf_t exact;
+	int argi;
+	shim_val_t *callback;
 
 	if (!shim_unpack(ctx, args,
 	    SHIM_TYPE_UINT32, &selfptr,
-	    SHIM_TYPE_FUNCTION, &callback,
 	    SHIM_TYPE_UNKNOWN)) {
 		return (FALSE);
 	}
 
+	bzero(&exact, sizeof (exact));
+
 	/* XXX commonize this with dta_consume? */
 	dtap = UNPACK_SELF(selfptr);
-	dtp = dtap->dta_dtrace;
 
 	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
 		shim_throw_error(ctx, "consumer is busy");
 		return (TRUE);
 	}
 
-	dtap->dta_flags |= DTA_F_CONSUMING;
-	dtap->dta_consume_callback = callback;
-	dtap->dta_consume_ctx = ctx;
-	dta_error_clear(dtap);
+	/* Without a callback, records go to subscribers (see dta_subtab_t). */
+	callback = dta_callback_arg(args, 1);
 
-	if (dtrace_status(dtp) == -1) {
-		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
-		    "couldn't get status: %s\n",
-		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
-		goto out;
+	argi = 2;
+	if (dta_aggfilter_parse(ctx, args, &argi, &filter) != 0) {
+		if (callback != NULL)
+			shim_value_release(callback);
+		shim_throw_error(ctx, "aggwalk: %s", strerror(errno));
+		return (TRUE);
 	}
 
-	if (dtrace_aggregate_snap(dtp) == -1) {
-		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
-		    "couldn't snap aggregate: %s\n",
-		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
-		goto out;
+	if (dta_aggstats_parse(ctx, args, &argi, &stats) != 0) {
+		dta_aggfilter_fini(&filter);
+		if (callback != NULL)
+			shim_value_release(callback);
+		shim_throw_error(ctx, "aggwalk: %s", strerror(errno));
+		return (TRUE);
 	}
 
-	dtap->dta_rval = 0;
-	rval = dtrace_aggregate_walk(dtp, dta_dt_aggwalk, dtap);
-	if (dtap->dta_rval == 0 && rval == -1)
-		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
-		    "couldn't walk aggregate: %s\n",
-		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
-
-out:
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	if (peek)
+		dtap->dta_flags |= DTA_F_PEEKING;
+	dtap->dta_consume_callback = callback;
+	dtap->dta_consume_ctx = ctx;
+	dtap->dta_aggfilter = &filter;
+	dtap->dta_aggstats = stats.das_enabled ? &stats : NULL;
+	dtap->dta_exact = dta_flag_parse(ctx, args, &argi) ? &exact : NULL;
+	if (dta_flag_parse(ctx, args, &argi))
+		dtap->dta_flags |= DTA_F_SLOTS;
+	(void) dta_agg_snapwalk(dtap, dtrace_aggregate_walk,
+	    dta_dt_aggwalk, dtap);
+	dtap->dta_aggfilter = NULL;
+	dtap->dta_aggstats = NULL;
+	dtap->dta_exact = NULL;
+	dta_buf_fini(&exact);
 	dtap->dta_consume_callback = NULL;
 	dtap->dta_consume_ctx = NULL;
-	dtap->dta_flags &= ~DTA_F_CONSUMING;
-	shim_value_release(callback);
+	dtap->dta_flags &= ~(DTA_F_CONSUMING | DTA_F_PEEKING | DTA_F_SLOTS);
+	dta_aggfilter_fini(&filter);
+	dta_aggstats_fini(&stats);
+	if (callback != NULL)
+		shim_value_release(callback);
 	dta_error_throw(dtap, ctx);
 	return (TRUE);
 }
@@ -664,8 +1782,13 @@ dta_dt_aggwalk(const dtrace_aggdata_t *agg, void *arg)
 	shim_ctx_t *ctx = dtap->dta_consume_ctx;
 	shim_val_t *callback = dtap->dta_consume_callback;
 	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
-	const dtrace_recdesc_t *aggrec;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	dta_aggval_t val;
 	shim_val_t **argv;
+	uint64_t subs = 0;
+	int64_t slot = -1;
+	int *lent;
 	int argc, nvalargs, i;
 
 	/*
@@ -674,6 +1797,23 @@ dta_dt_aggwalk(const dtrace_aggdata_t *agg, void *arg)
 	 */
 	assert(aggdesc->dtagd_nrecs >= 2);
 
+	if (dtap->dta_aggfilter != NULL &&
+	    !dta_aggfilter_match(dtap, dtap->dta_aggfilter, agg))
+		return (DTRACE_AGGWALK_NEXT);
+
+	/*
+	 * When walking on behalf of subscribers, records that none of them
+	 * want are consumed without being decoded.
+	 */
+	if (callback == NULL) {
+		if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL)
+			return (DTRACE_AGGWALK_ERROR);
+
+		if ((subs = dta_sub_agg(dtap, plan,
+		    aggdesc->dtagd_varid)) == 0)
+			goto out;
+	}
+
 	/*
 	 * The callback will be invoked as
 	 *
@@ -697,159 +1837,3824 @@ dta_dt_aggwalk(const dtrace_aggdata_t *agg, void *arg)
 	 *   				pairs of values denoting the bucket
 	 *   				index and the value in that bucket.
 	 *
+	 * If statistics were requested (see dta_aggstats_t), the values for
+	 * all three quantizing actions are instead the count, the mean, and
+	 * then each of the requested percentiles, in order.  If key slots
+	 * were requested (see dta_slots_t), "nkeys" and the keys are replaced
+	 * by the keys' slot.
+	 *
 	 * Recall that there's one record for the variable ID, one for the
 	 * value, and one for each aggregation key.  Our initial argc ignores
 	 * the value, since that will translate into a variable number of
 	 * callback arguments, but adds one each for "action" and "nkeys".
 	 */
 	argc = aggdesc->dtagd_nrecs + 1;
-	if (dta_aggwalk_argv_populate(dtap, NULL, 0, agg, &nvalargs) != 0)
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL ||
+	    dta_aggval(dtap, agg, &val) != 0 ||
+	    dta_aggwalk_argv_populate(dtap, NULL, 0, &val, &nvalargs) != 0 ||
+	    dta_exact_begin(dtap, aggdesc->dtagd_nrecs - 2 + 1 +
+	    val.dtv_nvals) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if ((dtap->dta_flags & DTA_F_SLOTS) != 0) {
+		if ((slot = dta_slots_agg(dtap, agg)) == -1)
+			return (DTRACE_AGGWALK_ERROR);
+		argc = 3;
+	}
+
+	argc += nvalargs;
+	argv = calloc(argc, sizeof (argv[0]));
+	lent = calloc(argc, sizeof (lent[0]));
+	if (argv == NULL || lent == NULL) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+		free(argv);
+		free(lent);
 		return (DTRACE_AGGWALK_ERROR);
+	}
+
+	argv[0] = shim_integer_new(ctx, aggdesc->dtagd_varid);
+
+	argv[1] = dta_intern_get(dtap, plan->dpl_action, &lent[1]);
+	argv[2] = shim_integer_uint(ctx,
+	    slot == -1 ? plan->dpl_nfields : (uint32_t)slot);
+
+	for (i = 2; slot == -1 && i < aggdesc->dtagd_nrecs; i++) {
+		fld = &plan->dpl_fields[i - 2];
+		if (fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "unsupported action %s as key #%d in aggregation "
+			    "\"%s\"\n",
+			    dta_dt_action(fld->dfl_rec->dtrd_action), i - 1,
+			    aggdesc->dtagd_name);
+			dtap->dta_rval = -1;
+			dta_intern_release(dtap, argv, lent, i + 1);
+			free(argv);
+			free(lent);
+			return (DTRACE_AGGWALK_ERROR);
+		}
+
+		assert(i < argc - 1);
+		argv[i + 1] = dta_dt_record(dtap, fld,
+		    agg->dtada_data + fld->dfl_offset, &lent[i + 1]);
+	}
+
+	(void) dta_aggwalk_argv_populate(dtap, &argv[i + 1], nvalargs, &val,
+	    NULL);
+
+	if (callback != NULL)
+		(void) shim_func_call_val(ctx, NULL, callback, argc, argv,
+		    NULL);
+	else
+		dta_sub_call(dtap, subs, B_TRUE, argc, argv);
+	dta_intern_release(dtap, argv, lent, argc);
+	free(argv);
+	free(lent);
+
+out:
+	if ((dtap->dta_flags & DTA_F_PEEKING) != 0)
+		return (DTRACE_AGGWALK_NEXT);
+	return (DTRACE_AGGWALK_REMOVE);
+}
+
+/*
+ * Entry points for aggclear() and aggtrunc().  These operate on every record
+ * of the given aggregation variable (or all variables, if the varid is
+ * negative) entirely within libdtrace's walk, without calling into JavaScript
+ * at all, and return the number of records cleared or removed.  Clearing
+ * zeroes each record's value but keeps its key, just like the D clear()
+ * action.  Truncating to "n" keeps the "n" records of each variable with the
+ * largest values (or the smallest, if "n" is negative) and removes the rest,
+ * like trunc().
+ */
+static int
+dta_aggclear(shim_ctx_t *ctx, shim_args_t *args)
+{
+	return (dta_aggop_common(ctx, args, DTRACE_AGGWALK_CLEAR));
+}
+
+static int
+dta_aggtrunc(shim_ctx_t *ctx, shim_args_t *args)
+{
+	return (dta_aggop_common(ctx, args, DTRACE_AGGWALK_REMOVE));
+}
+
+/*
+ * State for a native clear or truncate operation.  The sorted walk used for
+ * truncation interleaves the records of different variables, so the number of
+ * records kept so far is counted separately for each variable in "dao_seen",
+ * an array of dta_aggop_var_t.
+ */
+typedef struct dta_aggop_var {
+	int64_t		daov_varid;
+	int64_t		daov_nseen;	/* records of this variable seen */
+} dta_aggop_var_t;
+
+typedef struct dta_aggop {
+	dta_hdl_t	*dao_hdl;
+	int64_t		dao_varid;	/* variable to act on, or -1 */
+	int		dao_action;	/* DTRACE_AGGWALK_CLEAR or _REMOVE */
+	int64_t		dao_keep;	/* records to keep (for _REMOVE) */
+	dta_buf_t	dao_seen;	/* records seen so far, per variable */
+	int64_t		dao_nchanged;	/* records cleared or removed */
+} dta_aggop_t;
+
+/*
+ * Return the per-variable state for "varid", adding it if necessary.
+ * Programs have few aggregation variables, so a linear search suffices.
+ */
+static dta_aggop_var_t *
+dta_aggop_var(dta_aggop_t *op, int64_t varid)
+{
+	dta_hdl_t *dtap = op->dao_hdl;
+	dta_aggop_var_t *vars = (dta_aggop_var_t *)op->dao_seen.db_buf;
+	dta_aggop_var_t *var;
+	size_t i, nvars = op->dao_seen.db_len / sizeof (*var);
+
+	for (i = 0; i < nvars; i++) {
+		if (vars[i].daov_varid == varid)
+			return (&vars[i]);
+	}
+
+	if ((var = dta_buf_reserve(&op->dao_seen, sizeof (*var))) == NULL) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+		return (NULL);
+	}
+
+	var->daov_varid = varid;
+	return (var);
+}
+
+static int
+dta_aggop_common(shim_ctx_t *ctx, shim_args_t *args, int action)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_aggop_t op;
+	shim_val_t *arg;
+	double varid, keep = 0;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	varid = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if (action == DTRACE_AGGWALK_REMOVE) {
+		arg = shim_args_get(args, 2);
+		keep = shim_number_value(arg);
+		shim_value_release(arg);
+	}
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	bzero(&op, sizeof (op));
+	op.dao_hdl = dtap;
+	op.dao_varid = varid < 0 ? -1 : (int64_t)varid;
+	op.dao_action = action;
+	op.dao_keep = keep < 0 ? -(int64_t)keep : (int64_t)keep;
+
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	(void) dta_agg_snapwalk(dtap, action == DTRACE_AGGWALK_CLEAR ?
+	    dtrace_aggregate_walk : keep >= 0 ?
+	    dtrace_aggregate_walk_valrevsorted :
+	    dtrace_aggregate_walk_valsorted, dta_dt_aggop, &op);
+	dtap->dta_flags &= ~DTA_F_CONSUMING;
+	dta_buf_fini(&op.dao_seen);
+
+	if (dtap->dta_rval == 0)
+		shim_args_set_rval(ctx, args,
+		    shim_number_new(ctx, op.dao_nchanged));
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+static int
+dta_dt_aggop(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_aggop_t *op = arg;
+	dta_aggop_var_t *var;
+
+	if (op->dao_varid != -1 &&
+	    op->dao_varid != agg->dtada_desc->dtagd_varid)
+		return (DTRACE_AGGWALK_NEXT);
+
+	if (op->dao_action == DTRACE_AGGWALK_REMOVE) {
+		if ((var = dta_aggop_var(op,
+		    agg->dtada_desc->dtagd_varid)) == NULL)
+			return (DTRACE_AGGWALK_ERROR);
+
+		if (var->daov_nseen++ < op->dao_keep)
+			return (DTRACE_AGGWALK_NEXT);
+	}
+
+	op->dao_nchanged++;
+	return (op->dao_action);
+}
+
+static int
+dta_aggwalk_argv_populate(dta_hdl_t *dtap, shim_val_t **argv, int argc,
+    const dta_aggval_t *valp, int *nvalargs)
+{
+	shim_ctx_t *ctx = dtap->dta_consume_ctx;
+	const int64_t *data = valp->dtv_data;
+	uint64_t arg = valp->dtv_param;
+	int i = 0, count = 0, bi;
+
+#define APPEND(val) \
+	if (argv != NULL && i < argc)	\
+		argv[i++] = (val);	\
+	count++
+
+	if (dtap->dta_aggstats != NULL &&
+	    (valp->dtv_kind == DTA_AGG_QUANTIZE ||
+	    valp->dtv_kind == DTA_AGG_LQUANTIZE ||
+	    valp->dtv_kind == DTA_AGG_LLQUANTIZE)) {
+		dta_aggstats_t *stats = dtap->dta_aggstats;
+		double total, mean;
+		int pi;
+
+		/*
+		 * Make sure we have enough scratch space on the counting pass
+		 * so that filling in the values can't fail.
+		 */
+		if (argv == NULL) {
+			if (dta_aggstats_reserve(stats, valp->dtv_nvals) != 0) {
+				(void) snprintf(dtap->dta_errmsg,
+				    sizeof (dtap->dta_errmsg),
+				    "malloc: %s\n", strerror(errno));
+				dtap->dta_rval = -1;
+				return (-1);
+			}
+
+			count = 2 + stats->das_npct;
+			goto out;
+		}
+
+		dta_aggstats_compute(stats, valp, &total, &mean);
+
+		APPEND(shim_number_new(ctx, total));
+		APPEND(shim_number_new(ctx, mean));
+		for (pi = 0; pi < stats->das_npct; pi++) {
+			APPEND(shim_number_new(ctx, stats->das_result[pi]));
+		}
+		goto out;
+	}
+
+	/*
+	 * For an exact walk, the parameter and the values are passed in the
+	 * buffer of integers that's appended below.
+	 */
+	if (dtap->dta_exact != NULL) {
+		if (argv != NULL) {
+			dta_exact_put(dtap, (int64_t)arg);
+			for (bi = 0; bi < valp->dtv_nvals; bi++)
+				dta_exact_put(dtap, data[bi]);
+		}
+
+		goto out;
+	}
+
+	switch (valp->dtv_kind) {
+	case DTA_AGG_AVG:
+		APPEND(shim_number_new(ctx, data[1] / (double)data[0]));
+		break;
+
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		if (valp->dtv_kind == DTA_AGG_LQUANTIZE) {
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LQUANTIZE_BASE(arg)));
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LQUANTIZE_STEP(arg)));
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LQUANTIZE_LEVELS(arg)));
+		} else if (valp->dtv_kind == DTA_AGG_LLQUANTIZE) {
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LLQUANTIZE_FACTOR(arg)));
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LLQUANTIZE_LOW(arg)));
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LLQUANTIZE_HIGH(arg)));
+			APPEND(shim_integer_new(ctx,
+			    DTRACE_LLQUANTIZE_NSTEP(arg)));
+			APPEND(shim_integer_new(ctx, valp->dtv_nvals));
+		}
+
+		for (bi = 0; bi < valp->dtv_nvals; bi++) {
+			if (!data[bi])
+				continue;
+
+			APPEND(shim_integer_new(ctx, bi));
+			APPEND(shim_number_new(ctx, data[bi]));
+		}
+
+		break;
+
+	default:
+		/* count(), min(), max(), and sum() */
+		APPEND(shim_number_new(ctx, (double)data[0]));
+		break;
+	}
+
+out:
+	if (dtap->dta_exact != NULL) {
+		APPEND(dta_exact_take(dtap));
+	}
+
+	if (nvalargs != NULL)
+		*nvalargs = count;
+
+	return (0);
+#undef APPEND
+}
+
+
+/*
+ * Snapshot the aggregation buffer and walk it using "walk" (one of libdtrace's
+ * dtrace_aggregate_walk*() functions) with "func".  On failure, the error is
+ * left in the handle for dta_error_throw().
+ */
+static int
+dta_agg_snapwalk(dta_hdl_t *dtap,
+    int (*walk)(dtrace_hdl_t *, dtrace_aggregate_f *, void *),
+    dtrace_aggregate_f *func, void *arg)
+{
+	dtrace_hdl_t *dtp = dtap->dta_dtrace;
+	int rval;
+
+	dta_error_clear(dtap);
+
+	if (dtrace_status(dtp) == -1) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't get status: %s\n",
+		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		return (-1);
+	}
+
+	if (dtrace_aggregate_snap(dtp) == -1) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't snap aggregate: %s\n",
+		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		return (-1);
+	}
+
+	dtap->dta_rval = 0;
+	rval = walk(dtp, func, arg);
+	if (dtap->dta_rval == 0 && rval == -1) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't walk aggregate: %s\n",
+		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		dtap->dta_rval = -1;
+	}
+
+	return (dtap->dta_rval);
+}
+
+/*
+ * Remove every record from the aggregation buffer.  Walks that consume the
+ * buffer but can fail part way use this to remove the records only once
+ * they've succeeded.  The buffer isn't snapshotted again first, so this
+ * removes exactly the records that were walked.
+ */
+static int
+dta_agg_remove(dta_hdl_t *dtap)
+{
+	dtrace_hdl_t *dtp = dtap->dta_dtrace;
+
+	if (dtrace_aggregate_walk(dtp, dta_dt_aggremove, NULL) == -1) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't walk aggregate: %s\n",
+		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		dtap->dta_rval = -1;
+	}
+
+	return (dtap->dta_rval);
+}
+
+/* ARGSUSED */
+static int
+dta_dt_aggremove(const dtrace_aggdata_t *agg, void *arg)
+{
+	return (DTRACE_AGGWALK_REMOVE);
+}
+
+/*
+ * Parse an aggregation filter from the arguments starting at "*argip", which
+ * look like:
+ *
+ *     nvarids, varid1, ..., nprefix, key1, ...
+ *
+ * If there are no such arguments, the filter matches everything.  As with the
+ * other entry points, the arguments have already been validated by the caller.
+ */
+static int
+dta_aggfilter_parse(shim_ctx_t *ctx, shim_args_t *args, int *argip,
+    dta_aggfilter_t *filt)
+{
+	shim_val_t *arg;
+	int argi = *argip;
+	int i;
+
+	bzero(filt, sizeof (*filt));
+
+	arg = shim_args_get(args, argi++);
+	if (shim_value_is(arg, SHIM_TYPE_UNDEFINED)) {
+		shim_value_release(arg);
+		return (0);
+	}
+
+	filt->daf_nvarids = shim_number_value(arg);
+	shim_value_release(arg);
+	if (filt->daf_nvarids > 0 && (filt->daf_varids =
+	    calloc(filt->daf_nvarids, sizeof (int64_t))) == NULL)
+		return (-1);
+
+	for (i = 0; i < filt->daf_nvarids; i++) {
+		arg = shim_args_get(args, argi++);
+		filt->daf_varids[i] = shim_number_value(arg);
+		shim_value_release(arg);
+	}
+
+	arg = shim_args_get(args, argi++);
+	filt->daf_nprefix = shim_number_value(arg);
+	shim_value_release(arg);
+	if (filt->daf_nprefix > 0 && (filt->daf_prefix =
+	    calloc(filt->daf_nprefix, sizeof (dta_filtkey_t))) == NULL) {
+		filt->daf_nprefix = 0;
+		dta_aggfilter_fini(filt);
+		return (-1);
+	}
+
+	for (i = 0; i < filt->daf_nprefix; i++) {
+		dta_filtkey_t *dfk = &filt->daf_prefix[i];
+
+		arg = shim_args_get(args, argi++);
+		if (shim_value_is(arg, SHIM_TYPE_STRING)) {
+			dfk->dfk_kind = DTA_V_STRING;
+			dfk->dfk_str = shim_string_value(arg);
+		} else {
+			dfk->dfk_kind = DTA_V_INT;
+			dfk->dfk_int = shim_number_value(arg);
+		}
+		shim_value_release(arg);
+	}
+
+	*argip = argi;
+	return (0);
+}
+
+static int
+dta_aggfilter_match(dta_hdl_t *dtap, const dta_aggfilter_t *filt,
+    const dtrace_aggdata_t *agg)
+{
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	const dta_filtkey_t *dfk;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	const char *str;
+	char buf[2048];
+	int64_t ival;
+	int i;
+
+	if (!dta_aggfilter_varid(filt, aggdesc->dtagd_varid) ||
+	    filt->daf_nprefix > aggdesc->dtagd_nrecs - 2)
+		return (B_FALSE);
+
+	if (filt->daf_nprefix == 0)
+		return (B_TRUE);
+
+	/*
+	 * If we can't allocate the plan, we treat the record as matching so
+	 * that the walk itself reports the error.
+	 */
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL)
+		return (B_TRUE);
+
+	for (i = 0; i < filt->daf_nprefix; i++) {
+		fld = &plan->dpl_fields[i];
+
+		/*
+		 * Unsupported keys never match.  We leave it to the normal walk
+		 * to report them if the caller asks for everything.
+		 */
+		if (fld->dfl_kind == DTA_FLD_UNSUPPORTED)
+			return (B_FALSE);
+
+		dfk = &filt->daf_prefix[i];
+		if (dta_field_read(dtap, fld, agg->dtada_data +
+		    fld->dfl_offset, &ival, &str, buf, sizeof (buf)) !=
+		    dfk->dfk_kind)
+			return (B_FALSE);
+
+		if (dfk->dfk_kind == DTA_V_INT ? ival != dfk->dfk_int :
+		    strcmp(str, dfk->dfk_str) != 0)
+			return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Like dta_aggfilter_match(), but for a record in one of our own tables, whose
+ * keys are already decoded and canonically encoded.
+ */
+static int
+dta_aggfilter_match_ent(const dta_aggfilter_t *filt, const dta_aggent_t *ent)
+{
+	const dta_aggvar_t *var = ent->dae_var;
+	const uint8_t *key = ent->dae_key;
+	const uint8_t *end = key + ent->dae_keylen;
+	const dta_filtkey_t *dfk;
+	const char *str;
+	uint32_t len;
+	int64_t ival;
+	int i;
+
+	if (!dta_aggfilter_varid(filt, var->dav_varid) ||
+	    filt->daf_nprefix > var->dav_nkeys)
+		return (B_FALSE);
+
+	for (i = 0; i < filt->daf_nprefix; i++) {
+		dfk = &filt->daf_prefix[i];
+
+		if (dta_aggkey_next(&key, end, &ival, &str, &len) ==
+		    DTA_KEY_INT) {
+			if (dfk->dfk_kind != DTA_V_INT || ival != dfk->dfk_int)
+				return (B_FALSE);
+		} else if (dfk->dfk_kind != DTA_V_STRING ||
+		    strcmp(str, dfk->dfk_str) != 0) {
+			return (B_FALSE);
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Returns whether the filter allows aggregation variable "varid".
+ */
+static int
+dta_aggfilter_varid(const dta_aggfilter_t *filt, int64_t varid)
+{
+	int i;
+
+	if (filt->daf_nvarids == 0)
+		return (B_TRUE);
+
+	for (i = 0; i < filt->daf_nvarids; i++) {
+		if (filt->daf_varids[i] == varid)
+			return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+static void
+dta_aggfilter_fini(dta_aggfilter_t *filt)
+{
+	int i;
+
+	for (i = 0; i < filt->daf_nprefix; i++)
+		free(filt->daf_prefix[i].dfk_str);
+
+	free(filt->daf_prefix);
+	free(filt->daf_varids);
+	bzero(filt, sizeof (*filt));
+}
+
+/*
+ * Parse the requested statistics from the arguments starting at "*argip",
+ * which look like:
+ *
+ *     npercentiles, percentile1, ...
+ *
+ * If there are no such arguments, or "npercentiles" is negative, no statistics
+ * are computed.  If it's zero, just the count and mean are.
+ */
+static int
+dta_aggstats_parse(shim_ctx_t *ctx, shim_args_t *args, int *argip,
+    dta_aggstats_t *stats)
+{
+	shim_val_t *arg;
+	int argi = *argip;
+	int i;
+
+	bzero(stats, sizeof (*stats));
+
+	arg = shim_args_get(args, argi++);
+	if (shim_value_is(arg, SHIM_TYPE_UNDEFINED)) {
+		shim_value_release(arg);
+		return (0);
+	}
+
+	stats->das_npct = shim_number_value(arg);
+	shim_value_release(arg);
+	if (stats->das_npct < 0) {
+		stats->das_npct = 0;
+		*argip = argi;
+		return (0);
+	}
+
+	stats->das_enabled = B_TRUE;
+	if (stats->das_npct == 0) {
+		*argip = argi;
+		return (0);
+	}
+
+	if ((stats->das_pct = calloc(stats->das_npct,
+	    sizeof (double))) == NULL ||
+	    (stats->das_result = calloc(stats->das_npct,
+	    sizeof (double))) == NULL) {
+		dta_aggstats_fini(stats);
+		return (-1);
+	}
+
+	for (i = 0; i < stats->das_npct; i++) {
+		arg = shim_args_get(args, argi++);
+		stats->das_pct[i] = shim_number_value(arg);
+		shim_value_release(arg);
+	}
+
+	*argip = argi;
+	return (0);
+}
+
+/*
+ * Summarize the buckets of a quantizing action: store the total count into
+ * "countp", the approximate mean into "meanp", and the requested percentiles
+ * into das_result.  Each bucket's count is assumed to be spread evenly across
+ * the bucket's range, so the mean uses bucket midpoints and percentiles are
+ * linearly interpolated within the bucket that contains them.  The unbounded
+ * first and last buckets are treated as if all of their values were at their
+ * finite edge.  If the count is zero, the mean and percentiles are NaN.
+ */
+static void
+dta_aggstats_compute(dta_aggstats_t *stats, const dta_aggval_t *valp,
+    double *countp, double *meanp)
+{
+	const int64_t *data = valp->dtv_data;
+	int nb = valp->dtv_nvals;
+	int64_t *lo, *hi;
+	double total, sum, rank, cum, lod, hid;
+	int bi, pi;
+
+	assert(nb <= stats->das_nbuckets);
+	lo = stats->das_lo;
+	hi = stats->das_hi;
+	dta_bucket_ranges(valp, lo, hi);
+
+	for (bi = 0; bi < nb; bi++) {
+		if (lo[bi] == INT64_MIN)
+			lo[bi] = hi[bi];
+		if (hi[bi] == INT64_MAX)
+			hi[bi] = lo[bi];
+	}
+
+	total = sum = 0;
+	for (bi = 0; bi < nb; bi++) {
+		total += data[bi];
+		sum += data[bi] * (((double)lo[bi] + (double)hi[bi]) / 2);
+	}
+
+	*countp = total;
+	*meanp = total == 0 ? NAN : sum / total;
+
+	for (pi = 0; pi < stats->das_npct; pi++) {
+		if (total == 0) {
+			stats->das_result[pi] = NAN;
+			continue;
+		}
+
+		rank = stats->das_pct[pi] / 100 * total;
+		cum = 0;
+		for (bi = 0; bi < nb; bi++) {
+			if (data[bi] == 0)
+				continue;
+
+			if (cum + data[bi] >= rank)
+				break;
+
+			cum += data[bi];
+		}
+
+		if (bi == nb) {
+			/* Only possible for percentiles above 100. */
+			for (bi = nb - 1; bi > 0 && data[bi] == 0; bi--)
+				continue;
+		}
+
+		/*
+		 * Interpolate over the half-open interval [lo, hi + 1), which
+		 * covers exactly the integers in the bucket.
+		 */
+		lod = lo[bi];
+		hid = hi[bi] == lo[bi] ? lod : (double)hi[bi] + 1;
+		stats->das_result[pi] = data[bi] == 0 ? lod :
+		    lod + (hid - lod) * ((rank - cum) / data[bi]);
+	}
+}
+
+/*
+ * Make sure there's scratch space for computing statistics over "nb" buckets.
+ */
+static int
+dta_aggstats_reserve(dta_aggstats_t *stats, int nb)
+{
+	if (nb <= stats->das_nbuckets)
+		return (0);
+
+	free(stats->das_lo);
+	free(stats->das_hi);
+	stats->das_lo = malloc(nb * sizeof (int64_t));
+	stats->das_hi = malloc(nb * sizeof (int64_t));
+	if (stats->das_lo == NULL || stats->das_hi == NULL) {
+		stats->das_nbuckets = 0;
+		return (-1);
+	}
+
+	stats->das_nbuckets = nb;
+	return (0);
+}
+
+static void
+dta_aggstats_fini(dta_aggstats_t *stats)
+{
+	free(stats->das_pct);
+	free(stats->das_result);
+	free(stats->das_lo);
+	free(stats->das_hi);
+	bzero(stats, sizeof (*stats));
+}
+
+/*
+ * Exact aggregation walks: when requested, every integer aggregation key and
+ * value is passed exactly, as a 64-bit integer in a buffer that's appended to
+ * the callback's arguments.  Each integer key is passed as null, and its value
+ * is in the buffer, in order, followed by the record's parameter word (see
+ * dta_aggval_t) and its values.  If statistics were requested, the buffer
+ * holds just the keys.  Passing all of a record's integers in one buffer means
+ * there's only one allocation per record, no matter how many buckets it has.
+ */
+
+/*
+ * Parse an optional boolean flag, like the one indicating whether an
+ * aggregation walk is exact.
+ */
+static int
+dta_flag_parse(shim_ctx_t *ctx, shim_args_t *args, int *argip)
+{
+	shim_val_t *arg;
+	int rv;
+
+	arg = shim_args_get(args, (*argip)++);
+	rv = !shim_value_is(arg, SHIM_TYPE_UNDEFINED) &&
+	    shim_number_value(arg) != 0;
+	shim_value_release(arg);
+	return (rv);
+}
+
+/*
+ * Prepare to collect up to "n" integers for the next record, so that
+ * dta_exact_put() can't fail.  The buffer is allocated at exactly that size
+ * (rather than with dta_buf_reserve()) since it will be handed to JavaScript.
+ * On failure, the error is left in the handle.
+ */
+static int
+dta_exact_begin(dta_hdl_t *dtap, int n)
+{
+	dta_buf_t *dbp = dtap->dta_exact;
+
+	if (dbp == NULL)
+		return (0);
+
+	dbp->db_len = 0;
+	if (dbp->db_size >= n * sizeof (int64_t))
+		return (0);
+
+	free(dbp->db_buf);
+	dbp->db_size = n * sizeof (int64_t);
+	if ((dbp->db_buf = malloc(dbp->db_size)) != NULL)
+		return (0);
+
+	dbp->db_size = 0;
+
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "malloc: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (-1);
+}
+
+static void
+dta_exact_put(dta_hdl_t *dtap, int64_t val)
+{
+	assert(dtap->dta_exact->db_len + sizeof (val) <=
+	    dtap->dta_exact->db_size);
+	(void) dta_buf_append(dtap->dta_exact, &val, sizeof (val));
+}
+
+/*
+ * Hand the integers collected for the current record to JavaScript.  The
+ * buffer's memory is handed over as well, so the next record gets a new one.
+ */
+static shim_val_t *
+dta_exact_take(dta_hdl_t *dtap)
+{
+	dta_buf_t *dbp = dtap->dta_exact;
+	shim_val_t *rv;
+
+	rv = shim_buffer_new_external(dtap->dta_consume_ctx, dbp->db_buf,
+	    dbp->db_len, dta_buf_free, NULL);
+	bzero(dbp, sizeof (*dbp));
+	return (rv);
+}
+
+/*
+ * Fill in the inclusive range [lo[i], hi[i]] of values counted by each bucket
+ * "i" of a quantizing action.  This is the C counterpart of lib/buckets.js.
+ */
+static void
+dta_bucket_ranges(const dta_aggval_t *valp, int64_t *lo, int64_t *hi)
+{
+	uint64_t arg = valp->dtv_param;
+	int nb = valp->dtv_nvals;
+	int bi;
+
+	switch (valp->dtv_kind) {
+	case DTA_AGG_QUANTIZE:
+		for (bi = 0; bi < nb; bi++) {
+			if (bi < DTRACE_QUANTIZE_ZEROBUCKET) {
+				lo[bi] = bi > 0 ? DTRACE_QUANTIZE_BUCKETVAL(
+				    bi - 1) + 1 : INT64_MIN;
+				hi[bi] = DTRACE_QUANTIZE_BUCKETVAL(bi);
+			} else if (bi == DTRACE_QUANTIZE_ZEROBUCKET) {
+				lo[bi] = hi[bi] = 0;
+			} else {
+				lo[bi] = DTRACE_QUANTIZE_BUCKETVAL(bi);
+				hi[bi] = bi < nb - 1 ?
+				    DTRACE_QUANTIZE_BUCKETVAL(bi + 1) - 1 :
+				    INT64_MAX;
+			}
+		}
+		break;
+
+	case DTA_AGG_LQUANTIZE: {
+		int64_t base = DTRACE_LQUANTIZE_BASE(arg);
+		int64_t step = DTRACE_LQUANTIZE_STEP(arg);
+		int levels = DTRACE_LQUANTIZE_LEVELS(arg);
+
+		for (bi = 0; bi < nb; bi++) {
+			lo[bi] = bi == 0 ? INT64_MIN : base + (bi - 1) * step;
+			hi[bi] = bi > levels ? INT64_MAX :
+			    base + bi * step - 1;
+		}
+		break;
+	}
+
+	case DTA_AGG_LLQUANTIZE: {
+		int64_t factor = DTRACE_LLQUANTIZE_FACTOR(arg);
+		int low = DTRACE_LLQUANTIZE_LOW(arg);
+		int high = DTRACE_LLQUANTIZE_HIGH(arg);
+		int64_t nsteps = DTRACE_LLQUANTIZE_NSTEP(arg);
+		int64_t value = 1, next, step;
+		int order;
+
+		for (order = 0; order < low; order++)
+			value *= factor;
+
+		bi = 0;
+		lo[bi] = 0;
+		hi[bi++] = value - 1;
+		next = value * factor;
+		step = next > nsteps ? next / nsteps : 1;
+
+		while (order <= high && bi < nb - 1) {
+			lo[bi] = value;
+			hi[bi++] = value + step - 1;
+
+			if ((value += step) != next)
+				continue;
+
+			next = value * factor;
+			step = next > nsteps ? next / nsteps : 1;
+			order++;
+		}
+
+		for (; bi < nb; bi++) {
+			lo[bi] = value;
+			hi[bi] = INT64_MAX;
+		}
+		break;
+	}
+
+	default:
+		assert(B_FALSE);
+		break;
+	}
+}
+
+/*
+ * Decode the value record of an aggregation.  See dta_aggval_t.
+ */
+static int
+dta_aggval(dta_hdl_t *dtap, const dtrace_aggdata_t *agg, dta_aggval_t *valp)
+{
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	const int64_t *data;
+	dta_plan_t *plan;
+
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL)
+		return (-1);
+
+	if (plan->dpl_aggkind == 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "unsupported aggregating action %s in aggregation "
+		    "\"%s\"\n", plan->dpl_action, aggdesc->dtagd_name);
+		dtap->dta_rval = -1;
+		return (-1);
+	}
+
+	data = (int64_t *)(agg->dtada_data + plan->dpl_valoff);
+	valp->dtv_kind = plan->dpl_aggkind;
+	valp->dtv_param = plan->dpl_hasparam ? (uint64_t)data[0] : 0;
+	valp->dtv_data = plan->dpl_hasparam ? data + 1 : data;
+	valp->dtv_nvals = plan->dpl_nvals;
+	return (0);
+}
+
+/*
+ * Returns the name of an aggregating action, as reported by aggwalk().
+ */
+static const char *
+dta_aggkind_name(dta_aggkind_t kind)
+{
+	static const dtrace_actkind_t actions[] = {
+		DTRACEACT_NONE,
+		DTRACEAGG_COUNT,
+		DTRACEAGG_MIN,
+		DTRACEAGG_MAX,
+		DTRACEAGG_SUM,
+		DTRACEAGG_AVG,
+		DTRACEAGG_QUANTIZE,
+		DTRACEAGG_LQUANTIZE,
+		DTRACEAGG_LLQUANTIZE,
+	};
+
+	assert(kind > 0 && kind < sizeof (actions) / sizeof (actions[0]));
+	return (dta_dt_action(actions[kind]));
+}
+
+/*
+ * Encode the keys of an aggregation record into "dbp", replacing its contents,
+ * using the canonical key encoding described in dta_aggtab.h.
+ */
+static int
+dta_aggkey_encode(dta_hdl_t *dtap, const dtrace_aggdata_t *agg, dta_buf_t *dbp)
+{
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	const char *str;
+	char buf[2048];
+	int64_t ival;
+	uint8_t *p;
+	size_t len;
+	int i;
+
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL)
+		return (-1);
+
+	dbp->db_len = 0;
+	for (i = 0; i < plan->dpl_nfields; i++) {
+		fld = &plan->dpl_fields[i];
+		if (fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "unsupported action %s as key #%d in aggregation "
+			    "\"%s\"\n",
+			    dta_dt_action(fld->dfl_rec->dtrd_action), i + 1,
+			    aggdesc->dtagd_name);
+			dtap->dta_rval = -1;
+			return (-1);
+		}
+
+		if (dta_field_read(dtap, fld, agg->dtada_data +
+		    fld->dfl_offset, &ival, &str, buf, sizeof (buf)) ==
+		    DTA_V_INT) {
+			if ((p = dta_buf_reserve(dbp,
+			    DTA_AGGKEY_INTSIZE)) == NULL)
+				goto nomem;
+			(void) dta_aggkey_int(p, ival);
+			continue;
+		}
+
+		len = strlen(str);
+		if ((p = dta_buf_reserve(dbp, DTA_AGGKEY_STRSIZE(len))) == NULL)
+			goto nomem;
+		(void) dta_aggkey_string(p, str, len);
+	}
+
+	return (0);
+
+nomem:
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "malloc: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (-1);
+}
+
+/*
+ * Entry point for consumer.slotInfo(): invoke the callback as
+ *
+ *     callback(varid, hash, encoding, key1, ...)
+ *
+ * for the given slot, where "hash" is the 64-bit hash of the variable ID and
+ * the key encoding (see dta_aggkey_hash()) as 16 hexadecimal digits, and
+ * "encoding" is a buffer holding the canonical encoding of the keys.  This may
+ * be called from within an aggregation walk's callback.
+ */
+static int
+dta_slotinfo(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	const dta_keyslot_t *dks;
+	const uint8_t *key, *end;
+	const char *str;
+	char hash[17];
+	shim_val_t **argv;
+	uint32_t slot, len;
+	int64_t ival;
+	int argc, i;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UINT32, &slot,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if (dtap->dta_slots == NULL ||
+	    slot >= dtap->dta_slots->dsl_idx.dki_nslots) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "slotinfo: no such slot");
+		return (TRUE);
+	}
+
+	dks = dta_keyidx_get(&dtap->dta_slots->dsl_idx, slot, &key);
+	end = key + dks->dks_keylen;
+
+	/*
+	 * Every key takes at least DTA_AGGKEY_STRSIZE(0) bytes, which bounds
+	 * the number of arguments.
+	 */
+	argc = 3 + dks->dks_keylen / DTA_AGGKEY_STRSIZE(0);
+	if ((argv = calloc(argc, sizeof (argv[0]))) == NULL) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "slotinfo: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	(void) snprintf(hash, sizeof (hash), "%016llx",
+	    (unsigned long long)dks->dks_hash);
+	argv[0] = shim_integer_new(ctx, dks->dks_varid);
+	argv[1] = shim_string_new_copy(ctx, hash);
+	argv[2] = shim_buffer_new_copy(ctx, (const char *)key,
+	    dks->dks_keylen);
+
+	for (argc = 3; key < end; argc++) {
+		if (dta_aggkey_next(&key, end, &ival, &str, &len) ==
+		    DTA_KEY_INT)
+			argv[argc] = shim_number_new(ctx, (double)ival);
+		else
+			argv[argc] = shim_string_new_copy(ctx, str);
+	}
+
+	(void) shim_func_call_val(ctx, NULL, callback, argc, argv, NULL);
+	for (i = 0; i < argc; i++)
+		shim_value_release(argv[i]);
+	free(argv);
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.slotCount(): returns the number of slots assigned.
+ */
+static int
+dta_slotcount(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+	shim_args_set_rval(ctx, args, shim_integer_uint(ctx,
+	    dtap->dta_slots == NULL ? 0 : dtap->dta_slots->dsl_idx.dki_nslots));
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.slotReset(): forget all slots, so that the next
+ * walk starts assigning them from zero again.
+ */
+static int
+dta_slotreset(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	dta_slots_free(dtap->dta_slots);
+	dtap->dta_slots = NULL;
+	return (TRUE);
+}
+
+/*
+ * Returns the handle's key slots, creating them if necessary.  On failure, the
+ * error is left in the handle.
+ */
+static dta_slots_t *
+dta_slots_init(dta_hdl_t *dtap)
+{
+	dta_slots_t *dsl;
+
+	if (dtap->dta_slots != NULL)
+		return (dtap->dta_slots);
+
+	if ((dsl = calloc(1, sizeof (*dsl))) == NULL) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+		return (NULL);
+	}
+
+	dta_keyidx_init(&dsl->dsl_idx);
+	dtap->dta_slots = dsl;
+	return (dsl);
+}
+
+/*
+ * Returns the slot for the keys of aggregation record "agg", or -1 on failure
+ * (with the error left in the handle).
+ */
+static int64_t
+dta_slots_agg(dta_hdl_t *dtap, const dtrace_aggdata_t *agg)
+{
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_slots_t *dsl;
+	const uint8_t *key;
+
+	if ((dsl = dta_slots_init(dtap)) == NULL ||
+	    dta_aggkey_encode(dtap, agg, &dsl->dsl_key) != 0)
+		return (-1);
+
+	key = (const uint8_t *)dsl->dsl_key.db_buf;
+	return (dta_slots_get(dtap, aggdesc->dtagd_varid,
+	    dta_aggkey_hash(aggdesc->dtagd_varid, key, dsl->dsl_key.db_len),
+	    key, dsl->dsl_key.db_len));
+}
+
+/*
+ * Like dta_slots_agg(), but for a record of one of our own tables, whose keys
+ * are already encoded and hashed.
+ */
+static int64_t
+dta_slots_ent(dta_hdl_t *dtap, const dta_aggent_t *ent)
+{
+	if (dta_slots_init(dtap) == NULL)
+		return (-1);
+
+	return (dta_slots_get(dtap, ent->dae_var->dav_varid, ent->dae_hash,
+	    ent->dae_key, ent->dae_keylen));
+}
+
+static int64_t
+dta_slots_get(dta_hdl_t *dtap, int64_t varid, uint64_t hash,
+    const uint8_t *key, size_t keylen)
+{
+	int64_t slot;
+
+	if ((slot = dta_keyidx_slot(&dtap->dta_slots->dsl_idx, varid, hash,
+	    key, keylen)) == -1) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't assign key slot: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+	}
+
+	return (slot);
+}
+
+static void
+dta_slots_free(dta_slots_t *dsl)
+{
+	if (dsl == NULL)
+		return;
+
+	dta_keyidx_fini(&dsl->dsl_idx);
+	dta_buf_fini(&dsl->dsl_key);
+	free(dsl);
+}
+
+/*
+ * Entry point for consumer.aggsnapshot().  Like aggwalk(), this consumes the
+ * aggregation buffer, but rather than invoking a callback for each record it
+ * writes the whole thing into a single binary snapshot (see dta_snaphdr_t).
+ * Records are only removed once the snapshot has been built, so if that fails,
+ * nothing is lost.  If we're given a buffer, the snapshot is written there and
+ * we return its size.  If the buffer is too small, nothing is written, but the
+ * snapshot is kept so that the caller can retry with a buffer of at least the
+ * returned size without losing data.  If we're not given a buffer, we return a
+ * new one.
+ */
+static int
+dta_aggsnapshot(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_snap_t snap;
+	shim_val_t *target;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if (dtap->dta_snapbuf == NULL) {
+		bzero(&snap, sizeof (snap));
+		snap.dts_hdl = dtap;
+
+		dtap->dta_flags |= DTA_F_CONSUMING;
+		if (dta_agg_snapwalk(dtap, dtrace_aggregate_walk,
+		    dta_dt_aggsnap, &snap) == 0 &&
+		    dta_snap_finish(&snap, &dtap->dta_snapbuf,
+		    &dtap->dta_snaplen) != 0) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "couldn't build snapshot: %s\n", strerror(errno));
+			dtap->dta_rval = -1;
+		}
+
+		if (dtap->dta_rval == 0 && dta_agg_remove(dtap) != 0) {
+			free(dtap->dta_snapbuf);
+			dtap->dta_snapbuf = NULL;
+			dtap->dta_snaplen = 0;
+		}
+		dtap->dta_flags &= ~DTA_F_CONSUMING;
+		dta_snap_fini(&snap);
+
+		if (dtap->dta_rval != 0) {
+			dta_error_throw(dtap, ctx);
+			return (TRUE);
+		}
+	}
+
+	target = shim_args_get(args, 1);
+	if (!shim_value_is(target, SHIM_TYPE_UNDEFINED)) {
+		shim_args_set_rval(ctx, args,
+		    shim_number_new(ctx, dtap->dta_snaplen));
+		if (dtap->dta_snaplen > shim_buffer_length(target)) {
+			shim_value_release(target);
+			return (TRUE);
+		}
+
+		bcopy(dtap->dta_snapbuf, shim_buffer_value(target),
+		    dtap->dta_snaplen);
+	} else {
+		shim_args_set_rval(ctx, args, shim_buffer_new_copy(ctx,
+		    dtap->dta_snapbuf, dtap->dta_snaplen));
+	}
+
+	shim_value_release(target);
+	free(dtap->dta_snapbuf);
+	dtap->dta_snapbuf = NULL;
+	dtap->dta_snaplen = 0;
+	return (TRUE);
+}
+
+static int
+dta_dt_aggsnap(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_snap_t *snap = arg;
+	dta_hdl_t *dtap = snap->dts_hdl;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_aggval_t val;
+	dta_snaprow_t *row;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	int64_t cells[DTA_SNAP_MAXKEYS], ival;
+	uint32_t strkeys = 0;
+	const char *str;
+	char buf[2048];
+	int nkeys, vi, si, i;
+
+	assert(aggdesc->dtagd_nrecs >= 2);
+	nkeys = aggdesc->dtagd_nrecs - 2;
+
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL ||
+	    dta_aggval(dtap, agg, &val) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if (nkeys > DTA_SNAP_MAXKEYS) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "too many keys (%d) in aggregation \"%s\"\n", nkeys,
+		    aggdesc->dtagd_name);
+		dtap->dta_rval = -1;
+		return (DTRACE_AGGWALK_ERROR);
+	}
+
+	for (i = 0; i < nkeys; i++) {
+		fld = &plan->dpl_fields[i];
+		if (fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "unsupported action %s as key #%d in aggregation "
+			    "\"%s\"\n",
+			    dta_dt_action(fld->dfl_rec->dtrd_action), i + 1,
+			    aggdesc->dtagd_name);
+			dtap->dta_rval = -1;
+			return (DTRACE_AGGWALK_ERROR);
+		}
+
+		if (dta_field_read(dtap, fld, agg->dtada_data +
+		    fld->dfl_offset, &ival, &str, buf, sizeof (buf)) ==
+		    DTA_V_INT) {
+			cells[i] = ival;
+			continue;
+		}
+
+		if ((si = dta_strtab_intern(&snap->dts_strings, str,
+		    strlen(str))) == -1)
+			goto nomem;
+
+		cells[i] = si;
+		strkeys |= 1U << i;
+	}
+
+	if ((vi = dta_snap_var(snap, agg, &val, strkeys)) == -1 ||
+	    dta_buf_append(&snap->dts_keys, cells,
+	    nkeys * sizeof (cells[0])) != 0 ||
+	    (row = dta_buf_reserve(&snap->dts_rows, sizeof (*row))) == NULL)
+		goto nomem;
+
+	row->dsr_var = vi;
+	row->dsr_bucket = snap->dts_buckets.db_len / sizeof (int64_t);
+
+	switch (val.dtv_kind) {
+	case DTA_AGG_AVG:
+		row->dsr_value = val.dtv_data[1];
+		row->dsr_value2 = val.dtv_data[0];
+		break;
+
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		for (i = 0; i < val.dtv_nvals; i++)
+			row->dsr_value += val.dtv_data[i];
+
+		if (dta_buf_append(&snap->dts_buckets, val.dtv_data,
+		    val.dtv_nvals * sizeof (int64_t)) != 0)
+			goto nomem;
+		break;
+
+	default:
+		row->dsr_value = val.dtv_data[0];
+		break;
+	}
+
+	return (DTRACE_AGGWALK_NEXT);
+
+nomem:
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "couldn't build snapshot: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (DTRACE_AGGWALK_ERROR);
+}
+
+/*
+ * Return the index of the variable table entry for this aggregation record,
+ * creating it if necessary.
+ */
+static int
+dta_snap_var(dta_snap_t *snap, const dtrace_aggdata_t *agg,
+    const dta_aggval_t *valp, uint32_t strkeys)
+{
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dtrace_aggvarid_t varid = aggdesc->dtagd_varid;
+	dta_snapvar_t *var;
+	uint32_t *newmap, newsz;
+	int name, vi;
+
+	if (varid < 0 || varid > INT32_MAX) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (varid < snap->dts_varmapsz && snap->dts_varmap[varid] != 0)
+		return (snap->dts_varmap[varid] - 1);
+
+	if (varid >= snap->dts_varmapsz) {
+		newsz = snap->dts_varmapsz == 0 ? 16 : snap->dts_varmapsz;
+		while (newsz <= varid)
+			newsz *= 2;
+		if ((newmap = realloc(snap->dts_varmap,
+		    newsz * sizeof (uint32_t))) == NULL)
+			return (-1);
+		bzero(newmap + snap->dts_varmapsz,
+		    (newsz - snap->dts_varmapsz) * sizeof (uint32_t));
+		snap->dts_varmap = newmap;
+		snap->dts_varmapsz = newsz;
+	}
+
+	if ((name = dta_strtab_intern(&snap->dts_strings,
+	    aggdesc->dtagd_name, strlen(aggdesc->dtagd_name))) == -1 ||
+	    (var = dta_buf_reserve(&snap->dts_vars, sizeof (*var))) == NULL)
+		return (-1);
+
+	vi = snap->dts_vars.db_len / sizeof (*var) - 1;
+	var->dsv_varid = varid;
+	var->dsv_kind = valp->dtv_kind;
+	var->dsv_nkeys = aggdesc->dtagd_nrecs - 2;
+	var->dsv_strkeys = strkeys;
+	var->dsv_param = valp->dtv_param;
+	var->dsv_name = name;
+
+	switch (valp->dtv_kind) {
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		var->dsv_nbuckets = valp->dtv_nvals;
+		break;
+	default:
+		break;
+	}
+
+	if (var->dsv_nkeys > snap->dts_maxkeys)
+		snap->dts_maxkeys = var->dsv_nkeys;
+
+	snap->dts_varmap[varid] = vi + 1;
+	return (vi);
+}
+
+/*
+ * Lay out the accumulated snapshot into a single newly-allocated buffer.
+ */
+static int
+dta_snap_finish(dta_snap_t *snap, char **bufp, size_t *lenp)
+{
+	dta_snaphdr_t *hdr;
+	const dta_strtab_t *strs = &snap->dts_strings;
+	const dta_snapvar_t *vars = (dta_snapvar_t *)snap->dts_vars.db_buf;
+	const dta_snaprow_t *rows = (dta_snaprow_t *)snap->dts_rows.db_buf;
+	const int64_t *src = (int64_t *)snap->dts_keys.db_buf;
+	int64_t *dst;
+	uint32_t nrows, r;
+	uint64_t size;
+	char *buf;
+
+#define	DTA_SNAP_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+	nrows = snap->dts_rows.db_len / sizeof (dta_snaprow_t);
+	size = sizeof (dta_snaphdr_t);
+	size += snap->dts_vars.db_len;
+	size += strs->dst_index.db_len;
+	size += DTA_SNAP_ALIGN(strs->dst_data.db_len);
+	size += (uint64_t)nrows * snap->dts_maxkeys * sizeof (int64_t);
+	size += snap->dts_rows.db_len;
+	size += snap->dts_buckets.db_len;
+
+	if (size > UINT32_MAX) {
+		errno = EOVERFLOW;
+		return (-1);
+	}
+
+	if ((buf = calloc(1, size)) == NULL)
+		return (-1);
+
+	hdr = (dta_snaphdr_t *)buf;
+	hdr->dsh_magic = DTA_SNAP_MAGIC;
+	hdr->dsh_version = DTA_SNAP_VERSION;
+	hdr->dsh_hdrsize = sizeof (dta_snaphdr_t);
+	hdr->dsh_size = size;
+	hdr->dsh_nvars = snap->dts_vars.db_len / sizeof (dta_snapvar_t);
+	hdr->dsh_nrows = nrows;
+	hdr->dsh_nstrings = strs->dst_nstrings;
+	hdr->dsh_maxkeys = snap->dts_maxkeys;
+	hdr->dsh_nbuckets = snap->dts_buckets.db_len / sizeof (int64_t);
+	hdr->dsh_qnbuckets = DTRACE_QUANTIZE_NBUCKETS;
+	hdr->dsh_qzerobucket = DTRACE_QUANTIZE_ZEROBUCKET;
+
+	hdr->dsh_varoff = sizeof (dta_snaphdr_t);
+	hdr->dsh_stroff = hdr->dsh_varoff + snap->dts_vars.db_len;
+	hdr->dsh_strdataoff = hdr->dsh_stroff + strs->dst_index.db_len;
+	hdr->dsh_keyoff = hdr->dsh_strdataoff +
+	    DTA_SNAP_ALIGN(strs->dst_data.db_len);
+	hdr->dsh_rowoff = hdr->dsh_keyoff +
+	    nrows * snap->dts_maxkeys * sizeof (int64_t);
+	hdr->dsh_bucketoff = hdr->dsh_rowoff + snap->dts_rows.db_len;
+
+#undef	DTA_SNAP_ALIGN
+
+	bcopy(snap->dts_vars.db_buf, buf + hdr->dsh_varoff,
+	    snap->dts_vars.db_len);
+	bcopy(strs->dst_index.db_buf, buf + hdr->dsh_stroff,
+	    strs->dst_index.db_len);
+	bcopy(strs->dst_data.db_buf, buf + hdr->dsh_strdataoff,
+	    strs->dst_data.db_len);
+	bcopy(snap->dts_rows.db_buf, buf + hdr->dsh_rowoff,
+	    snap->dts_rows.db_len);
+	bcopy(snap->dts_buckets.db_buf, buf + hdr->dsh_bucketoff,
+	    snap->dts_buckets.db_len);
+
+	dst = (int64_t *)(buf + hdr->dsh_keyoff);
+	for (r = 0; r < nrows; r++) {
+		uint16_t nkeys = vars[rows[r].dsr_var].dsv_nkeys;
+
+		bcopy(src, dst, nkeys * sizeof (int64_t));
+		src += nkeys;
+		dst += snap->dts_maxkeys;
+	}
+
+	*bufp = buf;
+	*lenp = size;
+	return (0);
+}
+
+static void
+dta_snap_fini(dta_snap_t *snap)
+{
+	dta_buf_fini(&snap->dts_vars);
+	dta_strtab_fini(&snap->dts_strings);
+	dta_buf_fini(&snap->dts_keys);
+	dta_buf_fini(&snap->dts_rows);
+	dta_buf_fini(&snap->dts_buckets);
+	free(snap->dts_varmap);
+}
+
+
+/*
+ * Entry point for consumer.rollup(): set up a ring of "nwindows" rollup
+ * windows, discarding any existing ones.  With zero windows, rollups are
+ * disabled and their memory is freed.
+ */
+static int
+dta_rollup(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_rollup_t *rup = NULL;
+	shim_val_t *arg;
+	int nwindows, i;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	nwindows = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if (nwindows > 0) {
+		if ((rup = calloc(1, sizeof (*rup))) == NULL ||
+		    (rup->dru_windows = calloc(nwindows,
+		    sizeof (dta_aggtab_t))) == NULL) {
+			shim_throw_error(ctx, "malloc: %s", strerror(errno));
+			free(rup);
+			return (TRUE);
+		}
+
+		rup->dru_nwindows = nwindows;
+		rup->dru_cur = nwindows - 1;
+		for (i = 0; i < nwindows; i++)
+			dta_aggtab_init(&rup->dru_windows[i]);
+		dta_aggtab_init(&rup->dru_merged);
+		dta_aggtab_init(&rup->dru_next);
+	}
+
+	dta_rollup_fini(dtap->dta_rollup);
+	dtap->dta_rollup = rup;
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.rollupTick(): consume the aggregation buffer (just
+ * like aggwalk()) into the next rollup window, replacing the oldest window if
+ * the ring is full.  Returns the number of records in the new window.  If the
+ * walk fails, the ring and the aggregation buffer are left as they were.
+ */
+static int
+dta_rolluptick(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_rollup_t *rup;
+	dta_aggtab_t tab;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if ((rup = dtap->dta_rollup) == NULL) {
+		shim_throw_error(ctx, "rollups are not enabled");
+		return (TRUE);
+	}
+
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	if (dta_agg_snapwalk(dtap, dtrace_aggregate_walk,
+	    dta_dt_rollup, dtap) != 0) {
+		dtap->dta_flags &= ~DTA_F_CONSUMING;
+		dta_aggtab_clear(&rup->dru_next);
+		dta_error_throw(dtap, ctx);
+		return (TRUE);
+	}
+
+	rup->dru_cur = (rup->dru_cur + 1) % rup->dru_nwindows;
+	if (rup->dru_nfilled < rup->dru_nwindows)
+		rup->dru_nfilled++;
+
+	tab = rup->dru_windows[rup->dru_cur];
+	rup->dru_windows[rup->dru_cur] = rup->dru_next;
+	rup->dru_next = tab;
+	dta_aggtab_clear(&rup->dru_next);
+
+	(void) dta_agg_remove(dtap);
+	dtap->dta_flags &= ~DTA_F_CONSUMING;
+
+	if (dtap->dta_rval == 0)
+		shim_args_set_rval(ctx, args, shim_number_new(ctx,
+		    rup->dru_windows[rup->dru_cur].dat_nents));
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+static int
+dta_dt_rollup(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_hdl_t *dtap = arg;
+	dta_rollup_t *rup = dtap->dta_rollup;
+	dta_aggtab_t *tab = &rup->dru_next;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_aggval_t val;
+	dta_aggvar_t *var;
+
+	assert(aggdesc->dtagd_nrecs >= 2);
+
+	if (dta_aggval(dtap, agg, &val) != 0 ||
+	    dta_aggkey_encode(dtap, agg, &rup->dru_key) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if ((var = dta_aggtab_var(tab, aggdesc->dtagd_varid, val.dtv_kind,
+	    val.dtv_param, aggdesc->dtagd_nrecs - 2, val.dtv_nvals,
+	    aggdesc->dtagd_name)) == NULL ||
+	    dta_aggtab_update(tab, var, (uint8_t *)rup->dru_key.db_buf,
+	    rup->dru_key.db_len, val.dtv_data) != 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't update rollup for aggregation \"%s\": %s\n",
+		    aggdesc->dtagd_name, strerror(errno));
+		dtap->dta_rval = -1;
+		return (DTRACE_AGGWALK_ERROR);
+	}
+
+	return (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * Entry point for consumer.rollupQuery(): merge the newest "nwindows" rollup
+ * windows and invoke the callback for each resulting record exactly as
+ * aggwalk() would, including its filter and statistics arguments.  Nothing is
+ * removed from the windows.
+ */
+static int
+dta_rollupquery(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_rollup_t *rup;
+	dta_aggfilter_t filter;
+	dta_aggstats_t stats;
+	dta_buf_t exact;
+	const dta_aggtab_t *src;
+	const dta_aggent_t *ent;
+	shim_val_t *arg;
+	int nwindows, argi, i;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 2);
+	nwindows = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if ((rup = dtap->dta_rollup) == NULL) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "rollups are not enabled");
+		return (TRUE);
+	}
+
+	argi = 3;
+	if (dta_aggfilter_parse(ctx, args, &argi, &filter) != 0) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "rollupquery: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	if (dta_aggstats_parse(ctx, args, &argi, &stats) != 0) {
+		dta_aggfilter_fini(&filter);
+		shim_value_release(callback);
+		shim_throw_error(ctx, "rollupquery: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	if (nwindows > rup->dru_nfilled)
+		nwindows = rup->dru_nfilled;
+
+	dta_error_clear(dtap);
+	dtap->dta_rval = 0;
+
+	/*
+	 * A single window can be reported directly.  Otherwise, merge the
+	 * windows from oldest to newest so that records come out roughly in
+	 * the order they first appeared.
+	 */
+	if (nwindows == 1) {
+		src = &rup->dru_windows[rup->dru_cur];
+	} else {
+		src = &rup->dru_merged;
+		for (i = nwindows - 1; i >= 0; i--) {
+			if (dta_aggtab_merge(&rup->dru_merged,
+			    &rup->dru_windows[(rup->dru_cur - i +
+			    rup->dru_nwindows) % rup->dru_nwindows]) == 0)
+				continue;
+
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "couldn't merge rollup windows: %s\n",
+			    strerror(errno));
+			dtap->dta_rval = -1;
+			break;
+		}
+	}
+
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	dtap->dta_consume_callback = callback;
+	dtap->dta_consume_ctx = ctx;
+	dtap->dta_aggstats = stats.das_enabled ? &stats : NULL;
+	bzero(&exact, sizeof (exact));
+	dtap->dta_exact = dta_flag_parse(ctx, args, &argi) ? &exact : NULL;
+	if (dta_flag_parse(ctx, args, &argi))
+		dtap->dta_flags |= DTA_F_SLOTS;
+
+	for (ent = src->dat_first; ent != NULL && dtap->dta_rval == 0;
+	    ent = ent->dae_lnext) {
+		if (dta_aggfilter_match_ent(&filter, ent))
+			(void) dta_rollup_emit(dtap, ent);
+	}
+
+	dtap->dta_aggstats = NULL;
+	dtap->dta_exact = NULL;
+	dta_buf_fini(&exact);
+	dtap->dta_consume_callback = NULL;
+	dtap->dta_consume_ctx = NULL;
+	dtap->dta_flags &= ~(DTA_F_CONSUMING | DTA_F_SLOTS);
+
+	dta_aggtab_clear(&rup->dru_merged);
+	dta_aggfilter_fini(&filter);
+	dta_aggstats_fini(&stats);
+	shim_value_release(callback);
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+/*
+ * Invoke the current callback for a record of one of our own tables (a rollup
+ * window or a merge), with the same arguments that dta_dt_aggwalk() would use
+ * for the corresponding record of the aggregation buffer.
+ */
+static int
+dta_rollup_emit(dta_hdl_t *dtap, const dta_aggent_t *ent)
+{
+	shim_ctx_t *ctx = dtap->dta_consume_ctx;
+	const dta_aggvar_t *var = ent->dae_var;
+	const uint8_t *key = ent->dae_key;
+	const uint8_t *end = key + ent->dae_keylen;
+	dta_aggval_t val;
+	shim_val_t **argv;
+	int *lent;
+	const char *str;
+	uint32_t len;
+	int64_t ival, slot = -1;
+	int argc, nvalargs, i;
+
+	val.dtv_kind = var->dav_kind;
+	val.dtv_param = var->dav_param;
+	val.dtv_data = ent->dae_vals;
+	val.dtv_nvals = var->dav_nvals;
+
+	if (dta_aggwalk_argv_populate(dtap, NULL, 0, &val, &nvalargs) != 0 ||
+	    dta_exact_begin(dtap, var->dav_nkeys + 1 + var->dav_nvals) != 0)
+		return (-1);
+
+	if ((dtap->dta_flags & DTA_F_SLOTS) != 0 &&
+	    (slot = dta_slots_ent(dtap, ent)) == -1)
+		return (-1);
+
+	argc = 3 + (slot == -1 ? var->dav_nkeys : 0) + nvalargs;
+	argv = calloc(argc, sizeof (argv[0]));
+	lent = calloc(argc, sizeof (lent[0]));
+	if (argv == NULL || lent == NULL) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+		free(argv);
+		free(lent);
+		return (-1);
+	}
+
+	argv[0] = shim_integer_new(ctx, var->dav_varid);
+	argv[1] = dta_intern_get(dtap, dta_aggkind_name(var->dav_kind),
+	    &lent[1]);
+	argv[2] = shim_integer_uint(ctx,
+	    slot == -1 ? var->dav_nkeys : (uint32_t)slot);
+
+	for (i = 0; slot == -1 && i < var->dav_nkeys; i++) {
+		if (dta_aggkey_next(&key, end, &ival, &str, &len) !=
+		    DTA_KEY_INT) {
+			argv[i + 3] = dta_intern_get(dtap, str, &lent[i + 3]);
+		} else if (dtap->dta_exact != NULL) {
+			dta_exact_put(dtap, ival);
+			argv[i + 3] = shim_null();
+		} else {
+			argv[i + 3] = shim_number_new(ctx, (double)ival);
+		}
+	}
+
+	(void) dta_aggwalk_argv_populate(dtap, &argv[i + 3], nvalargs, &val,
+	    NULL);
+
+	(void) shim_func_call_val(ctx, NULL, dtap->dta_consume_callback,
+	    argc, argv, NULL);
+	dta_intern_release(dtap, argv, lent, argc);
+	free(argv);
+	free(lent);
+	return (0);
+}
+
+static void
+dta_rollup_fini(dta_rollup_t *rup)
+{
+	int i;
+
+	if (rup == NULL)
+		return;
+
+	for (i = 0; i < rup->dru_nwindows; i++)
+		dta_aggtab_fini(&rup->dru_windows[i]);
+
+	dta_aggtab_fini(&rup->dru_merged);
+	dta_aggtab_fini(&rup->dru_next);
+	dta_buf_fini(&rup->dru_key);
+	free(rup->dru_windows);
+	free(rup);
+}
+
+
+/*
+ * Merging across consumers: an enabling that's too big for one consumer can be
+ * sharded across several, and consumer.aggmerge() then combines the
+ * aggregation buffers of all of them into a single table (see dta_aggtab.h),
+ * with records merged the way DTrace itself would, and reports the result
+ * through the aggwalk() callback.  The consumers' variable IDs are unrelated,
+ * so variables are matched by name.  Each merged variable takes the ID it has
+ * in the first consumer that has it (or a fresh ID, if that one is taken).
+ *
+ * Every consumer is merged before any records are removed, so that a failure
+ * part way through (such as an aggregation whose shape differs between
+ * consumers) leaves all of them intact.  Records are removed only once they've
+ * been reported, by walking each consumer's existing snapshot again.
+ */
+typedef struct dta_merge {
+	dta_hdl_t	*dme_hdl;	/* handle being walked */
+	dta_aggtab_t	dme_tab;
+	dta_buf_t	dme_key;	/* scratch space for encoding keys */
+	dta_aggfilter_t	*dme_filter;
+} dta_merge_t;
+
+#define	DTA_MERGE_F_PEEK	0x1	/* leave the records in place */
+
+/*
+ * Entry point for consumer.aggmerge().  The arguments are the callback, flags
+ * (DTA_MERGE_F_*), the number of other consumers, those consumers' handles,
+ * and then aggwalk()'s filter, statistics, and exact arguments.  The filter
+ * applies to each consumer's own variable IDs and keys, and records that don't
+ * match are left in place.
+ */
+static int
+dta_aggmerge(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap, **hdls = NULL;
+	dta_merge_t merge;
+	dta_aggfilter_t filter;
+	dta_aggstats_t stats;
+	dta_buf_t exact;
+	const dta_aggent_t *ent;
+	shim_val_t *arg;
+	int flags, nhdls, nbusy, argi, i, rval;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 2);
+	flags = shim_number_value(arg);
+	shim_value_release(arg);
+
+	arg = shim_args_get(args, 3);
+	nhdls = shim_number_value(arg) + 1;
+	shim_value_release(arg);
+
+	if ((hdls = calloc(nhdls, sizeof (hdls[0]))) == NULL) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	hdls[0] = dtap;
+	for (i = 1; i < nhdls; i++) {
+		arg = shim_args_get(args, i + 3);
+		selfptr = shim_integer_uint32_value(arg);
+		shim_value_release(arg);
+		hdls[i] = UNPACK_SELF(selfptr);
+	}
+
+	/*
+	 * Mark every handle as consuming, which also catches a handle that
+	 * appears twice.
+	 */
+	for (nbusy = 0; nbusy < nhdls; nbusy++) {
+		if ((hdls[nbusy]->dta_flags &
+		    (DTA_F_BUSY | DTA_F_CONSUMING)) != 0)
+			break;
+		hdls[nbusy]->dta_flags |= DTA_F_CONSUMING;
+	}
+
+	if (nbusy < nhdls) {
+		for (i = 0; i < nbusy; i++)
+			hdls[i]->dta_flags &= ~DTA_F_CONSUMING;
+		free(hdls);
+		shim_value_release(callback);
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	argi = nhdls + 3;
+	if (dta_aggfilter_parse(ctx, args, &argi, &filter) != 0 ||
+	    dta_aggstats_parse(ctx, args, &argi, &stats) != 0) {
+		dta_aggfilter_fini(&filter);
+		for (i = 0; i < nhdls; i++)
+			hdls[i]->dta_flags &= ~DTA_F_CONSUMING;
+		free(hdls);
+		shim_value_release(callback);
+		shim_throw_error(ctx, "aggmerge: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	bzero(&merge, sizeof (merge));
+	dta_aggtab_init(&merge.dme_tab);
+	merge.dme_filter = &filter;
+
+	dta_error_clear(dtap);
+	dtap->dta_rval = 0;
+
+	for (i = 0; i < nhdls; i++) {
+		merge.dme_hdl = hdls[i];
+		if (dta_agg_snapwalk(hdls[i], dtrace_aggregate_walk,
+		    dta_dt_merge, &merge) != 0) {
+			dta_merge_error(dtap, hdls[i], i);
+			break;
+		}
+	}
+
+	dtap->dta_consume_callback = callback;
+	dtap->dta_consume_ctx = ctx;
+	dtap->dta_aggstats = stats.das_enabled ? &stats : NULL;
+	bzero(&exact, sizeof (exact));
+	dtap->dta_exact = dta_flag_parse(ctx, args, &argi) ? &exact : NULL;
+	if (dta_flag_parse(ctx, args, &argi))
+		dtap->dta_flags |= DTA_F_SLOTS;
+
+	for (ent = merge.dme_tab.dat_first; ent != NULL &&
+	    dtap->dta_rval == 0; ent = ent->dae_lnext)
+		(void) dta_rollup_emit(dtap, ent);
+
+	/*
+	 * Remove what was reported.  The snapshots aren't refreshed, so this
+	 * visits exactly the records that were merged.
+	 */
+	for (i = 0; i < nhdls && dtap->dta_rval == 0 &&
+	    (flags & DTA_MERGE_F_PEEK) == 0; i++) {
+		merge.dme_hdl = hdls[i];
+		if (hdls[i] != dtap)
+			dta_error_clear(hdls[i]);
+		hdls[i]->dta_rval = 0;
+		rval = dtrace_aggregate_walk(hdls[i]->dta_dtrace,
+		    dta_dt_mergeremove, &merge);
+		if (rval == -1) {
+			(void) snprintf(hdls[i]->dta_errmsg,
+			    sizeof (hdls[i]->dta_errmsg),
+			    "couldn't walk aggregate: %s\n",
+			    dtrace_errmsg(hdls[i]->dta_dtrace,
+			    dtrace_errno(hdls[i]->dta_dtrace)));
+			hdls[i]->dta_rval = -1;
+			dta_merge_error(dtap, hdls[i], i);
+		}
+	}
+
+	dtap->dta_aggstats = NULL;
+	dtap->dta_exact = NULL;
+	dta_buf_fini(&exact);
+	dtap->dta_consume_callback = NULL;
+	dtap->dta_consume_ctx = NULL;
+	for (i = 0; i < nhdls; i++)
+		hdls[i]->dta_flags &= ~DTA_F_CONSUMING;
+	dtap->dta_flags &= ~DTA_F_SLOTS;
+
+	dta_aggtab_fini(&merge.dme_tab);
+	dta_buf_fini(&merge.dme_key);
+	dta_aggfilter_fini(&filter);
+	dta_aggstats_fini(&stats);
+	free(hdls);
+	shim_value_release(callback);
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+static int
+dta_dt_merge(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_merge_t *dme = arg;
+	dta_hdl_t *dtap = dme->dme_hdl;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_aggval_t val;
+	dta_aggvar_t *var;
+
+	assert(aggdesc->dtagd_nrecs >= 2);
+
+	if (!dta_aggfilter_match(dtap, dme->dme_filter, agg))
+		return (DTRACE_AGGWALK_NEXT);
+
+	if (dta_aggval(dtap, agg, &val) != 0 ||
+	    dta_aggkey_encode(dtap, agg, &dme->dme_key) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if ((var = dta_merge_var(&dme->dme_tab, aggdesc, &val)) == NULL ||
+	    dta_aggtab_update(&dme->dme_tab, var,
+	    (uint8_t *)dme->dme_key.db_buf, dme->dme_key.db_len,
+	    val.dtv_data) != 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't merge aggregation \"%s\": %s\n",
+		    aggdesc->dtagd_name, errno == EINVAL ?
+		    "aggregations differ between consumers" : strerror(errno));
+		dtap->dta_rval = -1;
+		return (DTRACE_AGGWALK_ERROR);
+	}
+
+	return (DTRACE_AGGWALK_NEXT);
+}
+
+/*
+ * Remove a record that dta_dt_merge() merged.
+ */
+static int
+dta_dt_mergeremove(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_merge_t *dme = arg;
+
+	if (!dta_aggfilter_match(dme->dme_hdl, dme->dme_filter, agg))
+		return (DTRACE_AGGWALK_NEXT);
+
+	return (DTRACE_AGGWALK_REMOVE);
+}
+
+/*
+ * Report the failure of consumer "i" of a merge, "hdl", as the failure of the
+ * merge as a whole.  Errors from other consumers are prefixed with the
+ * consumer's index, truncating the original message as needed.
+ */
+static void
+dta_merge_error(dta_hdl_t *dtap, dta_hdl_t *hdl, int i)
+{
+	if (hdl != dtap) {
+		dta_error_canonicalize(hdl);
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "consumer %d: %.*s", i,
+		    (int)sizeof (dtap->dta_errmsg) - 32, hdl->dta_errmsg);
+	}
+
+	dtap->dta_rval = -1;
+}
+
+/*
+ * Returns the variable of the merge table "tab" for the aggregation described
+ * by "aggdesc" and "valp", matching variables by name.
+ */
+static dta_aggvar_t *
+dta_merge_var(dta_aggtab_t *tab, const dtrace_aggdesc_t *aggdesc,
+    const dta_aggval_t *valp)
+{
+	dta_aggvar_t *var;
+	int64_t varid, maxid = 0;
+
+	for (var = tab->dat_vars; var != NULL; var = var->dav_next) {
+		if (strcmp(var->dav_name, aggdesc->dtagd_name) == 0)
+			break;
+		if (var->dav_varid > maxid)
+			maxid = var->dav_varid;
+	}
+
+	if (var != NULL)
+		varid = var->dav_varid;
+	else if (dta_aggtab_findvar(tab, aggdesc->dtagd_varid) == NULL)
+		varid = aggdesc->dtagd_varid;
+	else
+		varid = maxid + 1;
+
+	return (dta_aggtab_var(tab, varid, valp->dtv_kind, valp->dtv_param,
+	    aggdesc->dtagd_nrecs - 2, valp->dtv_nvals, aggdesc->dtagd_name));
+}
+
+
+/*
+ * Entry point for consumer.exposition().  The arguments are validated and
+ * flattened by the caller:
+ *
+ *     flags, nmetrics, then for each metric:
+ *         varid, name, help, type, nlabels, label1, ...
+ *
+ * The text is built in native memory and handed to JavaScript as a Buffer
+ * without being copied.
+ */
+static int
+dta_exposition(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_expo_t expo;
+	shim_val_t *rval;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	bzero(&expo, sizeof (expo));
+	expo.dte_hdl = dtap;
+	if (dta_expo_parse(ctx, args, &expo) != 0) {
+		shim_throw_error(ctx, "exposition: %s", strerror(errno));
+		dta_expo_fini(&expo);
+		return (TRUE);
+	}
+
+	/*
+	 * Walking in variable order keeps each metric's samples together, as
+	 * the format requires.
+	 */
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	if (dta_agg_snapwalk(dtap, dtrace_aggregate_walk_varkeysorted,
+	    dta_dt_expo, &expo) == 0 &&
+	    (expo.dte_flags & DTA_EXPO_F_OPENMETRICS) != 0 &&
+	    dta_buf_printf(&expo.dte_buf, "# EOF\n") != 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+	}
+	dtap->dta_flags &= ~DTA_F_CONSUMING;
+
+	if (dtap->dta_rval == 0) {
+		if (expo.dte_buf.db_len == 0) {
+			rval = shim_buffer_new(ctx, 0);
+		} else {
+			rval = shim_buffer_new_external(ctx,
+			    expo.dte_buf.db_buf, expo.dte_buf.db_len,
+			    dta_buf_free, NULL);
+			bzero(&expo.dte_buf, sizeof (expo.dte_buf));
+		}
+
+		shim_args_set_rval(ctx, args, rval);
+	}
+
+	dta_expo_fini(&expo);
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+static int
+dta_dt_expo(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_expo_t *expo = arg;
+	dta_hdl_t *dtap = expo->dte_hdl;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	const dta_expmetric_t *dem;
+	const char *type, *name;
+	dta_aggval_t val;
+	int i, rv;
+
+	for (i = 0; i < expo->dte_nmetrics; i++) {
+		if (expo->dte_metrics[i].dem_varid == aggdesc->dtagd_varid)
+			break;
+	}
+
+	if (i == expo->dte_nmetrics)
+		return (DTRACE_AGGWALK_NEXT);
+
+	dem = &expo->dte_metrics[i];
+	if (dta_aggval(dtap, agg, &val) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if (val.dtv_kind == DTA_AGG_QUANTIZE ||
+	    val.dtv_kind == DTA_AGG_LQUANTIZE ||
+	    val.dtv_kind == DTA_AGG_LLQUANTIZE)
+		type = "histogram";
+	else if (dem->dem_type != NULL)
+		type = dem->dem_type;
+	else if (val.dtv_kind == DTA_AGG_COUNT)
+		type = "counter";
+	else
+		type = "gauge";
+
+	/*
+	 * OpenMetrics requires counter samples to be suffixed with "_total",
+	 * while the metric family itself is named without it.
+	 */
+	name = (expo->dte_flags & DTA_EXPO_F_OPENMETRICS) != 0 &&
+	    strcmp(type, "counter") == 0 ? "_total" : "";
+
+	if (dta_expo_header(expo, dem, type) != 0 ||
+	    dta_expo_labels(expo, dem, agg) != 0)
+		goto err;
+
+	switch (val.dtv_kind) {
+	case DTA_AGG_AVG:
+		rv = dta_expo_sample(expo, name, NULL, NULL, "%.17g",
+		    val.dtv_data[0] == 0 ? 0 :
+		    val.dtv_data[1] / (double)val.dtv_data[0]);
+		break;
+
+	case DTA_AGG_QUANTIZE:
+	case DTA_AGG_LQUANTIZE:
+	case DTA_AGG_LLQUANTIZE:
+		rv = dta_expo_histogram(expo, name, &val);
+		break;
+
+	default:
+		rv = dta_expo_sample(expo, name, NULL, NULL, "%lld",
+		    (long long)val.dtv_data[0]);
+		break;
+	}
+
+	if (rv != 0)
+		goto err;
+
+	if ((expo->dte_flags & DTA_EXPO_F_CONSUME) != 0)
+		return (DTRACE_AGGWALK_REMOVE);
+	return (DTRACE_AGGWALK_NEXT);
+
+err:
+	if (dtap->dta_rval == 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "malloc: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+	}
+
+	return (DTRACE_AGGWALK_ERROR);
+}
+
+/*
+ * Write the "# TYPE" and "# HELP" lines for a metric, unless we just did.
+ */
+static int
+dta_expo_header(dta_expo_t *expo, const dta_expmetric_t *dem,
+    const char *type)
+{
+	if (expo->dte_cur == dem)
+		return (0);
+
+	expo->dte_cur = dem;
+	if (dta_buf_printf(&expo->dte_buf, "# TYPE %s %s\n",
+	    dem->dem_name, type) != 0)
+		return (-1);
+
+	if (dem->dem_help == NULL)
+		return (0);
+
+	if (dta_buf_printf(&expo->dte_buf, "# HELP %s ", dem->dem_name) != 0 ||
+	    dta_buf_escape(&expo->dte_buf, dem->dem_help, B_FALSE) != 0 ||
+	    dta_buf_append(&expo->dte_buf, "\n", 1) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Render the keys of a record as labels (without the surrounding braces) into
+ * dte_labels.  Keys without a configured label name are called "key0",
+ * "key1", and so on.
+ */
+static int
+dta_expo_labels(dta_expo_t *expo, const dta_expmetric_t *dem,
+    const dtrace_aggdata_t *agg)
+{
+	dta_hdl_t *dtap = expo->dte_hdl;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_buf_t *dbp = &expo->dte_labels;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	const char *str;
+	char buf[2048];
+	int64_t ival;
+	int i;
+
+	if ((plan = dta_plan_agg(dtap, aggdesc)) == NULL)
+		return (-1);
+
+	dbp->db_len = 0;
+	for (i = 0; i < plan->dpl_nfields; i++) {
+		fld = &plan->dpl_fields[i];
+		if (fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "unsupported action %s as key #%d in aggregation "
+			    "\"%s\"\n",
+			    dta_dt_action(fld->dfl_rec->dtrd_action), i + 1,
+			    aggdesc->dtagd_name);
+			dtap->dta_rval = -1;
+			return (-1);
+		}
+
+		if ((i > 0 && dta_buf_append(dbp, ",", 1) != 0) ||
+		    (i < dem->dem_nlabels ?
+		    dta_buf_printf(dbp, "%s=\"", dem->dem_labels[i]) :
+		    dta_buf_printf(dbp, "key%d=\"", i)) != 0)
+			return (-1);
+
+		if (dta_field_read(dtap, fld, agg->dtada_data +
+		    fld->dfl_offset, &ival, &str, buf, sizeof (buf)) ==
+		    DTA_V_INT) {
+			if (dta_buf_printf(dbp, "%lld\"", (long long)ival) != 0)
+				return (-1);
+		} else if (dta_buf_escape(dbp, str, B_TRUE) != 0 ||
+		    dta_buf_append(dbp, "\"", 1) != 0) {
+			return (-1);
+		}
+	}
+
+	return (0);
+}
+
+/*
+ * Write one sample of the current metric: its name, "suffix", the current
+ * record's labels (plus label "extra" with value "extraval", if given), and
+ * the value, formatted with "fmt".
+ */
+static int
+dta_expo_sample(dta_expo_t *expo, const char *suffix, const char *extra,
+    const char *extraval, const char *fmt, ...)
+{
+	dta_buf_t *dbp = &expo->dte_buf;
+	const dta_buf_t *labels = &expo->dte_labels;
+	char value[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	(void) vsnprintf(value, sizeof (value), fmt, ap);
+	va_end(ap);
+
+	if (dta_buf_printf(dbp, "%s%s", expo->dte_cur->dem_name, suffix) != 0)
+		return (-1);
+
+	if (labels->db_len > 0 || extra != NULL) {
+		if (dta_buf_append(dbp, "{", 1) != 0 ||
+		    dta_buf_append(dbp, labels->db_buf, labels->db_len) != 0 ||
+		    (extra != NULL && dta_buf_printf(dbp, "%s%s=\"%s\"",
+		    labels->db_len > 0 ? "," : "", extra, extraval) != 0) ||
+		    dta_buf_append(dbp, "}", 1) != 0)
+			return (-1);
+	}
+
+	return (dta_buf_printf(dbp, " %s\n", value));
+}
+
+/*
+ * Write the samples for a quantizing action as a cumulative histogram.  Each
+ * bucket's "le" bound is the largest integer it counts.  Every bucket is
+ * written, even if it's empty, so that a histogram has the same "le" labels in
+ * every exposition, except for the last bucket, which is unbounded and so
+ * becomes the "+Inf" bucket.  The "_sum" is approximated from bucket midpoints
+ * (see dta_aggstats_compute()).
+ */
+static int
+dta_expo_histogram(dta_expo_t *expo, const char *suffix,
+    const dta_aggval_t *valp)
+{
+	dta_aggstats_t *stats = &expo->dte_stats;
+	const int64_t *data = valp->dtv_data;
+	int nb = valp->dtv_nvals;
+	double total, mean;
+	int64_t cum;
+	char le[32];
+	int bi;
+
+	if (dta_aggstats_reserve(stats, nb) != 0)
+		return (-1);
+
+	dta_aggstats_compute(stats, valp, &total, &mean);
+	dta_bucket_ranges(valp, stats->das_lo, stats->das_hi);
+
+	cum = 0;
+	for (bi = 0; bi < nb; bi++) {
+		cum += data[bi];
+		if (stats->das_hi[bi] == INT64_MAX)
+			break;
+
+		(void) snprintf(le, sizeof (le), "%lld",
+		    (long long)stats->das_hi[bi]);
+		if (dta_expo_sample(expo, "_bucket", "le", le, "%lld",
+		    (long long)cum) != 0)
+			return (-1);
+	}
+
+	if (dta_expo_sample(expo, "_bucket", "le", "+Inf", "%.17g",
+	    total) != 0 ||
+	    dta_expo_sample(expo, "_sum", NULL, NULL, "%.17g",
+	    total == 0 ? 0 : mean * total) != 0 ||
+	    dta_expo_sample(expo, "_count", NULL, NULL, "%.17g", total) != 0)
+		return (-1);
+
+	return (0);
+}
+
+/*
+ * Parse the metric descriptions passed to dta_exposition().
+ */
+static int
+dta_expo_parse(shim_ctx_t *ctx, shim_args_t *args, dta_expo_t *expo)
+{
+	dta_expmetric_t *dem;
+	shim_val_t *arg;
+	int argi = 1;
+	int i, j;
+
+#define	NEXTARG()	(arg = shim_args_get(args, argi++))
+#define	STRARG()	(shim_value_is(arg, SHIM_TYPE_STRING) ? \
+	shim_string_value(arg) : NULL)
+
+	NEXTARG();
+	expo->dte_flags = shim_number_value(arg);
+	shim_value_release(arg);
+
+	NEXTARG();
+	expo->dte_nmetrics = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if (expo->dte_nmetrics > 0 && (expo->dte_metrics = calloc(
+	    expo->dte_nmetrics, sizeof (dta_expmetric_t))) == NULL) {
+		expo->dte_nmetrics = 0;
+		return (-1);
+	}
+
+	for (i = 0; i < expo->dte_nmetrics; i++) {
+		dem = &expo->dte_metrics[i];
+
+		NEXTARG();
+		dem->dem_varid = shim_number_value(arg);
+		shim_value_release(arg);
+
+		NEXTARG();
+		dem->dem_name = STRARG();
+		shim_value_release(arg);
+
+		NEXTARG();
+		dem->dem_help = STRARG();
+		shim_value_release(arg);
+
+		NEXTARG();
+		dem->dem_type = STRARG();
+		shim_value_release(arg);
+
+		NEXTARG();
+		dem->dem_nlabels = shim_number_value(arg);
+		shim_value_release(arg);
+
+		if (dem->dem_name == NULL) {
+			errno = EINVAL;
+			return (-1);
+		}
+
+		if (dem->dem_nlabels > 0 && (dem->dem_labels = calloc(
+		    dem->dem_nlabels, sizeof (char *))) == NULL) {
+			dem->dem_nlabels = 0;
+			return (-1);
+		}
+
+		for (j = 0; j < dem->dem_nlabels; j++) {
+			NEXTARG();
+			dem->dem_labels[j] = STRARG();
+			shim_value_release(arg);
+
+			if (dem->dem_labels[j] == NULL) {
+				errno = EINVAL;
+				return (-1);
+			}
+		}
+	}
+
+#undef	NEXTARG
+#undef	STRARG
+
+	return (0);
+}
+
+static void
+dta_expo_fini(dta_expo_t *expo)
+{
+	dta_expmetric_t *dem;
+	int i, j;
+
+	for (i = 0; i < expo->dte_nmetrics; i++) {
+		dem = &expo->dte_metrics[i];
+		for (j = 0; j < dem->dem_nlabels; j++)
+			free(dem->dem_labels[j]);
+		free(dem->dem_labels);
+		free(dem->dem_name);
+		free(dem->dem_help);
+		free(dem->dem_type);
+	}
+
+	free(expo->dte_metrics);
+	dta_buf_fini(&expo->dte_buf);
+	dta_buf_fini(&expo->dte_labels);
+	dta_aggstats_fini(&expo->dte_stats);
+}
+
+
+/*
+ * Entry point for consumer.aggencode(): walk the aggregation buffer (removing
+ * the records walked unless DTA_WIRE_ENC_F_PEEK is set) and return its records
+ * as a wire frame (see dta_wire.h) in a Buffer.  With DTA_WIRE_ENC_F_DELTA, the
+ * frame is encoded relative to the previous one, if there was one.
+ */
+static int
+dta_aggencode(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_wstate_t *dtw;
+	dta_aggtab_t tmp;
+	dta_buf_t out;
+	shim_val_t *arg;
+	int flags;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	flags = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if ((dtw = dtap->dta_wire) == NULL) {
+		if ((dtw = calloc(1, sizeof (*dtw))) == NULL) {
+			shim_throw_error(ctx, "malloc: %s", strerror(errno));
+			return (TRUE);
+		}
+
+		dta_aggtab_init(&dtw->dtw_prev);
+		dta_aggtab_init(&dtw->dtw_cur);
+		dtap->dta_wire = dtw;
+	}
+
+	dta_aggtab_clear(&dtw->dtw_cur);
+	bzero(&out, sizeof (out));
+
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	if (dta_agg_snapwalk(dtap, dtrace_aggregate_walk,
+	    dta_dt_wire, dtap) == 0 &&
+	    dta_wire_encode(&dtw->dtw_cur,
+	    (flags & DTA_WIRE_ENC_F_DELTA) != 0 && dtw->dtw_seq != 0 ?
+	    &dtw->dtw_prev : NULL, dtw->dtw_seq + 1, dtw->dtw_seq, &out) != 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't encode aggregation data: %s\n", strerror(errno));
+		dtap->dta_rval = -1;
+	}
+
+	/*
+	 * Records are only removed once they've been encoded, so if encoding
+	 * fails, they're sent in the next frame instead.
+	 */
+	if (dtap->dta_rval == 0 && (flags & DTA_WIRE_ENC_F_PEEK) == 0)
+		(void) dta_agg_remove(dtap);
+	dtap->dta_flags &= ~DTA_F_CONSUMING;
+
+	if (dtap->dta_rval == 0) {
+		/*
+		 * The records just encoded become the base for the next frame.
+		 * Swapping the tables lets the next walk reuse the old one's
+		 * hash table and variables.
+		 */
+		tmp = dtw->dtw_prev;
+		dtw->dtw_prev = dtw->dtw_cur;
+		dtw->dtw_cur = tmp;
+		dtw->dtw_seq++;
+
+		shim_args_set_rval(ctx, args, shim_buffer_new_external(ctx,
+		    out.db_buf, out.db_len, dta_buf_free, NULL));
+	} else {
+		dta_buf_fini(&out);
+	}
+
+	dta_error_throw(dtap, ctx);
+	return (TRUE);
+}
+
+static int
+dta_dt_wire(const dtrace_aggdata_t *agg, void *arg)
+{
+	dta_hdl_t *dtap = arg;
+	dta_wstate_t *dtw = dtap->dta_wire;
+	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
+	dta_aggval_t val;
+	dta_aggvar_t *var;
+
+	assert(aggdesc->dtagd_nrecs >= 2);
+
+	if (dta_aggval(dtap, agg, &val) != 0 ||
+	    dta_aggkey_encode(dtap, agg, &dtw->dtw_key) != 0)
+		return (DTRACE_AGGWALK_ERROR);
+
+	if ((var = dta_aggtab_var(&dtw->dtw_cur, aggdesc->dtagd_varid,
+	    val.dtv_kind, val.dtv_param, aggdesc->dtagd_nrecs - 2,
+	    val.dtv_nvals, aggdesc->dtagd_name)) == NULL ||
+	    dta_aggtab_update(&dtw->dtw_cur, var,
+	    (uint8_t *)dtw->dtw_key.db_buf, dtw->dtw_key.db_len,
+	    val.dtv_data) != 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't encode aggregation \"%s\": %s\n",
+		    aggdesc->dtagd_name, strerror(errno));
+		dtap->dta_rval = -1;
+		return (DTRACE_AGGWALK_ERROR);
+	}
+
+	return (DTRACE_AGGWALK_NEXT);
+}
+
+
+/*
+ * Entry point for consumer.capture(): start capturing records to the capture
+ * log at "path".  The arguments (path, segsize, flags, maxage in milliseconds)
+ * are validated by the caller.
+ */
+static int
+dta_capture(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_capture_t *dcp;
+	shim_val_t *arg;
+	char *path;
+	size_t segsize;
+	int flags;
+	double maxage;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	path = shim_string_value(arg);
+	shim_value_release(arg);
+	arg = shim_args_get(args, 2);
+	segsize = shim_number_value(arg);
+	shim_value_release(arg);
+	arg = shim_args_get(args, 3);
+	flags = shim_number_value(arg);
+	shim_value_release(arg);
+	arg = shim_args_get(args, 4);
+	maxage = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		free(path);
+		return (TRUE);
+	}
+
+	if (dtap->dta_capture != NULL) {
+		shim_throw_error(ctx, "capture already in progress");
+		free(path);
+		return (TRUE);
+	}
+
+	if ((dcp = calloc(1, sizeof (*dcp))) == NULL) {
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+		free(path);
+		return (TRUE);
+	}
+
+	if (dta_caplog_open(&dcp->dcp_log, path, segsize,
+	    (flags & DTA_CAP_F_SYNC) != 0 ? DTA_CAPLOG_F_SYNC : 0) != 0) {
+		shim_throw_error(ctx, "capture: %s: %s", path,
+		    errno == EINVAL ? "not a capture log" : strerror(errno));
+		free(dcp);
+		free(path);
+		return (TRUE);
+	}
+
+	dcp->dcp_flags = flags;
+	dcp->dcp_maxage = (uint64_t)(maxage * 1000000);
+	dtap->dta_capture = dcp;
+	free(path);
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.captureFlush(): write out the current segment.
+ */
+static int
+dta_captureflush(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if (dtap->dta_capture == NULL) {
+		shim_throw_error(ctx, "capture is not enabled");
+		return (TRUE);
+	}
+
+	if (dta_caplog_flush(&dtap->dta_capture->dcp_log) != 0)
+		shim_throw_error(ctx, "capture: %s", strerror(errno));
+
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.captureStats(): invoke the callback with the
+ * capture statistics (see dta_capture_stats()).
+ */
+static int
+dta_capturestats(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if (dtap->dta_capture == NULL)
+		shim_throw_error(ctx, "capture is not enabled");
+	else
+		dta_capture_stats(dtap, ctx, callback);
+
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.captureStop(): write out the current segment, close
+ * the capture log, and invoke the callback with the final statistics.
+ */
+static int
+dta_capturestop(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_capture_t *dcp;
+	int rv, err;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		shim_value_release(callback);
+		return (TRUE);
+	}
+
+	if ((dcp = dtap->dta_capture) == NULL) {
+		shim_throw_error(ctx, "capture is not enabled");
+		shim_value_release(callback);
+		return (TRUE);
+	}
+
+	/*
+	 * The capture is stopped even if the last segment couldn't be written,
+	 * so the statistics (which will reflect that) are always reported.
+	 */
+	rv = dta_caplog_close(&dcp->dcp_log);
+	err = errno;
+	dta_capture_stats(dtap, ctx, callback);
+	if (rv != 0)
+		shim_throw_error(ctx, "capture: %s", strerror(err));
+
+	dtap->dta_capture = NULL;
+	free(dcp);
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Invoke "callback" with the capture statistics: records captured, segments
+ * written, bytes written, records lost to write errors, and nanoseconds spent
+ * in consume() while capturing.
+ */
+static void
+dta_capture_stats(dta_hdl_t *dtap, shim_ctx_t *ctx, shim_val_t *callback)
+{
+	dta_caplog_t *log = &dtap->dta_capture->dcp_log;
+	shim_val_t *argv[5];
+	int i;
+
+	argv[0] = shim_number_new(ctx, (double)log->dcl_stat_events);
+	argv[1] = shim_number_new(ctx, (double)log->dcl_stat_segments);
+	argv[2] = shim_number_new(ctx, (double)log->dcl_stat_bytes);
+	argv[3] = shim_number_new(ctx, (double)log->dcl_stat_dropped);
+	argv[4] = shim_number_new(ctx, (double)dtap->dta_capture->dcp_nsecs);
+
+	(void) shim_func_call_val(ctx, NULL, callback, 5, argv, NULL);
+	for (i = 0; i < 5; i++)
+		shim_value_release(argv[i]);
+}
+
+/*
+ * Append an event for probe "pd" to the capture log.  On failure, the error is
+ * left in the handle.
+ */
+static int
+dta_capture_record(dta_hdl_t *dtap, const dtrace_probedesc_t *pd,
+    dta_capev_t kind, int64_t val, const char *str)
+{
+	dta_capture_t *dcp = dtap->dta_capture;
+	dta_caplog_t *log = &dcp->dcp_log;
+
+	if (pd != dcp->dcp_lastpd || log->dcl_gen != dcp->dcp_lastgen) {
+		if ((dcp->dcp_lastprobe = dta_caplog_probe(log,
+		    pd->dtpd_provider, pd->dtpd_mod, pd->dtpd_func,
+		    pd->dtpd_name)) == -1) {
+			dcp->dcp_lastpd = NULL;
+			goto err;
+		}
+
+		dcp->dcp_lastpd = pd;
+		dcp->dcp_lastgen = log->dcl_gen;
+	}
+
+	if (dta_caplog_event(log, kind, dcp->dcp_lastprobe, val, str,
+	    str == NULL ? 0 : strlen(str)) == 0)
+		return (0);
+
+err:
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "capture: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (-1);
+}
+
+/*
+ * Entry point for consumer.snapshot(): drain the principal buffers once on a
+ * worker thread (see dta_ring_t), stopping tracing first unless the caller
+ * says otherwise.  (illumos won't read ring buffers while tracing:
+ * dtrace_work() skips them, and snapshotting one directly fails with EBUSY.)
+ * The callback is invoked when the snapshot is ready to be read with
+ * dta_snapshotread().
+ */
+static int
+dta_snapshot(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	uint32_t flags;
+	dta_hdl_t *dtap;
+	int rv;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UINT32, &flags,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if (dtap->dta_ring == NULL &&
+	    (dtap->dta_ring = calloc(1, sizeof (dta_ring_t))) == NULL) {
+		shim_value_release(callback);
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	dtap->dta_ring->drg_flags = flags;
+	rv = dta_async_begin(ctx, dtap, dta_async_snapshot, callback);
+	shim_value_release(callback);
+	return (rv);
+}
+
+static void
+dta_async_snapshot(dta_hdl_t *dtap)
+{
+	dtrace_hdl_t *dtp = dtap->dta_dtrace;
+	dta_ring_t *drg = dtap->dta_ring;
+	uint64_t start = dta_clock(CLOCK_MONOTONIC);
+
+	drg->drg_recs.db_len = 0;
+	drg->drg_strings.db_len = 0;
+
+	if ((drg->drg_flags & DTA_RING_F_STOP) != 0 &&
+	    (dtap->dta_flags & DTA_F_TRACING) != 0) {
+		if (dtrace_stop(dtp) == -1) {
+			(void) snprintf(dtap->dta_errmsg,
+			    sizeof (dtap->dta_errmsg),
+			    "couldn't disable tracing: %s\n",
+			    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+			return;
+		}
+
+		dtap->dta_flags &= ~DTA_F_TRACING;
+	}
+
+	dtap->dta_rval = 0;
+	if (dtrace_consume(dtp, NULL, NULL, dta_dt_ringhandler, dtap) == -1 &&
+	    dtap->dta_rval == 0) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "couldn't consume buffers: %s\n",
+		    dtrace_errmsg(dtp, dtrace_errno(dtp)));
+		dtap->dta_rval = -1;
+	}
+
+	drg->drg_nsecs = dta_clock(CLOCK_MONOTONIC) - start;
+}
+
+/*
+ * Like dta_dt_consumehandler(), but runs on a worker thread and collects
+ * records for a snapshot rather than passing them to JavaScript.
+ */
+static int
+dta_dt_ringhandler(const dtrace_probedata_t *data,
+    const dtrace_recdesc_t *rec, void *arg)
+{
+	dta_hdl_t *dtap = arg;
+	dtrace_probedesc_t *pd = data->dtpda_pdesc;
+	const dtrace_eprobedesc_t *edesc = data->dtpda_edesc;
+	const dta_field_t *fld;
+	dta_plan_t *plan;
+	char buf[2048];
+	const char *str;
+	int64_t val;
+	int rv;
+
+	if (rec == NULL) {
+		rv = dta_ring_record(dtap, pd, DTA_CAPEV_PROBE, 0, NULL);
+		return (rv == 0 ? DTRACE_CONSUME_THIS : DTRACE_CONSUME_ABORT);
+	}
+
+	if ((plan = dta_plan_epid(dtap, edesc)) == NULL)
+		return (DTRACE_CONSUME_ABORT);
+
+	fld = &plan->dpl_fields[rec - edesc->dtepd_rec];
+	if (fld->dfl_kind == DTA_FLD_PRINTF)
+		return (DTRACE_CONSUME_THIS);
+
+	if (fld->dfl_kind == DTA_FLD_UNSUPPORTED) {
+		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+		    "unsupported action %s in record for %s:%s:%s:%s\n",
+		    dta_dt_action(rec->dtrd_action), pd->dtpd_provider,
+		    pd->dtpd_mod, pd->dtpd_func, pd->dtpd_name);
+		dtap->dta_rval = -1;
+		return (DTRACE_CONSUME_ABORT);
+	}
+
+	if (dta_field_read(dtap, fld, data->dtpda_data, &val, &str,
+	    buf, sizeof (buf)) == DTA_V_STRING)
+		rv = dta_ring_record(dtap, pd, DTA_CAPEV_STRING, 0, str);
+	else
+		rv = dta_ring_record(dtap, pd, DTA_CAPEV_INT, val, NULL);
+
+	return (rv == 0 ? DTRACE_CONSUME_THIS : DTRACE_CONSUME_ABORT);
+}
+
+/*
+ * Append a record to the snapshot being taken.
+ */
+static int
+dta_ring_record(dta_hdl_t *dtap, const dtrace_probedesc_t *pd,
+    dta_capev_t kind, int64_t val, const char *str)
+{
+	dta_ring_t *drg = dtap->dta_ring;
+	dta_ringrec_t *drr;
+
+	if (str != NULL) {
+		val = drg->drg_strings.db_len;
+		if (dta_buf_append(&drg->drg_strings, str,
+		    strlen(str) + 1) != 0)
+			goto nomem;
+	}
+
+	if ((drr = dta_buf_reserve(&drg->drg_recs, sizeof (*drr))) == NULL)
+		goto nomem;
+
+	drr->drr_pd = pd;
+	drr->drr_kind = kind;
+	drr->drr_val = val;
+	return (0);
+
+nomem:
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "snapshot: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (-1);
+}
+
+/*
+ * Entry point for reading a snapshot taken by dta_snapshot(): invoke the first
+ * callback for each record, just as consume() would, and then the second with
+ * the number of records, the native memory they used, and the time spent
+ * draining the buffers (in nanoseconds).  The records are freed afterwards.
+ */
+static int
+dta_snapshotread(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_ring_t *drg;
+	const dta_ringrec_t *drr;
+	shim_val_t *argv[5];
+	int lent[5];
+	uint32_t nrecs, i;
+	int argc;
+	shim_val_t *callback = shim_value_alloc();
+	shim_val_t *statscb = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_FUNCTION, &statscb,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_value_release(callback);
+		shim_value_release(statscb);
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	drg = dtap->dta_ring;
+	nrecs = drg == NULL ? 0 : drg->drg_recs.db_len / sizeof (*drr);
+	drr = drg == NULL ? NULL : (dta_ringrec_t *)drg->drg_recs.db_buf;
+
+	dtap->dta_flags |= DTA_F_CONSUMING;
+	dtap->dta_consume_ctx = ctx;
+
+	for (i = 0; i < nrecs; i++, drr++) {
+		argv[0] = dta_intern_get(dtap, drr->drr_pd->dtpd_provider,
+		    &lent[0]);
+		argv[1] = dta_intern_get(dtap, drr->drr_pd->dtpd_mod,
+		    &lent[1]);
+		argv[2] = dta_intern_get(dtap, drr->drr_pd->dtpd_func,
+		    &lent[2]);
+		argv[3] = dta_intern_get(dtap, drr->drr_pd->dtpd_name,
+		    &lent[3]);
+		argc = 4;
+
+		if (drr->drr_kind == DTA_CAPEV_INT) {
+			argv[argc] = shim_number_new(ctx,
+			    (double)drr->drr_val);
+			lent[argc++] = 0;
+		} else if (drr->drr_kind == DTA_CAPEV_STRING) {
+			argv[argc] = dta_intern_get(dtap,
+			    drg->drg_strings.db_buf + drr->drr_val,
+			    &lent[argc]);
+			argc++;
+		}
+
+		(void) shim_func_call_val(ctx, NULL, callback, argc, argv,
+		    NULL);
+		dta_intern_release(dtap, argv, lent, argc);
+	}
+
+	dtap->dta_consume_ctx = NULL;
+	dtap->dta_flags &= ~DTA_F_CONSUMING;
+
+	argv[0] = shim_number_new(ctx, nrecs);
+	argv[1] = shim_number_new(ctx, drg == NULL ? 0 :
+	    (double)(drg->drg_recs.db_len + drg->drg_strings.db_len));
+	argv[2] = shim_number_new(ctx, drg == NULL ? 0 :
+	    (double)drg->drg_nsecs);
+	(void) shim_func_call_val(ctx, NULL, statscb, 3, argv, NULL);
+	for (i = 0; i < 3; i++)
+		shim_value_release(argv[i]);
+
+	/*
+	 * Snapshots are rare, so there's no sense keeping the memory around.
+	 */
+	if (drg != NULL) {
+		dta_buf_fini(&drg->drg_recs);
+		dta_buf_fini(&drg->drg_strings);
+		drg->drg_nsecs = 0;
+	}
+
+	shim_value_release(callback);
+	shim_value_release(statscb);
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.internConfig(): replace the string intern table
+ * with an empty one holding up to "capacity" strings (rounded up to a power of
+ * 2), or disable interning if "capacity" is zero.
+ */
+static int
+dta_internconf(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	shim_val_t *arg;
+	uint32_t capacity, n;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	capacity = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if (dtap->dta_intern != NULL) {
+		dta_intern_fini(dtap->dta_intern);
+		dtap->dta_intern = NULL;
+	}
+
+	if (capacity == 0)
+		return (TRUE);
+
+	for (n = 1; n < capacity; n <<= 1)
+		continue;
+
+	if ((dtap->dta_intern = dta_intern_new(n)) == NULL)
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.internStats(): invoke the callback with the number
+ * of strings in the intern table, its capacity, and the numbers of hits,
+ * misses, evictions, and strings that weren't eligible for the table.
+ */
+static int
+dta_internstats(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_intern_t *din;
+	dta_intern_t empty;
+	shim_val_t *argv[6];
+	int i;
+	shim_val_t *callback = shim_value_alloc();
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_FUNCTION, &callback,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+	if ((din = dtap->dta_intern) == NULL) {
+		bzero(&empty, sizeof (empty));
+		din = &empty;
+	}
+
+	argv[0] = shim_number_new(ctx, din->din_count);
+	argv[1] = shim_number_new(ctx, din->din_capacity);
+	argv[2] = shim_number_new(ctx, (double)din->din_hits);
+	argv[3] = shim_number_new(ctx, (double)din->din_misses);
+	argv[4] = shim_number_new(ctx, (double)din->din_evictions);
+	argv[5] = shim_number_new(ctx, (double)din->din_uncached);
+
+	(void) shim_func_call_val(ctx, NULL, callback, 6, argv, NULL);
+	for (i = 0; i < 6; i++)
+		shim_value_release(argv[i]);
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * Entry point for consumer.subscribe(): the arguments are the subscriber's
+ * consume() and aggwalk() callbacks (either of which may be null), the four
+ * components of its probe filter (each a string, or null to match anything),
+ * and then the number of variable IDs followed by the IDs themselves.  Returns
+ * the subscriber's index, for use with unsubscribe().
+ */
+static int
+dta_subscribe(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_subtab_t *dst;
+	dta_sub_t *dsb;
+	shim_val_t *arg;
+	int i, idx;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if ((dst = dtap->dta_subs) == NULL) {
+		if ((dst = calloc(1, sizeof (*dst))) == NULL) {
+			shim_throw_error(ctx, "malloc: %s", strerror(errno));
+			return (TRUE);
+		}
+
+		/* Plans start out with generation zero, which is stale. */
+		dst->dst_gen = 1;
+		dtap->dta_subs = dst;
+	}
+
+	for (idx = 0; idx < DTA_SUB_MAX; idx++) {
+		if (!dst->dst_subs[idx].dsb_active)
+			break;
+	}
+
+	if (idx == DTA_SUB_MAX) {
+		shim_throw_error(ctx, "too many subscribers (limit %d)",
+		    DTA_SUB_MAX);
+		return (TRUE);
+	}
+
+	/* By design, argument checking happens in the caller. */
+	dsb = &dst->dst_subs[idx];
+	bzero(dsb, sizeof (*dsb));
+
+	if ((arg = dta_callback_arg(args, 1)) != NULL) {
+		dsb->dsb_consume = shim_persistent_new(ctx, arg);
+		shim_value_release(arg);
+	}
+
+	if ((arg = dta_callback_arg(args, 2)) != NULL) {
+		dsb->dsb_aggwalk = shim_persistent_new(ctx, arg);
+		shim_value_release(arg);
+	}
+
+	for (i = 0; i < 4; i++) {
+		arg = shim_args_get(args, i + 3);
+		if (shim_value_is(arg, SHIM_TYPE_STRING))
+			dsb->dsb_probe[i] = shim_string_value(arg);
+		shim_value_release(arg);
+	}
+
+	arg = shim_args_get(args, 7);
+	dsb->dsb_nvarids = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if (dsb->dsb_nvarids > 0 && (dsb->dsb_varids =
+	    malloc(dsb->dsb_nvarids * sizeof (dsb->dsb_varids[0]))) == NULL)
+		goto nomem;
+
+	for (i = 0; i < dsb->dsb_nvarids; i++) {
+		arg = shim_args_get(args, i + 8);
+		dsb->dsb_varids[i] = shim_number_value(arg);
+		shim_value_release(arg);
+	}
+
+	dsb->dsb_active = B_TRUE;
+	dst->dst_gen++;
+	shim_args_set_rval(ctx, args, shim_integer_new(ctx, idx));
+	return (TRUE);
+
+nomem:
+	dta_sub_fini(dsb);
+	shim_throw_error(ctx, "malloc: %s", strerror(errno));
+	return (TRUE);
+}
+
+/*
+ * Entry point for subscription.unsubscribe(): remove the subscriber with the
+ * given index.
+ */
+static int
+dta_unsubscribe(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+	dta_hdl_t *dtap;
+	dta_subtab_t *dst;
+	shim_val_t *arg;
+	int idx;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (FALSE);
+	}
+
+	dtap = UNPACK_SELF(selfptr);
+
+	/* By design, argument checking happens in the caller. */
+	arg = shim_args_get(args, 1);
+	idx = shim_number_value(arg);
+	shim_value_release(arg);
+
+	/*
+	 * We can't remove a subscriber while its callback may be running, so
+	 * the caller has to defer this until the walk is done.
+	 */
+	if ((dtap->dta_flags & (DTA_F_BUSY | DTA_F_CONSUMING)) != 0) {
+		shim_throw_error(ctx, "consumer is busy");
+		return (TRUE);
+	}
+
+	if ((dst = dtap->dta_subs) == NULL || idx < 0 || idx >= DTA_SUB_MAX ||
+	    !dst->dst_subs[idx].dsb_active) {
+		shim_throw_error(ctx, "no such subscriber");
+		return (TRUE);
+	}
+
+	dta_sub_fini(&dst->dst_subs[idx]);
+	dst->dst_gen++;
+	return (TRUE);
+}
+
+/*
+ * Returns the current time on the given clock, in nanoseconds.
+ */
+static uint64_t
+dta_clock(clockid_t clock)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+
+/*
+ * Subscribers (see dta_subtab_t)
+ */
+
+/*
+ * Returns argument "argi" if it's a function, or NULL (having released it)
+ * otherwise.
+ */
+static shim_val_t *
+dta_callback_arg(shim_args_t *args, int argi)
+{
+	shim_val_t *arg = shim_args_get(args, argi);
 
-	argc += nvalargs;
-	argv = malloc(argc * sizeof (argv[0])); /* XXX */
-	bzero(argv, argc * sizeof (argv[0]));
+	if (shim_value_is(arg, SHIM_TYPE_FUNCTION))
+		return (arg);
 
-	argv[0] = shim_integer_new(ctx, aggdesc->dtagd_varid);
+	shim_value_release(arg);
+	return (NULL);
+}
 
-	aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
-	argv[1] = shim_string_new_copy(ctx, dta_dt_action(aggrec->dtrd_action));
-	argv[2] = shim_integer_uint(ctx, aggdesc->dtagd_nrecs - 2);
+/*
+ * Returns the set of subscribers that want the records of the enabled probe
+ * described by "plan" and "pd".
+ */
+static uint64_t
+dta_sub_epid(dta_hdl_t *dtap, dta_plan_t *plan, const dtrace_probedesc_t *pd)
+{
+	dta_subtab_t *dst = dtap->dta_subs;
+	const char *names[4];
+	const dta_sub_t *dsb;
+	uint64_t subs = 0;
+	int i, j;
+
+	if (dst == NULL)
+		return (0);
+
+	if (plan->dpl_subgen == dst->dst_gen)
+		return (plan->dpl_subs);
+
+	names[0] = pd->dtpd_provider;
+	names[1] = pd->dtpd_mod;
+	names[2] = pd->dtpd_func;
+	names[3] = pd->dtpd_name;
+
+	for (i = 0; i < DTA_SUB_MAX; i++) {
+		dsb = &dst->dst_subs[i];
+		if (!dsb->dsb_active || dsb->dsb_consume == NULL)
+			continue;
+
+		for (j = 0; j < 4; j++) {
+			if (dsb->dsb_probe[j] != NULL &&
+			    strcmp(dsb->dsb_probe[j], names[j]) != 0)
+				break;
+		}
 
-	for (i = 2; i < aggdesc->dtagd_nrecs; i++) {
-		const dtrace_recdesc_t *rec = &aggdesc->dtagd_rec[i - 1];
-		caddr_t addr = agg->dtada_data + rec->dtrd_offset;
+		if (j == 4)
+			subs |= 1ULL << i;
+	}
 
-		if (!dta_dt_valid(rec)) {
-			(void) snprintf(dtap->dta_errmsg,
-			    sizeof (dtap->dta_errmsg),
-			    "unsupported action %s as key #%d in aggregation "
-			    "\"%s\"\n", dta_dt_action(rec->dtrd_action),
-			    i - 1, aggdesc->dtagd_name);
-			dtap->dta_rval = -1;
-			return (DTRACE_AGGWALK_ERROR);
+	plan->dpl_subs = subs;
+	plan->dpl_subgen = dst->dst_gen;
+	return (subs);
+}
+
+/*
+ * Returns the set of subscribers that want the records of the aggregation
+ * described by "plan", whose variable ID is "varid".
+ */
+static uint64_t
+dta_sub_agg(dta_hdl_t *dtap, dta_plan_t *plan, int64_t varid)
+{
+	dta_subtab_t *dst = dtap->dta_subs;
+	const dta_sub_t *dsb;
+	uint64_t subs = 0;
+	int i, j;
+
+	if (dst == NULL)
+		return (0);
+
+	if (plan->dpl_subgen == dst->dst_gen)
+		return (plan->dpl_subs);
+
+	for (i = 0; i < DTA_SUB_MAX; i++) {
+		dsb = &dst->dst_subs[i];
+		if (!dsb->dsb_active || dsb->dsb_aggwalk == NULL)
+			continue;
+
+		for (j = 0; j < dsb->dsb_nvarids; j++) {
+			if (dsb->dsb_varids[j] == varid)
+				break;
 		}
 
-		assert(i < argc - 1);
-		argv[i + 1] = dta_dt_record(dtap, rec, addr);
+		if (dsb->dsb_nvarids == 0 || j < dsb->dsb_nvarids)
+			subs |= 1ULL << i;
 	}
 
-	(void) dta_aggwalk_argv_populate(dtap, &argv[i + 1], nvalargs, agg,
-	    NULL);
-
-	(void) shim_func_call_val(ctx, NULL, callback, argc, argv, NULL);
-	for (i = 0; i < argc; i++)
-		shim_value_release(argv[i]);
-	free(argv);
-	return (DTRACE_AGGWALK_REMOVE);
+	plan->dpl_subs = subs;
+	plan->dpl_subgen = dst->dst_gen;
+	return (subs);
 }
 
-static int
-dta_aggwalk_argv_populate(dta_hdl_t *dtap, shim_val_t **argv, int argc,
-    const dtrace_aggdata_t *agg, int *nvalargs)
+/*
+ * Invoke the consume() callback (or, if "agg" is set, the aggwalk() callback)
+ * of each subscriber in "subs" with the same arguments.
+ */
+static void
+dta_sub_call(dta_hdl_t *dtap, uint64_t subs, int agg, int argc,
+    shim_val_t **argv)
 {
 	shim_ctx_t *ctx = dtap->dta_consume_ctx;
-	const dtrace_aggdesc_t *aggdesc = agg->dtada_desc;
-	const dtrace_recdesc_t *aggrec;
-	int i = 0, count = 0;
+	const dta_sub_t *dsb;
+	int i;
 
-#define APPEND(val) \
-	if (argv != NULL && i < argc)	\
-		argv[i++] = (val);	\
-	count++
+	for (i = 0; subs != 0; i++, subs >>= 1) {
+		if ((subs & 1) == 0)
+			continue;
 
-	aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+		dsb = &dtap->dta_subs->dst_subs[i];
+		assert(dsb->dsb_active);
+		(void) shim_func_call_val(ctx, NULL,
+		    agg ? dsb->dsb_aggwalk : dsb->dsb_consume, argc, argv,
+		    NULL);
+	}
+}
 
-	switch (aggrec->dtrd_action) {
-	case DTRACEAGG_COUNT:
-	case DTRACEAGG_MIN:
-	case DTRACEAGG_MAX:
-	case DTRACEAGG_SUM: {
-		caddr_t addr = agg->dtada_data + aggrec->dtrd_offset;
+static void
+dta_sub_fini(dta_sub_t *dsb)
+{
+	int i;
 
-		assert(aggrec->dtrd_size == sizeof (uint64_t));
-		APPEND(shim_number_new(ctx, (double)(*((int64_t *)addr))));
-		break;
-	}
+	if (dsb->dsb_consume != NULL)
+		shim_persistent_dispose(dsb->dsb_consume);
+	if (dsb->dsb_aggwalk != NULL)
+		shim_persistent_dispose(dsb->dsb_aggwalk);
+	for (i = 0; i < 4; i++)
+		free(dsb->dsb_probe[i]);
+	free(dsb->dsb_varids);
+	bzero(dsb, sizeof (*dsb));
+}
 
-	case DTRACEAGG_AVG: {
-		const int64_t *data = (int64_t *)(agg->dtada_data +
-		    aggrec->dtrd_offset);
 
-		assert(aggrec->dtrd_size == sizeof (uint64_t) * 2);
-		APPEND(shim_number_new(ctx, data[1] / (double)data[0]));
-		break;
-	}
+/*
+ * String interning (see dta_intern_t)
+ */
 
-	case DTRACEAGG_QUANTIZE: {
-		const int64_t *data = (int64_t *)(agg->dtada_data +
-		    aggrec->dtrd_offset);
-		int bi;
+/*
+ * Returns a new, empty intern table for "capacity" strings, which must be a
+ * power of 2.
+ */
+static dta_intern_t *
+dta_intern_new(uint32_t capacity)
+{
+	dta_intern_t *din;
 
-		for (bi = 0; bi < DTRACE_QUANTIZE_NBUCKETS; bi++) {
-			if (!data[bi])
-				continue;
+	assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
 
-			APPEND(shim_integer_new(ctx, bi));
-			APPEND(shim_number_new(ctx, data[bi]));
-		}
+	if ((din = calloc(1, sizeof (*din))) == NULL)
+		return (NULL);
 
-		break;
+	din->din_capacity = capacity;
+	din->din_ents = calloc(capacity, sizeof (din->din_ents[0]));
+	din->din_buckets = calloc(capacity, sizeof (din->din_buckets[0]));
+	if (din->din_ents == NULL || din->din_buckets == NULL) {
+		dta_intern_fini(din);
+		return (NULL);
 	}
 
-	case DTRACEAGG_LQUANTIZE:
-	case DTRACEAGG_LLQUANTIZE: {
-		const int64_t *data = (int64_t *)(agg->dtada_data +
-		    aggrec->dtrd_offset);
-		uint64_t arg = *data++;
-		int levels = (aggrec->dtrd_size / sizeof (uint64_t)) - 1;
-		int bi;
-
-		if (aggrec->dtrd_action == DTRACEAGG_LQUANTIZE) {
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LQUANTIZE_BASE(arg)));
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LQUANTIZE_STEP(arg)));
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LQUANTIZE_LEVELS(arg)));
-		} else {
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LLQUANTIZE_FACTOR(arg)));
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LLQUANTIZE_LOW(arg)));
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LLQUANTIZE_HIGH(arg)));
-			APPEND(shim_integer_new(ctx,
-			    DTRACE_LLQUANTIZE_NSTEP(arg)));
-			APPEND(shim_integer_new(ctx,
-			    (aggrec->dtrd_size / sizeof (uint64_t)) - 1));
+	return (din);
+}
+
+/*
+ * Returns a JavaScript string for "str".  If it came from the intern table,
+ * "*lentp" is set, and the caller must not release it; otherwise, "*lentp" is
+ * cleared.  Either way, callers release the arguments they've assembled with
+ * dta_intern_release() once the callback has returned.
+ */
+static shim_val_t *
+dta_intern_get(dta_hdl_t *dtap, const char *str, int *lentp)
+{
+	shim_ctx_t *ctx = dtap->dta_consume_ctx;
+	dta_intern_t *din = dtap->dta_intern;
+	dta_internent_t *ent;
+	shim_val_t *val;
+	size_t len = strlen(str);
+	uint64_t hash;
+	uint32_t mask, i, n, *bp;
+	char *copy;
+
+	*lentp = 0;
+	if (din == NULL || len > DTA_INTERN_MAXLEN) {
+		if (din != NULL)
+			din->din_uncached++;
+		return (shim_string_new_copy(ctx, str));
+	}
+
+	mask = din->din_capacity - 1;
+	hash = dta_hash(DTA_HASH_INIT, str, len);
+	for (i = din->din_buckets[hash & mask]; i != 0; i = ent->die_next) {
+		ent = &din->din_ents[i - 1];
+		if (ent->die_hash == hash && ent->die_len == len &&
+		    bcmp(ent->die_str, str, len) == 0) {
+			ent->die_ref = 1;
+			ent->die_gen = din->din_gen;
+			din->din_hits++;
+			*lentp = 1;
+			return (ent->die_val);
 		}
+	}
 
-		for (bi = 0; bi < levels; bi++) {
-			if (!data[bi])
+	if (din->din_count < din->din_capacity) {
+		i = din->din_count;
+	} else {
+		/*
+		 * Sweep for an entry to evict.  Two passes suffice to find one
+		 * unless every entry is in use by the current callback.
+		 */
+		for (n = 0; n < 2 * din->din_capacity; n++) {
+			ent = &din->din_ents[din->din_hand];
+			din->din_hand = (din->din_hand + 1) & mask;
+			if (ent->die_gen == din->din_gen)
 				continue;
+			if (ent->die_ref == 0)
+				break;
+			ent->die_ref = 0;
+		}
 
-			APPEND(shim_integer_new(ctx, bi));
-			APPEND(shim_number_new(ctx, data[bi]));
+		if (n == 2 * din->din_capacity) {
+			din->din_uncached++;
+			return (shim_string_new_copy(ctx, str));
 		}
 
-		break;
+		i = ent - din->din_ents;
 	}
 
-	default:
-		(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
-		    "unsupported aggregating action %s in aggregation "
-		    "\"%s\"\n", dta_dt_action(aggrec->dtrd_action),
-		    aggdesc->dtagd_name);
-		dtap->dta_rval = -1;
-		return (-1);
+	if ((copy = malloc(len + 1)) == NULL) {
+		din->din_uncached++;
+		return (shim_string_new_copy(ctx, str));
 	}
 
-	if (nvalargs != NULL)
-		*nvalargs = count;
+	ent = &din->din_ents[i];
+	if (ent->die_val != NULL) {
+		for (bp = &din->din_buckets[ent->die_hash & mask];
+		    *bp != i + 1; bp = &din->din_ents[*bp - 1].die_next)
+			assert(*bp != 0);
+		*bp = ent->die_next;
+		shim_persistent_dispose(ent->die_val);
+		free(ent->die_str);
+		din->din_evictions++;
+	} else {
+		din->din_count++;
+	}
 
-	return (0);
-#undef APPEND
+	bcopy(str, copy, len + 1);
+	val = shim_string_new_copy(ctx, str);
+	ent->die_val = shim_persistent_new(ctx, val);
+	shim_value_release(val);
+	ent->die_str = copy;
+	ent->die_len = len;
+	ent->die_hash = hash;
+	ent->die_gen = din->din_gen;
+	ent->die_ref = 1;
+	ent->die_next = din->din_buckets[hash & mask];
+	din->din_buckets[hash & mask] = i + 1;
+	din->din_misses++;
+	*lentp = 1;
+	return (ent->die_val);
+}
+
+/*
+ * Release the "argc" callback arguments in "argv", except for those lent out
+ * by the intern table (as indicated by "lent"), and note that the intern
+ * table's entries may be evicted again.
+ */
+static void
+dta_intern_release(dta_hdl_t *dtap, shim_val_t **argv, const int *lent,
+    int argc)
+{
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (!lent[i])
+			shim_value_release(argv[i]);
+	}
+
+	if (dtap->dta_intern != NULL)
+		dtap->dta_intern->din_gen++;
+}
+
+static void
+dta_intern_fini(dta_intern_t *din)
+{
+	uint32_t i;
+
+	if (din->din_ents != NULL) {
+		for (i = 0; i < din->din_count; i++) {
+			shim_persistent_dispose(din->din_ents[i].die_val);
+			free(din->din_ents[i].die_str);
+		}
+	}
+
+	free(din->din_ents);
+	free(din->din_buckets);
+	free(din);
 }
 
 
@@ -943,6 +5748,49 @@ dta_async_uvafter(shim_ctx_t *ctx, shim_work_t *req, int status, void *arg)
 }
 
 
+/*
+ * Buffer helpers (see also dta_buf.c)
+ */
+
+/*
+ * Append "str" to the buffer, escaping backslashes and newlines (and double
+ * quotes, if "quotes" is set) as the Prometheus text format requires.
+ */
+static int
+dta_buf_escape(dta_buf_t *dbp, const char *str, int quotes)
+{
+	const char *p;
+	char esc[2] = { '\\', '\0' };
+
+	for (p = str; *p != '\0'; p++) {
+		if (*p == '\n')
+			esc[1] = 'n';
+		else if (*p == '\\' || (quotes && *p == '"'))
+			esc[1] = *p;
+		else
+			continue;
+
+		if (dta_buf_append(dbp, str, p - str) != 0 ||
+		    dta_buf_append(dbp, esc, sizeof (esc)) != 0)
+			return (-1);
+		str = p + 1;
+	}
+
+	return (dta_buf_append(dbp, str, p - str));
+}
+
+/*
+ * Free function for buffers handed to JavaScript with
+ * shim_buffer_new_external().
+ */
+/* ARGSUSED */
+static void
+dta_buf_free(char *buf, void *arg)
+{
+	free(buf);
+}
+
+
 /*
  * libdtrace helper functions
  */
@@ -1013,31 +5861,279 @@ dta_dt_action(dtrace_actkind_t action)
 	return ("<unknown action>");
 }
 
+/*
+ * Returns the plan for the given enabled probe, building it if this is the
+ * first time we've seen it.  See dta_plan_t.
+ */
+static dta_plan_t *
+dta_plan_epid(dta_hdl_t *dtap, const dtrace_eprobedesc_t *edesc)
+{
+	dtrace_epid_t epid = edesc->dtepd_epid;
+
+	if (epid < dtap->dta_neplans && dtap->dta_eplans[epid] != NULL)
+		return (dtap->dta_eplans[epid]);
+
+	return (dta_plan_build(dtap, &dtap->dta_eplans, &dtap->dta_neplans,
+	    epid, edesc->dtepd_rec, edesc->dtepd_nrecs));
+}
+
+/*
+ * Returns the plan for the given aggregation.  The first record of an
+ * aggregation is the variable ID and the last is the value, so the fields
+ * describe only the records in between.
+ *
+ * Note that we index plans by aggregation ID rather than variable ID: the same
+ * variable aggregated in different clauses has a distinct aggregation ID (and
+ * potentially different keys) for each clause.
+ */
+static dta_plan_t *
+dta_plan_agg(dta_hdl_t *dtap, const dtrace_aggdesc_t *aggdesc)
+{
+	dtrace_aggid_t id = aggdesc->dtagd_id;
+	const dtrace_recdesc_t *aggrec;
+	dta_plan_t *plan;
+
+	if (id < dtap->dta_naplans && dtap->dta_aplans[id] != NULL)
+		return (dtap->dta_aplans[id]);
+
+	assert(aggdesc->dtagd_nrecs >= 2);
+	if ((plan = dta_plan_build(dtap, &dtap->dta_aplans, &dtap->dta_naplans,
+	    id, &aggdesc->dtagd_rec[1], aggdesc->dtagd_nrecs - 2)) == NULL)
+		return (NULL);
+
+	aggrec = &aggdesc->dtagd_rec[aggdesc->dtagd_nrecs - 1];
+	plan->dpl_action = dta_dt_action(aggrec->dtrd_action);
+	plan->dpl_valoff = aggrec->dtrd_offset;
+
+	switch (aggrec->dtrd_action) {
+	case DTRACEAGG_COUNT:
+	case DTRACEAGG_MIN:
+	case DTRACEAGG_MAX:
+	case DTRACEAGG_SUM:
+		assert(aggrec->dtrd_size == sizeof (uint64_t));
+		plan->dpl_aggkind =
+		    aggrec->dtrd_action == DTRACEAGG_COUNT ? DTA_AGG_COUNT :
+		    aggrec->dtrd_action == DTRACEAGG_MIN ? DTA_AGG_MIN :
+		    aggrec->dtrd_action == DTRACEAGG_MAX ? DTA_AGG_MAX :
+		    DTA_AGG_SUM;
+		plan->dpl_nvals = 1;
+		break;
+
+	case DTRACEAGG_AVG:
+		assert(aggrec->dtrd_size == sizeof (uint64_t) * 2);
+		plan->dpl_aggkind = DTA_AGG_AVG;
+		plan->dpl_nvals = 2;
+		break;
+
+	case DTRACEAGG_QUANTIZE:
+		plan->dpl_aggkind = DTA_AGG_QUANTIZE;
+		plan->dpl_nvals = DTRACE_QUANTIZE_NBUCKETS;
+		break;
+
+	case DTRACEAGG_LQUANTIZE:
+	case DTRACEAGG_LLQUANTIZE:
+		plan->dpl_aggkind = aggrec->dtrd_action == DTRACEAGG_LQUANTIZE ?
+		    DTA_AGG_LQUANTIZE : DTA_AGG_LLQUANTIZE;
+		plan->dpl_hasparam = B_TRUE;
+		plan->dpl_nvals = (aggrec->dtrd_size / sizeof (uint64_t)) - 1;
+		break;
+
+	default:
+		/* dta_aggval() reports this when it's used. */
+		break;
+	}
+
+	return (plan);
+}
+
+/*
+ * Build the plan with index "id" in the array "*plansp" (of "*nplansp"
+ * entries, which we grow as needed) from the "nrecs" records "recs".
+ */
+static dta_plan_t *
+dta_plan_build(dta_hdl_t *dtap, dta_plan_t ***plansp, uint32_t *nplansp,
+    uint32_t id, const dtrace_recdesc_t *recs, int nrecs)
+{
+	const dtrace_recdesc_t *rec;
+	dta_plan_t **plans, *plan;
+	dta_field_t *fld;
+	uint32_t nplans;
+	int i;
+
+	if (id >= *nplansp) {
+		nplans = *nplansp == 0 ? 16 : *nplansp;
+		while (nplans <= id)
+			nplans *= 2;
+
+		if ((plans = realloc(*plansp,
+		    nplans * sizeof (plans[0]))) == NULL)
+			goto nomem;
+
+		bzero(&plans[*nplansp],
+		    (nplans - *nplansp) * sizeof (plans[0]));
+		*plansp = plans;
+		*nplansp = nplans;
+	}
+
+	if ((plan = calloc(1, sizeof (*plan))) == NULL)
+		goto nomem;
+
+	if (nrecs > 0 && (plan->dpl_fields =
+	    calloc(nrecs, sizeof (plan->dpl_fields[0]))) == NULL) {
+		free(plan);
+		goto nomem;
+	}
+
+	plan->dpl_nfields = nrecs;
+	for (i = 0; i < nrecs; i++) {
+		rec = &recs[i];
+		fld = &plan->dpl_fields[i];
+		fld->dfl_rec = rec;
+		fld->dfl_offset = rec->dtrd_offset;
+
+		if (!dta_dt_valid(rec)) {
+			fld->dfl_kind = rec->dtrd_action == DTRACEACT_PRINTF ?
+			    DTA_FLD_PRINTF : DTA_FLD_UNSUPPORTED;
+			continue;
+		}
+
+		if (rec->dtrd_action != DTRACEACT_DIFEXPR) {
+			fld->dfl_kind = DTA_FLD_SYMBOL;
+			continue;
+		}
+
+		switch (rec->dtrd_size) {
+		case sizeof (uint64_t):
+			fld->dfl_kind = DTA_FLD_INT64;
+			break;
+
+		case sizeof (uint32_t):
+			fld->dfl_kind = DTA_FLD_UINT32;
+			break;
+
+		case sizeof (uint16_t):
+			fld->dfl_kind = DTA_FLD_UINT16;
+			break;
+
+		case sizeof (uint8_t):
+			fld->dfl_kind = DTA_FLD_UINT8;
+			break;
+
+		default:
+			fld->dfl_kind = DTA_FLD_STRING;
+			break;
+		}
+	}
+
+	(*plansp)[id] = plan;
+	return (plan);
+
+nomem:
+	(void) snprintf(dtap->dta_errmsg, sizeof (dtap->dta_errmsg),
+	    "malloc: %s\n", strerror(errno));
+	dtap->dta_rval = -1;
+	return (NULL);
+}
+
+/*
+ * Like dta_dt_rawval(), but for a record that has already been classified by
+ * its plan, so that the common cases don't need to look at the record
+ * description at all.
+ */
+static dta_vkind_t
+dta_field_read(dta_hdl_t *dtap, const dta_field_t *fld, caddr_t addr,
+    int64_t *valp, const char **strp, char *buf, size_t bufsz)
+{
+	switch (fld->dfl_kind) {
+	case DTA_FLD_INT64:
+		*valp = *((int64_t *)addr);
+		return (DTA_V_INT);
+
+	case DTA_FLD_UINT32:
+		*valp = *((uint32_t *)addr);
+		return (DTA_V_INT);
+
+	case DTA_FLD_UINT16:
+		*valp = *((uint16_t *)addr);
+		return (DTA_V_INT);
+
+	case DTA_FLD_UINT8:
+		*valp = *((uint8_t *)addr);
+		return (DTA_V_INT);
+
+	case DTA_FLD_STRING:
+		*strp = addr;
+		return (DTA_V_STRING);
+
+	default:
+		assert(fld->dfl_kind == DTA_FLD_SYMBOL);
+		return (dta_dt_rawval(dtap, fld->dfl_rec, addr, valp, strp,
+		    buf, bufsz));
+	}
+}
+
+/*
+ * Returns a JavaScript value for the given field.  Strings may come from the
+ * intern table, in which case "*lentp" is set (see dta_intern_get()).
+ */
 static shim_val_t *
-dta_dt_record(dta_hdl_t *dtap, const dtrace_recdesc_t *rec, caddr_t addr)
+dta_dt_record(dta_hdl_t *dtap, const dta_field_t *fld, caddr_t addr,
+    int *lentp)
 {
 	shim_ctx_t *ctx = dtap->dta_consume_ctx;
+	char buf[2048];
+	const char *str;
+	int64_t val;
+
+	*lentp = 0;
+	if (dta_field_read(dtap, fld, addr, &val, &str,
+	    buf, sizeof (buf)) == DTA_V_STRING)
+		return (dta_intern_get(dtap, str, lentp));
+
+	if (dtap->dta_exact != NULL) {
+		dta_exact_put(dtap, val);
+		return (shim_null());
+	}
+
+	if (fld->dfl_kind == DTA_FLD_INT64)
+		return (shim_number_new(ctx, (double)val));
+
+	return (shim_integer_uint(ctx, (uint32_t)val));
+}
+
+/*
+ * Decode a single record into either an integer (stored into "valp") or a
+ * string (stored into "strp").  Symbolic records are formatted into "buf".
+ */
+static dta_vkind_t
+dta_dt_rawval(dta_hdl_t *dtap, const dtrace_recdesc_t *rec, caddr_t addr,
+    int64_t *valp, const char **strp, char *buf, size_t bufsz)
+{
 	dtrace_hdl_t *dtp = dtap->dta_dtrace;
-	char buf[2048], *tick, *plus;
+	char *tick, *plus;
 
 	switch (rec->dtrd_action) {
 	case DTRACEACT_DIFEXPR:
 		switch (rec->dtrd_size) {
 		case sizeof (uint64_t):
-			return (shim_number_new(ctx,
-			    (double)(*(int64_t *)addr)));
+			*valp = *((int64_t *)addr);
+			return (DTA_V_INT);
 
 		case sizeof (uint32_t):
-			return (shim_integer_uint(ctx, *((uint32_t *)addr)));
+			*valp = *((uint32_t *)addr);
+			return (DTA_V_INT);
 
 		case sizeof (uint16_t):
-			return (shim_integer_uint(ctx, *((uint16_t *)addr)));
+			*valp = *((uint16_t *)addr);
+			return (DTA_V_INT);
 
 		case sizeof (uint8_t):
-			return (shim_integer_uint(ctx, *((uint8_t *)addr)));
+			*valp = *((uint8_t *)addr);
+			return (DTA_V_INT);
 
 		default:
-			return (shim_string_new_copy(ctx, addr));
+			*strp = addr;
+			return (DTA_V_STRING);
 		}
 
 	case DTRACEACT_SYM:
@@ -1046,14 +6142,15 @@ dta_dt_record(dta_hdl_t *dtap, const dtrace_recdesc_t *rec, caddr_t addr)
 	case DTRACEACT_UMOD:
 	case DTRACEACT_UADDR:
 		buf[0] = '\0';
+		*strp = buf;
 
 		if (DTRACEACT_CLASS(rec->dtrd_action) == DTRACEACT_KERNEL) {
 			uint64_t pc = ((uint64_t *)addr)[0];
-			dtrace_addr2str(dtp, pc, buf, sizeof (buf) - 1);
+			dtrace_addr2str(dtp, pc, buf, bufsz - 1);
 		} else {
 			uint64_t pid = ((uint64_t *)addr)[0];
 			uint64_t pc = ((uint64_t *)addr)[1];
-			dtrace_uaddr2str(dtp, pid, pc, buf, sizeof (buf) - 1);
+			dtrace_uaddr2str(dtp, pid, pc, buf, bufsz - 1);
 		}
 
 		if (rec->dtrd_action == DTRACEACT_MOD ||
@@ -1063,8 +6160,10 @@ dta_dt_record(dta_hdl_t *dtap, const dtrace_recdesc_t *rec, caddr_t addr)
 			 * return everything to the left of the left-most
 			 * tick -- or "<undefined>" if there is none.
 			 */
-			if ((tick = strchr(buf, '`')) == NULL)
-				return (shim_string_new_copy(ctx, "<unknown>"));
+			if ((tick = strchr(buf, '`')) == NULL) {
+				*strp = "<unknown>";
+				return (DTA_V_STRING);
+			}
 
 			*tick = '\0';
 		} else if (rec->dtrd_action == DTRACEACT_SYM ||
@@ -1078,9 +6177,10 @@ dta_dt_record(dta_hdl_t *dtap, const dtrace_recdesc_t *rec, caddr_t addr)
 				*plus = '\0';
 		}
 
-		return (shim_string_new_copy(ctx, buf));
+		return (DTA_V_STRING);
 	}
 
 	assert(B_FALSE);
-	return (shim_integer_uint(ctx, -1));
+	*valp = -1;
+	return (DTA_V_INT);
 }
@@ -0,0 +1,591 @@
+/*
+ * dtrace_replay.c: Node.js binding for replaying capture logs (see
+ * dta_caplog.h) through the same callbacks that DTraceConsumer uses.  This is
+ * built as a separate module that doesn't depend on libdtrace, so that
+ * captures can be replayed on systems without DTrace.  See lib/replay.js.
+ * For the same reason, this also provides the native decoder for the wire
+ * frames produced by consumer.aggencode() (see dta_wire.h and lib/aggwire.js).
+ */
+
+#include <shim.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "dta_caplog.h"
+#include "dta_wire.h"
+
+/*
+ * Handle: there's one of these per JavaScript ReplayConsumer.  "dtr_self" is
+ * the JavaScript wrapper for the handle.
+ */
+typedef struct dtr_hdl {
+	dta_capreader_t	dtr_reader;
+	shim_val_t	*dtr_self;
+} dtr_hdl_t;
+
+/*
+ * Wire decoder: there's one of these per JavaScript NativeAggWireDecoder.
+ * "dtw_tab" holds the sender's records as of frame "dtw_seq".
+ */
+typedef struct dtr_wire {
+	dta_aggtab_t	dtw_tab;
+	uint64_t	dtw_seq;
+} dtr_wire_t;
+
+/* See UNPACK_SELF in dtrace_async.c. */
+#define	UNPACK_SELF(arg) ((dtr_hdl_t *)((arg) << 1))
+#define	UNPACK_WIRE(arg) ((dtr_wire_t *)((arg) << 1))
+
+/* Shim configuration */
+static int initialize(shim_ctx_t *, shim_val_t *, shim_val_t *);
+SHIM_MODULE(dtrace_replay, initialize)
+
+/* JavaScript entry points */
+static int dtr_open(shim_ctx_t *, shim_args_t *);
+static int dtr_filter(shim_ctx_t *, shim_args_t *);
+static int dtr_seek(shim_ctx_t *, shim_args_t *);
+static int dtr_read(shim_ctx_t *, shim_args_t *);
+static int dtr_time(shim_ctx_t *, shim_args_t *);
+static int dtr_segments(shim_ctx_t *, shim_args_t *);
+static int dtr_stats(shim_ctx_t *, shim_args_t *);
+static int dtr_close(shim_ctx_t *, shim_args_t *);
+static int dtr_wireopen(shim_ctx_t *, shim_args_t *);
+static int dtr_wiredecode(shim_ctx_t *, shim_args_t *);
+static int dtr_wirewalk(shim_ctx_t *, shim_args_t *);
+static int dtr_wireseq(shim_ctx_t *, shim_args_t *);
+static int dtr_wirecount(shim_ctx_t *, shim_args_t *);
+static int dtr_wireclose(shim_ctx_t *, shim_args_t *);
+
+static dtr_hdl_t *dtr_self(shim_ctx_t *, shim_args_t *);
+static dtr_wire_t *dtr_wire_self(shim_ctx_t *, shim_args_t *);
+static char *dtr_string_arg(shim_args_t *, int);
+
+static int
+initialize(shim_ctx_t *ctx, shim_val_t *exports, shim_val_t *module)
+{
+	shim_fspec_t funcs[] = {
+		SHIM_FS_FULL("open", dtr_open, 0, NULL, 0),
+		SHIM_FS_FULL("filter", dtr_filter, 0, NULL, 0),
+		SHIM_FS_FULL("seek", dtr_seek, 0, NULL, 0),
+		SHIM_FS_FULL("read", dtr_read, 0, NULL, 0),
+		SHIM_FS_FULL("time", dtr_time, 0, NULL, 0),
+		SHIM_FS_FULL("segments", dtr_segments, 0, NULL, 0),
+		SHIM_FS_FULL("stats", dtr_stats, 0, NULL, 0),
+		SHIM_FS_FULL("close", dtr_close, 0, NULL, 0),
+		SHIM_FS_FULL("wireopen", dtr_wireopen, 0, NULL, 0),
+		SHIM_FS_FULL("wiredecode", dtr_wiredecode, 0, NULL, 0),
+		SHIM_FS_FULL("wirewalk", dtr_wirewalk, 0, NULL, 0),
+		SHIM_FS_FULL("wireseq", dtr_wireseq, 0, NULL, 0),
+		SHIM_FS_FULL("wirecount", dtr_wirecount, 0, NULL, 0),
+		SHIM_FS_FULL("wireclose", dtr_wireclose, 0, NULL, 0),
+		SHIM_FS_END,
+	};
+
+	shim_obj_set_funcs(ctx, exports, funcs);
+	return (TRUE);
+}
+
+
+/*
+ * JavaScript entry points.  As in dtrace_async.c, argument checking happens in
+ * the caller.  Times are passed as milliseconds since the epoch.
+ */
+
+/*
+ * open(path, flags): map the capture log and return a handle for it.
+ */
+static int
+dtr_open(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	shim_val_t *arg, *external_wrapper, *persistent_wrapper;
+	char *path;
+	int flags;
+
+	path = dtr_string_arg(args, 0);
+	arg = shim_args_get(args, 1);
+	flags = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if ((dtrp = calloc(1, sizeof (*dtrp))) == NULL) {
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+		free(path);
+		return (TRUE);
+	}
+
+	if (dta_capread_open(&dtrp->dtr_reader, path, flags) != 0) {
+		shim_throw_error(ctx, "%s: %s", path,
+		    errno == EINVAL ? "not a capture log" : strerror(errno));
+		free(dtrp);
+		free(path);
+		return (TRUE);
+	}
+
+	free(path);
+
+	external_wrapper = shim_external_new(ctx, dtrp);
+	persistent_wrapper = shim_persistent_new(ctx, external_wrapper);
+	shim_value_release(external_wrapper);
+	dtrp->dtr_self = persistent_wrapper;
+	shim_args_set_rval(ctx, args, persistent_wrapper);
+	return (TRUE);
+}
+
+/*
+ * filter(self, provider, module, func, name): see dta_capread_filter().
+ */
+static int
+dtr_filter(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	char *names[4];
+	int i, rv;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	for (i = 0; i < 4; i++)
+		names[i] = dtr_string_arg(args, i + 1);
+
+	rv = dta_capread_filter(&dtrp->dtr_reader, names[0], names[1],
+	    names[2], names[3]);
+	for (i = 0; i < 4; i++)
+		free(names[i]);
+
+	if (rv != 0)
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+	return (TRUE);
+}
+
+/*
+ * seek(self, time): see dta_capread_seek().
+ */
+static int
+dtr_seek(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	shim_val_t *arg;
+	double ms;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	arg = shim_args_get(args, 1);
+	ms = shim_number_value(arg);
+	shim_value_release(arg);
+
+	if (dta_capread_seek(&dtrp->dtr_reader,
+	    ms <= 0 ? 0 : (uint64_t)(ms * 1000000)) != 0)
+		shim_throw_error(ctx, "seek: %s", strerror(errno));
+	return (TRUE);
+}
+
+/*
+ * read(self, callback): invoke the callback for each record that was consumed
+ * by the next consume() call in the capture, just as consume() would:
+ *
+ *     callback(provider, module, func, name[, data])
+ *
+ * Returns the time at which those records were consumed, or -1 if there are
+ * no more records.
+ */
+static int
+dtr_read(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	dta_capreader_t *rd;
+	dta_capevent_t ev;
+	uint64_t time;
+	size_t nread = 0;
+	shim_val_t *argv[5];
+	int i, argc, rv;
+	shim_val_t *callback;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	callback = shim_args_get(args, 1);
+
+	rd = &dtrp->dtr_reader;
+	time = rd->dcr_time;
+	while ((rv = dta_capread_next(rd, &ev)) == 1) {
+		if (ev.dce_kind == DTA_CAPEV_TIME) {
+			/*
+			 * A new time marks the start of the next consume()
+			 * call, unless it just repeats the time at the start
+			 * of a segment.
+			 */
+			if (nread != 0 && ev.dce_time != time)
+				break;
+			time = ev.dce_time;
+			continue;
+		}
+
+		for (i = 0; i < 4; i++)
+			argv[i] = shim_string_new_copy(ctx, ev.dce_probe[i]);
+		argc = 4;
+
+		if (ev.dce_kind == DTA_CAPEV_INT)
+			argv[argc++] = shim_number_new(ctx, (double)ev.dce_int);
+		else if (ev.dce_kind == DTA_CAPEV_STRING)
+			argv[argc++] = shim_string_new_copy(ctx, ev.dce_str);
+
+		(void) shim_func_call_val(ctx, NULL, callback, argc, argv,
+		    NULL);
+		for (i = 0; i < argc; i++)
+			shim_value_release(argv[i]);
+		nread++;
+	}
+
+	shim_value_release(callback);
+
+	if (rv == -1) {
+		shim_throw_error(ctx, "read: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	shim_args_set_rval(ctx, args, shim_number_new(ctx,
+	    nread == 0 ? -1 : time / 1e6));
+	return (TRUE);
+}
+
+/*
+ * time(self): returns the time of the next records to be read, if known.
+ */
+static int
+dtr_time(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	shim_args_set_rval(ctx, args,
+	    shim_number_new(ctx, dtrp->dtr_reader.dcr_time / 1e6));
+	return (TRUE);
+}
+
+/*
+ * segments(self, callback): invoke the callback for each segment in the log
+ * with its start time, end time, number of events, and number of probes.
+ */
+static int
+dtr_segments(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	const dta_capseg_t *seg;
+	shim_val_t *argv[4];
+	uint32_t i;
+	int j;
+	shim_val_t *callback;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	callback = shim_args_get(args, 1);
+
+	for (i = 0; i < dtrp->dtr_reader.dcr_nsegs; i++) {
+		seg = &dtrp->dtr_reader.dcr_segs[i];
+		argv[0] = shim_number_new(ctx, seg->dcs_start / 1e6);
+		argv[1] = shim_number_new(ctx, seg->dcs_end / 1e6);
+		argv[2] = shim_number_new(ctx, seg->dcs_nevents);
+		argv[3] = shim_number_new(ctx, seg->dcs_nprobes);
+		(void) shim_func_call_val(ctx, NULL, callback, 4, argv, NULL);
+		for (j = 0; j < 4; j++)
+			shim_value_release(argv[j]);
+	}
+
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * stats(self, callback): invoke the callback with the number of segments, the
+ * number of segments skipped as corrupt, the number of bytes of complete
+ * segments, and the size of the file.
+ */
+static int
+dtr_stats(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+	dta_capreader_t *rd;
+	shim_val_t *argv[4];
+	int i;
+	shim_val_t *callback;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	callback = shim_args_get(args, 1);
+
+	rd = &dtrp->dtr_reader;
+	argv[0] = shim_number_new(ctx, rd->dcr_nsegs);
+	argv[1] = shim_number_new(ctx, rd->dcr_nbad);
+	argv[2] = shim_number_new(ctx, (double)rd->dcr_valid);
+	argv[3] = shim_number_new(ctx, (double)rd->dcr_size);
+	(void) shim_func_call_val(ctx, NULL, callback, 4, argv, NULL);
+	for (i = 0; i < 4; i++)
+		shim_value_release(argv[i]);
+
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * close(self): unmap the log and free the handle.  JavaScript must not use the
+ * handle afterwards.
+ */
+static int
+dtr_close(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_hdl_t *dtrp;
+
+	if ((dtrp = dtr_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	dta_capread_close(&dtrp->dtr_reader);
+	shim_persistent_dispose(dtrp->dtr_self);
+	free(dtrp);
+	return (TRUE);
+}
+
+/*
+ * wireopen(): returns a new wire decoder, which has decoded no frames.
+ */
+static int
+dtr_wireopen(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+
+	if ((dtwp = calloc(1, sizeof (*dtwp))) == NULL) {
+		shim_throw_error(ctx, "malloc: %s", strerror(errno));
+		return (TRUE);
+	}
+
+	dta_aggtab_init(&dtwp->dtw_tab);
+	shim_args_set_rval(ctx, args, shim_external_new(ctx, dtwp));
+	return (TRUE);
+}
+
+/*
+ * wiredecode(self, frame): apply the frame (a Buffer) to the decoder's records
+ * and return its sequence number.  See dta_wire_decode().
+ */
+static int
+dtr_wiredecode(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+	shim_val_t *frame;
+	int rv;
+
+	if ((dtwp = dtr_wire_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	frame = shim_args_get(args, 1);
+	rv = dta_wire_decode((const uint8_t *)shim_buffer_value(frame),
+	    shim_buffer_length(frame), &dtwp->dtw_tab, &dtwp->dtw_seq);
+	shim_value_release(frame);
+
+	if (rv == 0) {
+		shim_args_set_rval(ctx, args,
+		    shim_number_new(ctx, (double)dtwp->dtw_seq));
+		return (TRUE);
+	}
+
+	if (errno == EINVAL) {
+		shim_throw_error(ctx, "aggwire: malformed frame");
+	} else if (errno == ESTALE) {
+		shim_throw_error(ctx, "aggwire: frame is not relative to the "
+		    "last frame decoded (%llu)",
+		    (unsigned long long)dtwp->dtw_seq);
+	} else {
+		/*
+		 * We ran out of memory part way through applying the frame, so
+		 * the records are no longer those of any frame.  Start over
+		 * from the next full frame.
+		 */
+		shim_throw_error(ctx, "aggwire: %s", strerror(errno));
+		dta_aggtab_clear(&dtwp->dtw_tab);
+		dtwp->dtw_seq = 0;
+	}
+
+	return (TRUE);
+}
+
+/*
+ * wirewalk(self, callback): invoke the callback for each record with its
+ * variable's id, kind (dta_aggkind_t), parameter word (as two 32-bit halves),
+ * and number of keys, followed by the record's keys and then its values:
+ *
+ *     callback(varid, kind, paramhi, paramlo, nkeys, key0, ..., val0, ...)
+ *
+ * As with the other readers, 64-bit values beyond 2^53 lose precision.
+ */
+static int
+dtr_wirewalk(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+	const dta_aggent_t *ent;
+	const dta_aggvar_t *var;
+	const uint8_t *key, *end;
+	const char *str;
+	uint32_t len;
+	int64_t ival;
+	shim_val_t **argv;
+	int i, argc;
+	shim_val_t *callback;
+
+	if ((dtwp = dtr_wire_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	callback = shim_args_get(args, 1);
+	for (ent = dtwp->dtw_tab.dat_first; ent != NULL;
+	    ent = ent->dae_lnext) {
+		var = ent->dae_var;
+		if ((argv = calloc(5 + var->dav_nkeys + var->dav_nvals,
+		    sizeof (argv[0]))) == NULL) {
+			shim_throw_error(ctx, "malloc: %s", strerror(errno));
+			break;
+		}
+
+		argv[0] = shim_number_new(ctx, (double)var->dav_varid);
+		argv[1] = shim_number_new(ctx, var->dav_kind);
+		argv[2] = shim_number_new(ctx, var->dav_param >> 32);
+		argv[3] = shim_number_new(ctx, var->dav_param & UINT32_MAX);
+		argv[4] = shim_number_new(ctx, var->dav_nkeys);
+		argc = 5;
+
+		key = ent->dae_key;
+		end = key + ent->dae_keylen;
+		while (key < end) {
+			if (dta_aggkey_next(&key, end, &ival, &str, &len) ==
+			    DTA_KEY_INT)
+				argv[argc++] = shim_number_new(ctx,
+				    (double)ival);
+			else
+				argv[argc++] = shim_string_new_copy(ctx, str);
+		}
+
+		for (i = 0; i < var->dav_nvals; i++)
+			argv[argc++] = shim_number_new(ctx,
+			    (double)ent->dae_vals[i]);
+
+		(void) shim_func_call_val(ctx, NULL, callback, argc, argv,
+		    NULL);
+		for (i = 0; i < argc; i++)
+			shim_value_release(argv[i]);
+		free(argv);
+	}
+
+	shim_value_release(callback);
+	return (TRUE);
+}
+
+/*
+ * wireseq(self): returns the sequence number of the last frame decoded, or
+ * zero if the decoder needs a full frame.
+ */
+static int
+dtr_wireseq(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+
+	if ((dtwp = dtr_wire_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	shim_args_set_rval(ctx, args,
+	    shim_number_new(ctx, (double)dtwp->dtw_seq));
+	return (TRUE);
+}
+
+/*
+ * wirecount(self): returns the number of records.
+ */
+static int
+dtr_wirecount(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+
+	if ((dtwp = dtr_wire_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	shim_args_set_rval(ctx, args,
+	    shim_number_new(ctx, dtwp->dtw_tab.dat_nents));
+	return (TRUE);
+}
+
+/*
+ * wireclose(self): free the decoder.  JavaScript must not use the handle
+ * afterwards.
+ */
+static int
+dtr_wireclose(shim_ctx_t *ctx, shim_args_t *args)
+{
+	dtr_wire_t *dtwp;
+
+	if ((dtwp = dtr_wire_self(ctx, args)) == NULL)
+		return (TRUE);
+
+	dta_aggtab_fini(&dtwp->dtw_tab);
+	free(dtwp);
+	return (TRUE);
+}
+
+
+/*
+ * Helpers
+ */
+
+/*
+ * Returns the handle passed as the first argument.
+ */
+static dtr_hdl_t *
+dtr_self(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (NULL);
+	}
+
+	return (UNPACK_SELF(selfptr));
+}
+
+/*
+ * Returns the wire decoder passed as the first argument.
+ */
+static dtr_wire_t *
+dtr_wire_self(shim_ctx_t *ctx, shim_args_t *args)
+{
+	uintptr_t selfptr;
+
+	if (!shim_unpack(ctx, args,
+	    SHIM_TYPE_UINT32, &selfptr,
+	    SHIM_TYPE_UNKNOWN)) {
+		return (NULL);
+	}
+
+	return (UNPACK_WIRE(selfptr));
+}
+
+/*
+ * Returns argument "i" as a newly allocated string, or NULL if it's not a
+ * string.
+ */
+static char *
+dtr_string_arg(shim_args_t *args, int i)
+{
+	shim_val_t *arg;
+	char *rv = NULL;
+
+	arg = shim_args_get(args, i);
+	if (shim_value_is(arg, SHIM_TYPE_STRING))
+		rv = shim_string_value(arg);
+	shim_value_release(arg);
+	return (rv);
+}
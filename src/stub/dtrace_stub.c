@@ -0,0 +1,1140 @@
+/*
+ * src/stub/dtrace_stub.c: a stub libdtrace that synthesizes trace data, so that
+ * the binding can be built, exercised, and benchmarked on systems without
+ * DTrace (see bench/ and the "dtrace_stub" variable in binding.gyp).
+ *
+ * The D program passed to dtrace_program_strcompile() is ignored.  Instead,
+ * the data are described by options, which are set like any others with
+ * dtrace_setopt() (and so with consumer.setopt()) before dtrace_go():
+ *
+ *     stub_probes	number of distinct probes that fire (default 1)
+ *     stub_records	probe firings per consume (default 100)
+ *     stub_rate	if set, probe firings per second instead
+ *     stub_strings	number of distinct strings traced (default 16)
+ *     stub_printf	if non-zero, each firing also calls printf()
+ *     stub_agg		aggregating action: "count", "sum", "min", "max",
+ *     			"avg", "quantize" (the default), "lquantize", or
+ *     			"llquantize"
+ *     stub_keys	number of distinct aggregation keys (default 100)
+ *     stub_aggrecords	firings aggregated per aggregation snapshot (default
+ *     			1000)
+ *     stub_aggrate	if set, firings aggregated per second instead
+ *
+ * Each firing of probe "stub:bench:fire<i>:entry" is as if from:
+ *
+ *     stub:bench:fire<i>:entry
+ *     {
+ *             trace(seq); trace(str);
+ *             printf("fire<i>: %s seq %d\n", str, seq);	(stub_printf)
+ *             @agg[key] = <stub_agg>(value);
+ *     }
+ *
+ * where "str" is one of "str0", "str1", and so on, "key" one of "key0", "key1",
+ * and so on, and "value" a number between 0 and 2^24, all drawn from a
+ * generator with a fixed seed, so that every run produces the same data.
+ * lquantize() and llquantize() use the parameters (0, 1000, 10) and
+ * (10, 0, 6, 20).  "bufsize" bounds the firings returned by one consume, as
+ * the principal buffer would; with bufpolicy=ring, the most recent ones are
+ * kept.  Once tracing stops, whatever fired until then can still be consumed.
+ *
+ * As with libdtrace, a handle must only be used by one thread at a time.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "dtrace.h"
+
+#define	DTS_STRLEN	32	/* size of traced strings and keys */
+#define	DTS_VARID	1	/* variable, aggregation, and first EPID */
+
+/* offsets of the records of each firing and of each aggregation entry */
+#define	DTS_OFF_SEQ	0
+#define	DTS_OFF_STR	8
+#define	DTS_OFF_PRINTF	(DTS_OFF_STR + DTS_STRLEN)
+#define	DTS_OFF_AGGKEY	8
+#define	DTS_OFF_AGGVAL	(DTS_OFF_AGGKEY + DTS_STRLEN)
+
+#define	DTS_LQ_BASE	0
+#define	DTS_LQ_STEP	10
+#define	DTS_LQ_LEVELS	100
+#define	DTS_LLQ_FACTOR	10
+#define	DTS_LLQ_LOW	0
+#define	DTS_LLQ_HIGH	6
+#define	DTS_LLQ_NSTEPS	20
+
+const char _dtrace_version[] = "Sun D 1.13 (stub)";
+
+typedef struct dts_opt {
+	char		*dso_name;
+	char		*dso_value;
+	struct dts_opt	*dso_next;
+} dts_opt_t;
+
+/*
+ * Firings accumulate between consumes (and between aggregation snapshots) at
+ * either a fixed count or a fixed rate.  Once tracing has stopped, what fired
+ * until then is delivered once more.
+ */
+typedef struct dts_source {
+	int64_t		dsr_count;	/* firings per consume, or */
+	int64_t		dsr_rate;	/* firings per second */
+	uint64_t	dsr_last;	/* time of last consume */
+	double		dsr_pending;	/* fractional firing carried over */
+	int		dsr_final;	/* stopped, and delivered */
+} dts_source_t;
+
+struct dtrace_prog {
+	int		dp_unused;
+};
+
+struct dtrace_hdl {
+	int		dt_errno;
+	int		dt_status;	/* DTRACE_STATUS_{NONE,OKAY,STOPPED} */
+	uint64_t	dt_stoptime;
+	uint64_t	dt_rand;	/* xorshift64 state */
+	dts_opt_t	*dt_opts;
+	dtrace_handle_buffered_f *dt_bufhdlr;
+	void		*dt_bufarg;
+	struct dtrace_prog dt_prog;
+
+	/* probes */
+	int		dt_nprobes;
+	dtrace_probedesc_t *dt_pdescs;
+	dtrace_eprobedesc_t **dt_edescs;
+	uint32_t	dt_nstrings;
+	int64_t		dt_seq;
+	dts_source_t	dt_recsrc;
+
+	/* aggregation */
+	dtrace_aggdesc_t *dt_aggdesc;
+	char		*dt_aggdata;	/* dt_nkeys entries of dtagd_size */
+	uint8_t		*dt_aggpresent;
+	uint32_t	dt_nkeys;
+	int64_t		*dt_llbounds;	/* lower bound of each bucket */
+	uint32_t	dt_nllbuckets;
+	dts_source_t	dt_aggsrc;
+};
+
+/*
+ * Used to order aggregation entries for the sorted walks.
+ */
+typedef struct dts_sort {
+	int64_t		dss_val;
+	const char	*dss_key;
+	uint32_t	dss_idx;
+} dts_sort_t;
+
+static const struct {
+	const char	*dsa_name;
+	dtrace_actkind_t dsa_action;
+} dts_aggs[] = {
+	{ "count",	DTRACEAGG_COUNT },
+	{ "sum",	DTRACEAGG_SUM },
+	{ "min",	DTRACEAGG_MIN },
+	{ "max",	DTRACEAGG_MAX },
+	{ "avg",	DTRACEAGG_AVG },
+	{ "quantize",	DTRACEAGG_QUANTIZE },
+	{ "lquantize",	DTRACEAGG_LQUANTIZE },
+	{ "llquantize",	DTRACEAGG_LLQUANTIZE },
+	{ NULL }
+};
+
+static const char *dts_numopts[] = {
+	"stub_probes", "stub_records", "stub_rate", "stub_strings",
+	"stub_printf", "stub_keys", "stub_aggrecords", "stub_aggrate", NULL
+};
+
+static int dts_error(dtrace_hdl_t *, int);
+static uint64_t dts_clock(void);
+static uint64_t dts_rand(dtrace_hdl_t *);
+static int dts_parsenum(const char *, int64_t *);
+static const char *dts_optstr(dtrace_hdl_t *, const char *);
+static int64_t dts_optnum(dtrace_hdl_t *, const char *, int64_t);
+static dtrace_actkind_t dts_aggaction(const char *);
+static void dts_teardown(dtrace_hdl_t *);
+static int dts_setup(dtrace_hdl_t *);
+static int dts_setup_agg(dtrace_hdl_t *);
+static uint64_t dts_fire(dtrace_hdl_t *, dts_source_t *);
+static void dts_agg_init(dtrace_hdl_t *, char *);
+static void dts_agg_add(dtrace_hdl_t *, char *, int64_t);
+static int64_t dts_agg_sortval(dtrace_hdl_t *, const char *);
+static int dts_aggwalk(dtrace_hdl_t *, dtrace_aggregate_f *, void *,
+    int (*)(const void *, const void *), int);
+static int dts_sort_val(const void *, const void *);
+static int dts_sort_key(const void *, const void *);
+
+
+/*
+ * Handles and errors
+ */
+
+dtrace_hdl_t *
+dtrace_open(int version, int flags, int *errp)
+{
+	dtrace_hdl_t *dtp;
+
+	if (version > DTRACE_VERSION || flags != 0) {
+		*errp = EINVAL;
+		return (NULL);
+	}
+
+	if ((dtp = calloc(1, sizeof (*dtp))) == NULL) {
+		*errp = errno;
+		return (NULL);
+	}
+
+	dtp->dt_rand = 0x9e3779b97f4a7c15ULL;
+	return (dtp);
+}
+
+void
+dtrace_close(dtrace_hdl_t *dtp)
+{
+	dts_opt_t *dso, *next;
+
+	for (dso = dtp->dt_opts; dso != NULL; dso = next) {
+		next = dso->dso_next;
+		free(dso->dso_name);
+		free(dso->dso_value);
+		free(dso);
+	}
+
+	dts_teardown(dtp);
+	free(dtp);
+}
+
+int
+dtrace_errno(dtrace_hdl_t *dtp)
+{
+	return (dtp->dt_errno);
+}
+
+/*ARGSUSED*/
+const char *
+dtrace_errmsg(dtrace_hdl_t *dtp, int err)
+{
+	return (strerror(err));
+}
+
+static int
+dts_error(dtrace_hdl_t *dtp, int err)
+{
+	dtp->dt_errno = err;
+	return (-1);
+}
+
+static uint64_t
+dts_clock(void)
+{
+	struct timespec ts;
+
+	(void) clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+static uint64_t
+dts_rand(dtrace_hdl_t *dtp)
+{
+	uint64_t x = dtp->dt_rand;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	dtp->dt_rand = x;
+	return (x * 0x2545f4914f6cdd1dULL);
+}
+
+
+/*
+ * Options
+ */
+
+int
+dtrace_setopt(dtrace_hdl_t *dtp, const char *name, const char *value)
+{
+	dts_opt_t *dso;
+	int64_t num;
+	int i;
+
+	if (value == NULL)
+		value = "";
+
+	if (strncmp(name, "stub_", 5) == 0) {
+		if (strcmp(name, "stub_agg") == 0) {
+			if (dts_aggaction(value) == DTRACEACT_NONE)
+				return (dts_error(dtp, EINVAL));
+		} else {
+			for (i = 0; dts_numopts[i] != NULL; i++) {
+				if (strcmp(name, dts_numopts[i]) == 0)
+					break;
+			}
+
+			if (dts_numopts[i] == NULL ||
+			    dts_parsenum(value, &num) != 0 || num < 0)
+				return (dts_error(dtp, EINVAL));
+		}
+	} else if (strcmp(name, "bufpolicy") == 0) {
+		if (strcmp(value, "ring") != 0 && strcmp(value, "fill") != 0 &&
+		    strcmp(value, "switch") != 0)
+			return (dts_error(dtp, EINVAL));
+	}
+
+	for (dso = dtp->dt_opts; dso != NULL; dso = dso->dso_next) {
+		if (strcmp(dso->dso_name, name) == 0)
+			break;
+	}
+
+	if (dso == NULL) {
+		if ((dso = calloc(1, sizeof (*dso))) == NULL ||
+		    (dso->dso_name = strdup(name)) == NULL) {
+			free(dso);
+			return (dts_error(dtp, ENOMEM));
+		}
+
+		dso->dso_next = dtp->dt_opts;
+		dtp->dt_opts = dso;
+	}
+
+	free(dso->dso_value);
+	if ((dso->dso_value = strdup(value)) == NULL)
+		return (dts_error(dtp, ENOMEM));
+
+	return (0);
+}
+
+int
+dtrace_getopt(dtrace_hdl_t *dtp, const char *name, dtrace_optval_t *valp)
+{
+	const char *str = dts_optstr(dtp, name);
+	int64_t num;
+
+	if (strcmp(name, "bufpolicy") == 0) {
+		*valp = str == NULL || strcmp(str, "switch") == 0 ?
+		    DTRACEOPT_BUFPOLICY_SWITCH : strcmp(str, "ring") == 0 ?
+		    DTRACEOPT_BUFPOLICY_RING : DTRACEOPT_BUFPOLICY_FILL;
+		return (0);
+	}
+
+	if (str == NULL) {
+		*valp = DTRACEOPT_UNSET;
+		return (0);
+	}
+
+	if (*str == '\0') {
+		*valp = 0;
+		return (0);
+	}
+
+	if (dts_parsenum(str, &num) != 0)
+		return (dts_error(dtp, EINVAL));
+
+	*valp = num;
+	return (0);
+}
+
+/*
+ * Parse a number with an optional size suffix, as in "4m".  Other suffixes
+ * (like the "hz" of rates) are ignored.
+ */
+static int
+dts_parsenum(const char *str, int64_t *valp)
+{
+	char *end;
+	int64_t val;
+
+	errno = 0;
+	val = strtoll(str, &end, 0);
+	if (errno != 0 || end == str)
+		return (-1);
+
+	switch (*end) {
+	case 't':
+	case 'T':
+		val *= 1024;
+		/*FALLTHROUGH*/
+	case 'g':
+	case 'G':
+		val *= 1024;
+		/*FALLTHROUGH*/
+	case 'm':
+	case 'M':
+		val *= 1024;
+		/*FALLTHROUGH*/
+	case 'k':
+	case 'K':
+		val *= 1024;
+		break;
+	}
+
+	*valp = val;
+	return (0);
+}
+
+static const char *
+dts_optstr(dtrace_hdl_t *dtp, const char *name)
+{
+	dts_opt_t *dso;
+
+	for (dso = dtp->dt_opts; dso != NULL; dso = dso->dso_next) {
+		if (strcmp(dso->dso_name, name) == 0)
+			return (dso->dso_value);
+	}
+
+	return (NULL);
+}
+
+static int64_t
+dts_optnum(dtrace_hdl_t *dtp, const char *name, int64_t dflt)
+{
+	const char *str = dts_optstr(dtp, name);
+	int64_t num;
+
+	if (str == NULL || dts_parsenum(str, &num) != 0)
+		return (dflt);
+
+	return (num);
+}
+
+static dtrace_actkind_t
+dts_aggaction(const char *name)
+{
+	int i;
+
+	for (i = 0; dts_aggs[i].dsa_name != NULL; i++) {
+		if (strcmp(dts_aggs[i].dsa_name, name) == 0)
+			return (dts_aggs[i].dsa_action);
+	}
+
+	return (DTRACEACT_NONE);
+}
+
+int
+dtrace_handle_buffered(dtrace_hdl_t *dtp, dtrace_handle_buffered_f *func,
+    void *arg)
+{
+	if (dtp->dt_bufhdlr != NULL)
+		return (dts_error(dtp, EALREADY));
+
+	dtp->dt_bufhdlr = func;
+	dtp->dt_bufarg = arg;
+	return (0);
+}
+
+
+/*
+ * Programs and tracing
+ */
+
+/*ARGSUSED*/
+dtrace_prog_t *
+dtrace_program_strcompile(dtrace_hdl_t *dtp, const char *str, int spec,
+    unsigned int cflags, int argc, char *const argv[])
+{
+	return (&dtp->dt_prog);
+}
+
+/*ARGSUSED*/
+int
+dtrace_program_exec(dtrace_hdl_t *dtp, dtrace_prog_t *pgp,
+    dtrace_proginfo_t *pip)
+{
+	if (pip != NULL) {
+		bzero(pip, sizeof (*pip));
+		pip->dpi_descs = 1;
+		pip->dpi_recgens = 1;
+		pip->dpi_matches = dts_optnum(dtp, "stub_probes", 1);
+		pip->dpi_aggregates = 1;
+	}
+
+	return (0);
+}
+
+int
+dtrace_go(dtrace_hdl_t *dtp)
+{
+	if (dtp->dt_status != DTRACE_STATUS_NONE)
+		return (dts_error(dtp, EALREADY));
+
+	if (dts_setup(dtp) != 0) {
+		dts_teardown(dtp);
+		return (-1);
+	}
+
+	dtp->dt_recsrc.dsr_last = dtp->dt_aggsrc.dsr_last = dts_clock();
+	dtp->dt_status = DTRACE_STATUS_OKAY;
+	return (0);
+}
+
+int
+dtrace_stop(dtrace_hdl_t *dtp)
+{
+	if (dtp->dt_status == DTRACE_STATUS_STOPPED)
+		return (0);
+
+	dtp->dt_stoptime = dts_clock();
+	dtp->dt_status = DTRACE_STATUS_STOPPED;
+	return (0);
+}
+
+int
+dtrace_status(dtrace_hdl_t *dtp)
+{
+	return (dtp->dt_status == DTRACE_STATUS_STOPPED ?
+	    DTRACE_STATUS_STOPPED : DTRACE_STATUS_NONE);
+}
+
+/*
+ * Free the probe and aggregation descriptions built by dts_setup().
+ */
+static void
+dts_teardown(dtrace_hdl_t *dtp)
+{
+	int i;
+
+	if (dtp->dt_edescs != NULL) {
+		for (i = 0; i < dtp->dt_nprobes; i++)
+			free(dtp->dt_edescs[i]);
+	}
+
+	free(dtp->dt_edescs);
+	free(dtp->dt_pdescs);
+	free(dtp->dt_aggdesc);
+	free(dtp->dt_aggdata);
+	free(dtp->dt_aggpresent);
+	free(dtp->dt_llbounds);
+	dtp->dt_edescs = NULL;
+	dtp->dt_pdescs = NULL;
+	dtp->dt_aggdesc = NULL;
+	dtp->dt_aggdata = NULL;
+	dtp->dt_aggpresent = NULL;
+	dtp->dt_llbounds = NULL;
+}
+
+/*
+ * Build the probe and aggregation descriptions from the options.
+ */
+static int
+dts_setup(dtrace_hdl_t *dtp)
+{
+	dtrace_eprobedesc_t *edesc;
+	dtrace_probedesc_t *pdesc;
+	dtrace_recdesc_t *rec;
+	int doprintf = dts_optnum(dtp, "stub_printf", 0) != 0;
+	int nrecs = doprintf ? 3 : 2;
+	int i;
+
+	dtp->dt_nprobes = dts_optnum(dtp, "stub_probes", 1);
+	dtp->dt_nstrings = dts_optnum(dtp, "stub_strings", 16);
+	dtp->dt_recsrc.dsr_count = dts_optnum(dtp, "stub_records", 100);
+	dtp->dt_recsrc.dsr_rate = dts_optnum(dtp, "stub_rate", 0);
+	if (dtp->dt_nprobes < 1 || dtp->dt_nstrings < 1)
+		return (dts_error(dtp, EINVAL));
+
+	if ((dtp->dt_pdescs = calloc(dtp->dt_nprobes,
+	    sizeof (dtp->dt_pdescs[0]))) == NULL ||
+	    (dtp->dt_edescs = calloc(dtp->dt_nprobes,
+	    sizeof (dtp->dt_edescs[0]))) == NULL)
+		return (dts_error(dtp, ENOMEM));
+
+	for (i = 0; i < dtp->dt_nprobes; i++) {
+		pdesc = &dtp->dt_pdescs[i];
+		pdesc->dtpd_id = i + 1;
+		(void) strcpy(pdesc->dtpd_provider, "stub");
+		(void) strcpy(pdesc->dtpd_mod, "bench");
+		(void) snprintf(pdesc->dtpd_func, sizeof (pdesc->dtpd_func),
+		    "fire%d", i);
+		(void) strcpy(pdesc->dtpd_name, "entry");
+
+		if ((edesc = calloc(1, sizeof (*edesc) +
+		    (nrecs - 1) * sizeof (edesc->dtepd_rec[0]))) == NULL)
+			return (dts_error(dtp, ENOMEM));
+
+		dtp->dt_edescs[i] = edesc;
+		edesc->dtepd_epid = DTS_VARID + i;
+		edesc->dtepd_probeid = pdesc->dtpd_id;
+		edesc->dtepd_nrecs = nrecs;
+		edesc->dtepd_size = DTS_OFF_PRINTF +
+		    (doprintf ? sizeof (uint64_t) : 0);
+
+		rec = &edesc->dtepd_rec[0];
+		rec->dtrd_action = DTRACEACT_DIFEXPR;
+		rec->dtrd_size = sizeof (uint64_t);
+		rec->dtrd_offset = DTS_OFF_SEQ;
+		rec->dtrd_alignment = sizeof (uint64_t);
+
+		rec = &edesc->dtepd_rec[1];
+		rec->dtrd_action = DTRACEACT_DIFEXPR;
+		rec->dtrd_size = DTS_STRLEN;
+		rec->dtrd_offset = DTS_OFF_STR;
+		rec->dtrd_alignment = 1;
+
+		if (doprintf) {
+			rec = &edesc->dtepd_rec[2];
+			rec->dtrd_action = DTRACEACT_PRINTF;
+			rec->dtrd_size = sizeof (uint64_t);
+			rec->dtrd_offset = DTS_OFF_PRINTF;
+			rec->dtrd_alignment = sizeof (uint64_t);
+			rec->dtrd_format = 1;
+		}
+	}
+
+	return (dts_setup_agg(dtp));
+}
+
+static int
+dts_setup_agg(dtrace_hdl_t *dtp)
+{
+	const char *aggname = dts_optstr(dtp, "stub_agg");
+	dtrace_actkind_t action;
+	dtrace_aggdesc_t *aggdesc;
+	dtrace_recdesc_t *rec;
+	uint32_t valsize, n;
+	int64_t value, next, step;
+	int order;
+
+	action = dts_aggaction(aggname == NULL ? "quantize" : aggname);
+	dtp->dt_nkeys = dts_optnum(dtp, "stub_keys", 100);
+	dtp->dt_aggsrc.dsr_count = dts_optnum(dtp, "stub_aggrecords", 1000);
+	dtp->dt_aggsrc.dsr_rate = dts_optnum(dtp, "stub_aggrate", 0);
+	if (dtp->dt_nkeys < 1)
+		return (dts_error(dtp, EINVAL));
+
+	switch (action) {
+	case DTRACEAGG_AVG:
+		valsize = 2 * sizeof (uint64_t);
+		break;
+
+	case DTRACEAGG_QUANTIZE:
+		valsize = DTRACE_QUANTIZE_NBUCKETS * sizeof (uint64_t);
+		break;
+
+	case DTRACEAGG_LQUANTIZE:
+		valsize = (1 + DTS_LQ_LEVELS + 2) * sizeof (uint64_t);
+		break;
+
+	case DTRACEAGG_LLQUANTIZE:
+		/*
+		 * Compute the lower bound of each bucket, as lib/buckets.js
+		 * computes their ranges.
+		 */
+		if ((dtp->dt_llbounds = calloc(2 +
+		    (DTS_LLQ_HIGH - DTS_LLQ_LOW + 1) * DTS_LLQ_NSTEPS,
+		    sizeof (int64_t))) == NULL)
+			return (dts_error(dtp, ENOMEM));
+
+		value = 1;
+		for (order = 0; order < DTS_LLQ_LOW; order++)
+			value *= DTS_LLQ_FACTOR;
+
+		n = 0;
+		dtp->dt_llbounds[n++] = INT64_MIN;
+		next = value * DTS_LLQ_FACTOR;
+		step = next > DTS_LLQ_NSTEPS ? next / DTS_LLQ_NSTEPS : 1;
+
+		while (order <= DTS_LLQ_HIGH) {
+			dtp->dt_llbounds[n++] = value;
+			if ((value += step) != next)
+				continue;
+
+			next = value * DTS_LLQ_FACTOR;
+			step = next > DTS_LLQ_NSTEPS ?
+			    next / DTS_LLQ_NSTEPS : 1;
+			order++;
+		}
+
+		dtp->dt_llbounds[n++] = value;
+		dtp->dt_nllbuckets = n;
+		valsize = (1 + n) * sizeof (uint64_t);
+		break;
+
+	default:
+		valsize = sizeof (uint64_t);
+		break;
+	}
+
+	if ((aggdesc = calloc(1, sizeof (*aggdesc) +
+	    2 * sizeof (aggdesc->dtagd_rec[0]))) == NULL)
+		return (dts_error(dtp, ENOMEM));
+
+	dtp->dt_aggdesc = aggdesc;
+	aggdesc->dtagd_name = "agg";
+	aggdesc->dtagd_varid = DTS_VARID;
+	aggdesc->dtagd_id = DTS_VARID;
+	aggdesc->dtagd_epid = DTS_VARID;
+	aggdesc->dtagd_size = DTS_OFF_AGGVAL + valsize;
+	aggdesc->dtagd_nrecs = 3;
+
+	rec = &aggdesc->dtagd_rec[0];
+	rec->dtrd_action = DTRACEACT_DIFEXPR;
+	rec->dtrd_size = sizeof (uint64_t);
+	rec->dtrd_offset = 0;
+	rec->dtrd_alignment = sizeof (uint64_t);
+
+	rec = &aggdesc->dtagd_rec[1];
+	rec->dtrd_action = DTRACEACT_DIFEXPR;
+	rec->dtrd_size = DTS_STRLEN;
+	rec->dtrd_offset = DTS_OFF_AGGKEY;
+	rec->dtrd_alignment = 1;
+
+	rec = &aggdesc->dtagd_rec[2];
+	rec->dtrd_action = action;
+	rec->dtrd_size = valsize;
+	rec->dtrd_offset = DTS_OFF_AGGVAL;
+	rec->dtrd_alignment = sizeof (uint64_t);
+
+	if ((dtp->dt_aggdata = calloc(dtp->dt_nkeys,
+	    aggdesc->dtagd_size)) == NULL ||
+	    (dtp->dt_aggpresent = calloc(dtp->dt_nkeys, 1)) == NULL)
+		return (dts_error(dtp, ENOMEM));
+
+	return (0);
+}
+
+/*
+ * Returns the number of firings since the last call for the given source.
+ */
+static uint64_t
+dts_fire(dtrace_hdl_t *dtp, dts_source_t *dsr)
+{
+	uint64_t now, n;
+
+	if (dtp->dt_status == DTRACE_STATUS_NONE || dsr->dsr_final)
+		return (0);
+
+	if (dtp->dt_status == DTRACE_STATUS_STOPPED) {
+		dsr->dsr_final = 1;
+		now = dtp->dt_stoptime;
+	} else {
+		now = dts_clock();
+	}
+
+	if (dsr->dsr_rate == 0)
+		return (dsr->dsr_count);
+
+	dsr->dsr_pending += (double)dsr->dsr_rate *
+	    (now - dsr->dsr_last) / 1e9;
+	dsr->dsr_last = now;
+	n = (uint64_t)dsr->dsr_pending;
+	dsr->dsr_pending -= n;
+	return (n);
+}
+
+
+/*
+ * Consuming
+ */
+
+dtrace_workstatus_t
+dtrace_work(dtrace_hdl_t *dtp, FILE *fp, dtrace_consume_probe_f *pfunc,
+    dtrace_consume_rec_f *rfunc, void *arg)
+{
+	if (dtrace_consume(dtp, fp, pfunc, rfunc, arg) == -1)
+		return (DTRACE_WORKSTATUS_ERROR);
+
+	return (dtp->dt_status == DTRACE_STATUS_STOPPED ?
+	    DTRACE_WORKSTATUS_DONE : DTRACE_WORKSTATUS_OKAY);
+}
+
+/*ARGSUSED*/
+int
+dtrace_consume(dtrace_hdl_t *dtp, FILE *fp, dtrace_consume_probe_f *pfunc,
+    dtrace_consume_rec_f *rfunc, void *arg)
+{
+	uint64_t data[(DTS_OFF_PRINTF + sizeof (uint64_t)) / sizeof (uint64_t)];
+	char msg[DTRACE_FUNCNAMELEN + DTS_STRLEN + 32];
+	dtrace_optval_t bufsize, policy;
+	dtrace_eprobedesc_t *edesc;
+	const dtrace_recdesc_t *rec;
+	dtrace_probedata_t pdata;
+	dtrace_bufdata_t bdata;
+	uint64_t n, max;
+	int i, probe, rv;
+
+	n = dts_fire(dtp, &dtp->dt_recsrc);
+	if (n == 0)
+		return (0);
+
+	/*
+	 * Firings that wouldn't have fit in the principal buffer are dropped,
+	 * except that a ring buffer keeps the most recent ones.
+	 */
+	(void) dtrace_getopt(dtp, "bufpolicy", &policy);
+	if (dtrace_getopt(dtp, "bufsize", &bufsize) != 0 || bufsize <= 0)
+		bufsize = 4 * 1024 * 1024;
+	max = bufsize / dtp->dt_edescs[0]->dtepd_size;
+	if (n > max) {
+		if (policy == DTRACEOPT_BUFPOLICY_RING)
+			dtp->dt_seq += n - max;
+		n = max;
+	}
+
+	bzero(&pdata, sizeof (pdata));
+	pdata.dtpda_handle = dtp;
+	pdata.dtpda_data = (caddr_t)data;
+
+	while (n-- > 0) {
+		probe = dts_rand(dtp) % dtp->dt_nprobes;
+		edesc = dtp->dt_edescs[probe];
+		pdata.dtpda_edesc = edesc;
+		pdata.dtpda_pdesc = &dtp->dt_pdescs[probe];
+
+		bzero(data, sizeof (data));
+		data[DTS_OFF_SEQ / sizeof (uint64_t)] = dtp->dt_seq++;
+		(void) snprintf((char *)data + DTS_OFF_STR, DTS_STRLEN,
+		    "str%u", (uint32_t)(dts_rand(dtp) % dtp->dt_nstrings));
+
+		if (pfunc != NULL) {
+			if ((rv = pfunc(&pdata, arg)) == DTRACE_CONSUME_NEXT)
+				continue;
+			if (rv != DTRACE_CONSUME_THIS)
+				return (dts_error(dtp, ECANCELED));
+		}
+
+		for (i = 0; i < edesc->dtepd_nrecs; i++) {
+			rec = &edesc->dtepd_rec[i];
+			if ((rv = rfunc(&pdata, rec, arg)) ==
+			    DTRACE_CONSUME_NEXT)
+				continue;
+			if (rv != DTRACE_CONSUME_THIS)
+				return (dts_error(dtp, ECANCELED));
+
+			if (rec->dtrd_action != DTRACEACT_PRINTF ||
+			    dtp->dt_bufhdlr == NULL)
+				continue;
+
+			(void) snprintf(msg, sizeof (msg), "%s: %s seq %lld\n",
+			    pdata.dtpda_pdesc->dtpd_func,
+			    (char *)data + DTS_OFF_STR,
+			    (long long)data[DTS_OFF_SEQ / sizeof (uint64_t)]);
+			bzero(&bdata, sizeof (bdata));
+			bdata.dtbda_handle = dtp;
+			bdata.dtbda_buffered = msg;
+			bdata.dtbda_probe = &pdata;
+			bdata.dtbda_recdesc = rec;
+			if (dtp->dt_bufhdlr(&bdata, dtp->dt_bufarg) ==
+			    DTRACE_HANDLE_ABORT)
+				return (dts_error(dtp, ECANCELED));
+		}
+
+		rv = rfunc(&pdata, NULL, arg);
+		if (rv != DTRACE_CONSUME_THIS && rv != DTRACE_CONSUME_NEXT)
+			return (dts_error(dtp, ECANCELED));
+	}
+
+	return (0);
+}
+
+
+/*
+ * Aggregations
+ */
+
+int
+dtrace_aggregate_snap(dtrace_hdl_t *dtp)
+{
+	dtrace_aggdesc_t *aggdesc = dtp->dt_aggdesc;
+	uint64_t n, r;
+	uint32_t key;
+	char *entry;
+
+	n = dts_fire(dtp, &dtp->dt_aggsrc);
+	while (n-- > 0) {
+		key = dts_rand(dtp) % dtp->dt_nkeys;
+		entry = dtp->dt_aggdata + (size_t)key * aggdesc->dtagd_size;
+		if (!dtp->dt_aggpresent[key]) {
+			dtp->dt_aggpresent[key] = 1;
+			dts_agg_init(dtp, entry);
+			(void) snprintf(entry + DTS_OFF_AGGKEY, DTS_STRLEN,
+			    "key%u", key);
+		}
+
+		r = dts_rand(dtp);
+		dts_agg_add(dtp, entry,
+		    (int64_t)(r % (1ULL << ((r >> 58) % 25))));
+	}
+
+	return (0);
+}
+
+/*
+ * Reset the value of an aggregation entry.
+ */
+static void
+dts_agg_init(dtrace_hdl_t *dtp, char *entry)
+{
+	const dtrace_recdesc_t *rec = &dtp->dt_aggdesc->dtagd_rec[2];
+	int64_t *val = (int64_t *)(entry + DTS_OFF_AGGVAL);
+
+	*(int64_t *)entry = DTS_VARID;
+	bzero(val, rec->dtrd_size);
+
+	switch (rec->dtrd_action) {
+	case DTRACEAGG_MIN:
+		val[0] = INT64_MAX;
+		break;
+
+	case DTRACEAGG_MAX:
+		val[0] = INT64_MIN;
+		break;
+
+	case DTRACEAGG_LQUANTIZE:
+		val[0] = (int64_t)(((uint64_t)DTS_LQ_STEP <<
+		    DTRACE_LQUANTIZE_STEPSHIFT) |
+		    ((uint64_t)DTS_LQ_LEVELS << DTRACE_LQUANTIZE_LEVELSHIFT) |
+		    ((uint64_t)(uint32_t)DTS_LQ_BASE <<
+		    DTRACE_LQUANTIZE_BASESHIFT));
+		break;
+
+	case DTRACEAGG_LLQUANTIZE:
+		val[0] = (int64_t)(((uint64_t)DTS_LLQ_FACTOR <<
+		    DTRACE_LLQUANTIZE_FACTORSHIFT) |
+		    ((uint64_t)DTS_LLQ_LOW << DTRACE_LLQUANTIZE_LOWSHIFT) |
+		    ((uint64_t)DTS_LLQ_HIGH << DTRACE_LLQUANTIZE_HIGHSHIFT) |
+		    ((uint64_t)DTS_LLQ_NSTEPS << DTRACE_LLQUANTIZE_NSTEPSHIFT));
+		break;
+	}
+}
+
+/*
+ * Aggregate "value" (which is non-negative) into an aggregation entry.
+ */
+static void
+dts_agg_add(dtrace_hdl_t *dtp, char *entry, int64_t value)
+{
+	int64_t *val = (int64_t *)(entry + DTS_OFF_AGGVAL);
+	uint32_t lo, hi, mid;
+	int64_t bucket;
+
+	switch (dtp->dt_aggdesc->dtagd_rec[2].dtrd_action) {
+	case DTRACEAGG_COUNT:
+		val[0]++;
+		break;
+
+	case DTRACEAGG_SUM:
+		val[0] += value;
+		break;
+
+	case DTRACEAGG_MIN:
+		if (value < val[0])
+			val[0] = value;
+		break;
+
+	case DTRACEAGG_MAX:
+		if (value > val[0])
+			val[0] = value;
+		break;
+
+	case DTRACEAGG_AVG:
+		val[0]++;
+		val[1] += value;
+		break;
+
+	case DTRACEAGG_QUANTIZE:
+		bucket = DTRACE_QUANTIZE_ZEROBUCKET;
+		while (value > 0) {
+			bucket++;
+			value >>= 1;
+		}
+		val[bucket]++;
+		break;
+
+	case DTRACEAGG_LQUANTIZE:
+		bucket = value < DTS_LQ_BASE ? 0 :
+		    (value - DTS_LQ_BASE) / DTS_LQ_STEP + 1;
+		if (bucket > DTS_LQ_LEVELS)
+			bucket = DTS_LQ_LEVELS + 1;
+		val[1 + bucket]++;
+		break;
+
+	case DTRACEAGG_LLQUANTIZE:
+		/* Find the last bucket whose lower bound is at most "value". */
+		lo = 0;
+		hi = dtp->dt_nllbuckets;
+		while (hi - lo > 1) {
+			mid = lo + (hi - lo) / 2;
+			if (dtp->dt_llbounds[mid] <= value)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		val[1 + lo]++;
+		break;
+	}
+}
+
+/*
+ * Returns the value by which the sorted walks order an entry: the value itself
+ * for scalar actions, the mean for avg(), and the total count for the
+ * distributions.
+ */
+static int64_t
+dts_agg_sortval(dtrace_hdl_t *dtp, const char *entry)
+{
+	const dtrace_recdesc_t *rec = &dtp->dt_aggdesc->dtagd_rec[2];
+	const int64_t *val = (const int64_t *)(entry + DTS_OFF_AGGVAL);
+	int64_t total = 0;
+	uint32_t i;
+
+	switch (rec->dtrd_action) {
+	case DTRACEAGG_AVG:
+		return (val[0] == 0 ? 0 : val[1] / val[0]);
+
+	case DTRACEAGG_QUANTIZE:
+		for (i = 0; i < rec->dtrd_size / sizeof (int64_t); i++)
+			total += val[i];
+		return (total);
+
+	case DTRACEAGG_LQUANTIZE:
+	case DTRACEAGG_LLQUANTIZE:
+		for (i = 1; i < rec->dtrd_size / sizeof (int64_t); i++)
+			total += val[i];
+		return (total);
+
+	default:
+		return (val[0]);
+	}
+}
+
+int
+dtrace_aggregate_walk(dtrace_hdl_t *dtp, dtrace_aggregate_f *func, void *arg)
+{
+	return (dts_aggwalk(dtp, func, arg, NULL, 0));
+}
+
+int
+dtrace_aggregate_walk_valsorted(dtrace_hdl_t *dtp, dtrace_aggregate_f *func,
+    void *arg)
+{
+	return (dts_aggwalk(dtp, func, arg, dts_sort_val, 0));
+}
+
+int
+dtrace_aggregate_walk_valrevsorted(dtrace_hdl_t *dtp,
+    dtrace_aggregate_f *func, void *arg)
+{
+	return (dts_aggwalk(dtp, func, arg, dts_sort_val, 1));
+}
+
+int
+dtrace_aggregate_walk_varkeysorted(dtrace_hdl_t *dtp,
+    dtrace_aggregate_f *func, void *arg)
+{
+	return (dts_aggwalk(dtp, func, arg, dts_sort_key, 0));
+}
+
+/*
+ * Invoke "func" for each aggregation entry, in the order given by "cmp" (or in
+ * key order, if that's NULL), reversed if "reverse" is set.
+ */
+static int
+dts_aggwalk(dtrace_hdl_t *dtp, dtrace_aggregate_f *func, void *arg,
+    int (*cmp)(const void *, const void *), int reverse)
+{
+	dtrace_aggdesc_t *aggdesc = dtp->dt_aggdesc;
+	dtrace_aggdata_t adata;
+	dts_sort_t *order;
+	uint32_t i, n, idx;
+	char *entry;
+	int rv = 0;
+
+	if (aggdesc == NULL)
+		return (0);
+
+	if ((order = malloc(dtp->dt_nkeys * sizeof (order[0]))) == NULL)
+		return (dts_error(dtp, ENOMEM));
+
+	for (i = 0, n = 0; i < dtp->dt_nkeys; i++) {
+		if (!dtp->dt_aggpresent[i])
+			continue;
+
+		entry = dtp->dt_aggdata + (size_t)i * aggdesc->dtagd_size;
+		order[n].dss_val = cmp == NULL ? 0 :
+		    dts_agg_sortval(dtp, entry);
+		order[n].dss_key = entry + DTS_OFF_AGGKEY;
+		order[n++].dss_idx = i;
+	}
+
+	if (cmp != NULL)
+		qsort(order, n, sizeof (order[0]), cmp);
+
+	bzero(&adata, sizeof (adata));
+	adata.dtada_handle = dtp;
+	adata.dtada_desc = aggdesc;
+	adata.dtada_edesc = dtp->dt_edescs[0];
+	adata.dtada_pdesc = &dtp->dt_pdescs[0];
+	adata.dtada_normal = 1;
+	adata.dtada_size = aggdesc->dtagd_size;
+
+	for (i = 0; i < n; i++) {
+		idx = order[reverse ? n - i - 1 : i].dss_idx;
+		entry = dtp->dt_aggdata + (size_t)idx * aggdesc->dtagd_size;
+		adata.dtada_data = entry;
+
+		switch (func(&adata, arg)) {
+		case DTRACE_AGGWALK_CLEAR:
+			dts_agg_init(dtp, entry);
+			break;
+
+		case DTRACE_AGGWALK_REMOVE:
+			dts_agg_init(dtp, entry);
+			dtp->dt_aggpresent[idx] = 0;
+			break;
+
+		case DTRACE_AGGWALK_ERROR:
+		case DTRACE_AGGWALK_ABORT:
+			rv = dts_error(dtp, ECANCELED);
+			goto out;
+
+		default:
+			break;
+		}
+	}
+
+out:
+	free(order);
+	return (rv);
+}
+
+static int
+dts_sort_val(const void *l, const void *r)
+{
+	const dts_sort_t *lhs = l, *rhs = r;
+
+	if (lhs->dss_val != rhs->dss_val)
+		return (lhs->dss_val < rhs->dss_val ? -1 : 1);
+
+	return (dts_sort_key(l, r));
+}
+
+static int
+dts_sort_key(const void *l, const void *r)
+{
+	const dts_sort_t *lhs = l, *rhs = r;
+
+	return (strcmp(lhs->dss_key, rhs->dss_key));
+}
+
+
+/*
+ * Symbols
+ */
+
+/*ARGSUSED*/
+int
+dtrace_addr2str(dtrace_hdl_t *dtp, uint64_t addr, char *buf, int len)
+{
+	return (snprintf(buf, len, "stub`0x%llx", (unsigned long long)addr));
+}
+
+/*ARGSUSED*/
+int
+dtrace_uaddr2str(dtrace_hdl_t *dtp, pid_t pid, uint64_t addr, char *buf,
+    int len)
+{
+	return (snprintf(buf, len, "stub`0x%llx", (unsigned long long)addr));
+}
@@ -0,0 +1,78 @@
+/*
+ * test/common.js: helpers for the tests.  These run against the stub
+ * libdtrace (see src/stub/dtrace_stub.c), whose data come from a generator
+ * with a fixed seed, so two consumers given the same stub options see the same
+ * records.  The tests use that to check each encoding of the data against what
+ * aggwalk() or consume() reports for the same records.
+ */
+
+var mod_assert = require('assert');
+var mod_fs = require('fs');
+var mod_os = require('os');
+var mod_path = require('path');
+
+var lda = require('../lib/dtrace-async');
+
+/* Public interface */
+exports.lda = lda;
+exports.createStubConsumer = createStubConsumer;
+exports.aggRecords = aggRecords;
+exports.tmpfile = tmpfile;
+
+/*
+ * Create a consumer with the given stub options, start tracing, and invoke
+ * callback(consumer).  The stub ignores D programs, so "prog" is only
+ * descriptive.
+ */
+function createStubConsumer(opts, prog, callback)
+{
+	var dtp = lda.createConsumer();
+
+	dtp.on('ready', function () {
+		Object.keys(opts).forEach(function (name) {
+			dtp.setopt(name, opts[name]);
+		});
+
+		dtp.strcompile(prog, function (err) {
+			mod_assert.ifError(err);
+			dtp.go(function (err2) {
+				mod_assert.ifError(err2);
+				callback(dtp);
+			});
+		});
+	});
+}
+
+/*
+ * Invoke "walk" with a function that takes the same arguments as an aggwalk()
+ * callback, and return the records it was passed in a canonical order, for
+ * comparing with assert.deepEqual().
+ */
+function aggRecords(walk)
+{
+	var records = [];
+
+	walk(function (varid, key, value) {
+		records.push(JSON.stringify([ varid, key, value ]));
+	});
+
+	return (records.sort());
+}
+
+/*
+ * Returns the path of a file in the temporary directory that doesn't exist.
+ */
+function tmpfile(name)
+{
+	var path = mod_path.join(mod_os.tmpdir(),
+	    'dtrace-async-test.' + process.pid + '.' + name);
+
+	try {
+		mod_fs.unlinkSync(path);
+	} catch (ex) {
+		if (ex.code != 'ENOENT')
+			throw (ex);
+	}
+
+	return (path);
+}
@@ -0,0 +1,56 @@
+/*
+ * test/run.js: runs each test (test/tst.*.js) in its own process and reports
+ * which ones failed.  The tests need the consumer binding built against the
+ * stub libdtrace (see "Platforms" in README.md).
+ *
+ * Usage: node test/run.js [test ...]
+ */
+
+var mod_child = require('child_process');
+var mod_fs = require('fs');
+var mod_path = require('path');
+
+function main()
+{
+	var tests = process.argv.slice(2);
+	var nfailed = 0;
+
+	try {
+		require('bindings')('dtrace_async.node');
+	} catch (ex) {
+		console.error('tests need the consumer binding built against ' +
+		    'the stub libdtrace:\n\n    node-gyp configure -- ' +
+		    '-Ddtrace_stub=1 && node-gyp build\n\n' + ex.message);
+		process.exit(2);
+	}
+
+	if (tests.length === 0) {
+		tests = mod_fs.readdirSync(__dirname).filter(function (name) {
+			return (/^tst\..*\.js$/.test(name));
+		}).sort().map(function (name) {
+			return (mod_path.join(__dirname, name));
+		});
+	}
+
+	tests.forEach(function (test) {
+		var result = mod_child.spawnSync(process.execPath, [ test ],
+		    { 'encoding': 'utf8' });
+
+		if (result.status === 0) {
+			console.log('ok   %s', mod_path.basename(test));
+			return;
+		}
+
+		nfailed++;
+		console.log('FAIL %s (%s)', mod_path.basename(test),
+		    result.signal !== null ? 'signal ' + result.signal :
+		    'status ' + result.status);
+		process.stdout.write(result.stdout + result.stderr);
+	});
+
+	console.log('%d of %d tests passed', tests.length - nfailed,
+	    tests.length);
+	process.exit(nfailed === 0 ? 0 : 1);
+}
+
+main();
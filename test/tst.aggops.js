@@ -0,0 +1,116 @@
+/*
+ * tst.aggops.js: aggtrunc() and aggclear() report how many records they
+ * removed or cleared, and leave the records that trunc() and clear() would.
+ * Each operation runs on its own consumer, and the results are checked against
+ * the same records as reported by aggwalk() on another consumer.
+ */
+
+var mod_assert = require('assert');
+
+var common = require('./common');
+
+var opts = {
+    'stub_agg': 'count',
+    'stub_keys': 50,
+    'stub_aggrecords': 500
+};
+var prog = 'stub:::entry { @agg[key] = count(); }';
+
+/*
+ * Each case applies "op" to a consumer's first round of records (whose values,
+ * as reported by aggwalk(), are "first"), checks its return value, and returns
+ * the values it should have kept.  Kept records are merged with the second
+ * round's records by the following aggwalk().
+ */
+var cases = [ {
+    'name': 'aggtrunc(1, 10)',
+    'op': function (dtp, first) {
+	mod_assert.equal(dtp.aggtrunc(1, 10), first.length - 10);
+	return (sorted(first).slice(-10));
+    }
+}, {
+    'name': 'aggtrunc(-1, -5)',
+    'op': function (dtp, first) {
+	mod_assert.equal(dtp.aggtrunc(-1, -5), first.length - 5);
+	return (sorted(first).slice(0, 5));
+    }
+}, {
+    'name': 'aggtrunc(1)',
+    'op': function (dtp, first) {
+	mod_assert.equal(dtp.aggtrunc(1), first.length);
+	return ([]);
+    }
+}, {
+    'name': 'aggtrunc(2, 10)',
+    'op': function (dtp, first) {
+	/* There's no variable 2, so nothing is removed. */
+	mod_assert.equal(dtp.aggtrunc(2, 10), 0);
+	return (first);
+    }
+}, {
+    'name': 'aggclear()',
+    'op': function (dtp, first) {
+	mod_assert.equal(dtp.aggclear(), first.length);
+	return (first.map(function () { return (0); }));
+    }
+} ];
+
+function sorted(values)
+{
+	return (values.slice().sort(function (a, b) { return (a - b); }));
+}
+
+function sum(values)
+{
+	return (values.reduce(function (a, b) { return (a + b); }, 0));
+}
+
+function walkValues(dtp)
+{
+	var values = [];
+
+	dtp.aggwalk(function (varid, key, value) {
+		mod_assert.equal(varid, 1);
+		values.push(value);
+	});
+
+	return (values);
+}
+
+common.createStubConsumer(opts, prog, function (walker) {
+	var first = walkValues(walker);
+	var second = walkValues(walker);
+
+	walker.close();
+	mod_assert.equal(first.length, opts.stub_keys);
+
+	function next() {
+		var c = cases.shift();
+
+		if (c === undefined)
+			return;
+
+		common.createStubConsumer(opts, prog, function (dtp) {
+			var kept = c.op(dtp, first);
+			var after = walkValues(dtp);
+
+			/*
+			 * Which keys are kept when values tie isn't specified,
+			 * so only the sum and the number of kept records can
+			 * be checked.
+			 */
+			mod_assert.equal(sum(after), sum(kept) + sum(second),
+			    c.name);
+			mod_assert.ok(after.length >= kept.length &&
+			    after.length >= second.length &&
+			    after.length <= kept.length + second.length,
+			    c.name);
+			if (kept.length == first.length)
+				mod_assert.equal(after.length, first.length);
+			dtp.close();
+			next();
+		});
+	}
+
+	next();
+});
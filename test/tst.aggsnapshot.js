@@ -0,0 +1,73 @@
+/*
+ * tst.aggsnapshot.js: snapshots from aggsnapshot(), read with AggSnapshot,
+ * hold the same records that aggwalk() reports, for each aggregating action.
+ */
+
+var mod_assert = require('assert');
+
+var common = require('./common');
+
+var AggSnapshot = common.lda.AggSnapshot;
+
+var actions = [
+    [ 'count', '@agg[key] = count();' ],
+    [ 'sum', '@agg[key] = sum(value);' ],
+    [ 'avg', '@agg[key] = avg(value);' ],
+    [ 'quantize', '@agg[key] = quantize(value);' ],
+    [ 'lquantize', '@agg[key] = lquantize(value, 0, 1000, 10);' ],
+    [ 'llquantize', '@agg[key] = llquantize(value, 10, 0, 6, 20);' ]
+];
+
+function check(action, callback)
+{
+	var opts = {
+	    'stub_agg': action[0],
+	    'stub_keys': 50,
+	    'stub_aggrecords': 1000
+	};
+	var prog = 'stub:::entry { ' + action[1] + ' }';
+
+	common.createStubConsumer(opts, prog, function (walker) {
+		common.createStubConsumer(opts, prog, function (snapper) {
+			var i, expected, buf, size, sab, snap;
+
+			for (i = 0; i < 3; i++) {
+				expected = common.aggRecords(function (func) {
+					walker.aggwalk(func);
+				});
+				mod_assert.ok(expected.length > 0);
+
+				/* Alternate between a new Buffer and a SAB. */
+				if (i % 2 === 0) {
+					snap = new AggSnapshot(
+					    snapper.aggsnapshot());
+				} else {
+					sab = new SharedArrayBuffer(1 << 20);
+					size = snapper.aggsnapshot(sab);
+					buf = Buffer.from(sab, 0, size);
+					snap = new AggSnapshot(buf);
+				}
+
+				mod_assert.equal(snap.nrecords(),
+				    expected.length);
+				mod_assert.deepEqual(common.aggRecords(
+				    function (func) { snap.forEach(func); }),
+				    expected, action[0] + ' snapshot ' + i);
+			}
+
+			walker.close();
+			snapper.close();
+			callback();
+		});
+	});
+}
+
+function next()
+{
+	var action = actions.shift();
+
+	if (action !== undefined)
+		check(action, next);
+}
+
+next();
@@ -0,0 +1,101 @@
+/*
+ * tst.aggwire.js: decoding the full and delta frames from aggencode(), with
+ * both AggWireDecoder and NativeAggWireDecoder, reproduces the records that
+ * aggwalk() reports, and decoders reject frames they can't apply.
+ */
+
+var mod_assert = require('assert');
+
+var common = require('./common');
+
+var lda = common.lda;
+
+var actions = [
+    [ 'count', '@agg[key] = count();' ],
+    [ 'avg', '@agg[key] = avg(value);' ],
+    [ 'quantize', '@agg[key] = quantize(value);' ],
+    [ 'llquantize', '@agg[key] = llquantize(value, 10, 0, 6, 20);' ]
+];
+
+function check(action, callback)
+{
+	var opts = {
+	    'stub_agg': action[0],
+	    'stub_keys': 50,
+	    'stub_aggrecords': 200
+	};
+	var prog = 'stub:::entry { ' + action[1] + ' }';
+
+	common.createStubConsumer(opts, prog, function (walker) {
+		common.createStubConsumer(opts, prog, function (encoder) {
+			var decoders = [ new lda.AggWireDecoder(),
+			    new lda.NativeAggWireDecoder() ];
+			var fresh = new lda.NativeAggWireDecoder();
+			var i, expected, frame, bad;
+
+			/*
+			 * With 200 firings over 50 keys, some keys are missing
+			 * from each round, so the delta frames include
+			 * removals as well as updates.
+			 */
+			for (i = 0; i < 4; i++) {
+				expected = common.aggRecords(function (func) {
+					walker.aggwalk(func);
+				});
+				frame = encoder.aggencode({ 'delta': i > 0 });
+
+				decoders.forEach(function (decoder) {
+					mod_assert.equal(decoder.decode(frame),
+					    i + 1);
+					mod_assert.equal(decoder.seq(), i + 1);
+					mod_assert.equal(decoder.nrecords(),
+					    expected.length);
+					mod_assert.deepEqual(common.aggRecords(
+					    function (func) {
+						decoder.forEach(func);
+					    }), expected,
+					    action[0] + ' frame ' + i);
+				});
+			}
+
+			/* A delta frame can't be applied out of order. */
+			decoders.concat(fresh).forEach(function (decoder) {
+				mod_assert.throws(function () {
+					decoder.decode(frame);
+				}, /aggwire: .*relative to/);
+			});
+
+			/* A corrupt frame is rejected without any changes. */
+			bad = Buffer.from(frame);
+			bad[4] = 0xff;
+			decoders.forEach(function (decoder) {
+				mod_assert.throws(function () {
+					decoder.decode(bad);
+				}, /aggwire: /);
+				mod_assert.equal(decoder.seq(), 4);
+				mod_assert.deepEqual(common.aggRecords(
+				    function (func) { decoder.forEach(func); }),
+				    expected);
+			});
+
+			decoders[1].close();
+			fresh.close();
+			mod_assert.throws(function () {
+				fresh.decode(frame);
+			}, /closed/);
+			walker.close();
+			encoder.close();
+			callback();
+		});
+	});
+}
+
+function next()
+{
+	var action = actions.shift();
+
+	if (action !== undefined)
+		check(action, next);
+}
+
+next();
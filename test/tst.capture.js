@@ -0,0 +1,95 @@
+/*
+ * tst.capture.js: a ReplayConsumer delivers the records captured by capture(),
+ * batch by batch, exactly as consume() delivered them, and skips a segment
+ * that was only partly written.
+ */
+
+var mod_assert = require('assert');
+var mod_fs = require('fs');
+
+var common = require('./common');
+
+var mod_replay = require('../lib/replay');
+
+var opts = {
+    'stub_records': 100,
+    'stub_probes': 5,
+    'stub_strings': 20
+};
+var prog = 'stub:::entry { trace(seq); trace(str); }';
+var path = common.tmpfile('capture.dtac');
+
+/*
+ * Returns the records delivered by one call to "consume", which takes the same
+ * callback as consumer.consume().
+ */
+function batch(consume)
+{
+	var records = [];
+
+	consume(function (probe, rec) {
+		records.push(JSON.stringify([ probe, rec ]));
+	});
+
+	return (records);
+}
+
+/*
+ * Replay the log and check that it holds the first "nbatches" of "batches".
+ */
+function checkReplay(batches, nbatches)
+{
+	var replay = mod_replay.createReplayConsumer(path);
+	var i;
+
+	for (i = 0; i < nbatches; i++) {
+		mod_assert.deepEqual(batch(function (func) {
+			mod_assert.ok(replay.consume(func) instanceof Date);
+		}), batches[i], 'batch ' + i);
+	}
+
+	mod_assert.strictEqual(replay.consume(function () {
+		throw (new Error('unexpected record'));
+	}), null);
+	mod_assert.equal(replay.segments().length, nbatches);
+	return (replay);
+}
+
+common.createStubConsumer(opts, prog, function (dtp) {
+	var batches = [];
+	var replay, stats, size, i;
+
+	dtp.capture(path, { 'passthrough': true, 'maxSegmentAge': 0 });
+	for (i = 0; i < 3; i++) {
+		batches.push(batch(function (func) { dtp.consume(func); }));
+		mod_assert.ok(batches[i].length > 0);
+		dtp.captureFlush();
+	}
+
+	stats = dtp.captureStop();
+	mod_assert.equal(stats.segments, 3);
+	mod_assert.equal(stats.dropped, 0);
+	dtp.close();
+
+	replay = checkReplay(batches, 3);
+	mod_assert.deepEqual(replay.stats(),
+	    { 'segments': 3, 'corrupt': 0, 'tornBytes': 0 });
+	replay.close();
+	replay.close();
+	mod_assert.throws(function () { replay.stats(); }, /closed/);
+
+	/*
+	 * Tear the last segment, as if the system had crashed while it was
+	 * being written.  The other segments are still replayed in full.
+	 */
+	size = mod_fs.statSync(path).size;
+	mod_fs.truncateSync(path, size - 10);
+	replay = checkReplay(batches, 2);
+	stats = replay.stats();
+	mod_assert.equal(stats.segments, 2);
+	mod_assert.equal(stats.corrupt, 0);
+	mod_assert.ok(stats.tornBytes > 0 && stats.tornBytes < size);
+	replay.close();
+
+	mod_fs.unlinkSync(path);
+});